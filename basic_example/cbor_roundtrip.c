@@ -0,0 +1,101 @@
+/*
+Copyright 2015 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**< Check that json converted to CBOR and back is unchanged; with a server (e.g. python3 mock_server.py 8080,
+     then ./cbor_roundtrip http://localhost:8080/) also publish and retrieve records as CBOR and as json */
+
+#define AUTH_PLUGID "dev-xxxxxxxxxxxxxxxxxx" /**< The device plug ID */
+#define AUTH_PASS "your-password" /**< The device connection password */
+#define CHANNEL "roundtrip"
+#define BIG "18446744073709551615" /**< 2^64 - 1, beyond the integers exact in a double */
+
+/**< Each json text with the text expected back: integers are exact, the other numbers keep their value */
+static const char* cases[][2] = {
+    { "{\"a\":1,\"b\":[true,false,null],\"c\":\"x\\u00e9\\n\"}", "{\"a\":1,\"b\":[true,false,null],\"c\":\"x\xc3\xa9\\n\"}" },
+    { "[0,-1,23,24,255,256,65535,65536,4294967295,4294967296]", NULL },
+    { "[9007199254740993,-9007199254740993," BIG ",-" BIG "]", NULL },
+    { "[1.5,-0.25,0.1,1e300,2.5e-5,100.0]", "[1.5,-0.25,0.1,1e+300,2.5e-05,100]" },
+    { "{\"nested\":{\"list\":[{},[],\"\"]}}", NULL }
+};
+
+static int roundtrip(const char* json, const char* expected) {
+    cp_json_writer cbor, back;
+    size_t length;
+    int ok = 0;
+    cloudplugs_json_writer_init(&cbor);
+    cloudplugs_json_writer_init(&back);
+    cloudplugs_json_writer_cbor(&cbor, CP_TRUE);
+    if(cloudplugs_json_write_raw(&cbor, json, strlen(json)) == CP_OK) {
+        const char* data = cloudplugs_json_writer_finish(&cbor, &length);
+        if(data && cloudplugs_cbor_to_json(data, length, &back) == CP_OK) {
+            const char* out = cloudplugs_json_writer_finish(&back, NULL);
+            ok = out && !strcmp(out, expected ? expected : json);
+            printf("%s %s -> %s\n", ok ? "OK  " : "FAIL", json, out ? out : "(null)");
+        }
+    }
+    if(!ok && !cloudplugs_json_writer_finish(&back, NULL)) printf("FAIL %s\n", json);
+    cloudplugs_json_writer_free(&cbor);
+    cloudplugs_json_writer_free(&back);
+    return ok;
+}
+
+/**< Publish a record and read it back, with the session in its current format */
+static int exchange(cp_session cps, const char* format) {
+    char* res = NULL;
+    size_t res_len;
+    int ok = cloudplugs_publish_data(cps, CHANNEL, "{\"data\":{\"big\":" BIG ",\"x\":1.5}}", &res, &res_len) == CP_OK;
+    cloudplugs_free(res);
+    res = NULL;
+    ok = ok && cloudplugs_retrieve_data(cps, CHANNEL, "limit=1", &res, &res_len) == CP_OK && strstr(res, "\"big\":" BIG);
+    printf("%s %s exchange, CBOR %s: %s\n", ok ? "OK  " : "FAIL", format, cloudplugs_has_cbor(cps) ? "on" : "off", res ? res : "(null)");
+    cloudplugs_free(res);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    int failed = 0;
+    size_t i;
+    cloudplugs_global_init();
+    for(i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        if(!roundtrip(cases[i][0], cases[i][1])) failed++;
+
+    if(argc > 1) {
+        cp_session cps = cloudplugs_create_session();
+        cloudplugs_set_base_url(cps, argv[1]);
+        cloudplugs_set_auth(cps, AUTH_PLUGID, AUTH_PASS, CP_FALSE);
+        if(!exchange(cps, "json")) failed++;
+        cloudplugs_set_cbor(cps, CP_TRUE);
+        if(!exchange(cps, "CBOR")) failed++;
+        /**< a server refusing CBOR disables it on the session, until it is enabled again */
+        if(!cloudplugs_has_cbor(cps)) {
+            cloudplugs_set_cbor(cps, CP_TRUE);
+            printf("CBOR enabled again\n");
+        }
+        cloudplugs_destroy_session(cps);
+    }
+    cloudplugs_global_shutdown();
+    printf("%d failed\n", failed);
+    return failed ? 1 : 0;
+}
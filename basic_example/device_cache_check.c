@@ -0,0 +1,86 @@
+/*
+Copyright 2015 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest.h"
+#include "cp_rest_json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**< Check the writes of a device cache against a server (e.g. python3 mock_server.py 8080,
+     then ./device_cache_check http://localhost:8080/): a property is written whole, so a write changing
+     one member of an object property must keep the others */
+
+#define AUTH_PLUGID "dev-xxxxxxxxxxxxxxxxxx" /**< The device plug ID */
+#define AUTH_PASS "your-password" /**< The device connection password */
+
+static int failed = 0;
+
+static void check(int ok, const char* what) {
+    printf("%s %s\n", ok ? "OK  " : "FAIL", what);
+    if(!ok) failed++;
+}
+
+/**< Write prop (all the properties if NULL) through the cache, return whether a request was sent */
+static int write_prop(cp_device_cache cache, const char* prop, const char* text) {
+    cp_bool sent = CP_FALSE;
+    json_t* value = json_loads(text, JSON_DECODE_ANY, NULL);
+    if(!value || cloudplugs_set_device_prop_json_diff(cache, NULL, prop, value, &sent) != CP_OK) failed++;
+    if(value) json_decref(value);
+    return sent;
+}
+
+/**< Whether the property on the server equals the json text */
+static int server_has(cp_session cps, const char* prop, const char* text) {
+    json_t* stored = NULL;
+    json_t* expected = json_loads(text, JSON_DECODE_ANY, NULL);
+    int ok = cloudplugs_get_device_prop_json(cps, NULL, prop, &stored) == CP_OK && json_equal(stored, expected);
+    if(stored) json_decref(stored);
+    if(expected) json_decref(expected);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        printf("usage: %s server-url\n", argv[0]);
+        return 77; /**< skipped, as a test without its server */
+    }
+    cloudplugs_global_init();
+    cp_session cps = cloudplugs_create_session();
+    cloudplugs_set_base_url(cps, argv[1]);
+    cloudplugs_set_auth(cps, AUTH_PLUGID, AUTH_PASS, CP_FALSE);
+    cp_device_cache cache = cloudplugs_device_cache_create(cps);
+
+    check(write_prop(cache, "cfg", "{\"a\":1,\"b\":2}"), "first write of cfg is sent");
+    check(write_prop(cache, "cfg", "{\"a\":1,\"b\":3}"), "changed member of cfg is sent");
+    check(server_has(cps, "cfg", "{\"a\":1,\"b\":3}"), "cfg keeps the unchanged member");
+    check(!write_prop(cache, "cfg", "{\"a\":1,\"b\":3}"), "unchanged cfg is not sent");
+
+    check(write_prop(cache, NULL, "{\"cfg\":{\"a\":1,\"b\":4},\"mode\":\"on\"}"), "changed properties are sent");
+    check(server_has(cps, "cfg", "{\"a\":1,\"b\":4}"), "cfg keeps the unchanged member in a write of all the properties");
+    check(server_has(cps, "mode", "\"on\""), "mode is written");
+    check(!write_prop(cache, NULL, "{\"cfg\":{\"a\":1,\"b\":4},\"mode\":\"on\"}"), "unchanged properties are not sent");
+
+    cloudplugs_device_cache_destroy(cache);
+    cloudplugs_destroy_session(cps);
+    cloudplugs_global_shutdown();
+    printf("%d failed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,143 @@
+/*
+Copyright 2015 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+/**< Measure the memory used by the library: run it against a server (e.g. ./footprint_example http://localhost:8080/ 100)
+     once for each build profile, ./configure and ./configure --enable-tiny, and compare the reports */
+
+#define AUTH_PLUGID "dev-xxxxxxxxxxxxxxxxxx" /**< The device plug ID */
+#define AUTH_PASS "your-password" /**< The device connection password */
+#define REQUESTS 100 /**< Requests of each phase, unless given on the command line */
+
+/**< The allocator of the library keeps the size of each block before it, to account the heap in use and its peak */
+static size_t heap_used = 0;
+static size_t heap_peak = 0;
+
+union header {
+    size_t size;
+    long double align;
+};
+
+static void* count_malloc(size_t size) {
+    union header* h = (union header*) malloc(sizeof(union header) + size);
+    if(!h) return NULL;
+    h->size = size;
+    heap_used += size;
+    if(heap_used > heap_peak) heap_peak = heap_used;
+    return h + 1;
+}
+
+static void count_free(void* ptr) {
+    if(!ptr) return;
+    union header* h = (union header*) ptr - 1;
+    heap_used -= h->size;
+    free(h);
+}
+
+static void* count_realloc(void* ptr, size_t size) {
+    if(!ptr) return count_malloc(size);
+    union header* h = (union header*) ptr - 1;
+    size_t old = h->size;
+    union header* n = (union header*) realloc(h, sizeof(union header) + size);
+    if(!n) return NULL;
+    n->size = size;
+    heap_used = heap_used - old + size;
+    if(heap_used > heap_peak) heap_peak = heap_used;
+    return n + 1;
+}
+
+static long max_rss_kb() {
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage)) return -1;
+    return usage.ru_maxrss;
+}
+
+static void phase_begin() {
+    cloudplugs_reset_alloc_count();
+    heap_peak = heap_used;
+}
+
+static void phase_report(const char* name, int failed, size_t base) {
+    printf("%-20s allocs %8lu  peak heap %8lu bytes  failed %d\n", name, (unsigned long) cloudplugs_get_alloc_count(), (unsigned long) (heap_peak - base), failed);
+}
+
+int main(int argc, char** argv) {
+    const char* url = argc > 1 ? argv[1] : NULL;
+    int requests = argc > 2 ? atoi(argv[2]) : REQUESTS;
+    char body[64];
+    char buf[1024];
+    int i;
+    int failed;
+
+    if(cloudplugs_set_allocator(count_malloc, count_free, count_realloc, NULL, NULL) != CP_OK) return 1;
+    cloudplugs_global_init();
+    printf("****CLOUDPLUGS FOOTPRINT****\n");
+#ifdef CP_TINY
+    printf("profile: tiny\n");
+#else
+    printf("profile: default\n");
+#endif
+
+    size_t base = heap_used;
+    phase_begin();
+    cp_session cps = cloudplugs_create_session();
+    if(!cps) return 1;
+    if(url) cloudplugs_set_base_url(cps, url);
+    cloudplugs_set_auth(cps, AUTH_PLUGID, AUTH_PASS, CP_FALSE);
+    phase_report("session", 0, base);
+    printf("session footprint    %lu bytes\n", (unsigned long) cloudplugs_session_footprint(cps));
+
+    base = heap_used;
+    phase_begin();
+    for(i = 0, failed = 0; i < requests; i++) {
+        char* res = NULL;
+        size_t res_len;
+        sprintf(body, "{\"data\":%d}", i);
+        if(cloudplugs_publish_data(cps, "footprint/temperature", body, &res, &res_len) != CP_OK) failed++;
+        cloudplugs_free(res);
+    }
+    phase_report("publish_data", failed, base);
+
+    base = heap_used;
+    phase_begin();
+    for(i = 0, failed = 0; i < requests; i++) {
+        sprintf(body, "{\"data\":%d}", i);
+        if(cloudplugs_publish_data_buf(cps, "footprint/temperature", body, buf, sizeof(buf), NULL) != CP_OK) failed++;
+    }
+    phase_report("publish_data_buf", failed, base);
+
+    base = heap_used;
+    phase_begin();
+    for(i = 0, failed = 0; i < requests; i++) {
+        if(cloudplugs_retrieve_data_buf(cps, "footprint/temperature", "limit=1", buf, sizeof(buf), NULL) != CP_OK) failed++;
+    }
+    phase_report("retrieve_data_buf", failed, base);
+
+    printf("heap in use          %lu bytes\n", (unsigned long) heap_used);
+    cloudplugs_destroy_session(cps);
+    cloudplugs_global_shutdown();
+    printf("max rss              %ld kB\n", max_rss_kb());
+    return 0;
+}
@@ -0,0 +1,14 @@
+#!/bin/sh
+# Run the checks needing a server against a local mock_server.py, skipped without python3
+command -v python3 >/dev/null 2>&1 || exit 77
+port=$((20000 + $$ % 10000))
+python3 "${srcdir:-.}/mock_server.py" $port 2>/dev/null &
+server=$!
+trap 'kill $server 2>/dev/null' EXIT
+sleep 1
+status=0
+./cbor_roundtrip http://localhost:$port/ || status=1
+if [ -x ./device_cache_check ]; then
+    ./device_cache_check http://localhost:$port/ || status=1
+fi
+exit $status
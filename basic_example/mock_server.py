@@ -0,0 +1,269 @@
+#!/usr/bin/env python3
+#
+# Copyright 2015 CloudPlugs Inc.
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+# A local stand-in of the data API, to try the library without an account:
+#   python3 mock_server.py [port] [--json-only]
+# PUT /iot/data/<channel> stores the published records, GET /iot/data/<channel> returns them, newest first.
+# PATCH /iot/device/<id>/<prop> writes a whole property, PATCH /iot/device/<id>/ each property of the body,
+# PATCH /iot/device/<id> merges the body in the device; GET reads them back.
+# Bodies and responses are json or CBOR, following Content-Type and Accept; with --json-only CBOR is refused
+# with 415 Unsupported Media Type or 406 Not Acceptable, as by a server without CBOR support.
+
+import http.server
+import json
+import struct
+import sys
+import time
+import urllib.parse
+
+CBOR = 'application/cbor'
+JSON = 'application/json'
+
+
+def cbor_encode(v):
+    def head(major, n):
+        if n < 24:
+            return bytes([major << 5 | n])
+        for info, fmt, limit in ((24, '>B', 0xff), (25, '>H', 0xffff), (26, '>I', 0xffffffff), (27, '>Q', 0xffffffffffffffff)):
+            if n <= limit:
+                return bytes([major << 5 | info]) + struct.pack(fmt, n)
+        raise ValueError('integer out of range')
+    if v is None:
+        return b'\xf6'
+    if v is True:
+        return b'\xf5'
+    if v is False:
+        return b'\xf4'
+    if isinstance(v, int):
+        return head(0, v) if v >= 0 else head(1, -1 - v)
+    if isinstance(v, float):
+        return b'\xfb' + struct.pack('>d', v)
+    if isinstance(v, str):
+        b = v.encode()
+        return head(3, len(b)) + b
+    if isinstance(v, list):
+        return head(4, len(v)) + b''.join(cbor_encode(x) for x in v)
+    if isinstance(v, dict):
+        return head(5, len(v)) + b''.join(cbor_encode(k) + cbor_encode(x) for k, x in v.items())
+    raise ValueError('unsupported type')
+
+
+BREAK = object()
+
+
+def cbor_decode(data):
+    pos = 0
+
+    def read(n):
+        nonlocal pos
+        if pos + n > len(data):
+            raise ValueError('truncated')
+        s = data[pos:pos + n]
+        pos += n
+        return s
+
+    def item():
+        b = read(1)[0]
+        major, info = b >> 5, b & 31
+        if info < 24:
+            n = info
+        elif info < 28:
+            n = int.from_bytes(read(1 << (info - 24)), 'big')
+        elif info == 31:
+            n = None
+        else:
+            raise ValueError('reserved')
+        if major == 0:
+            return n
+        if major == 1:
+            return -1 - n
+        if major in (2, 3):
+            if n is None:
+                parts = []
+                while True:
+                    x = item()
+                    if x is BREAK:
+                        break
+                    parts.append(x)
+                return (b'' if major == 2 else '').join(parts)
+            s = read(n)
+            return s if major == 2 else s.decode()
+        if major == 4:
+            out = []
+            while n is None or len(out) < n:
+                x = item()
+                if x is BREAK:
+                    break
+                out.append(x)
+            return out
+        if major == 5:
+            out = {}
+            while n is None or len(out) < n:
+                k = item()
+                if k is BREAK:
+                    break
+                out[k] = item()
+            return out
+        if major == 6:
+            return item()
+        if info == 20:
+            return False
+        if info == 21:
+            return True
+        if info in (22, 23):
+            return None
+        if info == 25:
+            return struct.unpack('>e', n.to_bytes(2, 'big'))[0]
+        if info == 26:
+            return struct.unpack('>f', n.to_bytes(4, 'big'))[0]
+        if info == 27:
+            return struct.unpack('>d', n.to_bytes(8, 'big'))[0]
+        if info == 31:
+            return BREAK
+        raise ValueError('simple value')
+
+    v = item()
+    if pos != len(data):
+        raise ValueError('trailing bytes')
+    return v
+
+
+def write_prop(props, prop, value):
+    if value is None:
+        props.pop(prop, None)
+    else:
+        props[prop] = value
+
+
+def merge_patch(target, patch):
+    for k, v in patch.items():
+        if isinstance(v, dict) and isinstance(target.get(k), dict):
+            merge_patch(target[k], v)
+        else:
+            write_prop(target, k, v)
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+    json_only = False
+    channels = {}
+    devices = {}
+
+    def log_message(self, fmt, *args):
+        sys.stderr.write('%s %s\n' % (self.command, self.path))
+
+    def reply(self, status, value=None):
+        body = b''
+        if value is not None:
+            if CBOR in (self.headers.get('Accept') or ''):
+                body, ctype = cbor_encode(value), CBOR
+            else:
+                body, ctype = json.dumps(value, separators=(',', ':')).encode(), JSON
+        self.send_response(status)
+        if body:
+            self.send_header('Content-Type', ctype)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def body(self):
+        length = self.headers.get('Content-Length')
+        if length:
+            return self.rfile.read(int(length))
+        data = b''
+        if self.headers.get('Transfer-Encoding') == 'chunked':
+            while True:
+                n = int(self.rfile.readline().strip(), 16)
+                if n == 0:
+                    self.rfile.readline()
+                    break
+                data += self.rfile.read(n)
+                self.rfile.readline()
+        return data
+
+    def handle_any(self):
+        data = self.body()
+        url = urllib.parse.urlparse(self.path)
+        if self.json_only and CBOR in (self.headers.get('Content-Type') or ''):
+            return self.reply(415)
+        if self.json_only and CBOR in (self.headers.get('Accept') or ''):
+            return self.reply(406)
+        if url.path.startswith('/iot/device/'):
+            return self.device(url.path[len('/iot/device/'):], data)
+        if not url.path.startswith('/iot/data'):
+            return self.reply(404, {'error': 'only /iot/data and /iot/device are served'})
+        channel = urllib.parse.unquote(url.path[len('/iot/data/'):])
+        if self.command == 'GET':
+            records = sorted(self.channels.get(channel, []), key=lambda r: -r['at'])
+            query = urllib.parse.parse_qs(url.query)
+            limit = int(query.get('limit', ['1000'])[0])
+            return self.reply(200, records[:limit])
+        if self.command != 'PUT':
+            return self.reply(405)
+        try:
+            value = cbor_decode(data) if CBOR in (self.headers.get('Content-Type') or '') else json.loads(data)
+        except ValueError as e:
+            return self.reply(400, {'error': str(e)})
+        ids = []
+        for record in value if isinstance(value, list) else [value]:
+            if not isinstance(record, dict) or 'data' not in record:
+                return self.reply(400, {'error': 'a record needs data'})
+            stored = {'id': 'r%d' % sum(len(r) for r in self.channels.values()), 'at': record.get('at', time.time()), 'data': record['data']}
+            self.channels.setdefault(record.get('channel', channel), []).append(stored)
+            ids.append(stored['id'])
+        self.reply(200, ids)
+
+    def device(self, path, data):
+        plugid, slash, prop = path.partition('/')
+        plugid, prop = urllib.parse.unquote(plugid), urllib.parse.unquote(prop)
+        device = self.devices.setdefault(plugid, {'id': plugid, 'props': {}})
+        if self.command == 'GET':
+            if not slash:
+                return self.reply(200, device)
+            if not prop:
+                return self.reply(200, device['props'])
+            return self.reply(200, device['props'][prop]) if prop in device['props'] else self.reply(404, {'error': 'no such property'})
+        if self.command != 'PATCH':
+            return self.reply(405)
+        try:
+            value = cbor_decode(data) if CBOR in (self.headers.get('Content-Type') or '') else json.loads(data)
+        except ValueError as e:
+            return self.reply(400, {'error': str(e)})
+        if not slash:
+            merge_patch(device, value)
+        elif prop:
+            write_prop(device['props'], prop, value)
+        elif isinstance(value, dict):
+            for k, v in value.items():
+                write_prop(device['props'], k, v)
+        else:
+            return self.reply(400, {'error': 'the properties must be an object'})
+        self.reply(200, {})
+
+    do_GET = do_PUT = do_POST = do_PATCH = do_DELETE = handle_any
+
+
+if __name__ == '__main__':
+    args = [a for a in sys.argv[1:] if not a.startswith('--')]
+    Handler.json_only = '--json-only' in sys.argv
+    port = int(args[0]) if args else 8080
+    print('serving on http://localhost:%d/ %s' % (port, '(json only)' if Handler.json_only else '(json and CBOR)'))
+    http.server.ThreadingHTTPServer(('127.0.0.1', port), Handler).serve_forever()
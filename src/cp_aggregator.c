@@ -0,0 +1,418 @@
+/*
+Copyright 2014 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest.h"
+#include "cp_internals.h"
+#include "cp_constants.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* a sample in the ingest ring; seq tells producers and the consumer whose turn the cell is */
+struct _cp_agg_cell {
+    atomic_size_t seq;
+    size_t channel;
+    cp_time at;
+    double value;
+};
+
+struct _cp_agg_channel {
+    char* channel;
+    cp_time slide;		/* duration of a pane */
+    long long panes;		/* panes in a window */
+    long long slots;		/* panes kept, the window plus the ones ahead of the watermark */
+    const cp_reducer* reducer;
+    char* states;
+    size_t* samples;
+    char* merged;
+    cp_bool started;
+    long long first;		/* oldest pane still kept */
+    long long closed;		/* last pane of the last closed window */
+    size_t live;
+};
+
+struct _cloudplugs_aggregator {
+    cp_session cps;
+    struct _cp_agg_cell* ring;
+    size_t mask;
+    atomic_size_t enqueue;
+    size_t dequeue;
+    atomic_size_t dropped;
+    cp_time lateness;
+    struct _cp_agg_channel* channels;
+    size_t count;
+    char* out;
+    size_t out_length;
+    size_t out_size;
+    size_t records;
+};
+
+cp_aggregator cloudplugs_aggregator_create(cp_session cps, size_t capacity, cp_time lateness) {
+    if(!cps) return NULL;
+    if(lateness < 0) {
+        cps->err = CP_ERR_INVALID_PARAMETER;
+        return NULL;
+    }
+    size_t size = 2;
+    while(size < capacity) size *= 2;
+
+    cp_aggregator agg = (cp_aggregator) cloudplugs_calloc(1, sizeof(struct _cloudplugs_aggregator));
+    if(!agg || !(agg->ring = (struct _cp_agg_cell*) cloudplugs_malloc(size * sizeof(struct _cp_agg_cell)))) {
+        cloudplugs_free(agg);
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    size_t i;
+    for(i = 0; i < size; i++) atomic_init(&agg->ring[i].seq, i);
+    agg->mask = size - 1;
+    atomic_init(&agg->enqueue, 0);
+    atomic_init(&agg->dropped, 0);
+    agg->cps = cps;
+    agg->lateness = lateness;
+    return agg;
+}
+
+cp_res cloudplugs_aggregator_destroy(cp_aggregator agg) {
+    if(!agg) return CP_FAIL;
+    size_t i;
+    for(i = 0; i < agg->count; i++) {
+        cloudplugs_free(agg->channels[i].channel);
+        cloudplugs_free(agg->channels[i].states);
+        cloudplugs_free(agg->channels[i].samples);
+        cloudplugs_free(agg->channels[i].merged);
+    }
+    cloudplugs_free(agg->channels);
+    cloudplugs_free(agg->out);
+    cloudplugs_free(agg->ring);
+    cloudplugs_free(agg);
+    return CP_OK;
+}
+
+static void* cloudplugs_agg_state(struct _cp_agg_channel* c, long long pane) {
+    long long slot = pane % c->slots;
+    if(slot < 0) slot += c->slots;
+    return c->states + (size_t) slot * c->reducer->state_size;
+}
+
+static size_t* cloudplugs_agg_samples(struct _cp_agg_channel* c, long long pane) {
+    long long slot = pane % c->slots;
+    if(slot < 0) slot += c->slots;
+    return &c->samples[slot];
+}
+
+int cloudplugs_aggregator_add_channel(cp_aggregator agg, const char* channel, cp_time window, cp_time slide, const cp_reducer* reducer) {
+    if(!agg) return -1;
+    cp_session cps = agg->cps;
+    if(!channel || !reducer || window <= 0 || slide < 0 || slide > window) {
+        cps->err = CP_ERR_INVALID_PARAMETER;
+        return -1;
+    }
+    if(!slide) slide = window;
+    long long panes = (long long) (window / slide + 0.5);
+    if(panes * slide != window) {
+        cps->err = CP_ERR_INVALID_PARAMETER;
+        return -1;
+    }
+
+    struct _cp_agg_channel* tmp = (struct _cp_agg_channel*) cloudplugs_realloc(agg->channels, (agg->count + 1) * sizeof(struct _cp_agg_channel));
+    if(!tmp) {
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        return -1;
+    }
+    agg->channels = tmp;
+    struct _cp_agg_channel* c = &agg->channels[agg->count];
+    memset(c, 0, sizeof(struct _cp_agg_channel));
+    c->slide = slide;
+    c->panes = panes;
+    c->slots = panes + CP_AGGREGATOR_AHEAD;
+    c->reducer = reducer;
+    c->channel = cloudplugs_strdup(channel);
+    c->states = (char*) cloudplugs_malloc((size_t) c->slots * reducer->state_size);
+    c->samples = (size_t*) cloudplugs_calloc((size_t) c->slots, sizeof(size_t));
+    c->merged = (char*) cloudplugs_malloc(reducer->state_size);
+    if(!c->channel || !c->states || !c->samples || !c->merged) {
+        cloudplugs_free(c->channel);
+        cloudplugs_free(c->states);
+        cloudplugs_free(c->samples);
+        cloudplugs_free(c->merged);
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        return -1;
+    }
+    long long i;
+    for(i = 0; i < c->slots; i++) reducer->init(c->states + (size_t) i * reducer->state_size);
+    return (int) agg->count++;
+}
+
+cp_res cloudplugs_aggregator_push(cp_aggregator agg, int channel, cp_time at, double value) {
+    if(!agg || channel < 0 || (size_t) channel >= agg->count || at < 0) return CP_FAIL;
+    size_t pos = atomic_load_explicit(&agg->enqueue, memory_order_relaxed);
+    struct _cp_agg_cell* cell;
+    for(;;) {
+        cell = &agg->ring[pos & agg->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+        if(!dif) {
+            if(atomic_compare_exchange_weak_explicit(&agg->enqueue, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        } else if(dif < 0) {
+            /* full: the sample is dropped rather than stalling the producer */
+            atomic_fetch_add_explicit(&agg->dropped, 1, memory_order_relaxed);
+            return CP_FAIL;
+        } else {
+            pos = atomic_load_explicit(&agg->enqueue, memory_order_relaxed);
+        }
+    }
+    cell->channel = (size_t) channel;
+    cell->at = at;
+    cell->value = value;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return CP_OK;
+}
+
+size_t cloudplugs_aggregator_dropped(cp_aggregator agg) {
+    return agg ? atomic_load_explicit(&agg->dropped, memory_order_relaxed) : 0;
+}
+
+/* append the record of the window ending with pane e to the session writer */
+static cp_bool cloudplugs_agg_emit(cp_aggregator agg, struct _cp_agg_channel* c, long long e) {
+    const cp_reducer* r = c->reducer;
+    size_t samples = 0;
+    long long p;
+    r->init(c->merged);
+    for(p = e - c->panes + 1; p <= e; p++) {
+        if(p < c->first || !*cloudplugs_agg_samples(c, p)) continue;
+        r->merge(c->merged, cloudplugs_agg_state(c, p));
+        samples += *cloudplugs_agg_samples(c, p);
+    }
+    if(!samples) return CP_TRUE;
+
+    cp_json_writer* w = &agg->cps->writer;
+    cp_time at = (cp_time) (e - c->panes + 1) * c->slide;
+    char data[CP_AGGREGATOR_DATA_SIZE];
+    int length = r->final(c->merged, data, sizeof(data));
+    if(length < 0) return CP_FALSE;
+    if((size_t) length >= sizeof(data)) {
+        char* big = (char*) cloudplugs_malloc((size_t) length + 1);
+        if(!big) return CP_FALSE;
+        r->final(c->merged, big, (size_t) length + 1);
+        cp_res res = cloudplugs_json_append_record(w, c->channel, big, at, NULL);
+        cloudplugs_free(big);
+        if(res != CP_OK) return CP_FALSE;
+    } else if(cloudplugs_json_append_record(w, c->channel, data, at, NULL) != CP_OK) {
+        return CP_FALSE;
+    }
+    agg->records++;
+    return CP_TRUE;
+}
+
+/* close the next window of the channel and forget its oldest pane */
+static cp_bool cloudplugs_agg_close(cp_aggregator agg, struct _cp_agg_channel* c) {
+    long long e = c->closed + 1;
+    if(!cloudplugs_agg_emit(agg, c, e)) return CP_FALSE;
+    long long oldest = e - c->panes + 1;
+    if(oldest >= c->first) {
+        size_t* samples = cloudplugs_agg_samples(c, oldest);
+        c->live -= *samples;
+        *samples = 0;
+        c->reducer->init(cloudplugs_agg_state(c, oldest));
+        c->first = oldest + 1;
+    }
+    c->closed = e;
+    return CP_TRUE;
+}
+
+static cp_bool cloudplugs_agg_advance(cp_aggregator agg, struct _cp_agg_channel* c, cp_time watermark) {
+    long long last = (long long) (watermark / c->slide) - 1;
+    if(!c->started || last <= c->closed) return CP_TRUE;
+    if(!c->live) {
+        /* nothing to emit: jump over the idle panes */
+        c->closed = last;
+        c->first = last - c->panes + 2;
+        return CP_TRUE;
+    }
+    while(c->closed < last) {
+        if(!cloudplugs_agg_close(agg, c)) return CP_FALSE;
+        if(!c->live) return cloudplugs_agg_advance(agg, c, watermark);
+    }
+    return CP_TRUE;
+}
+
+static cp_bool cloudplugs_agg_add(cp_aggregator agg, struct _cp_agg_channel* c, cp_time at, double value) {
+    long long pane = (long long) (at / c->slide);
+    if(!c->started) {
+        c->started = CP_TRUE;
+        c->first = pane - c->panes + 1;
+        c->closed = pane - 1;
+    }
+    if(pane < c->first) {
+        atomic_fetch_add_explicit(&agg->dropped, 1, memory_order_relaxed);
+        return CP_TRUE;
+    }
+    /* a sample too far ahead of the watermark closes the oldest windows to make room */
+    while(pane >= c->first + c->slots) {
+        if(!c->live) {
+            /* nothing to emit: jump over the idle panes */
+            c->first = pane - c->slots + 1;
+            c->closed = c->first + c->panes - 2;
+            break;
+        }
+        if(!cloudplugs_agg_close(agg, c)) return CP_FALSE;
+    }
+    c->reducer->add(cloudplugs_agg_state(c, pane), at, value);
+    (*cloudplugs_agg_samples(c, pane))++;
+    c->live++;
+    return CP_TRUE;
+}
+
+/* add the records of a poll to the ones not yet published, as a single JSON array */
+static cp_bool cloudplugs_agg_keep(cp_aggregator agg, const char* records, size_t length) {
+    if(agg->out_length + length > agg->out_size) {
+        size_t size = agg->out_size ? agg->out_size : CP_AGGREGATOR_DATA_SIZE;
+        while(size < agg->out_length + length) size *= 2;
+        char* tmp = (char*) cloudplugs_realloc(agg->out, size);
+        if(!tmp) return CP_FALSE;
+        agg->out = tmp;
+        agg->out_size = size;
+    }
+    if(agg->out_length) {
+        agg->out[agg->out_length - 1] = ',';
+        memcpy(agg->out + agg->out_length, records + 1, length - 1);
+        agg->out_length += length - 1;
+    } else {
+        memcpy(agg->out, records, length);
+        agg->out_length = length;
+    }
+    return CP_TRUE;
+}
+
+cp_res cloudplugs_aggregator_poll(cp_aggregator agg, cp_time now) {
+    if(!agg) return CP_FAIL;
+    cp_session cps = agg->cps;
+    cloudplugs_buffer_reset(cps);
+    agg->records = 0;
+    cp_bool ok = CP_TRUE;
+
+    for(;;) {
+        struct _cp_agg_cell* cell = &agg->ring[agg->dequeue & agg->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        if((intptr_t) seq - (intptr_t) (agg->dequeue + 1) < 0) break;
+        size_t channel = cell->channel;
+        cp_time at = cell->at;
+        double value = cell->value;
+        atomic_store_explicit(&cell->seq, agg->dequeue + agg->mask + 1, memory_order_release);
+        agg->dequeue++;
+        if(ok) ok = cloudplugs_agg_add(agg, &agg->channels[channel], at, value);
+    }
+
+    size_t i;
+    for(i = 0; ok && i < agg->count; i++) ok = cloudplugs_agg_advance(agg, &agg->channels[i], now - agg->lateness);
+    if(!ok) SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    if(agg->records) {
+        size_t length;
+        const char* records = cloudplugs_json_writer_finish(&cps->writer, &length);
+        if(!records || !cloudplugs_agg_keep(agg, records, length)) SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    }
+    if(!agg->out_length) return CP_OK;
+
+    /* the windows are already closed: their records stay until the server accepts them */
+    cp_body body;
+    cloudplugs_body_buffer(&body, agg->out, agg->out_length);
+    cp_res res = cloudplugs_publish_data_body(cps, NULL, &body, NULL, NULL);
+    if(res == CP_OK) agg->out_length = 0;
+    return res;
+}
+
+cp_res cloudplugs_aggregator_flush(cp_aggregator agg) {
+    if(!agg) return CP_FAIL;
+    cp_time end = 0;
+    size_t i;
+    for(i = 0; i < agg->count; i++) {
+        struct _cp_agg_channel* c = &agg->channels[i];
+        cp_time t = (cp_time) (c->first + c->slots) * c->slide;
+        if(c->started && t > end) end = t;
+    }
+    return cloudplugs_aggregator_poll(agg, end + agg->lateness + 1);
+}
+
+/* the built-in reducer of min, max, average and count */
+
+struct _cp_stats_state {
+    double min;
+    double max;
+    double sum;
+    size_t count;
+};
+
+static void cloudplugs_stats_init(void* state) {
+    struct _cp_stats_state* s = (struct _cp_stats_state*) state;
+    s->count = 0;
+    s->sum = 0;
+}
+
+static void cloudplugs_stats_add(void* state, cp_time at, double value) {
+    struct _cp_stats_state* s = (struct _cp_stats_state*) state;
+    (void) at;
+    if(isnan(value)) return;
+    if(!s->count || value < s->min) s->min = value;
+    if(!s->count || value > s->max) s->max = value;
+    s->sum += value;
+    s->count++;
+}
+
+static void cloudplugs_stats_merge(void* state, const void* other) {
+    struct _cp_stats_state* s = (struct _cp_stats_state*) state;
+    const struct _cp_stats_state* o = (const struct _cp_stats_state*) other;
+    if(!o->count) return;
+    if(!s->count || o->min < s->min) s->min = o->min;
+    if(!s->count || o->max > s->max) s->max = o->max;
+    s->sum += o->sum;
+    s->count += o->count;
+}
+
+/* append "key":value, to the length written so far; JSON has no infinities, so they are written as null as the missing values */
+static int cloudplugs_stats_field(char* buf, size_t size, int length, const char* key, double value) {
+    if(length < 0) return length;
+    char* end = (size_t) length < size ? buf + length : NULL;
+    size_t left = end ? size - (size_t) length : 0;
+    int n = isfinite(value) ? snprintf(end, left, "\"%s\":%.17g,", key, value) : snprintf(end, left, "\"%s\":null,", key);
+    return n < 0 ? n : length + n;
+}
+
+static int cloudplugs_stats_final(const void* state, char* buf, size_t size) {
+    const struct _cp_stats_state* s = (const struct _cp_stats_state*) state;
+    int length = snprintf(buf, size, "{");
+    length = cloudplugs_stats_field(buf, size, length, "min", s->count ? s->min : NAN);
+    length = cloudplugs_stats_field(buf, size, length, "max", s->count ? s->max : NAN);
+    length = cloudplugs_stats_field(buf, size, length, "avg", s->count ? s->sum / (double) s->count : NAN);
+    if(length < 0) return length;
+    char* end = (size_t) length < size ? buf + length : NULL;
+    int n = snprintf(end, end ? size - (size_t) length : 0, "\"count\":%lu}", (unsigned long) s->count);
+    return n < 0 ? n : length + n;
+}
+
+const cp_reducer cloudplugs_reducer_stats = {
+    sizeof(struct _cp_stats_state),
+    cloudplugs_stats_init,
+    cloudplugs_stats_add,
+    cloudplugs_stats_merge,
+    cloudplugs_stats_final
+};
@@ -0,0 +1,278 @@
+/*
+Copyright 2014 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest.h"
+#include "cp_internals.h"
+#include "cp_constants.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* a request running on the session multi handle, linked in the list of the pending ones */
+struct _cp_async {
+    cp_transfer t;
+    cp_async_callback cb;
+    void* userdata;
+    cp_res res;
+    char* result;
+    size_t result_length;
+    struct _cp_async* prev;
+    struct _cp_async* next;
+};
+
+static int cloudplugs_async_socket(CURL* curl, curl_socket_t s, int what, void* userp, void* socketp) {
+    cp_session cps = (cp_session) userp;
+    (void) curl;
+    (void) socketp;
+    int poll;
+    switch(what) {
+        case CURL_POLL_IN: poll = CP_POLL_IN; break;
+        case CURL_POLL_OUT: poll = CP_POLL_OUT; break;
+        case CURL_POLL_INOUT: poll = CP_POLL_INOUT; break;
+        case CURL_POLL_REMOVE: poll = CP_POLL_REMOVE; break;
+        default: poll = CP_POLL_NONE;
+    }
+    return cps->socket_cb(cps, (int) s, poll, cps->event_userdata);
+}
+
+static int cloudplugs_async_timer(CURLM* multi, long timeout_ms, void* userp) {
+    cp_session cps = (cp_session) userp;
+    (void) multi;
+    return cps->timer_cb(cps, timeout_ms, cps->event_userdata);
+}
+
+cp_res cloudplugs_set_event_callbacks(cp_session cps, cp_socket_callback socket_cb, cp_timer_callback timer_cb, void* userdata) {
+    if(!cps) return CP_FAIL;
+    if(!socket_cb || !timer_cb || cps->async) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    if(!cps->multi) {
+        cps->multi = curl_multi_init();
+        if(!cps->multi) SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+        curl_multi_setopt(cps->multi, CURLMOPT_SOCKETFUNCTION, cloudplugs_async_socket);
+        curl_multi_setopt(cps->multi, CURLMOPT_SOCKETDATA, cps);
+        curl_multi_setopt(cps->multi, CURLMOPT_TIMERFUNCTION, cloudplugs_async_timer);
+        curl_multi_setopt(cps->multi, CURLMOPT_TIMERDATA, cps);
+    }
+    curl_multi_setopt(cps->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long) cps->max_connections);
+    cps->socket_cb = socket_cb;
+    cps->timer_cb = timer_cb;
+    cps->event_userdata = userdata;
+    return CP_OK;
+}
+
+/* take the request out of the pending ones and release its transfer */
+static void cloudplugs_async_detach(cp_session cps, struct _cp_async* a) {
+    if(a->prev) a->prev->next = a->next;
+    else cps->async = a->next;
+    if(a->next) a->next->prev = a->prev;
+    a->prev = NULL;
+    a->next = NULL;
+    if(a->t.curl) {
+        curl_multi_remove_handle(cps->multi, a->t.curl);
+        curl_easy_cleanup(a->t.curl);
+    }
+    cloudplugs_body_close(&a->t.reader);
+    cloudplugs_req_buffer_discard(&a->t.response);
+    if(a->t.url) cloudplugs_free(a->t.url);
+    if(a->t.data) cloudplugs_free(a->t.data);
+    if(a->t.headers) curl_slist_free_all(a->t.headers);
+    a->t.curl = NULL;
+    a->t.url = NULL;
+    a->t.data = NULL;
+    a->t.headers = NULL;
+}
+
+static void cloudplugs_async_release(cp_session cps, struct _cp_async* a) {
+    cloudplugs_async_detach(cps, a);
+    cloudplugs_free(a);
+}
+
+cp_res cloudplugs_async_exec(cp_session cps, CP_HTTP_METHOD http_method, const char* path, const char* query, const cp_body* body, cp_bool copy, cp_async_callback cb, void* userdata) {
+    if(!cps) return CP_FAIL;
+    if(!path || !cb) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    if(!cps->multi) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    if(!cps->identity->auth) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
+
+    struct _cp_async* a = (struct _cp_async*) cloudplugs_calloc(1, sizeof(struct _cp_async));
+    if(!a) SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    a->cb = cb;
+    a->userdata = userdata;
+    cloudplugs_req_buffer_init(&a->t.response, cps, NULL, 0);
+    a->next = cps->async;
+    if(a->next) a->next->prev = a;
+    cps->async = a;
+
+    cp_transfer* t = &a->t;
+    t->method = http_method;
+    t->url = query ? cloudplugs_concat(cps, 4, cps->base_url, path, "?", query) : cloudplugs_concat(cps, 2, cps->base_url, path);
+    t->headers = cloudplugs_build_headers(cps, NULL);
+    t->curl = curl_easy_init();
+    if(body && copy && body->type == CP_BODY_BUFFER) {
+        t->data_length = body->length;
+        t->data = (char*) cloudplugs_malloc(body->length + 1);
+        if(t->data) memcpy(t->data, body->data, body->length);
+    }
+    if(!t->url || !t->headers || !t->curl || (body && copy && body->type == CP_BODY_BUFFER && !t->data)) {
+        cloudplugs_async_release(cps, a);
+        SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    }
+    t->response.curl = t->curl;
+    if(t->data) cloudplugs_body_buffer(&t->body, t->data, t->data_length);
+    else if(body) t->body = *body;
+    if(cloudplugs_easy_setup(cps, t->curl, t->method, t->url, t->headers, body ? &t->body : NULL, &t->reader, &t->response) != CP_OK) {
+        cloudplugs_async_release(cps, a);
+        return CP_FAIL;
+    }
+    curl_easy_setopt(t->curl, CURLOPT_PRIVATE, a);
+    if(curl_multi_add_handle(cps->multi, t->curl) != CURLM_OK) {
+        cloudplugs_async_release(cps, a);
+        SET_ERROR_AND_RETURN(cps, CP_ERR_INTERNAL_ERROR);
+    }
+    return CP_OK;
+}
+
+/* hand the completed requests to their callbacks, which may start new ones or destroy the session; return CP_FALSE if the session is gone */
+static cp_bool cloudplugs_async_complete(cp_session cps) {
+    /* the callbacks run after the messages are read, since they can change the multi handle */
+    struct _cp_async* done = NULL;
+    struct _cp_async** tail = &done;
+    CURLMsg* msg;
+    int left;
+    while((msg = curl_multi_info_read(cps->multi, &left))) {
+        if(msg->msg != CURLMSG_DONE) continue;
+        struct _cp_async* a = NULL;
+        CURLcode code = msg->data.result;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**) &a);
+        cp_transfer* t = &a->t;
+        long http_res = 0;
+        curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &http_res);
+        t->http_res = (CP_HTTP_RESULT) http_res;
+        t->response.curl_res = code;
+        if(code == CURLE_OK && cloudplugs_req_buffer_finish(&t->response) != CP_OK)
+            t->response.curl_res = CURLE_WRITE_ERROR;
+
+        cloudplugs_req_buffer_result(&t->response, &a->result, &a->result_length);
+        t->response.body = NULL;
+        a->res = CP_OK;
+        if(t->response.curl_res != CURLE_OK || (t->http_res != CP_HTTP_OK && t->http_res != CP_HTTP_CREATED)) a->res = CP_FAIL;
+        cloudplugs_async_detach(cps, a);
+        *tail = a;
+        tail = &a->next;
+    }
+
+    cps->dispatching++;
+    while(done) {
+        struct _cp_async* a = done;
+        done = a->next;
+        cps->http_res = a->t.http_res;
+        if(a->res != CP_OK) cps->err = CP_ERR_HTTP;
+        a->cb(cps, a->res, a->t.http_res, a->result, a->result_length, a->userdata);
+        cloudplugs_free(a);
+    }
+    if(--cps->dispatching || !cps->destroyed) return CP_TRUE;
+    cloudplugs_session_free(cps);
+    return CP_FALSE;
+}
+
+cp_res cloudplugs_socket_action(cp_session cps, int fd, int events) {
+    if(!cps) return CP_FAIL;
+    if(!cps->multi) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    int mask = 0;
+    if(events & CP_EVENT_IN) mask |= CURL_CSELECT_IN;
+    if(events & CP_EVENT_OUT) mask |= CURL_CSELECT_OUT;
+    if(events & CP_EVENT_ERR) mask |= CURL_CSELECT_ERR;
+    int running;
+    CURLMcode mc = curl_multi_socket_action(cps->multi, fd == CP_SOCKET_TIMEOUT ? CURL_SOCKET_TIMEOUT : (curl_socket_t) fd, mask, &running);
+    if(!cloudplugs_async_complete(cps)) return mc == CURLM_OK ? CP_OK : CP_FAIL;
+    if(mc != CURLM_OK) SET_ERROR_AND_RETURN(cps, CP_ERR_INTERNAL_ERROR);
+    return CP_OK;
+}
+
+int cloudplugs_async_pending(cp_session cps) {
+    if(!cps) return -1;
+    int n = 0;
+    struct _cp_async* a;
+    for(a = cps->async; a; a = a->next) n++;
+    return n;
+}
+
+void cloudplugs_async_cleanup(cp_session cps) {
+    /* the session is already going: a callback destroying it again is ignored */
+    cps->dispatching++;
+    while(cps->async) {
+        struct _cp_async* a = cps->async;
+        cp_async_callback cb = a->cb;
+        void* userdata = a->userdata;
+        cloudplugs_async_release(cps, a);
+        cb(cps, CP_FAIL, 0, NULL, 0, userdata);
+    }
+    cps->dispatching--;
+    if(cps->multi) curl_multi_cleanup(cps->multi);
+    cps->multi = NULL;
+}
+
+static cp_res cloudplugs_publish_data_async_exec(cp_session cps, const char* channel, const cp_body* body, cp_bool copy, cp_async_callback cb, void* userdata) {
+    char* url = channel ? cloudplugs_url_encode_data(cps, channel) : PATH_DATA;
+    if(!url) return CP_FAIL;
+    cp_res cp_res = cloudplugs_async_exec(cps, CP_HTTP_PUT, url, NULL, body, copy, cb, userdata);
+    if(channel) cloudplugs_url_free(cps, url);
+    return cp_res;
+}
+
+cp_res cloudplugs_publish_data_async(cp_session cps, const char* channel, const char* body, cp_async_callback cb, void* userdata) {
+    if(!body) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    cp_body b;
+    cloudplugs_body_buffer(&b, body, strlen(body));
+    return cloudplugs_publish_data_async_exec(cps, channel, &b, CP_TRUE, cb, userdata);
+}
+
+cp_res cloudplugs_publish_data_async_body(cp_session cps, const char* channel, const cp_body* body, cp_async_callback cb, void* userdata) {
+    if(!body) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    return cloudplugs_publish_data_async_exec(cps, channel, body, CP_FALSE, cb, userdata);
+}
+
+cp_res cloudplugs_retrieve_data_async(cp_session cps, const char* channel_mask, const char* query, cp_async_callback cb, void* userdata) {
+    if(!channel_mask) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    char* url = cloudplugs_url_encode_data(cps, channel_mask);
+    if(!url) return CP_FAIL;
+    cp_res cp_res = cloudplugs_async_exec(cps, CP_HTTP_GET, url, query, NULL, CP_FALSE, cb, userdata);
+    cloudplugs_url_free(cps, url);
+    return cp_res;
+}
+
+static cp_res cloudplugs_set_device_prop_async_exec(cp_session cps, const char* plugid, const char* prop, const cp_body* value, cp_bool copy, cp_async_callback cb, void* userdata) {
+    const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
+    if(!id) return CP_FAIL;
+    char* url = cloudplugs_url_encode_prop(cps, id, prop);
+    if(!url) return CP_FAIL;
+    cp_res cp_res = cloudplugs_async_exec(cps, CP_HTTP_PATCH, url, NULL, value, copy, cb, userdata);
+    cloudplugs_url_free(cps, url);
+    return cp_res;
+}
+
+cp_res cloudplugs_set_device_prop_async(cp_session cps, const char* plugid, const char* prop, const char* value, cp_async_callback cb, void* userdata) {
+    if(!value) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    cp_body b;
+    cloudplugs_body_buffer(&b, value, strlen(value));
+    return cloudplugs_set_device_prop_async_exec(cps, plugid, prop, &b, CP_TRUE, cb, userdata);
+}
+
+cp_res cloudplugs_set_device_prop_async_body(cp_session cps, const char* plugid, const char* prop, const cp_body* value, cp_async_callback cb, void* userdata) {
+    if(!value) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    return cloudplugs_set_device_prop_async_exec(cps, plugid, prop, value, CP_FALSE, cb, userdata);
+}
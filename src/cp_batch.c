@@ -0,0 +1,129 @@
+/*
+Copyright 2014 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest.h"
+#include "cp_internals.h"
+#include "cp_constants.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void cloudplugs_transfer_clear(cp_transfer* t) {
+    if(t->url) cloudplugs_free(t->url);
+    if(t->data) cloudplugs_free(t->data);
+    if(t->headers) curl_slist_free_all(t->headers);
+    t->url = NULL;
+    t->data = NULL;
+    t->data_length = 0;
+    t->headers = NULL;
+    t->method = CP_HTTP_GET;
+    t->http_res = 0;
+    t->index = 0;
+    t->userdata = NULL;
+}
+
+static void cloudplugs_transfer_complete(cp_session cps, cp_transfer* t, CURLcode code, cp_batch_done_func done, void* userdata) {
+    long http_res = 0;
+    t->response.curl_res = code;
+    if(code == CURLE_OK && cloudplugs_req_buffer_finish(&t->response) != CP_OK)
+        t->response.curl_res = CURLE_WRITE_ERROR;
+    if(code != CURLE_FAILED_INIT) {
+        curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &http_res);
+        cloudplugs_body_close(&t->reader);
+    }
+    t->http_res = (CP_HTTP_RESULT) http_res;
+    done(cps, t, userdata);
+    cloudplugs_req_buffer_discard(&t->response);
+    cloudplugs_transfer_clear(t);
+    if(t->curl) curl_easy_reset(t->curl);
+}
+
+/* ask the caller for the next request and start it on the free slot t; CP_FALSE when there is no work now */
+static cp_bool cloudplugs_transfer_start(cp_session cps, CURLM* multi, cp_transfer* t, struct curl_slist* headers, cp_batch_next_func next, cp_batch_done_func done, void* userdata) {
+    while(next(cps, t, userdata)) {
+        if(!t->curl) t->curl = curl_easy_init();
+        cloudplugs_req_buffer_init(&t->response, cps, t->curl, 0);
+        if(t->data) cloudplugs_body_buffer(&t->body, t->data, t->data_length);
+        if(t->curl && t->url
+            && cloudplugs_easy_setup(cps, t->curl, t->method, t->url, t->headers ? t->headers : headers, t->data ? &t->body : NULL, &t->reader, &t->response) == CP_OK) {
+            curl_easy_setopt(t->curl, CURLOPT_PRIVATE, t);
+            if(curl_multi_add_handle(multi, t->curl) == CURLM_OK) return CP_TRUE;
+        }
+        cloudplugs_transfer_complete(cps, t, CURLE_FAILED_INIT, done, userdata);
+    }
+    return CP_FALSE;
+}
+
+/* start requests on the idle slots, those without an url; return how many are started */
+static int cloudplugs_batch_fill(cp_session cps, CURLM* multi, cp_transfer* slots, int n, struct curl_slist* headers, cp_batch_next_func next, cp_batch_done_func done, void* userdata) {
+    int i, started = 0;
+    for(i = 0; i < n; i++) {
+        if(slots[i].url) continue;
+        if(!cloudplugs_transfer_start(cps, multi, &slots[i], headers, next, done, userdata)) break;
+        started++;
+    }
+    return started;
+}
+
+cp_res cloudplugs_batch_run(cp_session cps, cp_batch_next_func next, cp_batch_done_func done, void* userdata) {
+    if(!cps || !next || !done) return CP_FAIL;
+    int n = cps->max_connections;
+    int i;
+
+    CURLM* multi = curl_multi_init();
+    cp_transfer* slots = (cp_transfer*) cloudplugs_calloc(n, sizeof(cp_transfer));
+    struct curl_slist* headers = cloudplugs_build_headers(cps, NULL);
+    if(!multi || !slots || !headers) {
+        if(multi) curl_multi_cleanup(multi);
+        cloudplugs_free(slots);
+        if(headers) curl_slist_free_all(headers);
+        SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    }
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long) n);
+
+    /* a completed request can make new work (a retry, a split), so the idle slots are refilled after each round */
+    int active = cloudplugs_batch_fill(cps, multi, slots, n, headers, next, done, userdata);
+    while(active) {
+        int running;
+        curl_multi_perform(multi, &running);
+
+        CURLMsg* msg;
+        int left;
+        while((msg = curl_multi_info_read(multi, &left))) {
+            if(msg->msg != CURLMSG_DONE) continue;
+            CURL* curl = msg->easy_handle;
+            CURLcode code = msg->data.result;
+            cp_transfer* t = NULL;
+            curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**) &t);
+            curl_multi_remove_handle(multi, curl);
+            cloudplugs_transfer_complete(cps, t, code, done, userdata);
+            active--;
+        }
+        active += cloudplugs_batch_fill(cps, multi, slots, n, headers, next, done, userdata);
+        if(active) curl_multi_wait(multi, NULL, 0, CP_BATCH_WAIT_MS, NULL);
+    }
+
+    for(i = 0; i < n; i++) {
+        if(slots[i].curl) curl_easy_cleanup(slots[i].curl);
+    }
+    cloudplugs_free(slots);
+    curl_slist_free_all(headers);
+    curl_multi_cleanup(multi);
+    return CP_OK;
+}
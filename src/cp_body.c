@@ -0,0 +1,171 @@
+/*
+Copyright 2014 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest.h"
+#include "cp_internals.h"
+#include "cp_constants.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void cloudplugs_body_init(cp_body* body, CP_BODY_TYPE type, size_t length) {
+    body->type = type;
+    body->data = NULL;
+    body->length = length;
+    body->iov = NULL;
+    body->iovcnt = 0;
+    body->read = NULL;
+    body->userdata = NULL;
+    body->fd = -1;
+}
+
+void cloudplugs_body_buffer(cp_body* body, const char* data, size_t length) {
+    cloudplugs_body_init(body, CP_BODY_BUFFER, length);
+    body->data = data;
+}
+
+void cloudplugs_body_iovec(cp_body* body, const cp_iovec* iov, int iovcnt) {
+    int i;
+    cloudplugs_body_init(body, CP_BODY_IOVEC, 0);
+    for(i = 0; i < iovcnt; i++) body->length += iov[i].len;
+    body->iov = iov;
+    body->iovcnt = iovcnt;
+}
+
+void cloudplugs_body_callback(cp_body* body, cp_read_func read, void* userdata, size_t length) {
+    cloudplugs_body_init(body, CP_BODY_CALLBACK, length);
+    body->read = read;
+    body->userdata = userdata;
+}
+
+void cloudplugs_body_fd(cp_body* body, int fd, size_t length) {
+    cloudplugs_body_init(body, CP_BODY_FD, length);
+    body->fd = fd;
+}
+
+cp_res cloudplugs_body_mmap(cp_body* body, int fd) {
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode)) return CP_FAIL;
+    cloudplugs_body_init(body, CP_BODY_MMAP, (size_t) st.st_size);
+    body->fd = fd;
+    return CP_OK;
+}
+
+cp_res cloudplugs_body_open(cp_session cps, cp_body_reader* r, const cp_body* body) {
+    r->body = body;
+    r->data = NULL;
+    r->length = body->length;
+    r->index = 0;
+    r->offset = 0;
+    r->map = NULL;
+    r->map_length = 0;
+    r->released = 0;
+    switch(body->type) {
+        case CP_BODY_BUFFER:
+            r->data = body->data;
+            break;
+        case CP_BODY_MMAP:
+            if(!body->length) {
+                r->data = "";
+                break;
+            }
+            r->map = mmap(NULL, body->length, PROT_READ, MAP_SHARED, body->fd, 0);
+            if(r->map == MAP_FAILED) {
+                r->map = NULL;
+                SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+            }
+            r->map_length = body->length;
+            madvise(r->map, r->map_length, MADV_SEQUENTIAL);
+            r->data = (const char*) r->map;
+            break;
+        case CP_BODY_IOVEC:
+        case CP_BODY_CALLBACK:
+        case CP_BODY_FD:
+            break;
+        default:
+            SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    }
+    return CP_OK;
+}
+
+/* drop the pages of a mapping already sent, so that the resident memory stays constant */
+static void cloudplugs_body_release_pages(cp_body_reader* r) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t end = (r->offset / page) * page;
+    if(end > r->released) {
+        madvise((char*) r->map + r->released, end - r->released, MADV_DONTNEED);
+        r->released = end;
+    }
+}
+
+size_t cloudplugs_body_read(char* buffer, size_t size, void* userdata) {
+    cp_body_reader* r = (cp_body_reader*) userdata;
+    const cp_body* body = r->body;
+    size_t tot = 0;
+    if(r->data) {
+        size_t n = r->length - r->offset;
+        if(n > size) n = size;
+        memcpy(buffer, r->data + r->offset, n);
+        r->offset += n;
+        if(r->map) cloudplugs_body_release_pages(r);
+        return n;
+    }
+    switch(body->type) {
+        case CP_BODY_CALLBACK:
+            return body->read(buffer, size, body->userdata);
+        case CP_BODY_FD:
+            if(body->length != CP_BODY_UNKNOWN_LENGTH) {
+                if(r->offset >= body->length) return 0;
+                if(size > body->length - r->offset) size = body->length - r->offset;
+            }
+            for(;;) {
+                ssize_t n = read(body->fd, buffer, size);
+                if(n >= 0) {
+                    r->offset += (size_t) n;
+                    return (size_t) n;
+                }
+                if(errno != EINTR) return CP_READ_ABORT;
+            }
+        case CP_BODY_IOVEC:
+            while(tot < size && r->index < body->iovcnt) {
+                const cp_iovec* v = &body->iov[r->index];
+                size_t n = v->len - r->offset;
+                if(n > size - tot) n = size - tot;
+                memcpy(buffer + tot, (const char*) v->base + r->offset, n);
+                tot += n;
+                r->offset += n;
+                if(r->offset == v->len) {
+                    r->index++;
+                    r->offset = 0;
+                }
+            }
+            return tot;
+        default:
+            return CP_READ_ABORT;
+    }
+}
+
+void cloudplugs_body_close(cp_body_reader* r) {
+    if(r->map) munmap(r->map, r->map_length);
+    r->map = NULL;
+}
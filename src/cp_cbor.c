@@ -0,0 +1,504 @@
+/*
+Copyright 2014 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest.h"
+#include "cp_internals.h"
+#include "cp_constants.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
+
+cp_res cloudplugs_set_cbor(cp_session cps, cp_bool enabled) {
+    if(!cps) return CP_FAIL;
+    cps->cbor = enabled;
+    return CP_OK;
+}
+
+cp_bool cloudplugs_has_cbor(cp_session cps) {
+    return (cps && cps->cbor) ? CP_TRUE : CP_FALSE;
+}
+
+cp_bool cloudplugs_cbor_head(cp_json_writer* w, int major, unsigned long long value) {
+    unsigned char head[9];
+    size_t n;
+    head[0] = (unsigned char) (major << 5);
+    if(value < 24) {
+        head[0] |= (unsigned char) value;
+        n = 1;
+    } else if(value <= 0xff) {
+        head[0] |= 24;
+        n = 2;
+    } else if(value <= 0xffff) {
+        head[0] |= 25;
+        n = 3;
+    } else if(value <= 0xffffffffULL) {
+        head[0] |= 26;
+        n = 5;
+    } else {
+        head[0] |= 27;
+        n = 9;
+    }
+    /* the argument follows in network byte order */
+    size_t i;
+    for(i = n - 1; i > 0; i--) {
+        head[i] = (unsigned char) value;
+        value >>= 8;
+    }
+    return cloudplugs_json_writer_put(w, (const char*) head, n);
+}
+
+cp_bool cloudplugs_cbor_integer(cp_json_writer* w, long long value) {
+    /* a negative integer n is encoded as -1 - n */
+    if(value < 0) return cloudplugs_cbor_head(w, CP_CBOR_NEGATIVE, (unsigned long long) (-1 - value));
+    return cloudplugs_cbor_head(w, CP_CBOR_UNSIGNED, (unsigned long long) value);
+}
+
+cp_bool cloudplugs_cbor_number(cp_json_writer* w, double value) {
+    /* the smallest exact encoding: an integer, a single or a double precision float */
+    if(value >= -9223372036854775808.0 && value < 9223372036854775808.0 && (double) (long long) value == value)
+        return cloudplugs_cbor_integer(w, (long long) value);
+    unsigned char buf[9];
+    size_t n, i;
+    if(value >= -FLT_MAX && value <= FLT_MAX && (double) (float) value == value) {
+        float f = (float) value;
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        buf[0] = CP_CBOR_FLOAT32;
+        n = 5;
+        for(i = n - 1; i > 0; i--) {
+            buf[i] = (unsigned char) bits;
+            bits >>= 8;
+        }
+    } else {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        buf[0] = CP_CBOR_FLOAT64;
+        n = 9;
+        for(i = n - 1; i > 0; i--) {
+            buf[i] = (unsigned char) bits;
+            bits >>= 8;
+        }
+    }
+    return cloudplugs_json_writer_put(w, (const char*) buf, n);
+}
+
+/* write a string token, unescaped, as a key or a value */
+static cp_res cloudplugs_cbor_text(cp_json_writer* w, const char* js, const cp_token* t, cp_bool key) {
+    if(t->type != CP_TOKEN_STRING) return CP_FAIL;
+    char local[CP_CBOR_TEXT_SIZE];
+    size_t size = (size_t) (t->end - t->start) + 1;
+    char* s = size <= sizeof(local) ? local : (char*) cloudplugs_malloc(size);
+    if(!s) return CP_FAIL;
+    int n = cloudplugs_token_string(js, t, s, size);
+    cp_res res = CP_FAIL;
+    if(n >= 0) res = key ? cloudplugs_json_write_key_length(w, s, (size_t) n) : cloudplugs_json_write_string_length(w, s, (size_t) n);
+    if(s != local) cloudplugs_free(s);
+    return res;
+}
+
+/* write token i with its children, return the index of the next token or -1 */
+static int cloudplugs_cbor_token(cp_json_writer* w, const char* js, const cp_token* tokens, int count, int i) {
+    const cp_token* t = &tokens[i];
+    int j = i + 1;
+    int k;
+    double value;
+    cp_bool negative;
+    unsigned long long magnitude;
+    cp_res res;
+    switch(t->type) {
+        case CP_TOKEN_OBJECT:
+            if(cloudplugs_json_begin_object(w) != CP_OK) return -1;
+            for(k = 0; k < t->size; k++) {
+                if(j + 1 >= count || cloudplugs_cbor_text(w, js, &tokens[j], CP_TRUE) != CP_OK) return -1;
+                j = cloudplugs_cbor_token(w, js, tokens, count, j + 1);
+                if(j < 0) return -1;
+            }
+            return cloudplugs_json_end_object(w) == CP_OK ? j : -1;
+        case CP_TOKEN_ARRAY:
+            if(cloudplugs_json_begin_array(w) != CP_OK) return -1;
+            for(k = 0; k < t->size; k++) {
+                if(j >= count) return -1;
+                j = cloudplugs_cbor_token(w, js, tokens, count, j);
+                if(j < 0) return -1;
+            }
+            return cloudplugs_json_end_array(w) == CP_OK ? j : -1;
+        case CP_TOKEN_STRING:
+            return cloudplugs_cbor_text(w, js, t, CP_FALSE) == CP_OK ? j : -1;
+        case CP_TOKEN_PRIMITIVE:
+            switch(js[t->start]) {
+                case 't': res = cloudplugs_json_write_bool(w, CP_TRUE); break;
+                case 'f': res = cloudplugs_json_write_bool(w, CP_FALSE); break;
+                case 'n': res = cloudplugs_json_write_null(w); break;
+                default:
+                    /* an integer is copied exactly, the others go through a double */
+                    if(cloudplugs_integer_parse(js + t->start, (size_t) (t->end - t->start), &negative, &magnitude))
+                        res = cloudplugs_json_write_magnitude(w, negative, magnitude);
+                    else
+                        res = cloudplugs_token_number(js, t, &value) ? cloudplugs_json_write_number(w, value) : CP_FAIL;
+            }
+            return res == CP_OK ? j : -1;
+        default:
+            return -1;
+    }
+}
+
+cp_res cloudplugs_cbor_from_json(cp_json_writer* w, const char* json, size_t length) {
+    cp_token local[CP_JSON_TOKENS];
+    cp_token* tokens;
+    int count = cloudplugs_tokenize_all(json, length, local, CP_JSON_TOKENS, &tokens);
+    int next = count > 0 ? cloudplugs_cbor_token(w, json, tokens, count, 0) : -1;
+    if(tokens != local) cloudplugs_free(tokens);
+    if(next != count) {
+        w->failed = CP_TRUE;
+        return CP_FAIL;
+    }
+    return CP_OK;
+}
+
+struct _cp_cbor_reader {
+    const unsigned char* data;
+    size_t length;
+    size_t pos;
+};
+
+static cp_bool cloudplugs_cbor_read_head(struct _cp_cbor_reader* r, int* major, int* info, unsigned long long* value) {
+    if(r->pos >= r->length) return CP_FALSE;
+    unsigned char b = r->data[r->pos++];
+    *major = b >> 5;
+    *info = b & 31;
+    *value = (unsigned long long) *info;
+    if(*info < 24 || *info == CP_CBOR_INDEFINITE) return CP_TRUE;
+    if(*info > 27) return CP_FALSE;
+    size_t n = (size_t) 1 << (*info - 24);
+    if(r->length - r->pos < n) return CP_FALSE;
+    *value = 0;
+    while(n--) *value = (*value << 8) | r->data[r->pos++];
+    return CP_TRUE;
+}
+
+static cp_bool cloudplugs_cbor_break(struct _cp_cbor_reader* r) {
+    if(r->pos < r->length && r->data[r->pos] == CP_CBOR_BREAK) {
+        r->pos++;
+        return CP_TRUE;
+    }
+    return CP_FALSE;
+}
+
+/* the bytes of a string; the chunks of an indefinite length string are joined in *joined, to be released by the caller */
+static cp_bool cloudplugs_cbor_read_string(struct _cp_cbor_reader* r, int major, int info, unsigned long long value, const char** s, size_t* n, char** joined) {
+    *joined = NULL;
+    if(info != CP_CBOR_INDEFINITE) {
+        if(value > r->length - r->pos) return CP_FALSE;
+        *s = (const char*) r->data + r->pos;
+        *n = (size_t) value;
+        r->pos += (size_t) value;
+        return CP_TRUE;
+    }
+    size_t length = 0;
+    cp_bool closed = CP_FALSE;
+    while(!(closed = cloudplugs_cbor_break(r))) {
+        int chunk_major, chunk_info;
+        unsigned long long chunk;
+        if(!cloudplugs_cbor_read_head(r, &chunk_major, &chunk_info, &chunk) || chunk_major != major || chunk_info == CP_CBOR_INDEFINITE || chunk > r->length - r->pos) break;
+        char* tmp = (char*) cloudplugs_realloc(*joined, length + (size_t) chunk + 1);
+        if(!tmp) break;
+        *joined = tmp;
+        memcpy(tmp + length, r->data + r->pos, (size_t) chunk);
+        length += (size_t) chunk;
+        r->pos += (size_t) chunk;
+    }
+    if(!closed) {
+        cloudplugs_free(*joined);
+        *joined = NULL;
+        return CP_FALSE;
+    }
+    *s = *joined ? *joined : "";
+    *n = length;
+    return CP_TRUE;
+}
+
+/* byte strings become base64url text without padding, as advised by RFC 8949 for json */
+static cp_res cloudplugs_cbor_base64(cp_json_writer* w, const char* s, size_t n) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    char local[CP_CBOR_TEXT_SIZE];
+    size_t size = n / 3 * 4 + 4;
+    char* out = size <= sizeof(local) ? local : (char*) cloudplugs_malloc(size);
+    if(!out) return CP_FAIL;
+    const unsigned char* p = (const unsigned char*) s;
+    size_t i, len = 0;
+    for(i = 0; i + 2 < n; i += 3) {
+        out[len++] = alphabet[p[i] >> 2];
+        out[len++] = alphabet[((p[i] & 3) << 4) | (p[i + 1] >> 4)];
+        out[len++] = alphabet[((p[i + 1] & 15) << 2) | (p[i + 2] >> 6)];
+        out[len++] = alphabet[p[i + 2] & 63];
+    }
+    if(i < n) {
+        out[len++] = alphabet[p[i] >> 2];
+        if(i + 1 < n) {
+            out[len++] = alphabet[((p[i] & 3) << 4) | (p[i + 1] >> 4)];
+            out[len++] = alphabet[(p[i + 1] & 15) << 2];
+        } else {
+            out[len++] = alphabet[(p[i] & 3) << 4];
+        }
+    }
+    cp_res res = cloudplugs_json_write_string_length(w, out, len);
+    if(out != local) cloudplugs_free(out);
+    return res;
+}
+
+/* a half precision float, without libm */
+static double cloudplugs_cbor_half(unsigned int half) {
+    unsigned int exponent = (half >> 10) & 0x1f;
+    double mantissa = (double) (half & 0x3ff);
+    double value;
+    if(exponent == 0) {
+        value = mantissa / 16777216.0; /* 2^-24 */
+    } else if(exponent == 31) {
+        return NAN; /* infinity or nan, written as null */
+    } else {
+        value = (mantissa + 1024.0) / 1024.0;
+        while(exponent > 15) {
+            value *= 2.0;
+            exponent--;
+        }
+        while(exponent < 15) {
+            value /= 2.0;
+            exponent++;
+        }
+    }
+    return (half & 0x8000) ? -value : value;
+}
+
+static cp_res cloudplugs_cbor_float(cp_json_writer* w, double value) {
+    /* json has no infinity nor nan */
+    if(!isfinite(value)) return cloudplugs_json_write_null(w);
+    return cloudplugs_json_write_number(w, value);
+}
+
+static cp_bool cloudplugs_cbor_item(struct _cp_cbor_reader* r, cp_json_writer* w);
+
+/* a map key: text, or an integer written in decimal */
+static cp_bool cloudplugs_cbor_key(struct _cp_cbor_reader* r, cp_json_writer* w) {
+    int major, info;
+    unsigned long long value;
+    do {
+        if(!cloudplugs_cbor_read_head(r, &major, &info, &value)) return CP_FALSE;
+    } while(major == CP_CBOR_TAG);
+    if(major == CP_CBOR_TEXT) {
+        const char* s;
+        size_t n;
+        char* joined;
+        if(!cloudplugs_cbor_read_string(r, major, info, value, &s, &n, &joined)) return CP_FALSE;
+        cp_res res = cloudplugs_json_write_key_length(w, s, n);
+        cloudplugs_free(joined);
+        return res == CP_OK;
+    }
+    if((major != CP_CBOR_UNSIGNED && major != CP_CBOR_NEGATIVE) || info == CP_CBOR_INDEFINITE) return CP_FALSE;
+    char buf[24];
+    int n = major == CP_CBOR_UNSIGNED ? snprintf(buf, sizeof(buf), "%llu", value) : (value < ULLONG_MAX ? snprintf(buf, sizeof(buf), "-%llu", value + 1) : -1);
+    return n > 0 && cloudplugs_json_write_key_length(w, buf, (size_t) n) == CP_OK;
+}
+
+static cp_bool cloudplugs_cbor_item(struct _cp_cbor_reader* r, cp_json_writer* w) {
+    int major, info;
+    unsigned long long value;
+    /* tags only qualify the item that follows */
+    do {
+        if(!cloudplugs_cbor_read_head(r, &major, &info, &value)) return CP_FALSE;
+    } while(major == CP_CBOR_TAG);
+    if(info == CP_CBOR_INDEFINITE && major != CP_CBOR_BYTES && major != CP_CBOR_TEXT && major != CP_CBOR_ARRAY && major != CP_CBOR_MAP) return CP_FALSE;
+    switch(major) {
+        case CP_CBOR_UNSIGNED:
+            return cloudplugs_json_write_magnitude(w, CP_FALSE, value) == CP_OK;
+        case CP_CBOR_NEGATIVE:
+            /* -1 - value, whose magnitude needs 65 bits only for the smallest one */
+            if(value < ULLONG_MAX) return cloudplugs_json_write_magnitude(w, CP_TRUE, value + 1) == CP_OK;
+            return cloudplugs_json_write_raw(w, "-18446744073709551616", LIT_STR_LEN("-18446744073709551616")) == CP_OK;
+        case CP_CBOR_BYTES:
+        case CP_CBOR_TEXT: {
+            const char* s;
+            size_t n;
+            char* joined;
+            if(!cloudplugs_cbor_read_string(r, major, info, value, &s, &n, &joined)) return CP_FALSE;
+            cp_res res = major == CP_CBOR_TEXT ? cloudplugs_json_write_string_length(w, s, n) : cloudplugs_cbor_base64(w, s, n);
+            cloudplugs_free(joined);
+            return res == CP_OK;
+        }
+        case CP_CBOR_ARRAY:
+            if(cloudplugs_json_begin_array(w) != CP_OK) return CP_FALSE;
+            if(info == CP_CBOR_INDEFINITE) {
+                while(!cloudplugs_cbor_break(r))
+                    if(!cloudplugs_cbor_item(r, w)) return CP_FALSE;
+            } else {
+                /* every item takes a byte at least, a bogus count stops at the end of the data */
+                for(; value > 0; value--)
+                    if(!cloudplugs_cbor_item(r, w)) return CP_FALSE;
+            }
+            return cloudplugs_json_end_array(w) == CP_OK;
+        case CP_CBOR_MAP:
+            if(cloudplugs_json_begin_object(w) != CP_OK) return CP_FALSE;
+            if(info == CP_CBOR_INDEFINITE) {
+                while(!cloudplugs_cbor_break(r))
+                    if(!cloudplugs_cbor_key(r, w) || !cloudplugs_cbor_item(r, w)) return CP_FALSE;
+            } else {
+                for(; value > 0; value--)
+                    if(!cloudplugs_cbor_key(r, w) || !cloudplugs_cbor_item(r, w)) return CP_FALSE;
+            }
+            return cloudplugs_json_end_object(w) == CP_OK;
+        default:
+            switch(info) {
+                case 20: return cloudplugs_json_write_bool(w, CP_FALSE) == CP_OK;
+                case 21: return cloudplugs_json_write_bool(w, CP_TRUE) == CP_OK;
+                case 22: case 23: return cloudplugs_json_write_null(w) == CP_OK;
+                case 25: return cloudplugs_cbor_float(w, cloudplugs_cbor_half((unsigned int) value)) == CP_OK;
+                case 26: {
+                    uint32_t bits = (uint32_t) value;
+                    float f;
+                    memcpy(&f, &bits, sizeof(f));
+                    return cloudplugs_cbor_float(w, (double) f) == CP_OK;
+                }
+                case 27: {
+                    uint64_t bits = (uint64_t) value;
+                    double d;
+                    memcpy(&d, &bits, sizeof(d));
+                    return cloudplugs_cbor_float(w, d) == CP_OK;
+                }
+                default: return CP_FALSE;
+            }
+    }
+}
+
+cp_res cloudplugs_cbor_to_json(const char* cbor, size_t length, cp_json_writer* w) {
+    if(!w) return CP_FAIL;
+    struct _cp_cbor_reader r;
+    r.data = (const unsigned char*) cbor;
+    r.length = cbor ? length : 0;
+    r.pos = 0;
+    if(!cloudplugs_cbor_item(&r, w) || r.pos != r.length) {
+        w->failed = CP_TRUE;
+        return CP_FAIL;
+    }
+    return CP_OK;
+}
+
+/* hand over a cbor response converted to json as *result, or the conversion error */
+static cp_res cloudplugs_cbor_result(cp_session cps, cp_req_buffer* b, cp_res res, char** result, size_t* result_length) {
+    if(b->curl_res != CURLE_OK || !b->cbor || !b->offset) {
+        cloudplugs_req_buffer_result(b, result, result_length);
+        return res;
+    }
+    cp_json_writer w;
+    cloudplugs_json_writer_init(&w);
+    cp_res conv = cloudplugs_cbor_to_json(b->body, b->offset, &w);
+    cloudplugs_req_buffer_discard(b);
+    size_t n = 0;
+    if(conv != CP_OK || !cloudplugs_json_writer_finish(&w, &n)) {
+        cloudplugs_json_writer_free(&w);
+        if(result) *result = NULL;
+        if(result_length) *result_length = 0;
+        SET_ERROR_AND_RETURN(cps, CP_ERR_JSON_PARSE);
+    }
+    if(result) *result = w.buffer;
+    else cloudplugs_json_writer_free(&w);
+    if(result_length) *result_length = n;
+    return res;
+}
+
+/* a request preferring cbor: the body, if any, is cbor, and a cbor response is converted to json */
+static cp_res cloudplugs_cbor_exec(cp_session cps, CP_HTTP_METHOD http_method, const char* path, const char* query, const char* cbor, size_t length, char** result, size_t* result_length) {
+    char* headers[] = { CONTENT_TYPE_CBOR, ACCEPT_CBOR, NULL };
+    cp_body body;
+    if(cbor) cloudplugs_body_buffer(&body, cbor, length);
+    cp_req_buffer b;
+    cloudplugs_req_buffer_init(&b, cps, cps->curl, 0);
+    cp_res cp_res = cloudplugs_request_exec_buffer(cps, CP_TRUE, http_method, path, cbor ? headers : headers + 1, query, cbor ? &body : NULL, &b);
+    return cloudplugs_cbor_result(cps, &b, cp_res, result, result_length);
+}
+
+/* the server does not take cbor: json is used from now on */
+static cp_bool cloudplugs_cbor_refused(cp_session cps, char** result) {
+    if(cps->http_res != CP_HTTP_UNSUPPORTED_MEDIA_TYPE && cps->http_res != CP_HTTP_NOT_ACCEPTABLE) return CP_FALSE;
+    cps->cbor = CP_FALSE;
+    if(result && *result) {
+        cloudplugs_free(*result);
+        *result = NULL;
+    }
+    return CP_TRUE;
+}
+
+/* publish cbor, falling back to json: the given one, or the conversion of the cbor */
+static cp_res cloudplugs_cbor_publish(cp_session cps, const char* path, const char* cbor, size_t length, const char* json, size_t json_length, char** result, size_t* result_length) {
+    if(!path) return CP_FAIL;
+    cp_res cp_res = cloudplugs_cbor_exec(cps, CP_HTTP_PUT, path, NULL, cbor, length, result, result_length);
+    if(cp_res == CP_OK || !cloudplugs_cbor_refused(cps, result)) return cp_res;
+    cp_json_writer w;
+    cloudplugs_json_writer_init(&w);
+    if(!json) {
+        if(cloudplugs_cbor_to_json(cbor, length, &w) != CP_OK || !(json = cloudplugs_json_writer_finish(&w, &json_length))) {
+            cloudplugs_json_writer_free(&w);
+            SET_ERROR_AND_RETURN(cps, CP_ERR_JSON_ENCODE);
+        }
+    }
+    cp_body body;
+    cloudplugs_body_buffer(&body, json, json_length);
+    cp_res = cloudplugs_request_exec_body(cps, CP_TRUE, CP_HTTP_PUT, path, NULL, NULL, &body, result, result_length);
+    cloudplugs_json_writer_free(&w);
+    return cp_res;
+}
+
+cp_res cloudplugs_cbor_publish_json(cp_session cps, const char* path, const char* json, size_t length, char** result, size_t* result_length) {
+    if(!path) return CP_FAIL;
+    cp_json_writer w;
+    cloudplugs_json_writer_init(&w);
+    cloudplugs_json_writer_cbor(&w, CP_TRUE);
+    size_t n;
+    const char* cbor;
+    cp_res cp_res;
+    if(cloudplugs_json_write_raw(&w, json, length) == CP_OK && (cbor = cloudplugs_json_writer_finish(&w, &n))) {
+        cp_res = cloudplugs_cbor_publish(cps, path, cbor, n, json, length, result, result_length);
+    } else {
+        /* not json: let the server report it */
+        cp_body body;
+        cloudplugs_body_buffer(&body, json, length);
+        cp_res = cloudplugs_request_exec_body(cps, CP_TRUE, CP_HTTP_PUT, path, NULL, NULL, &body, result, result_length);
+    }
+    cloudplugs_json_writer_free(&w);
+    return cp_res;
+}
+
+cp_res cloudplugs_cbor_get(cp_session cps, const char* path, const char* query, char** result, size_t* result_length) {
+    if(!path) return CP_FAIL;
+    cp_res cp_res = cloudplugs_cbor_exec(cps, CP_HTTP_GET, path, query, NULL, 0, result, result_length);
+    if(cp_res == CP_OK || !cloudplugs_cbor_refused(cps, result)) return cp_res;
+    return cloudplugs_request_exec(cps, CP_TRUE, CP_HTTP_GET, path, NULL, query, NULL, result, result_length);
+}
+
+cp_res cloudplugs_publish_data_cbor(cp_session cps, const char* channel, const char* cbor, size_t length, char** result, size_t* result_length) {
+    if(!cps) return CP_FAIL;
+    if(!cbor || !length) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    char* url = channel ? cloudplugs_url_encode_data(cps, channel) : PATH_DATA;
+    cp_res cp_res = cloudplugs_cbor_publish(cps, url, cbor, length, NULL, 0, result, result_length);
+    if(url && channel) cloudplugs_url_free(cps, url);
+    return cp_res;
+}
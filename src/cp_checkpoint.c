@@ -0,0 +1,288 @@
+/*
+Copyright 2014 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest.h"
+#include "cp_internals.h"
+#include "cp_constants.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct _cp_checkpoint_entry {
+    char* channel_mask;
+    cp_time at;
+    cp_id_set ids;
+};
+
+struct _cloudplugs_checkpoint {
+    cp_session cps;
+    char* filename;
+    struct _cp_checkpoint_entry* entries;
+    size_t count;
+    size_t size;
+    cp_time window;
+    int max_updates;
+    int max_delay;
+    int pending;
+    long long synced;
+};
+
+static long long cloudplugs_checkpoint_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct _cp_checkpoint_entry* cloudplugs_checkpoint_find(cp_checkpoint cp, const char* channel_mask) {
+    size_t i;
+    for(i = 0; i < cp->count; i++) {
+        if(!strcmp(cp->entries[i].channel_mask, channel_mask)) return &cp->entries[i];
+    }
+    return NULL;
+}
+
+static struct _cp_checkpoint_entry* cloudplugs_checkpoint_add(cp_checkpoint cp, const char* channel_mask, size_t mask_length) {
+    if(cp->count == cp->size) {
+        size_t size = cp->size ? cp->size * 2 : 4;
+        struct _cp_checkpoint_entry* tmp = (struct _cp_checkpoint_entry*) cloudplugs_realloc(cp->entries, size * sizeof(struct _cp_checkpoint_entry));
+        if(!tmp) return NULL;
+        cp->entries = tmp;
+        cp->size = size;
+    }
+    char* mask = (char*) cloudplugs_malloc(mask_length + 1);
+    if(!mask) return NULL;
+    memcpy(mask, channel_mask, mask_length);
+    mask[mask_length] = '\0';
+    struct _cp_checkpoint_entry* e = &cp->entries[cp->count++];
+    e->channel_mask = mask;
+    e->at = 0;
+    memset(&e->ids, 0, sizeof(e->ids));
+    return e;
+}
+
+/* the fields are separated by tabs and the entries by newlines, so those and '%' are percent-encoded */
+static cp_bool cloudplugs_checkpoint_encode(FILE* f, const char* s) {
+    for(; *s; s++) {
+        if(*s == '%' || *s == '\t' || *s == '\n' || *s == '\r') {
+            if(fprintf(f, "%%%02X", (unsigned char) *s) < 0) return CP_FALSE;
+        } else if(fputc(*s, f) == EOF) return CP_FALSE;
+    }
+    return CP_TRUE;
+}
+
+static size_t cloudplugs_checkpoint_decode(char* s, size_t length) {
+    size_t i, j = 0;
+    for(i = 0; i < length; i++) {
+        if(s[i] == '%' && i + 2 < length) {
+            char hex[3] = { s[i+1], s[i+2], '\0' };
+            s[j++] = (char) strtol(hex, NULL, 16);
+            i += 2;
+        } else s[j++] = s[i];
+    }
+    return j;
+}
+
+/* line format: at TAB channel_mask [TAB id_at SPACE id]... */
+static cp_res cloudplugs_checkpoint_load(cp_checkpoint cp) {
+    FILE* f = fopen(cp->filename, "r");
+    if(!f) return CP_OK;
+    char* line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    cp_res res = CP_OK;
+    while(res == CP_OK && (length = getline(&line, &line_size, f)) > 0) {
+        if(line[length-1] == '\n') line[--length] = '\0';
+        char* field = strchr(line, '\t');
+        if(!field) continue;
+        *field++ = '\0';
+        cp_time at = strtod(line, NULL);
+        char* end = strchr(field, '\t');
+        size_t mask_length = end ? (size_t) (end - field) : strlen(field);
+        mask_length = cloudplugs_checkpoint_decode(field, mask_length);
+        struct _cp_checkpoint_entry* e = cloudplugs_checkpoint_add(cp, field, mask_length);
+        if(!e) {
+            res = CP_FAIL;
+            break;
+        }
+        e->at = at;
+        while(end) {
+            field = end + 1;
+            end = strchr(field, '\t');
+            if(end) *end = '\0';
+            char* id = strchr(field, ' ');
+            if(!id) continue;
+            *id++ = '\0';
+            id[cloudplugs_checkpoint_decode(id, strlen(id))] = '\0';
+            if(!cloudplugs_id_set_add(&e->ids, id, strtod(field, NULL))) {
+                res = CP_FAIL;
+                break;
+            }
+        }
+    }
+    free(line);
+    fclose(f);
+    if(res != CP_OK) cp->cps->err = CP_ERR_OUT_OF_MEMORY;
+    return res;
+}
+
+cp_checkpoint cloudplugs_checkpoint_open(cp_session cps, const char* filename) {
+    if(!cps) return NULL;
+    if(!filename) {
+        cps->err = CP_ERR_INVALID_PARAMETER;
+        return NULL;
+    }
+    cp_checkpoint cp = (cp_checkpoint) cloudplugs_calloc(1, sizeof(struct _cloudplugs_checkpoint));
+    if(!cp || !(cp->filename = cloudplugs_strdup(filename))) {
+        cloudplugs_free(cp);
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    cp->cps = cps;
+    cp->window = CP_CHECKPOINT_WINDOW;
+    cp->max_updates = CP_CHECKPOINT_MAX_UPDATES;
+    cp->max_delay = CP_CHECKPOINT_MAX_DELAY;
+    cp->synced = cloudplugs_checkpoint_now();
+    if(cloudplugs_checkpoint_load(cp) != CP_OK) {
+        cloudplugs_checkpoint_close(cp);
+        return NULL;
+    }
+    return cp;
+}
+
+cp_res cloudplugs_checkpoint_set_sync(cp_checkpoint cp, int max_updates, int max_delay) {
+    if(!cp || max_updates < 0 || max_delay < 0) return CP_FAIL;
+    cp->max_updates = max_updates;
+    cp->max_delay = max_delay;
+    return CP_OK;
+}
+
+cp_res cloudplugs_checkpoint_get(cp_checkpoint cp, const char* channel_mask, cp_time* at) {
+    if(!cp || !channel_mask) return CP_FAIL;
+    struct _cp_checkpoint_entry* e = cloudplugs_checkpoint_find(cp, channel_mask);
+    if(!e) return CP_FAIL;
+    if(at) *at = e->at;
+    return CP_OK;
+}
+
+cp_res cloudplugs_checkpoint_set_window(cp_checkpoint cp, cp_time window) {
+    if(!cp || window < 0) return CP_FAIL;
+    cp->window = window;
+    return CP_OK;
+}
+
+/* late or paged records can still arrive inside the window, so there only the ids tell what was processed */
+cp_bool cloudplugs_checkpoint_has(cp_checkpoint cp, const char* channel_mask, cp_time at, const char* id) {
+    if(!cp || !channel_mask) return CP_FALSE;
+    struct _cp_checkpoint_entry* e = cloudplugs_checkpoint_find(cp, channel_mask);
+    if(!e || at > e->at) return CP_FALSE;
+    if(at < e->at - cp->window) return CP_TRUE;
+    return id && cloudplugs_id_set_has(&e->ids, id);
+}
+
+cp_res cloudplugs_checkpoint_set(cp_checkpoint cp, const char* channel_mask, cp_time at, const char* id) {
+    if(!cp || !channel_mask) return CP_FAIL;
+    cp_session cps = cp->cps;
+    struct _cp_checkpoint_entry* e = cloudplugs_checkpoint_find(cp, channel_mask);
+    if(!e) {
+        e = cloudplugs_checkpoint_add(cp, channel_mask, strlen(channel_mask));
+        if(!e) SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+        e->at = at;
+    }
+    if(at < e->at - cp->window) return CP_OK;
+    if(at > e->at) {
+        e->at = at;
+        cloudplugs_id_set_prune(&e->ids, at - cp->window);
+    }
+    if(id && !cloudplugs_id_set_add(&e->ids, id, at)) SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+
+    cp->pending++;
+    if(cp->pending >= cp->max_updates || cloudplugs_checkpoint_now() - cp->synced >= cp->max_delay)
+        return cloudplugs_checkpoint_flush(cp);
+    return CP_OK;
+}
+
+cp_res cloudplugs_checkpoint_flush(cp_checkpoint cp) {
+    if(!cp) return CP_FAIL;
+    if(!cp->pending) return CP_OK;
+    cp_session cps = cp->cps;
+
+    char* tmp = cloudplugs_concat(cps, 2, cp->filename, CP_CHECKPOINT_TMP_SUFFIX);
+    if(!tmp) return CP_FAIL;
+    FILE* f = fopen(tmp, "w");
+    if(!f) {
+        cloudplugs_free(tmp);
+        SET_ERROR_AND_RETURN(cps, CP_ERR_INTERNAL_ERROR);
+    }
+    cp_bool ok = CP_TRUE;
+    size_t i, j;
+    for(i = 0; ok && i < cp->count; i++) {
+        struct _cp_checkpoint_entry* e = &cp->entries[i];
+        ok = fprintf(f, "%.17g\t", e->at) > 0 && cloudplugs_checkpoint_encode(f, e->channel_mask);
+        for(j = 0; ok && j < e->ids.size; j++) {
+            if(e->ids.entries[j].id)
+                ok = fprintf(f, "\t%.17g ", e->ids.entries[j].at) > 0 && cloudplugs_checkpoint_encode(f, e->ids.entries[j].id);
+        }
+        ok = ok && fputc('\n', f) != EOF;
+    }
+    /* the new file must be on disk before it replaces the old one */
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    ok = ok && rename(tmp, cp->filename) == 0;
+    if(!ok) unlink(tmp);
+    cloudplugs_free(tmp);
+    if(!ok) SET_ERROR_AND_RETURN(cps, CP_ERR_INTERNAL_ERROR);
+
+    /* make the rename itself durable */
+    char* slash = strrchr(cp->filename, '/');
+    char* dir = slash ? cloudplugs_malloc((size_t) (slash - cp->filename) + 2) : NULL;
+    if(dir) {
+        size_t length = slash == cp->filename ? 1 : (size_t) (slash - cp->filename);
+        memcpy(dir, cp->filename, length);
+        dir[length] = '\0';
+    }
+    int fd = open(dir ? dir : ".", O_RDONLY);
+    if(fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    cloudplugs_free(dir);
+
+    cp->pending = 0;
+    cp->synced = cloudplugs_checkpoint_now();
+    return CP_OK;
+}
+
+cp_res cloudplugs_checkpoint_close(cp_checkpoint cp) {
+    if(!cp) return CP_FAIL;
+    cp_res res = cloudplugs_checkpoint_flush(cp);
+    size_t i;
+    for(i = 0; i < cp->count; i++) {
+        cloudplugs_id_set_clear(&cp->entries[i].ids);
+        cloudplugs_free(cp->entries[i].channel_mask);
+    }
+    cloudplugs_free(cp->entries);
+    cloudplugs_free(cp->filename);
+    cloudplugs_free(cp);
+    return res;
+}
@@ -0,0 +1,351 @@
+/*
+Copyright 2014 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest.h"
+#include "cp_internals.h"
+#include "cp_constants.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct _cp_combiner_prop {
+    char* name;
+    char* value;
+};
+
+struct _cp_combiner_waiter {
+    size_t prop;
+    cp_combiner_callback cb;
+    void* userdata;
+};
+
+struct _cp_combiner_device {
+    char* plugid;
+    uint32_t hash;
+    cp_time since;
+    struct _cp_combiner_prop* props;
+    size_t props_count;
+    size_t props_size;
+    struct _cp_combiner_waiter* waiters;
+    size_t waiters_count;
+    size_t waiters_size;
+};
+
+/* the devices with pending writes are an open addressing table by plugid, kept at most 3/4 full */
+struct _cloudplugs_combiner {
+    cp_session cps;
+    cp_time window;
+    struct _cp_combiner_device** devices;
+    size_t count;
+    size_t size;
+};
+
+/* the devices sent by one batch, detached from the combiner so that callbacks can buffer new writes */
+struct _cp_combiner_send {
+    struct _cp_combiner_device** devices;
+    size_t n;
+    size_t next;
+    size_t failed;
+};
+
+static void cloudplugs_combiner_device_free(struct _cp_combiner_device* d) {
+    size_t i;
+    for(i = 0; i < d->props_count; i++) {
+        cloudplugs_free(d->props[i].name);
+        cloudplugs_free(d->props[i].value);
+    }
+    cloudplugs_free(d->props);
+    cloudplugs_free(d->waiters);
+    cloudplugs_free(d->plugid);
+    cloudplugs_free(d);
+}
+
+cp_combiner cloudplugs_combiner_create(cp_session cps, cp_time window) {
+    if(!cps) return NULL;
+    if(window < 0) {
+        cps->err = CP_ERR_INVALID_PARAMETER;
+        return NULL;
+    }
+    cp_combiner comb = (cp_combiner) cloudplugs_calloc(1, sizeof(struct _cloudplugs_combiner));
+    if(!comb) {
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    comb->cps = cps;
+    comb->window = window;
+    return comb;
+}
+
+cp_res cloudplugs_combiner_destroy(cp_combiner comb) {
+    if(!comb) return CP_FAIL;
+    cp_res res = cloudplugs_combiner_flush(comb);
+    size_t i;
+    for(i = 0; i < comb->size; i++) {
+        if(comb->devices[i]) cloudplugs_combiner_device_free(comb->devices[i]);
+    }
+    cloudplugs_free(comb->devices);
+    cloudplugs_free(comb);
+    return res;
+}
+
+static struct _cp_combiner_device** cloudplugs_combiner_slot(struct _cp_combiner_device** devices, size_t size, const char* plugid, uint32_t hash) {
+    size_t i = hash & (size - 1);
+    while(devices[i] && (devices[i]->hash != hash || strcmp(devices[i]->plugid, plugid))) i = (i + 1) & (size - 1);
+    return &devices[i];
+}
+
+static cp_bool cloudplugs_combiner_grow(cp_combiner comb) {
+    size_t size = comb->size ? comb->size * 2 : CP_COMBINER_SIZE;
+    struct _cp_combiner_device** devices = (struct _cp_combiner_device**) cloudplugs_calloc(size, sizeof(struct _cp_combiner_device*));
+    if(!devices) return CP_FALSE;
+    size_t i;
+    for(i = 0; i < comb->size; i++) {
+        struct _cp_combiner_device* d = comb->devices[i];
+        if(d) *cloudplugs_combiner_slot(devices, size, d->plugid, d->hash) = d;
+    }
+    cloudplugs_free(comb->devices);
+    comb->devices = devices;
+    comb->size = size;
+    return CP_TRUE;
+}
+
+static cp_bool cloudplugs_combiner_insert(cp_combiner comb, struct _cp_combiner_device* d) {
+    if((comb->count + 1) * 4 > comb->size * 3 && !cloudplugs_combiner_grow(comb)) return CP_FALSE;
+    *cloudplugs_combiner_slot(comb->devices, comb->size, d->plugid, d->hash) = d;
+    comb->count++;
+    return CP_TRUE;
+}
+
+/* the last write of a property replaces its value, while every caller keeps its own waiter */
+static cp_bool cloudplugs_combiner_put(struct _cp_combiner_device* d, const char* prop, const char* value, cp_combiner_callback cb, void* userdata) {
+    size_t i;
+    for(i = 0; i < d->props_count; i++) {
+        if(!strcmp(d->props[i].name, prop)) break;
+    }
+    char* copy = cloudplugs_strdup(value);
+    if(!copy) return CP_FALSE;
+
+    if(cb && d->waiters_count == d->waiters_size) {
+        size_t size = d->waiters_size ? d->waiters_size * 2 : 4;
+        struct _cp_combiner_waiter* waiters = (struct _cp_combiner_waiter*) cloudplugs_realloc(d->waiters, size * sizeof(struct _cp_combiner_waiter));
+        if(!waiters) {
+            cloudplugs_free(copy);
+            return CP_FALSE;
+        }
+        d->waiters = waiters;
+        d->waiters_size = size;
+    }
+
+    if(i == d->props_count) {
+        if(d->props_count == d->props_size) {
+            size_t size = d->props_size ? d->props_size * 2 : 4;
+            struct _cp_combiner_prop* props = (struct _cp_combiner_prop*) cloudplugs_realloc(d->props, size * sizeof(struct _cp_combiner_prop));
+            if(!props) {
+                cloudplugs_free(copy);
+                return CP_FALSE;
+            }
+            d->props = props;
+            d->props_size = size;
+        }
+        d->props[i].name = cloudplugs_strdup(prop);
+        if(!d->props[i].name) {
+            cloudplugs_free(copy);
+            return CP_FALSE;
+        }
+        d->props[i].value = NULL;
+        d->props_count++;
+    }
+    cloudplugs_free(d->props[i].value);
+    d->props[i].value = copy;
+
+    if(cb) {
+        struct _cp_combiner_waiter* w = &d->waiters[d->waiters_count++];
+        w->prop = i;
+        w->cb = cb;
+        w->userdata = userdata;
+    }
+    return CP_TRUE;
+}
+
+cp_res cloudplugs_combiner_set_prop(cp_combiner comb, const char* plugid, const char* prop, const char* value, cp_time now, cp_combiner_callback cb, void* userdata) {
+    if(!comb) return CP_FAIL;
+    cp_session cps = comb->cps;
+    if(!prop || !value) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
+    if(!id) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
+    uint32_t hash = cloudplugs_hash(id);
+    struct _cp_combiner_device* d = comb->size ? *cloudplugs_combiner_slot(comb->devices, comb->size, id, hash) : NULL;
+    if(d) {
+        if(!cloudplugs_combiner_put(d, prop, value, cb, userdata)) SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+        return CP_OK;
+    }
+
+    /* a new device enters the table only with its first property, so a failure leaves nothing to send */
+    d = (struct _cp_combiner_device*) cloudplugs_calloc(1, sizeof(struct _cp_combiner_device));
+    if(!d) SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    d->hash = hash;
+    d->since = now;
+    if(!(d->plugid = cloudplugs_strdup(id)) || !cloudplugs_combiner_put(d, prop, value, cb, userdata) || !cloudplugs_combiner_insert(comb, d)) {
+        cloudplugs_combiner_device_free(d);
+        SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    }
+    return CP_OK;
+}
+
+cp_res cloudplugs_combiner_set_location(cp_combiner comb, const char* plugid, double longitude, double latitude, double altitude, double accuracy, double timestamp, cp_time now, cp_combiner_callback cb, void* userdata) {
+    if(!comb) return CP_FAIL;
+    char body[CP_LOCATION_SIZE];
+    if(cloudplugs_location_format(comb->cps, body, sizeof(body), longitude, latitude, altitude, accuracy, timestamp) != CP_OK) return CP_FAIL;
+    return cloudplugs_combiner_set_prop(comb, plugid, LOCATION, body, now, cb, userdata);
+}
+
+/* {"props":{"name":value,...}} */
+static char* cloudplugs_combiner_body(cp_session cps, struct _cp_combiner_device* d, size_t* length) {
+    char** names = (char**) cloudplugs_calloc(d->props_count, sizeof(char*));
+    if(!names) return NULL;
+    size_t len = LIT_STR_LEN("{\"" PROPS "\":{}}");
+    size_t i;
+    for(i = 0; i < d->props_count; i++) {
+        names[i] = cloudplugs_json_quote(cps, d->props[i].name);
+        if(!names[i]) break;
+        len += strlen(names[i]) + 1 + strlen(d->props[i].value) + 1;
+    }
+
+    char* body = i == d->props_count ? (char*) cloudplugs_malloc(len + 1) : NULL;
+    if(body) {
+        char* p = body;
+        memcpy(p, "{\"" PROPS "\":{", LIT_STR_LEN("{\"" PROPS "\":{"));
+        p += LIT_STR_LEN("{\"" PROPS "\":{");
+        for(i = 0; i < d->props_count; i++) {
+            size_t n = strlen(names[i]);
+            if(i) *p++ = ',';
+            memcpy(p, names[i], n);
+            p += n;
+            *p++ = ':';
+            n = strlen(d->props[i].value);
+            memcpy(p, d->props[i].value, n);
+            p += n;
+        }
+        *p++ = '}';
+        *p++ = '}';
+        *p = '\0';
+        *length = p - body;
+    } else {
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+    }
+    for(i = 0; i < d->props_count; i++) cloudplugs_free(names[i]);
+    cloudplugs_free(names);
+    return body;
+}
+
+static void cloudplugs_combiner_notify(cp_session cps, struct _cp_combiner_device* d, cp_res res, CP_HTTP_RESULT http_res) {
+    size_t i;
+    for(i = 0; i < d->waiters_count; i++) {
+        struct _cp_combiner_waiter* w = &d->waiters[i];
+        w->cb(cps, d->plugid, d->props[w->prop].name, res, http_res, w->userdata);
+    }
+}
+
+static cp_bool cloudplugs_combiner_next(cp_session cps, cp_transfer* t, void* userdata) {
+    struct _cp_combiner_send* send = (struct _cp_combiner_send*) userdata;
+    for(;;) {
+        if(send->next >= send->n) return CP_FALSE;
+        struct _cp_combiner_device* d = send->devices[send->next];
+        t->index = send->next++;
+        t->method = CP_HTTP_PATCH;
+        t->url = cloudplugs_concat(cps, 3, cps->base_url, PATH_DEVICE "/", d->plugid);
+        t->data = cloudplugs_combiner_body(cps, d, &t->data_length);
+        if(t->url && t->data) return CP_TRUE;
+        cloudplugs_free(t->url);
+        cloudplugs_free(t->data);
+        t->url = NULL;
+        t->data = NULL;
+        send->failed++;
+        cloudplugs_combiner_notify(cps, d, CP_FAIL, 0);
+    }
+}
+
+static void cloudplugs_combiner_done(cp_session cps, cp_transfer* t, void* userdata) {
+    struct _cp_combiner_send* send = (struct _cp_combiner_send*) userdata;
+    cp_res res = CP_OK;
+    if(t->response.curl_res != CURLE_OK || (t->http_res != CP_HTTP_OK && t->http_res != CP_HTTP_CREATED)) {
+        cps->http_res = t->http_res;
+        send->failed++;
+        res = CP_FAIL;
+    }
+    cloudplugs_combiner_notify(cps, send->devices[t->index], res, t->http_res);
+}
+
+/* send the devices whose window ended at now, or all of them if all is CP_TRUE */
+static cp_res cloudplugs_combiner_send(cp_combiner comb, cp_time now, cp_bool all) {
+    if(!comb) return CP_FAIL;
+    cp_session cps = comb->cps;
+    struct _cp_combiner_send send;
+    send.n = 0;
+    send.next = 0;
+    send.failed = 0;
+    size_t i;
+    for(i = 0; i < comb->size; i++) {
+        if(comb->devices[i] && (all || now - comb->devices[i]->since >= comb->window)) send.n++;
+    }
+    if(!send.n) return CP_OK;
+    /* the devices kept move to a new table, since the ones sent leave holes in the probe sequences */
+    send.devices = (struct _cp_combiner_device**) cloudplugs_malloc(send.n * sizeof(struct _cp_combiner_device*));
+    struct _cp_combiner_device** kept = (struct _cp_combiner_device**) cloudplugs_calloc(comb->size, sizeof(struct _cp_combiner_device*));
+    if(!send.devices || !kept) {
+        cloudplugs_free(send.devices);
+        cloudplugs_free(kept);
+        SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    }
+
+    send.n = 0;
+    for(i = 0; i < comb->size; i++) {
+        struct _cp_combiner_device* d = comb->devices[i];
+        if(!d) continue;
+        if(all || now - d->since >= comb->window) send.devices[send.n++] = d;
+        else *cloudplugs_combiner_slot(kept, comb->size, d->plugid, d->hash) = d;
+    }
+    cloudplugs_free(comb->devices);
+    comb->devices = kept;
+    comb->count -= send.n;
+
+    cps->err = 0;
+    cps->http_res = CP_HTTP_OK;
+    cp_res res = cloudplugs_batch_run(cps, cloudplugs_combiner_next, cloudplugs_combiner_done, &send);
+    if(res != CP_OK) {
+        /* the batch could not start: nothing was sent */
+        for(i = send.next; i < send.n; i++) cloudplugs_combiner_notify(cps, send.devices[i], CP_FAIL, 0);
+    }
+    for(i = 0; i < send.n; i++) cloudplugs_combiner_device_free(send.devices[i]);
+    cloudplugs_free(send.devices);
+    if(res != CP_OK) return res;
+    if(send.failed) {
+        if(!cps->err) cps->err = CP_ERR_HTTP;
+        return CP_FAIL;
+    }
+    return CP_OK;
+}
+
+cp_res cloudplugs_combiner_poll(cp_combiner comb, cp_time now) {
+    return cloudplugs_combiner_send(comb, now, CP_FALSE);
+}
+
+cp_res cloudplugs_combiner_flush(cp_combiner comb) {
+    return cloudplugs_combiner_send(comb, 0, CP_TRUE);
+}
@@ -24,9 +24,61 @@ under the License.
 #define CP_URL "http://api.cloudplugs.com/"
 #define CP_MAX_URL_LENGTH 2048
 #define CP_TIMEOUT 30
+#define CP_BUFFER_SIZE 512
+#define CP_SPILL_TEMPLATE "cprest-XXXXXX"
+#define CP_MAX_CONNECTIONS 8
+#define CP_BATCH_WAIT_MS 1000
+#define CP_WATCH_LIMIT 100
+#define CP_WATCH_OVERLAP 0.0
+#define CP_WATCH_MIN_INTERVAL 1000
+#define CP_WATCH_MAX_INTERVAL 30000
+#define CP_RANGE_LIMIT 1000
+#define CP_RANGE_MIN_SPAN 1.0
+#define CP_AGGREGATOR_AHEAD 8
+#define CP_AGGREGATOR_DATA_SIZE 256
+#define CP_DEADBAND_SIZE 16
+#define CP_ID_SET_SIZE 16
+#define CP_COMBINER_SIZE 16
+#define CP_TRACKER_MIN_CAPACITY 3
+#define CP_EARTH_RADIUS 6371008.8
+#define CP_RADIANS_PER_DEGREE 0.017453292519943295
+#define CP_CHECKPOINT_MAX_UPDATES 64
+#define CP_CHECKPOINT_MAX_DELAY 1000
+#define CP_CHECKPOINT_TMP_SUFFIX ".tmp"
+#define CP_CHECKPOINT_WINDOW 0.0
+#define CP_JSON_TOKENS 64
+#define CP_JSON_KEY_SIZE 64
+#define CP_LOCATION_SIZE 200
+#define CP_CBOR_TEXT_SIZE 256
+#define CP_TINY_URL_SIZE 128
+#define CP_TINY_CA_SIZE 256
+#define CP_TINY_ID_SIZE 96
+#define CP_TINY_AUTH_SIZE 96
+#define CP_TINY_PATH_SIZE 256
 
 #define LIT_STR_LEN(x) (sizeof(x) - 1)
 
+//CBOR (RFC 8949)
+#define CP_CBOR_UNSIGNED 0
+#define CP_CBOR_NEGATIVE 1
+#define CP_CBOR_BYTES 2
+#define CP_CBOR_TEXT 3
+#define CP_CBOR_ARRAY 4
+#define CP_CBOR_MAP 5
+#define CP_CBOR_TAG 6
+#define CP_CBOR_SIMPLE 7
+#define CP_CBOR_INDEFINITE 31
+#define CP_CBOR_ARRAY_INDEFINITE 0x9f
+#define CP_CBOR_MAP_INDEFINITE 0xbf
+#define CP_CBOR_FALSE 0xf4
+#define CP_CBOR_TRUE 0xf5
+#define CP_CBOR_NULL 0xf6
+#define CP_CBOR_UNDEFINED 0xf7
+#define CP_CBOR_FLOAT16 0xf9
+#define CP_CBOR_FLOAT32 0xfa
+#define CP_CBOR_FLOAT64 0xfb
+#define CP_CBOR_BREAK 0xff
+
 #define CP_HTTP_STR "http://"
 #define CP_HTTPS_STR "https://"
 
@@ -42,13 +94,18 @@ under the License.
 #define PLUG_EMAIL_HEADER "X-Plug-Email: "
 #define PLUG_MASTER_HEADER "X-Plug-Master: "
 
+#define CONTENT_TYPE_HEADER "Content-type:"
 #define CONTENT_TYPE_JSON "Content-type: application/json"
+#define CONTENT_TYPE_CBOR "Content-type: application/cbor"
+#define ACCEPT_CBOR "Accept: application/cbor, application/json;q=0.5"
+#define MIME_CBOR "application/cbor"
 
 #define PATH_DATA "iot/data"
 #define PATH_DEVICE "iot/device"
 #define PATH_CHANNEL "iot/channel"
 
 #define CTRL "ctrl"
+#define CHANNEL "channel"
 #define HWID "hwid"
 #define NAME "name"
 #define MODEL "model"
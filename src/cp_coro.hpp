@@ -0,0 +1,367 @@
+/*
+Copyright 2014 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+/*
+ C++20 coroutine layer over the asynchronous requests of cp_rest.h, header only, on the types of cp_rest.hpp.
+
+ cp::Task<int> report(cp::Session& s) {
+     cp::Result r = co_await cp::publish(s, "temperature", "{\"data\":21.5}");
+     co_return r.http();
+ }
+
+ cp::Session s;
+ cp::Loop loop(s);
+ int http = loop.run(report(s));
+
+ Any event loop can drive the requests instead of cp::Loop, through cloudplugs_set_event_callbacks(), calling cp::resume_ready() after cloudplugs_socket_action().
+*/
+
+#ifndef CP_CORO_HPP
+#define CP_CORO_HPP
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <poll.h>
+#include "cp_rest.hpp"
+
+namespace cp {
+
+namespace detail {
+
+/** State of a request shared with its completion callback, which outlives the request when its coroutine is destroyed */
+struct Pending {
+    std::coroutine_handle<> handle;
+    Result result;
+    bool orphan = false;
+};
+
+/** The requests completed on this thread, whose coroutines resume in resume_ready() */
+inline std::vector<Pending*>& ready() {
+    static thread_local std::vector<Pending*> queue;
+    return queue;
+}
+
+} // namespace detail
+
+/**
+ Resume the coroutines whose requests completed, returning how many; cp::Loop calls it after each cloudplugs_socket_action(),
+ and other event loops must do the same, since the completion callbacks do not resume them from inside the library.
+*/
+inline size_t resume_ready() {
+    size_t n = 0;
+    std::vector<detail::Pending*>& queue = detail::ready();
+    while(!queue.empty()) {
+        detail::Pending* p = queue.front();
+        queue.erase(queue.begin());
+        if(p->orphan) {
+            delete p;
+            continue;
+        }
+        n++;
+        p->handle.resume();
+    }
+    return n;
+}
+
+/**
+ Awaitable of one request: start is called at the first suspension with the completion callback and its userdata.
+ The request keeps its arguments, so the views given to it must outlive the co_await expression only.
+ If its coroutine is destroyed while the request is in flight, the response is released when it arrives.
+*/
+template<class Start>
+class [[nodiscard]] Request {
+public:
+    explicit Request(cp_session cps, Start start) : cps_(cps), start_(std::move(start)) {}
+    Request(const Request&) = delete;
+    Request& operator=(const Request&) = delete;
+    ~Request() {
+        if(pending_) pending_->orphan = true;
+    }
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle) {
+        pending_ = new detail::Pending;
+        pending_->handle = handle;
+        if(start_(&Request::complete, pending_) == CP_OK) return true;
+        delete pending_;
+        pending_ = nullptr;
+        result_ = Result(CP_FAIL, CP_HTTP_RESULT(), cloudplugs_get_last_err_code(cps_), nullptr, 0);
+        return false;
+    }
+    Result await_resume() noexcept {
+        if(pending_) {
+            result_ = std::move(pending_->result);
+            delete pending_;
+            pending_ = nullptr;
+        }
+        return std::move(result_);
+    }
+
+private:
+    static void complete(cp_session cps, cp_res res, CP_HTTP_RESULT http, char* result, size_t length, void* userdata) {
+        detail::Pending* p = static_cast<detail::Pending*>(userdata);
+        p->result = Result(res, http, res == CP_OK ? CP_ERR_CODE() : cloudplugs_get_last_err_code(cps), result, length);
+        if(p->orphan) delete p;
+        else detail::ready().push_back(p);
+    }
+
+    cp_session cps_;
+    Start start_;
+    Result result_;
+    detail::Pending* pending_ = nullptr;
+};
+
+/**
+ Publish payload in a channel, as cloudplugs_publish_data(); payload is sent without being copied, and an empty channel must be in the payload.
+*/
+inline auto publish(Session& s, std::string_view channel, std::string_view payload) {
+    cp_body body;
+    cloudplugs_body_buffer(&body, payload.data(), payload.size());
+    auto start = [cps = s.get(), channel = detail::CString(channel), body](cp_async_callback cb, void* userdata) {
+        return cloudplugs_publish_data_async_body(cps, channel.or_null(), &body, cb, userdata);
+    };
+    return Request<decltype(start)>(s.get(), std::move(start));
+}
+
+/**
+ Retrieve the data of a channel mask, as cloudplugs_retrieve_data().
+*/
+inline auto retrieve(Session& s, std::string_view channel_mask, std::string_view query = {}) {
+    auto start = [cps = s.get(), mask = std::string(channel_mask), query = std::string(query)](cp_async_callback cb, void* userdata) {
+        return cloudplugs_retrieve_data_async(cps, mask.c_str(), query.empty() ? nullptr : query.c_str(), cb, userdata);
+    };
+    return Request<decltype(start)>(s.get(), std::move(start));
+}
+
+/**
+ Write a device property, as cloudplugs_set_device_prop(); an empty plugid is the device of the session, value is sent without being copied.
+*/
+inline auto set_prop(Session& s, std::string_view plugid, std::string_view prop, std::string_view value) {
+    cp_body body;
+    cloudplugs_body_buffer(&body, value.data(), value.size());
+    auto start = [cps = s.get(), plugid = std::string(plugid), prop = std::string(prop), body](cp_async_callback cb, void* userdata) {
+        return cloudplugs_set_device_prop_async_body(cps, plugid.empty() ? nullptr : plugid.c_str(), prop.empty() ? nullptr : prop.c_str(), &body, cb, userdata);
+    };
+    return Request<decltype(start)>(s.get(), std::move(start));
+}
+
+template<class T = void>
+class Task;
+
+namespace detail {
+
+template<class T>
+struct Promise;
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        template<class P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) const noexcept {
+            std::coroutine_handle<> next = handle.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+template<class T>
+struct Promise : PromiseBase {
+    std::optional<T> value;
+
+    Task<T> get_return_object() noexcept;
+    template<class U>
+    void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+    T result() {
+        if(error) std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template<>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object() noexcept;
+    void return_void() const noexcept {}
+    void result() {
+        if(error) std::rethrow_exception(error);
+    }
+};
+
+} // namespace detail
+
+/**
+ A lazy coroutine: it starts when awaited, or by start().
+*/
+template<class T>
+class Task {
+public:
+    using promise_type = detail::Promise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) noexcept : handle_(handle) {}
+    Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Task& operator=(Task&& other) noexcept {
+        if(this != &other) {
+            if(handle_) handle_.destroy();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if(handle_) handle_.destroy();
+    }
+
+    bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept {
+        handle_.promise().continuation = continuation;
+        return handle_;
+    }
+    T await_resume() { return handle_.promise().result(); }
+
+    void start() {
+        if(!started_) {
+            started_ = true;
+            handle_.resume();
+        }
+    }
+    bool done() const noexcept { return handle_.done(); }
+    T result() { return handle_.promise().result(); }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+    bool started_ = false;
+};
+
+namespace detail {
+
+template<class T>
+inline Task<T> Promise<T>::get_return_object() noexcept {
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() noexcept {
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+/**
+ A minimal event loop based on poll(), driving the requests of one session, e.g. for tests and tools.
+ It must outlive the pending requests of the session.
+*/
+class Loop {
+public:
+    explicit Loop(Session& s) : cps_(s.get()) {
+        if(cloudplugs_set_event_callbacks(cps_, &Loop::on_socket, &Loop::on_timer, this) != CP_OK)
+            throw std::runtime_error("cannot set the event callbacks of the session");
+    }
+    Loop(const Loop&) = delete;
+    Loop& operator=(const Loop&) = delete;
+    ~Loop() {
+        if(!cloudplugs_async_pending(cps_)) cloudplugs_set_event_callbacks(cps_, &Loop::ignore_socket, &Loop::ignore_timer, nullptr);
+    }
+
+    /** Wait for the next events, at most max_wait_ms milliseconds if not negative, and process them */
+    void step(int max_wait_ms = -1) {
+        int timeout = max_wait_ms;
+        if(timer_) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline_ - std::chrono::steady_clock::now()).count();
+            if(left < 0) left = 0;
+            if(timeout < 0 || left < timeout) timeout = (int) left;
+        }
+        std::vector<pollfd> fds = fds_;
+        int n = ::poll(fds.data(), fds.size(), timeout);
+        for(size_t i = 0; n > 0 && i < fds.size(); i++) {
+            if(!fds[i].revents) continue;
+            int events = (fds[i].revents & POLLIN ? CP_EVENT_IN : 0) | (fds[i].revents & POLLOUT ? CP_EVENT_OUT : 0)
+                | (fds[i].revents & (POLLERR | POLLHUP) ? CP_EVENT_ERR : 0);
+            cloudplugs_socket_action(cps_, fds[i].fd, events);
+            resume_ready();
+        }
+        if(timer_ && std::chrono::steady_clock::now() >= deadline_) {
+            timer_ = false;
+            cloudplugs_socket_action(cps_, CP_SOCKET_TIMEOUT, 0);
+            resume_ready();
+        }
+    }
+
+    /** Process events until no request is pending */
+    void run() {
+        while(cloudplugs_async_pending(cps_) > 0) step();
+    }
+
+    /** Start a task and process events until it ends, returning its result */
+    template<class T>
+    T run(Task<T> task) {
+        task.start();
+        while(!task.done()) {
+            if(cloudplugs_async_pending(cps_) <= 0 && !timer_) throw std::logic_error("the task waits for something else than a request");
+            step();
+        }
+        return task.result();
+    }
+
+private:
+    static int on_socket(cp_session, int fd, int what, void* userdata) {
+        Loop* self = static_cast<Loop*>(userdata);
+        short events = (what & CP_POLL_IN ? POLLIN : 0) | (what & CP_POLL_OUT ? POLLOUT : 0);
+        for(size_t i = 0; i < self->fds_.size(); i++) {
+            if(self->fds_[i].fd != fd) continue;
+            if(what == CP_POLL_REMOVE) self->fds_.erase(self->fds_.begin() + i);
+            else self->fds_[i].events = events;
+            return 0;
+        }
+        if(what != CP_POLL_REMOVE) self->fds_.push_back(pollfd{fd, events, 0});
+        return 0;
+    }
+    static int on_timer(cp_session, long timeout_ms, void* userdata) {
+        Loop* self = static_cast<Loop*>(userdata);
+        self->timer_ = timeout_ms >= 0;
+        if(self->timer_) self->deadline_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        return 0;
+    }
+    static int ignore_socket(cp_session, int, int, void*) { return 0; }
+    static int ignore_timer(cp_session, long, void*) { return 0; }
+
+    cp_session cps_;
+    std::vector<pollfd> fds_;
+    bool timer_ = false;
+    std::chrono::steady_clock::time_point deadline_;
+};
+
+} // namespace cp
+
+#endif // CP_CORO_HPP
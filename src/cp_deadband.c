@@ -0,0 +1,289 @@
+/*
+Copyright 2014 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest.h"
+#include "cp_internals.h"
+#include "cp_constants.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#ifdef CP_ENABLE_JSON
+#include "cp_rest_json.h"
+#endif
+
+enum _CP_DEADBAND_TYPE { CP_DEADBAND_NONE, CP_DEADBAND_NUMBER, CP_DEADBAND_STRING, CP_DEADBAND_JSON };
+
+struct _cp_deadband_entry {
+    char* channel;
+    uint32_t hash;
+    double abs;
+    double rel;
+    cp_time heartbeat;
+    enum _CP_DEADBAND_TYPE type;
+    double number;
+    char* string;
+    void* json;
+    cp_time sent_at;
+};
+
+struct _cloudplugs_deadband {
+    cp_session cps;
+    double abs;
+    double rel;
+    cp_time heartbeat;
+    struct _cp_deadband_entry* entries;
+    size_t count;
+    size_t size;
+};
+
+/* the heartbeat runs on the local clock, whatever the timestamps of the values */
+static cp_time cloudplugs_deadband_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (cp_time) ts.tv_sec * 1000 + (cp_time) (ts.tv_nsec / 1000000);
+}
+
+static void cloudplugs_deadband_forget(struct _cp_deadband_entry* e) {
+    if(e->string) cloudplugs_free(e->string);
+#ifdef CP_ENABLE_JSON
+    if(e->json) json_decref((json_t*) e->json);
+#endif
+    e->string = NULL;
+    e->json = NULL;
+    e->type = CP_DEADBAND_NONE;
+}
+
+cp_deadband cloudplugs_deadband_create(cp_session cps, double abs, double rel, cp_time heartbeat) {
+    if(!cps) return NULL;
+    if(abs < 0 || rel < 0 || heartbeat < 0) {
+        cps->err = CP_ERR_INVALID_PARAMETER;
+        return NULL;
+    }
+    cp_deadband db = (cp_deadband) cloudplugs_calloc(1, sizeof(struct _cloudplugs_deadband));
+    if(db) db->entries = (struct _cp_deadband_entry*) cloudplugs_calloc(CP_DEADBAND_SIZE, sizeof(struct _cp_deadband_entry));
+    if(!db || !db->entries) {
+        cloudplugs_free(db);
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    db->cps = cps;
+    db->abs = abs;
+    db->rel = rel;
+    db->heartbeat = heartbeat;
+    db->size = CP_DEADBAND_SIZE;
+    return db;
+}
+
+cp_res cloudplugs_deadband_destroy(cp_deadband db) {
+    if(!db) return CP_FAIL;
+    size_t i;
+    for(i = 0; i < db->size; i++) {
+        if(!db->entries[i].channel) continue;
+        cloudplugs_deadband_forget(&db->entries[i]);
+        cloudplugs_free(db->entries[i].channel);
+    }
+    cloudplugs_free(db->entries);
+    cloudplugs_free(db);
+    return CP_OK;
+}
+
+/* open addressing with linear probing; the table is kept at most 3/4 full */
+static struct _cp_deadband_entry* cloudplugs_deadband_lookup(cp_deadband db, const char* channel) {
+    uint32_t hash = cloudplugs_hash(channel);
+    size_t mask = db->size - 1;
+    size_t i = hash & mask;
+    while(db->entries[i].channel) {
+        if(db->entries[i].hash == hash && !strcmp(db->entries[i].channel, channel)) return &db->entries[i];
+        i = (i + 1) & mask;
+    }
+
+    if((db->count + 1) * 4 > db->size * 3) {
+        size_t size = db->size * 2;
+        struct _cp_deadband_entry* entries = (struct _cp_deadband_entry*) cloudplugs_calloc(size, sizeof(struct _cp_deadband_entry));
+        if(!entries) return NULL;
+        size_t j;
+        for(j = 0; j < db->size; j++) {
+            if(!db->entries[j].channel) continue;
+            size_t k = db->entries[j].hash & (size - 1);
+            while(entries[k].channel) k = (k + 1) & (size - 1);
+            entries[k] = db->entries[j];
+        }
+        cloudplugs_free(db->entries);
+        db->entries = entries;
+        db->size = size;
+        mask = size - 1;
+        i = hash & mask;
+        while(db->entries[i].channel) i = (i + 1) & mask;
+    }
+
+    struct _cp_deadband_entry* e = &db->entries[i];
+    e->channel = cloudplugs_strdup(channel);
+    if(!e->channel) return NULL;
+    e->hash = hash;
+    e->abs = db->abs;
+    e->rel = db->rel;
+    e->heartbeat = db->heartbeat;
+    db->count++;
+    return e;
+}
+
+cp_res cloudplugs_deadband_set_channel(cp_deadband db, const char* channel, double abs, double rel, cp_time heartbeat) {
+    if(!db) return CP_FAIL;
+    if(!channel || abs < 0 || rel < 0 || heartbeat < 0) SET_ERROR_AND_RETURN(db->cps, CP_ERR_INVALID_PARAMETER);
+    struct _cp_deadband_entry* e = cloudplugs_deadband_lookup(db, channel);
+    if(!e) SET_ERROR_AND_RETURN(db->cps, CP_ERR_OUT_OF_MEMORY);
+    e->abs = abs;
+    e->rel = rel;
+    e->heartbeat = heartbeat;
+    return CP_OK;
+}
+
+static cp_bool cloudplugs_deadband_expired(const struct _cp_deadband_entry* e, cp_time now) {
+    return e->type == CP_DEADBAND_NONE || (e->heartbeat > 0 && now - e->sent_at >= e->heartbeat);
+}
+
+static cp_bool cloudplugs_deadband_moved(const struct _cp_deadband_entry* e, double value) {
+    double delta = value > e->number ? value - e->number : e->number - value;
+    double base = e->number < 0 ? -e->number : e->number;
+    if(!e->abs && !e->rel) return delta != 0;
+    return (e->abs > 0 && delta > e->abs) || (e->rel > 0 && delta > e->rel * base);
+}
+
+static cp_res cloudplugs_deadband_publish(cp_deadband db, const char* channel, const char* data, cp_time at, char** result, size_t* result_length) {
+    char stamp[48] = "";
+    if(at > 0) snprintf(stamp, sizeof(stamp), ",\"" AT "\":%.17g", at);
+    char* body = cloudplugs_concat(db->cps, 4, "{\"" DATA "\":", data, stamp, "}");
+    if(!body) return CP_FAIL;
+    cp_res res = cloudplugs_publish_data(db->cps, channel, body, result, result_length);
+    cloudplugs_free(body);
+    return res;
+}
+
+cp_res cloudplugs_publish_number_deadband(cp_deadband db, const char* channel, double value, cp_time at, char** result, size_t* result_length, cp_bool* published) {
+    if(published) *published = CP_FALSE;
+    if(!db) return CP_FAIL;
+    if(!channel || !isfinite(value)) SET_ERROR_AND_RETURN(db->cps, CP_ERR_INVALID_PARAMETER);
+    struct _cp_deadband_entry* e = cloudplugs_deadband_lookup(db, channel);
+    if(!e) SET_ERROR_AND_RETURN(db->cps, CP_ERR_OUT_OF_MEMORY);
+
+    cp_time now = cloudplugs_deadband_now();
+    if(!cloudplugs_deadband_expired(e, now) && e->type == CP_DEADBAND_NUMBER && !cloudplugs_deadband_moved(e, value)) return CP_OK;
+
+    char data[32];
+    snprintf(data, sizeof(data), "%.17g", value);
+    cp_res res = cloudplugs_deadband_publish(db, channel, data, at, result, result_length);
+    if(res != CP_OK) return res;
+    cloudplugs_deadband_forget(e);
+    e->type = CP_DEADBAND_NUMBER;
+    e->number = value;
+    e->sent_at = now;
+    if(published) *published = CP_TRUE;
+    return CP_OK;
+}
+
+cp_res cloudplugs_publish_string_deadband(cp_deadband db, const char* channel, const char* value, cp_time at, char** result, size_t* result_length, cp_bool* published) {
+    if(published) *published = CP_FALSE;
+    if(!db) return CP_FAIL;
+    if(!channel || !value) SET_ERROR_AND_RETURN(db->cps, CP_ERR_INVALID_PARAMETER);
+    struct _cp_deadband_entry* e = cloudplugs_deadband_lookup(db, channel);
+    if(!e) SET_ERROR_AND_RETURN(db->cps, CP_ERR_OUT_OF_MEMORY);
+
+    cp_time now = cloudplugs_deadband_now();
+    if(!cloudplugs_deadband_expired(e, now) && e->type == CP_DEADBAND_STRING && !strcmp(e->string, value)) return CP_OK;
+
+    char* copy = cloudplugs_strdup(value);
+    char* data = cloudplugs_json_quote(db->cps, value);
+    cp_res res = (copy && data) ? cloudplugs_deadband_publish(db, channel, data, at, result, result_length) : CP_FAIL;
+    cloudplugs_free(data);
+    if(res != CP_OK) {
+        cloudplugs_free(copy);
+        if(!copy) db->cps->err = CP_ERR_OUT_OF_MEMORY;
+        return res;
+    }
+    cloudplugs_deadband_forget(e);
+    e->type = CP_DEADBAND_STRING;
+    e->string = copy;
+    e->sent_at = now;
+    if(published) *published = CP_TRUE;
+    return CP_OK;
+}
+
+#ifdef CP_ENABLE_JSON
+/* compare with the last value sent without serializing: numbers by deadband, the other values by equality */
+static cp_bool cloudplugs_deadband_changed(const struct _cp_deadband_entry* e, json_t* data) {
+    if(json_is_number(data)) return e->type != CP_DEADBAND_NUMBER || cloudplugs_deadband_moved(e, json_number_value(data));
+    if(json_is_string(data)) return e->type != CP_DEADBAND_STRING || strcmp(e->string, json_string_value(data));
+    return e->type != CP_DEADBAND_JSON || !json_equal((json_t*) e->json, data);
+}
+
+cp_res cloudplugs_publish_data_json_deadband(cp_deadband db, const char* channel, json_t* data, cp_time at, json_t** result, cp_bool* published) {
+    if(published) *published = CP_FALSE;
+    if(!db) return CP_FAIL;
+    cp_session cps = db->cps;
+    if(!channel || !data) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    struct _cp_deadband_entry* e = cloudplugs_deadband_lookup(db, channel);
+    if(!e) SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+
+    cp_time now = cloudplugs_deadband_now();
+    if(!cloudplugs_deadband_expired(e, now) && !cloudplugs_deadband_changed(e, data)) {
+        if(result) *result = NULL;
+        return CP_OK;
+    }
+
+    /* the last value is kept as a copy, since the caller may change data after the call */
+    char* string = NULL;
+    json_t* json = NULL;
+    if(json_is_string(data)) string = cloudplugs_strdup(json_string_value(data));
+    else if(!json_is_number(data)) json = json_deep_copy(data);
+    json_t* body = json_object();
+    if(!body || (json_is_string(data) && !string) || (!json_is_number(data) && !json_is_string(data) && !json)) {
+        if(body) json_decref(body);
+        if(json) json_decref(json);
+        cloudplugs_free(string);
+        SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    }
+    json_object_set(body, DATA, data);
+    if(at > 0) json_object_set_new(body, AT, json_real(at));
+    cp_res res = cloudplugs_publish_data_json(cps, channel, body, result);
+    json_decref(body);
+    if(res != CP_OK) {
+        if(json) json_decref(json);
+        cloudplugs_free(string);
+        return res;
+    }
+
+    cloudplugs_deadband_forget(e);
+    if(json_is_number(data)) {
+        e->type = CP_DEADBAND_NUMBER;
+        e->number = json_number_value(data);
+    } else if(string) {
+        e->type = CP_DEADBAND_STRING;
+        e->string = string;
+    } else {
+        e->type = CP_DEADBAND_JSON;
+        e->json = json;
+    }
+    e->sent_at = now;
+    if(published) *published = CP_TRUE;
+    return CP_OK;
+}
+#endif
@@ -0,0 +1,241 @@
+/*
+Copyright 2014 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest_json.h"
+#include "cp_internals.h"
+#include "cp_constants.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Each cached document holds what the server acknowledged: a null member records a deletion.
+ * The documents written by the cache are partial, since the members never written are unknown;
+ * the loaded ones are complete, so a member missing from them is known to be absent.
+ */
+struct _cloudplugs_device_cache {
+    cp_session cps;
+    json_t* docs;
+    json_t* complete;
+};
+
+cp_device_cache cloudplugs_device_cache_create(cp_session cps) {
+    if(!cps) return NULL;
+    cp_device_cache cache = (cp_device_cache) cloudplugs_calloc(1, sizeof(struct _cloudplugs_device_cache));
+    if(cache) {
+        cache->docs = json_object();
+        cache->complete = json_object();
+    }
+    if(!cache || !cache->docs || !cache->complete) {
+        if(cache) cloudplugs_device_cache_destroy(cache);
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    cache->cps = cps;
+    return cache;
+}
+
+cp_res cloudplugs_device_cache_destroy(cp_device_cache cache) {
+    if(!cache) return CP_FAIL;
+    if(cache->docs) json_decref(cache->docs);
+    if(cache->complete) json_decref(cache->complete);
+    cloudplugs_free(cache);
+    return CP_OK;
+}
+
+cp_res cloudplugs_device_cache_load(cp_device_cache cache, const char* plugid) {
+    if(!cache) return CP_FAIL;
+    cp_session cps = cache->cps;
+    const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
+    if(!id) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
+    json_t* doc = NULL;
+    if(cloudplugs_get_device_json(cps, id, &doc) != CP_OK || !json_is_object(doc)) {
+        if(doc) json_decref(doc);
+        cloudplugs_device_cache_forget(cache, id);
+        return CP_FAIL;
+    }
+    if(json_object_set_new(cache->docs, id, doc) || json_object_set(cache->complete, id, json_true())) {
+        cloudplugs_device_cache_forget(cache, id);
+        SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    }
+    return CP_OK;
+}
+
+cp_res cloudplugs_device_cache_forget(cp_device_cache cache, const char* plugid) {
+    if(!cache) return CP_FAIL;
+    const char* id = plugid ? plugid : cloudplugs_get_plug_id(cache->cps);
+    if(!id) SET_ERROR_AND_RETURN(cache->cps, CP_ERR_INVALID_LOGIN);
+    json_object_del(cache->docs, id);
+    json_object_del(cache->complete, id);
+    return CP_OK;
+}
+
+/* the members of the merge patch value changing base, added to diff; CP_FALSE when out of memory */
+static cp_bool cloudplugs_device_cache_diff(json_t* base, json_t* value, cp_bool complete, json_t* diff) {
+    const char* key;
+    json_t* v;
+    json_object_foreach(value, key, v) {
+        json_t* old = base ? json_object_get(base, key) : NULL;
+        if(json_is_null(v)) {
+            if(json_is_null(old) || (!old && complete)) continue;
+            if(json_object_set(diff, key, v)) return CP_FALSE;
+        } else if(json_is_object(v) && json_is_object(old)) {
+            json_t* sub = json_object();
+            if(!sub || !cloudplugs_device_cache_diff(old, v, complete, sub)) {
+                if(sub) json_decref(sub);
+                return CP_FALSE;
+            }
+            if(!json_object_size(sub)) json_decref(sub);
+            else if(json_object_set_new(diff, key, sub)) return CP_FALSE;
+        } else if(!old || !json_equal(old, v)) {
+            if(json_object_set(diff, key, v)) return CP_FALSE;
+        }
+    }
+    return CP_TRUE;
+}
+
+/* apply an acknowledged merge patch to a cached document, keeping its nulls as known deletions */
+static cp_bool cloudplugs_device_cache_apply(json_t* base, json_t* patch) {
+    const char* key;
+    json_t* v;
+    json_object_foreach(patch, key, v) {
+        json_t* old = json_object_get(base, key);
+        if(json_is_object(v) && json_is_object(old)) {
+            if(!cloudplugs_device_cache_apply(old, v)) return CP_FALSE;
+        } else if(json_object_set_new(base, key, json_deep_copy(v))) {
+            return CP_FALSE;
+        }
+    }
+    return CP_TRUE;
+}
+
+/* compute the patch of value against the cached device, as a new object */
+static json_t* cloudplugs_device_cache_patch(cp_device_cache cache, const char* id, json_t* value) {
+    json_t* diff = json_object();
+    if(diff && !cloudplugs_device_cache_diff(json_object_get(cache->docs, id), value, json_is_true(json_object_get(cache->complete, id)), diff)) {
+        json_decref(diff);
+        diff = NULL;
+    }
+    if(!diff) cache->cps->err = CP_ERR_OUT_OF_MEMORY;
+    return diff;
+}
+
+static void cloudplugs_device_cache_commit(cp_device_cache cache, const char* id, json_t* patch) {
+    json_t* doc = json_object_get(cache->docs, id);
+    if(!doc) {
+        doc = json_object();
+        if(!doc || json_object_set_new(cache->docs, id, doc)) return;
+    }
+    if(!cloudplugs_device_cache_apply(doc, patch)) cloudplugs_device_cache_forget(cache, id);
+}
+
+/* the members of value whose keys are in keys, as a new object */
+static json_t* cloudplugs_device_cache_select(json_t* value, json_t* keys) {
+    json_t* out = json_object();
+    const char* key;
+    json_t* v;
+    if(!out) return NULL;
+    json_object_foreach(keys, key, v) {
+        if(json_object_set(out, key, json_object_get(value, key))) {
+            json_decref(out);
+            return NULL;
+        }
+    }
+    return out;
+}
+
+/* store the properties written whole in the cached device: the single prop, or each member of value; CP_FALSE when out of memory */
+static cp_bool cloudplugs_device_cache_replace(cp_device_cache cache, const char* id, const char* prop, json_t* value) {
+    json_t* doc = json_object_get(cache->docs, id);
+    if(!doc) {
+        doc = json_object();
+        if(!doc || json_object_set_new(cache->docs, id, doc)) return CP_FALSE;
+    }
+    json_t* props = json_object_get(doc, PROPS);
+    if(!json_is_object(props)) {
+        props = json_object();
+        if(!props || json_object_set_new(doc, PROPS, props)) return CP_FALSE;
+    }
+    if(prop) return json_object_set_new(props, prop, json_deep_copy(value)) ? CP_FALSE : CP_TRUE;
+    const char* key;
+    json_t* v;
+    json_object_foreach(value, key, v) {
+        if(json_object_set_new(props, key, json_deep_copy(v))) return CP_FALSE;
+    }
+    return CP_TRUE;
+}
+
+cp_res cloudplugs_set_device_json_diff(cp_device_cache cache, const char* plugid, json_t* value, json_t** result, cp_bool* sent) {
+    if(sent) *sent = CP_FALSE;
+    if(result) *result = NULL;
+    if(!cache) return CP_FAIL;
+    cp_session cps = cache->cps;
+    if(!json_is_object(value)) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
+    if(!id) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
+
+    json_t* patch = cloudplugs_device_cache_patch(cache, id, value);
+    if(!patch) return CP_FAIL;
+    if(!json_object_size(patch)) {
+        json_decref(patch);
+        return CP_OK;
+    }
+    if(sent) *sent = CP_TRUE;
+    cp_res res = cloudplugs_set_device_json(cps, id, patch, result);
+    if(res == CP_OK) cloudplugs_device_cache_commit(cache, id, patch);
+    else cloudplugs_device_cache_forget(cache, id);
+    json_decref(patch);
+    return res;
+}
+
+cp_res cloudplugs_set_device_prop_json_diff(cp_device_cache cache, const char* plugid, const char* prop, json_t* value, cp_bool* sent) {
+    if(sent) *sent = CP_FALSE;
+    if(!cache) return CP_FAIL;
+    cp_session cps = cache->cps;
+    if(!value || (!prop && !json_is_object(value))) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
+    if(!id) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
+
+    /* the same write as a patch of the whole device */
+    json_t* props = prop ? json_object() : value;
+    json_t* wrapper = json_object();
+    if(!props || !wrapper || (prop && json_object_set(props, prop, value)) || json_object_set(wrapper, PROPS, props)) {
+        if(prop && props) json_decref(props);
+        if(wrapper) json_decref(wrapper);
+        SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    }
+    if(prop) json_decref(props);
+    json_t* patch = cloudplugs_device_cache_patch(cache, id, wrapper);
+    json_decref(wrapper);
+    if(!patch) return CP_FAIL;
+
+    /* the diff only tells what to write: a property is written whole, so the full value of each changed one is sent */
+    json_t* changed = json_object_get(patch, PROPS);
+    if(prop) changed = changed ? json_object_get(changed, prop) : NULL;
+    json_t* full = NULL;
+    if(changed) full = prop ? json_incref(value) : cloudplugs_device_cache_select(value, changed);
+    json_decref(patch);
+    if(!changed) return CP_OK;
+    if(!full) SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    if(sent) *sent = CP_TRUE;
+    cp_res res = cloudplugs_set_device_prop_json(cps, id, prop, full);
+    if(res != CP_OK || !cloudplugs_device_cache_replace(cache, id, prop, full)) cloudplugs_device_cache_forget(cache, id);
+    json_decref(full);
+    return res;
+}
@@ -21,8 +21,155 @@ under the License.
 #include "cp_rest.h"
 #include "cp_internals.h"
 #include "cp_constants.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static cp_malloc_func cp_user_malloc = malloc;
+static cp_free_func cp_user_free = free;
+static cp_realloc_func cp_user_realloc = realloc;
+static cp_strdup_func cp_user_strdup = NULL;
+static cp_calloc_func cp_user_calloc = NULL;
+/* incremented by the threads of libcurl too, e.g. its resolver, the count does not order anything else */
+static atomic_size_t cp_alloc_count = 0;
+
+static void cloudplugs_alloc_counted(void) {
+    atomic_fetch_add_explicit(&cp_alloc_count, 1, memory_order_relaxed);
+}
+
+cp_res cloudplugs_set_allocator(cp_malloc_func malloc_fn, cp_free_func free_fn, cp_realloc_func realloc_fn, cp_strdup_func strdup_fn, cp_calloc_func calloc_fn) {
+    if(!malloc_fn || !free_fn || !realloc_fn) return CP_FAIL;
+    cp_user_malloc = malloc_fn;
+    cp_user_free = free_fn;
+    cp_user_realloc = realloc_fn;
+    cp_user_strdup = strdup_fn;
+    cp_user_calloc = calloc_fn;
+    return CP_OK;
+}
+
+size_t cloudplugs_get_alloc_count() {
+    return atomic_load_explicit(&cp_alloc_count, memory_order_relaxed);
+}
+
+void cloudplugs_reset_alloc_count() {
+    atomic_store_explicit(&cp_alloc_count, 0, memory_order_relaxed);
+}
+
+void* cloudplugs_malloc(size_t size) {
+    cloudplugs_alloc_counted();
+    return cp_user_malloc(size);
+}
+
+void cloudplugs_free(void* ptr) {
+    if(ptr) cp_user_free(ptr);
+}
+
+void* cloudplugs_realloc(void* ptr, size_t size) {
+    cloudplugs_alloc_counted();
+    return cp_user_realloc(ptr, size);
+}
+
+char* cloudplugs_strdup(const char* str) {
+    if(cp_user_strdup) {
+        cloudplugs_alloc_counted();
+        return cp_user_strdup(str);
+    }
+    size_t len = strlen(str) + 1;
+    char* s = (char*) cloudplugs_malloc(len);
+    if(s) memcpy(s, str, len);
+    return s;
+}
+
+void* cloudplugs_calloc(size_t nmemb, size_t size) {
+    if(cp_user_calloc) {
+        cloudplugs_alloc_counted();
+        return cp_user_calloc(nmemb, size);
+    }
+    if(size && nmemb > SIZE_MAX / size) return NULL;
+    void* p = cloudplugs_malloc(nmemb * size);
+    if(p) memset(p, 0, nmemb * size);
+    return p;
+}
+
+uint32_t cloudplugs_hash(const char* s) {
+    uint32_t h = 2166136261u;
+    while(*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct _cp_id_entry* cloudplugs_id_set_slot(struct _cp_id_entry* entries, size_t size, const char* id, uint32_t hash) {
+    size_t i = hash & (size - 1);
+    while(entries[i].id && (entries[i].hash != hash || strcmp(entries[i].id, id))) i = (i + 1) & (size - 1);
+    return &entries[i];
+}
+
+/* move the ids at or after from into a table of the given size, releasing the others */
+static cp_bool cloudplugs_id_set_rehash(cp_id_set* s, size_t size, cp_time from) {
+    struct _cp_id_entry* entries = (struct _cp_id_entry*) cloudplugs_calloc(size, sizeof(struct _cp_id_entry));
+    if(!entries) return CP_FALSE;
+    size_t i, count = 0;
+    for(i = 0; i < s->size; i++) {
+        if(!s->entries[i].id) continue;
+        if(s->entries[i].at < from) {
+            cloudplugs_free(s->entries[i].id);
+            continue;
+        }
+        *cloudplugs_id_set_slot(entries, size, s->entries[i].id, s->entries[i].hash) = s->entries[i];
+        count++;
+    }
+    cloudplugs_free(s->entries);
+    s->entries = entries;
+    s->size = size;
+    s->count = count;
+    return CP_TRUE;
+}
+
+cp_bool cloudplugs_id_set_has(const cp_id_set* s, const char* id) {
+    return s->size && cloudplugs_id_set_slot(s->entries, s->size, id, cloudplugs_hash(id))->id;
+}
+
+cp_bool cloudplugs_id_set_add(cp_id_set* s, const char* id, cp_time at) {
+    if((s->count + 1) * 4 > s->size * 3 && !cloudplugs_id_set_rehash(s, s->size ? s->size * 2 : CP_ID_SET_SIZE, -HUGE_VAL)) return CP_FALSE;
+    uint32_t hash = cloudplugs_hash(id);
+    struct _cp_id_entry* slot = cloudplugs_id_set_slot(s->entries, s->size, id, hash);
+    if(slot->id) {
+        if(at > slot->at) slot->at = at;
+        return CP_TRUE;
+    }
+    if(!(slot->id = cloudplugs_strdup(id))) return CP_FALSE;
+    slot->hash = hash;
+    slot->at = at;
+    s->count++;
+    return CP_TRUE;
+}
+
+void cloudplugs_id_set_prune(cp_id_set* s, cp_time from) {
+    size_t i;
+    for(i = 0; i < s->size; i++) {
+        if(s->entries[i].id && s->entries[i].at < from) break;
+    }
+    /* a failed rebuild only keeps the stale ids a little longer */
+    if(i < s->size) cloudplugs_id_set_rehash(s, s->size, from);
+}
+
+void cloudplugs_id_set_clear(cp_id_set* s) {
+    size_t i;
+    for(i = 0; i < s->size; i++) cloudplugs_free(s->entries[i].id);
+    cloudplugs_free(s->entries);
+    s->entries = NULL;
+    s->count = 0;
+    s->size = 0;
+}
 
 char* cloudplugs_concat(cp_session cps, int num, ... ) {
     if(!cps) return NULL;
@@ -40,7 +187,7 @@ char* cloudplugs_concat(cp_session cps, int num, ... ) {
     }
     va_end(arguments);
 
-    char* s = (char*) malloc((sum+1)* sizeof(char));
+    char* s = (char*) cloudplugs_malloc((sum+1)* sizeof(char));
     if(!s) {
         if(cps) cps->err = CP_ERR_OUT_OF_MEMORY;
         return s;
@@ -56,160 +203,441 @@ char* cloudplugs_concat(cp_session cps, int num, ... ) {
     return s;
 }
 
-static const char* CP_HTTP_METHODS[] = { "GET", "POST", "PUT", "DELETE", "PATCH" };
+cp_res cloudplugs_string_set(cp_session cps, char** field, char* arena, size_t size, const char* a, const char* b) {
+    if(arena) {
+        if(!a) {
+            *field = NULL;
+            return CP_OK;
+        }
+        size_t la = strlen(a), lb = b ? strlen(b) : 0;
+        if(la + lb + 1 > size) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+        /* b is moved first, since it may be the tail of the current string */
+        memmove(arena+la, b ? b : "", lb + 1);
+        memmove(arena, a, la);
+        *field = arena;
+        return CP_OK;
+    }
+    char* s = NULL;
+    if(a) {
+        s = b ? cloudplugs_concat(cps, 2, a, b) : cloudplugs_concat(cps, 1, a);
+        if(!s) return CP_FAIL;
+    }
+    if(*field) cloudplugs_free(*field);
+    *field = s;
+    return CP_OK;
+}
 
-struct _cp_req_buffer {
-  char* body;
-  size_t len;
-  size_t offset;
-  cp_session cps;
-};
+static const char* CP_HTTP_METHODS[] = { "GET", "POST", "PUT", "DELETE", "PATCH" };
 
-typedef struct _cp_req_buffer cp_req_buffer;
+static int cloudplugs_spill_open(cp_session cps) {
+    const char* dir = getenv("TMPDIR");
+    if(!dir || !*dir) dir = P_tmpdir;
+    char path[CP_MAX_URL_LENGTH];
+    snprintf(path, sizeof(path), "%s/" CP_SPILL_TEMPLATE, dir);
+    int fd = mkstemp(path);
+    if(fd < 0) {
+        cps->err = CP_ERR_INTERNAL_ERROR;
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
 
-static size_t writefunc(void* ptr, size_t size, size_t nmemb, cp_req_buffer* b) {
-    if(!b->body) {
-        double sz;
-        b->len = 0;
-        CURLcode res = curl_easy_getinfo(b->cps->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &sz);
-        if(res == CURLE_OK && sz != -1) {
-            b->offset = 0;
-            b->len = (size_t) sz;
-            if(sz > 0){
-                b->body = (char*) malloc((b->len+1)*sizeof(char));
-                b->body[b->len] = '\0';
-            }
-        } else {
-            b->cps->err = CP_ERR_INVALID_CONTENT_LENGTH;
-            return 0;//If that amount differs from the amount passed to your function, it'll signal an error to the library
+static cp_bool cloudplugs_spill_write(int fd, const char* data, size_t length) {
+    while(length) {
+        ssize_t n = write(fd, data, length);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return CP_FALSE;
         }
+        data += n;
+        length -= (size_t) n;
     }
+    return CP_TRUE;
+}
+
+void cloudplugs_req_buffer_init(cp_req_buffer* b, cp_session cps, CURL* curl, size_t threshold) {
+    b->body = NULL;
+    b->len = 0;
+    b->offset = 0;
+    b->cps = cps;
+    b->curl = curl;
+    b->threshold = threshold;
+    b->fd = -1;
+    b->mapped = CP_FALSE;
+    b->fixed = CP_FALSE;
+    b->cbor = CP_FALSE;
+    b->curl_res = CURLE_OK;
+}
 
+void cloudplugs_req_buffer_fixed(cp_req_buffer* b, cp_session cps, char* buf, size_t cap) {
+    cloudplugs_req_buffer_init(b, cps, NULL, 0);
+    b->body = buf;
+    b->len = cap;
+    b->fixed = CP_TRUE;
+    if(cap) buf[0] = '\0';
+}
+
+size_t cloudplugs_req_buffer_write(void* ptr, size_t size, size_t nmemb, void* userdata) {
+    cp_req_buffer* b = (cp_req_buffer*) userdata;
     size_t tot = size * nmemb;
     size_t off = b->offset + tot;
-    if(off > b->len) {
-        b->cps->err = CP_ERR_INVALID_CONTENT_LENGTH;
+
+    if(b->fixed) {
+        /* keep counting past the end of the caller buffer, to report the size it needs */
+        if(b->offset + 1 < b->len) {
+            size_t room = b->len - 1 - b->offset;
+            memcpy(b->body+b->offset, ptr, tot < room ? tot : room);
+        }
+        b->offset = off;
+        if(b->len) b->body[off < b->len ? off : b->len - 1] = '\0';
+        return tot;
+    }
+
+    curl_off_t announced = -1;
+    if(!b->body && b->fd < 0 && (curl_easy_getinfo(b->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &announced) != CURLE_OK || announced < 0))
+        announced = -1;
+
+    /* a body announced larger than the budget goes to the file from its first byte, without being buffered first */
+    if(b->fd < 0 && b->threshold && (off > b->threshold || (announced >= 0 && (curl_off_t) b->threshold < announced))) {
+        /* the body does not fit the memory budget, move it to an unlinked temporary file */
+        b->fd = cloudplugs_spill_open(b->cps);
+        if(b->fd < 0) return 0;
+        if(b->offset && !cloudplugs_spill_write(b->fd, b->body, b->offset)) return 0;
+        cloudplugs_free(b->body);
+        b->body = NULL;
         b->len = 0;
-    } else {
-        memcpy(b->body+b->offset, ptr, tot);
+    }
+    if(b->fd >= 0) {
+        if(!cloudplugs_spill_write(b->fd, (const char*) ptr, tot)) {
+            b->cps->err = CP_ERR_INTERNAL_ERROR;
+            return 0;
+        }
         b->offset = off;
+        return tot;
+    }
+
+    if(off + 1 > b->len) {
+        size_t len = b->len ? b->len * 2 : CP_BUFFER_SIZE;
+        if(!b->body && announced >= 0) len = (size_t) announced + 1;
+        /* never grow past the budget, the next chunk beyond it spills */
+        if(b->threshold && len > b->threshold + 1) len = b->threshold + 1;
+        if(len < off + 1) len = off + 1;
+        char* tmp = (char*) cloudplugs_realloc(b->body, len*sizeof(char));
+        if(!tmp) {
+            b->cps->err = CP_ERR_OUT_OF_MEMORY;
+            return 0;//If that amount differs from the amount passed to your function, it'll signal an error to the library
+        }
+        b->body = tmp;
+        b->len = len;
     }
+    memcpy(b->body+b->offset, ptr, tot);
+    b->offset = off;
+    b->body[off] = '\0';
     return tot;//Return the number of bytes actually taken care of.
 }
 
-cp_res cloudplugs_request_exec(cp_session cps, cp_bool auth, CP_HTTP_METHOD http_method, const char* path, char* headers[], const char* query, const char* body, char** result, size_t* result_length) {
-    if(!cps) return CP_FAIL;
-    if(!path) return CP_FAIL;
+cp_res cloudplugs_req_buffer_finish(cp_req_buffer* b) {
+    if(b->fd < 0) return CP_OK;
+    /* the trailing zero byte makes the mapping a NUL-terminated string as any other result */
+    void* map = MAP_FAILED;
+    if(cloudplugs_spill_write(b->fd, "", 1))
+        map = mmap(NULL, b->offset + 1, PROT_READ, MAP_PRIVATE, b->fd, 0);
+    close(b->fd);
+    b->fd = -1;
+    if(map == MAP_FAILED) {
+        b->offset = 0;
+        SET_ERROR_AND_RETURN(b->cps, CP_ERR_INTERNAL_ERROR);
+    }
+    b->body = (char*) map;
+    b->len = b->offset + 1;
+    b->mapped = CP_TRUE;
+    return CP_OK;
+}
 
-    if(auth && !cps->auth) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
+void cloudplugs_req_buffer_discard(cp_req_buffer* b) {
+    if(b->fd >= 0) close(b->fd);
+    if(b->mapped) munmap(b->body, b->len);
+    else if(b->body && !b->fixed) cloudplugs_free(b->body);
+    b->fd = -1;
+    b->body = NULL;
+    b->len = b->offset = 0;
+    b->mapped = CP_FALSE;
+}
 
-    CURLcode curl_res;
+struct curl_slist* cloudplugs_build_headers(cp_session cps, char* headers[]) {
     struct curl_slist* chunk = NULL;
-    CURL* curl = NULL;
-    cps->http_res = 0;
-    cps->err = 0;
-    curl = cps->curl;
+    cp_bool typed = CP_FALSE;
+    if(headers) {
+        int i = 0 ;
+        while(headers[i] != 0) {
+            chunk = curl_slist_append(chunk, headers[i]);
+            if(!strncasecmp(headers[i], CONTENT_TYPE_HEADER, sizeof(CONTENT_TYPE_HEADER) - 1)) typed = CP_TRUE;
+            i++;
+        }
+    }
+    /* json unless the caller gave its own content type */
+    if(!typed) chunk = curl_slist_append(chunk, CONTENT_TYPE_JSON);
+
+    if(cps->identity->id && cps->identity->auth) {
+        chunk = curl_slist_append(chunk, cps->identity->id);
+        chunk = curl_slist_append(chunk, cps->identity->auth);
+    }
+    if(!chunk) cps->err = CP_ERR_OUT_OF_MEMORY;
+    return chunk;
+}
 
+/* the default headers of cloudplugs_build_headers(), linked on the stack of the caller instead of allocated by curl_slist_append() */
+static struct curl_slist* cloudplugs_fixed_headers(cp_session cps, struct curl_slist chunk[3]) {
+    chunk[0].data = (char*) CONTENT_TYPE_JSON;
+    chunk[0].next = NULL;
+    if(cps->identity->id && cps->identity->auth) {
+        chunk[0].next = &chunk[1];
+        chunk[1].data = cps->identity->id;
+        chunk[1].next = &chunk[2];
+        chunk[2].data = cps->identity->auth;
+        chunk[2].next = NULL;
+    }
+    return chunk;
+}
+
+/* without a result the body is dropped, instead of going to the default curl output, stdout */
+static size_t discardfunc(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    (void) ptr;
+    (void) userdata;
+    return size * nmemb;
+}
+
+static size_t readfunc(char* ptr, size_t size, size_t nmemb, cp_body_reader* r) {
+    size_t n = cloudplugs_body_read(ptr, size * nmemb, r);
+    return n == CP_READ_ABORT ? CURL_READFUNC_ABORT : n;
+}
+
+cp_res cloudplugs_easy_setup(cp_session cps, CURL* curl, CP_HTTP_METHOD http_method, const char* full_url, struct curl_slist* chunk, const cp_body* body, cp_body_reader* reader, cp_req_buffer* out) {
     //already default: curl_easy_setopt(cps->curl, CURLOPT_TCP_KEEPALIVE, 1L);
-    curl_easy_setopt(cps->curl, CURLOPT_CONNECTTIMEOUT, cps->timeout);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, cps->timeout);
     if(!cps->verify_ssl)
-        curl_easy_setopt(cps->curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
     if(cps->ca)
-        curl_easy_setopt(cps->curl, CURLOPT_CAINFO, cps->ca);
-
-    char* full_url = query ? cloudplugs_concat(cps, 4, cps->base_url , path, "?", query) : cloudplugs_concat(cps, 2, cps->base_url, path);
-    if(!full_url) {
-        curl_easy_reset(curl);
-        if(chunk) curl_slist_free_all(chunk);
-        return CP_FAIL;
-    }
+        curl_easy_setopt(curl, CURLOPT_CAINFO, cps->ca);
 
     curl_easy_setopt(curl, CURLOPT_URL, full_url);
-    free(full_url);
 
     /* is redirected, so we tell libcurl to follow redirection */
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
 
-    cp_req_buffer b;
-    if(result) {
-        b.body = NULL;
-        b.cps = cps;
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &b);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
+    if(out) {
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, out);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, cloudplugs_req_buffer_write);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discardfunc);
     }
     curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, CP_HTTP_METHODS[http_method]);
 
-    if(headers) {
-        int i = 0 ;
-        while(headers[i] != 0) {
-            chunk = curl_slist_append(chunk, headers[i]);
-            i++;
+    if(chunk) curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
+
+    if(body) {
+        if(cloudplugs_body_open(cps, reader, body) != CP_OK) return CP_FAIL;
+        if(reader->data) {
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) reader->length);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, reader->data);
+        } else {
+            /* with an unknown length libcurl sends the body with chunked transfer encoding */
+            if(body->length != CP_BODY_UNKNOWN_LENGTH)
+                curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) body->length);
+            curl_easy_setopt(curl, CURLOPT_POST, 1L);
+            curl_easy_setopt(curl, CURLOPT_READDATA, reader);
+            curl_easy_setopt(curl, CURLOPT_READFUNCTION, readfunc);
         }
     }
-    chunk = curl_slist_append(chunk, CONTENT_TYPE_JSON);
+    return CP_OK;
+}
+
+cp_res cloudplugs_request_send(cp_session cps, CP_HTTP_METHOD http_method, const char* full_url, struct curl_slist* chunk, const cp_body* body, cp_req_buffer* out) {
+    CURL* curl = cps->curl;
+    cps->http_res = 0;
+    cps->err = 0;
 
-    if(cps->id && cps->auth) {
-        chunk = curl_slist_append(chunk, cps->id);
-        chunk = curl_slist_append(chunk, cps->auth);
+    cp_body_reader reader;
+    if(cloudplugs_easy_setup(cps, curl, http_method, full_url, chunk, body, &reader, out) != CP_OK) {
+        curl_easy_reset(curl);
+        return CP_FAIL;
     }
 
-    if(chunk) curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
+    /* Perform the request, res will get the return code */
+    CURLcode curl_res = curl_easy_perform(curl);
+    if(out) {
+        out->curl_res = curl_res;
+        if(curl_res == CURLE_OK && cloudplugs_req_buffer_finish(out) != CP_OK)
+            out->curl_res = CURLE_WRITE_ERROR;
+        char* content_type = NULL;
+        if(curl_res == CURLE_OK && curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type) == CURLE_OK && content_type)
+            out->cbor = strncasecmp(content_type, MIME_CBOR, sizeof(MIME_CBOR) - 1) ? CP_FALSE : CP_TRUE;
+    }
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &cps->http_res);
 
-    if(body) curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+    /* always cleanup */
+    if(body) cloudplugs_body_close(&reader);
+    curl_easy_reset(curl);
+    if(cps->http_res == CP_HTTP_OK || cps->http_res == CP_HTTP_CREATED) {
+        return CP_OK;
+    } else {
+        if(!cps->err) cps->err = CP_ERR_HTTP;
+        return CP_FAIL;
+    }
+}
 
-    /* Perform the request, res will get the return code */
-    curl_res = curl_easy_perform(curl);
-    /* Check for errors */
-    if(curl_res != CURLE_OK) {
-        const char*error = curl_easy_strerror(curl_res);
+void cloudplugs_req_buffer_result(cp_req_buffer* b, char** result, size_t* result_length) {
+    if(b->curl_res != CURLE_OK) {
+        cloudplugs_req_buffer_discard(b);
+        const char*error = curl_easy_strerror(b->curl_res);
         int resl = strlen(error);
         if(result_length) *result_length = resl;
         if(result) {
-            *result = (char*) malloc(resl * sizeof(char));
+            *result = (char*) cloudplugs_malloc((resl+1) * sizeof(char));
             if(*result) strcpy(*result, error);
         }
     } else {
-        if(result) *result = b.body;
-        if(result_length) {
-            double sz;
-            CURLcode res = curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &sz);
-            if(res == CURLE_OK) *result_length = (size_t) sz;
-        }
+        if(result) *result = b->body;
+        else cloudplugs_req_buffer_discard(b);
+        if(result_length) *result_length = b->offset;
     }
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &cps->http_res);
+}
 
-    /* always cleanup */
+cp_res cloudplugs_request_perform(cp_session cps, CP_HTTP_METHOD http_method, const char* full_url, struct curl_slist* chunk, const cp_body* body, char** result, size_t* result_length) {
+    cp_req_buffer b;
+    cloudplugs_req_buffer_init(&b, cps, cps->curl, 0);
+    cp_res cp_res = cloudplugs_request_send(cps, http_method, full_url, chunk, body, result ? &b : NULL);
+    if(result) cloudplugs_req_buffer_result(&b, result, result_length);
+    return cp_res;
+}
 
-    curl_easy_reset(curl);
-    if(chunk) curl_slist_free_all(chunk);
-    if(cps->http_res == CP_HTTP_OK || cps->http_res == CP_HTTP_CREATED) {
-        return CP_OK;
-    } else {
-        cps->err = CP_ERR_HTTP;
+cp_res cloudplugs_request_exec(cp_session cps, cp_bool auth, CP_HTTP_METHOD http_method, const char* path, char* headers[], const char* query, const char* body, char** result, size_t* result_length) {
+    cp_body b;
+    if(body) cloudplugs_body_buffer(&b, body, strlen(body));
+    return cloudplugs_request_exec_body(cps, auth, http_method, path, headers, query, body ? &b : NULL, result, result_length);
+}
+
+cp_res cloudplugs_request_exec_body(cp_session cps, cp_bool auth, CP_HTTP_METHOD http_method, const char* path, char* headers[], const char* query, const cp_body* body, char** result, size_t* result_length) {
+    cp_req_buffer b;
+    cloudplugs_req_buffer_init(&b, cps, cps ? cps->curl : NULL, 0);
+    cp_res cp_res = cloudplugs_request_exec_buffer(cps, auth, http_method, path, headers, query, body, result ? &b : NULL);
+    if(result) cloudplugs_req_buffer_result(&b, result, result_length);
+    return cp_res;
+}
+
+/* send a request with the default headers, building the url and the headers on the stack */
+static cp_res cloudplugs_request_send_fixed(cp_session cps, CP_HTTP_METHOD http_method, const char* path, const char* query, const cp_body* body, cp_req_buffer* out) {
+    char full_url[CP_MAX_URL_LENGTH];
+    int n = query ? snprintf(full_url, sizeof(full_url), "%s%s?%s", cps->base_url, path, query) : snprintf(full_url, sizeof(full_url), "%s%s", cps->base_url, path);
+    if(n < 0 || (size_t) n >= sizeof(full_url)) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+
+    struct curl_slist chunk[3];
+    return cloudplugs_request_send(cps, http_method, full_url, cloudplugs_fixed_headers(cps, chunk), body, out);
+}
+
+cp_res cloudplugs_request_exec_buffer(cp_session cps, cp_bool auth, CP_HTTP_METHOD http_method, const char* path, char* headers[], const char* query, const cp_body* body, cp_req_buffer* out) {
+    if(!cps) return CP_FAIL;
+    if(!path) return CP_FAIL;
+
+    if(auth && !cps->identity->auth) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
+
+#ifdef CP_TINY
+    if(!headers) return cloudplugs_request_send_fixed(cps, http_method, path, query, body, out);
+#endif
+
+    char* full_url = query ? cloudplugs_concat(cps, 4, cps->base_url , path, "?", query) : cloudplugs_concat(cps, 2, cps->base_url, path);
+    if(!full_url) return CP_FAIL;
+
+    struct curl_slist* chunk = cloudplugs_build_headers(cps, headers);
+    if(!chunk) {
+        cloudplugs_free(full_url);
         return CP_FAIL;
     }
+
+    cp_res cp_res = cloudplugs_request_send(cps, http_method, full_url, chunk, body, out);
+
+    cloudplugs_free(full_url);
+    curl_slist_free_all(chunk);
+    return cp_res;
+}
+
+cp_res cloudplugs_request_exec_fixed(cp_session cps, cp_bool auth, CP_HTTP_METHOD http_method, const char* path, const char* query, const cp_body* body, char* buf, size_t cap, size_t* len) {
+    if(!cps) return CP_FAIL;
+    if(!path || !buf || !cap) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+
+    if(auth && !cps->identity->auth) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
+
+    cp_req_buffer b;
+    cloudplugs_req_buffer_fixed(&b, cps, buf, cap);
+    cp_res cp_res = cloudplugs_request_send_fixed(cps, http_method, path, query, body, &b);
+    if(b.curl_res != CURLE_OK) {
+        /* as cloudplugs_req_buffer_result(), the result is the transfer error */
+        const char* error = curl_easy_strerror(b.curl_res);
+        b.offset = 0;
+        cloudplugs_req_buffer_write((void*) error, 1, strlen(error), &b);
+    }
+    if(len) *len = b.offset;
+    if(cp_res == CP_OK && b.offset >= cap) SET_ERROR_AND_RETURN(cps, CP_ERR_BUFFER_TOO_SMALL);
+    return cp_res;
+}
+
+static int cloudplugs_url_unreserved(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+cp_res cloudplugs_path_format(cp_session cps, char* dst, size_t size, const char* prefix, const char* raw, const char* escaped) {
+    static const char hex[] = "0123456789ABCDEF";
+    int n = snprintf(dst, size, "%s%s%s", prefix, raw ? raw : "", raw && escaped ? "/" : "");
+    if(n < 0 || (size_t) n >= size) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    /* the same encoding of curl_easy_escape(), in place */
+    size_t i = (size_t) n;
+    const unsigned char* p;
+    for(p = (const unsigned char*) escaped; p && *p; p++) {
+        if(cloudplugs_url_unreserved(*p)) {
+            if(i + 1 >= size) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+            dst[i++] = (char) *p;
+        } else {
+            if(i + 3 >= size) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+            dst[i++] = '%';
+            dst[i++] = hex[*p >> 4];
+            dst[i++] = hex[*p & 15];
+        }
+    }
+    dst[i] = '\0';
+    return CP_OK;
 }
 
 const char* cloudplugs_get_plug_id(cp_session cps) {
     if(!cps) return NULL;
-    if(!cps->id || strchr(cps->id,'@')) {
+    if(!cps->identity->id || strchr(cps->identity->id,'@')) {
         cps->err = CP_ERR_INVALID_LOGIN;
         return NULL;
     }
-    return cps->id+LIT_STR_LEN(PLUG_ID_HEADER);
+    return cps->identity->id+LIT_STR_LEN(PLUG_ID_HEADER);
 }
 
 void cloudplugs_internal_set_auth(cp_session cps, cp_res cp_res, char** result){
     if(cp_res == CP_OK) {
-        char plugid[32] = "";
-        char auth[128] = "";
+        char plugid[32 + 1] = "";
+        char auth[128 + 1] = "";
         if(cloudplugs_extract_string_from_json(result, ID, plugid, 32) && cloudplugs_extract_string_from_json(result, AUTH, auth, 128)){
             cloudplugs_set_auth(cps, plugid, auth, CP_FALSE);
         }
     }
 }
 
+#ifdef CP_TINY
+/* the tiny build formats the paths in the session: one is in use at a time, by the request being set up */
+static char* cloudplugs_url_path(cp_session cps, const char* prefix, const char* raw, const char* escaped) {
+    return cloudplugs_path_format(cps, cps->path_arena, sizeof(cps->path_arena), prefix, raw, escaped) == CP_OK ? cps->path_arena : NULL;
+}
+#endif
+
 char* cloudplugs_url_encode_channel(cp_session cps, const char* channel_mask){
+#ifdef CP_TINY
+    return cloudplugs_url_path(cps, PATH_CHANNEL "/", NULL, channel_mask);
+#else
     char* ecm = curl_easy_escape(cps->curl, channel_mask, strlen(channel_mask));
     if(!ecm) {
         cps->err = CP_ERR_OUT_OF_MEMORY;
@@ -218,9 +646,13 @@ char* cloudplugs_url_encode_channel(cp_session cps, const char* channel_mask){
     char* res = cloudplugs_concat(cps, 2, PATH_CHANNEL "/", ecm);
     curl_free(ecm);
     return res;
+#endif
 }
 
 char* cloudplugs_url_encode_data(cp_session cps, const char* channel_mask){
+#ifdef CP_TINY
+    return cloudplugs_url_path(cps, PATH_DATA "/", NULL, channel_mask);
+#else
     char* ecm = curl_easy_escape(cps->curl, channel_mask, strlen(channel_mask));
     if(!ecm) {
         cps->err = CP_ERR_OUT_OF_MEMORY;
@@ -229,9 +661,15 @@ char* cloudplugs_url_encode_data(cp_session cps, const char* channel_mask){
     char* res = cloudplugs_concat(cps, 2, PATH_DATA "/", ecm);
     curl_free(ecm);
     return res;
+#endif
 }
 
 char* cloudplugs_url_encode_prop(cp_session cps, const char* id, const char* prop){
+    if(!id) return NULL;
+#ifdef CP_TINY
+    return cloudplugs_url_path(cps, PATH_DEVICE "/", id, prop ? prop : "");
+#else
+    if(!prop) return cloudplugs_concat(cps, 3, PATH_DEVICE "/", id, "/");
     char* ep = curl_easy_escape(cps->curl, prop, strlen(prop));
     if(!ep) {
         cps->err = CP_ERR_OUT_OF_MEMORY;
@@ -240,4 +678,106 @@ char* cloudplugs_url_encode_prop(cp_session cps, const char* id, const char* pro
     char* res = cloudplugs_concat(cps, 4, PATH_DEVICE "/", id, "/", ep);
     curl_free(ep);
     return res;
+#endif
+}
+
+char* cloudplugs_url_device(cp_session cps, const char* id){
+    if(!id) return NULL;
+#ifdef CP_TINY
+    return cloudplugs_url_path(cps, PATH_DEVICE "/", id, NULL);
+#else
+    return cloudplugs_concat(cps, 2, PATH_DEVICE "/", id);
+#endif
+}
+
+void cloudplugs_url_free(cp_session cps, char* url){
+#ifdef CP_TINY
+    if(url == cps->path_arena) return;
+#else
+    (void) cps;
+#endif
+    cloudplugs_free(url);
+}
+
+void cloudplugs_buffer_reset(cp_session cps) {
+    cloudplugs_json_writer_reset(&cps->writer);
+}
+
+int cloudplugs_buffer_append(const char* data, size_t length, void* userdata) {
+    cp_session cps = (cp_session) userdata;
+    if(!cloudplugs_json_writer_put(&cps->writer, data, length)) {
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        return -1;
+    }
+    return 0;
+}
+
+char* cloudplugs_json_quote(cp_session cps, const char* s) {
+    static const char hex[] = "0123456789abcdef";
+    size_t len = 2;
+    const unsigned char* p;
+    for(p = (const unsigned char*) s; *p; p++) {
+        if(*p == '"' || *p == '\\') len += 2;
+        else if(*p < 0x20) len += 6;
+        else len++;
+    }
+    char* res = (char*) cloudplugs_malloc(len + 1);
+    if(!res) {
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    char* d = res;
+    *d++ = '"';
+    for(p = (const unsigned char*) s; *p; p++) {
+        if(*p == '"' || *p == '\\') {
+            *d++ = '\\';
+            *d++ = (char) *p;
+        } else if(*p < 0x20) {
+            *d++ = '\\';
+            *d++ = 'u';
+            *d++ = '0';
+            *d++ = '0';
+            *d++ = hex[*p >> 4];
+            *d++ = hex[*p & 0xf];
+        } else {
+            *d++ = (char) *p;
+        }
+    }
+    *d++ = '"';
+    *d = '\0';
+    return res;
+}
+
+cp_res cloudplugs_location_format(cp_session cps, char* body, size_t size, double longitude, double latitude, double altitude, double accuracy, double timestamp) {
+    if(!longitude || !latitude) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+  //longitude,  latitude,  altitude,  accuracy,  timestamp
+    if(longitude > MAX_LONGITUDE || longitude < MIN_LONGITUDE) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    if(latitude > MAX_LATITUDE || latitude < MIN_LATITUDE) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+
+    cp_json_writer w;
+    cloudplugs_json_writer_fixed(&w, body, size);
+    if(cloudplugs_location_write(&w, longitude, latitude, altitude, accuracy, timestamp) != CP_OK) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    return CP_OK;
+}
+
+cp_res cloudplugs_location_write(cp_json_writer* w, double longitude, double latitude, double altitude, double accuracy, double timestamp) {
+    cloudplugs_json_begin_object(w);
+    cloudplugs_json_write_key(w, LONGITUDE);
+    cloudplugs_json_write_number(w, longitude);
+    cloudplugs_json_write_key(w, LATITUDE);
+    cloudplugs_json_write_number(w, latitude);
+    if(accuracy >= 0) {
+        cloudplugs_json_write_key(w, ACCURACY);
+        cloudplugs_json_write_number(w, accuracy);
+    }
+    if(altitude >= 0) {
+        cloudplugs_json_write_key(w, ALTITUDE);
+        cloudplugs_json_write_number(w, altitude);
+    }
+    if(timestamp >= 0) {
+        cloudplugs_json_write_key(w, TIMESTAMP);
+        cloudplugs_json_write_number(w, timestamp);
+    }
+    /* the writer ignores the calls after a failure, which is reported here */
+    return cloudplugs_json_end_object(w);
 }
@@ -22,7 +22,9 @@ under the License.
 #define CP_INTERNALS_H
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <curl/curl.h>
+#include "cp_constants.h"
 
 #ifdef  __cplusplus
 extern "C" {
@@ -42,25 +44,186 @@ typedef enum _CP_HTTP_METHOD CP_HTTP_METHOD;
  * Data structure to handle a request session
  */
 
+/**
+ * In the tiny build the strings of a session live in fixed arrays: CP_ARENA(a) passes one to cloudplugs_string_set()
+ */
+
+#ifdef CP_TINY
+#define CP_ARENA(a) (a), sizeof(a)
+#else
+#define CP_ARENA(a) NULL, 0
+#endif
+
+struct _cp_identity {
+   char* id;
+   char* auth;
+   cp_bool is_master;
+#ifdef CP_TINY
+   char id_arena[CP_TINY_ID_SIZE];
+   char auth_arena[CP_TINY_AUTH_SIZE];
+#endif
+};
+
 struct _cloudplugs_session {
    CURL* curl;
    char* base_url;
    int timeout;
-   char* id;
-   char* auth;
-   cp_bool is_master;
+   struct _cp_identity own;
+   cp_identity identity;
    CP_HTTP_RESULT http_res;
    CP_ERR_CODE err;
    cp_bool verify_ssl;
    char* ca;
+   cp_json_writer writer;
+   cp_bool cbor;   /**<Data records are exchanged as cbor, see cloudplugs_set_cbor() */
+   int max_connections;
+   CURLM* multi;
+   cp_socket_callback socket_cb;
+   cp_timer_callback timer_cb;
+   void* event_userdata;
+   struct _cp_async* async;
+   int dispatching;   /**<Nesting of the asynchronous callbacks running, which defer cloudplugs_destroy_session() */
+   cp_bool destroyed;
+#ifdef CP_TINY
+   char base_url_arena[CP_TINY_URL_SIZE];
+   char ca_arena[CP_TINY_CA_SIZE];
+   char path_arena[CP_TINY_PATH_SIZE];   /**<The path of the request being set up, see cloudplugs_url_free() */
+#endif
 };
 
 
+/**
+ * Data structure of a prepared request: everything but the body is computed once
+ */
+
+struct _cloudplugs_prepared {
+   CP_HTTP_METHOD method;
+   char* url;
+   struct curl_slist* headers;
+};
+
+
+/**
+ * State of a body being sent
+ */
+
+struct _cp_body_reader {
+   const cp_body* body;
+   const char* data;
+   size_t length;
+   int index;
+   size_t offset;
+   void* map;
+   size_t map_length;
+   size_t released;
+};
+typedef struct _cp_body_reader cp_body_reader;
+
+
+/**
+ * Destination of a response body: a growing buffer, moved to a mapped temporary file above threshold bytes
+ */
+
+struct _cp_req_buffer {
+   char* body;
+   size_t len;
+   size_t offset;
+   cp_session cps;
+   CURL* curl;
+   size_t threshold;
+   int fd;
+   cp_bool mapped;
+   cp_bool fixed;
+   cp_bool cbor;   /**<The response body is cbor, from its Content-Type */
+   CURLcode curl_res;
+};
+typedef struct _cp_req_buffer cp_req_buffer;
+
+
+/**
+ * One request of a batch, running on a pooled easy handle
+ */
+
+struct _cp_transfer {
+   CURL* curl;
+   CP_HTTP_METHOD method;
+   char* url;
+   struct curl_slist* headers;
+   char* data;
+   size_t data_length;
+   cp_body body;
+   cp_body_reader reader;
+   cp_req_buffer response;
+   CP_HTTP_RESULT http_res;
+   size_t index;
+   void* userdata;
+};
+typedef struct _cp_transfer cp_transfer;
+
+/**
+ * Set of record ids with their timestamps, an open addressing table kept at most 3/4 full
+ */
+
+struct _cp_id_entry {
+   char* id;   /**<NULL for a free slot */
+   uint32_t hash;
+   cp_time at;
+};
+
+struct _cp_id_set {
+   struct _cp_id_entry* entries;
+   size_t count;
+   size_t size;
+};
+typedef struct _cp_id_set cp_id_set;
+
+/**
+ * Set the next request of a batch in t: method, url and optionally data, data_length, headers, index and userdata; the strings and the list are released by the batch, userdata by the caller.
+ * Return CP_FALSE when there is no request to start now; it is asked again after each completed request.
+ */
+typedef cp_bool (*cp_batch_next_func)(cp_session cps, cp_transfer* t, void* userdata);
+
+/**
+ * Called when a request of a batch ends: t->response.curl_res is the transfer result, t->http_res the http status and t->response the body.
+ * The callback can take the body setting t->response.body to NULL.
+ */
+typedef void (*cp_batch_done_func)(cp_session cps, cp_transfer* t, void* userdata);
+
+
+/**
+ * Allocation functions of the library, routed to the ones given to cloudplugs_set_allocator()
+ */
+void* cloudplugs_malloc(size_t size);
+void* cloudplugs_realloc(void* ptr, size_t size);
+char* cloudplugs_strdup(const char* str);
+void* cloudplugs_calloc(size_t nmemb, size_t size);
+
+/**
+ * FNV-1a hash of a string, used by the internal hash tables
+ */
+uint32_t cloudplugs_hash(const char* s);
+
+/**
+ * Operations of an id set, which starts zeroed: cloudplugs_id_set_add() keeps the latest timestamp of an id already present and fails only when out of memory,
+ * cloudplugs_id_set_prune() releases the ids older than from and cloudplugs_id_set_clear() all of them
+ */
+cp_bool cloudplugs_id_set_has(const cp_id_set* s, const char* id);
+cp_bool cloudplugs_id_set_add(cp_id_set* s, const char* id, cp_time at);
+void cloudplugs_id_set_prune(cp_id_set* s, cp_time from);
+void cloudplugs_id_set_clear(cp_id_set* s);
+
 /**
  * Utility function for string concatenation
  */
 char* cloudplugs_concat(cp_session cps, int num, ... );
 
+/**
+ * Set *field to the concatenation of a and b (if not NULL), or release it if a is NULL.
+ * With an arena (the tiny build) the string is stored in it, and b may point into the arena itself; without, it is allocated and the old one is freed.
+ * Fail with CP_ERR_INVALID_PARAMETER if the string does not fit the arena, leaving *field unchanged.
+ */
+cp_res cloudplugs_string_set(cp_session cps, char** field, char* arena, size_t size, const char* a, const char* b);
+
 /**
  Execute a generic http request.
 
@@ -76,6 +239,240 @@ char* cloudplugs_concat(cp_session cps, int num, ... );
 */
 cp_res cloudplugs_request_exec(cp_session cps, cp_bool auth, CP_HTTP_METHOD http_method, const char* path, char* headers[], const char* query, const char* body, char** result, size_t* result_length);
 
+/**
+ Execute a generic http request as cloudplugs_request_exec(), with a body of known length.
+*/
+cp_res cloudplugs_request_exec_body(cp_session cps, cp_bool auth, CP_HTTP_METHOD http_method, const char* path, char* headers[], const char* query, const cp_body* body, char** result, size_t* result_length);
+
+/**
+ Execute a generic http request as cloudplugs_request_exec_body(), writing the response body in out.
+*/
+cp_res cloudplugs_request_exec_buffer(cp_session cps, cp_bool auth, CP_HTTP_METHOD http_method, const char* path, char* headers[], const char* query, const cp_body* body, cp_req_buffer* out);
+
+/**
+ Execute a generic http request with the default headers, writing the response body in the caller buffer buf of cap bytes, without allocations.
+ *len receives the length of the whole body; if it does not fit, the body is truncated and the request fails with CP_ERR_BUFFER_TOO_SMALL.
+*/
+cp_res cloudplugs_request_exec_fixed(cp_session cps, cp_bool auth, CP_HTTP_METHOD http_method, const char* path, const char* query, const cp_body* body, char* buf, size_t cap, size_t* len);
+
+/**
+ Write in dst the path prefix, followed by raw if not NULL, followed by the url-encoded escaped if not NULL (separated by a slash from raw).
+ @return CP_OK on success, CP_FAIL with CP_ERR_INVALID_PARAMETER if the path does not fit size bytes.
+*/
+cp_res cloudplugs_path_format(cp_session cps, char* dst, size_t size, const char* prefix, const char* raw, const char* escaped);
+
+/**
+ Build the list of request headers: the optional extra headers, the content type and the session credentials.
+
+ @param cps The session reference.
+ @param headers If not NULL, is an array of string, last element must be NULL.
+ @return The header list to be released with curl_slist_free_all(), NULL if occurred an error.
+*/
+struct curl_slist* cloudplugs_build_headers(cp_session cps, char* headers[]);
+
+/**
+ Perform a request whose url and headers are already computed.
+
+ @param cps The session reference.
+ @param http_method Enum that indicate the desired action to be performed on the identified resource.
+ @param full_url The absolute url of the requested resource.
+ @param chunk The request headers.
+ @param body If not NULL, the request body.
+ @param result If not NULL, then *result will contain the dynamically allocated json string of the retrieved response body. The caller is responsible to free memory in *result.
+ @param result_length The length of the string stored in *result.
+ @return CP_SUCCESS if the request succeeds, CP_FAILED otherwise.
+*/
+cp_res cloudplugs_request_perform(cp_session cps, CP_HTTP_METHOD http_method, const char* full_url, struct curl_slist* chunk, const cp_body* body, char** result, size_t* result_length);
+
+/**
+ Set the options of an easy handle for a request, with the settings of the session.
+
+ @param cps The session reference.
+ @param curl The easy handle, it can be different from the session one.
+ @param http_method Enum that indicate the desired action to be performed on the identified resource.
+ @param full_url The absolute url of the requested resource.
+ @param chunk The request headers.
+ @param body If not NULL, the request body.
+ @param reader The reader of body, it must stay valid until the transfer ends; release it with cloudplugs_body_close().
+ @param out If not NULL, the destination of the response body.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_easy_setup(cp_session cps, CURL* curl, CP_HTTP_METHOD http_method, const char* full_url, struct curl_slist* chunk, const cp_body* body, cp_body_reader* reader, cp_req_buffer* out);
+
+/**
+ Perform a request whose url and headers are already computed, writing the response body in out.
+
+ @param cps The session reference.
+ @param http_method Enum that indicate the desired action to be performed on the identified resource.
+ @param full_url The absolute url of the requested resource.
+ @param chunk The request headers.
+ @param body If not NULL, the request body.
+ @param out If not NULL, the destination of the response body, initialized with cloudplugs_req_buffer_init().
+ @return CP_SUCCESS if the request succeeds, CP_FAILED otherwise.
+*/
+cp_res cloudplugs_request_send(cp_session cps, CP_HTTP_METHOD http_method, const char* full_url, struct curl_slist* chunk, const cp_body* body, cp_req_buffer* out);
+
+/**
+ * Initialize a response destination; threshold is the size above which the body is spilled to a temporary file, 0 to keep it always in memory
+ */
+void cloudplugs_req_buffer_init(cp_req_buffer* b, cp_session cps, CURL* curl, size_t threshold);
+
+/**
+ * Initialize a response destination on the caller buffer buf of cap bytes: the body is truncated to cap - 1 bytes and NUL-terminated, while offset keeps counting its whole length
+ */
+void cloudplugs_req_buffer_fixed(cp_req_buffer* b, cp_session cps, char* buf, size_t cap);
+
+/**
+ * CURLOPT_WRITEFUNCTION storing the response body in a cp_req_buffer
+ */
+size_t cloudplugs_req_buffer_write(void* ptr, size_t size, size_t nmemb, void* userdata);
+
+/**
+ * Complete a response body after the transfer, mapping it in memory if it was spilled
+ */
+cp_res cloudplugs_req_buffer_finish(cp_req_buffer* b);
+
+/**
+ * Release a response body
+ */
+void cloudplugs_req_buffer_discard(cp_req_buffer* b);
+
+/**
+ * Hand a response body over to the caller as *result and *result_length, or the transfer error string if the transfer failed
+ */
+void cloudplugs_req_buffer_result(cp_req_buffer* b, char** result, size_t* result_length);
+
+/**
+ Prepare the reading of a body. The body is exposed in r->data and r->length when it is contiguous in memory (a buffer or a mapped file), otherwise it must be read with cloudplugs_body_read().
+
+ @param cps The session reference, for error reporting.
+ @param r The reader to initialize.
+ @param body The body to read.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_body_open(cp_session cps, cp_body_reader* r, const cp_body* body);
+
+/**
+ * Copy the next at most size bytes of the body in buffer, it has the signature of a cp_read_func whose userdata is the reader
+ */
+size_t cloudplugs_body_read(char* buffer, size_t size, void* userdata);
+
+/**
+ * Release the resources of a reader
+ */
+void cloudplugs_body_close(cp_body_reader* r);
+
+/**
+ Run requests concurrently on at most cps->max_connections connections, until all the started requests are done and next returns CP_FALSE.
+
+ @param cps The session reference, providing settings and credentials.
+ @param next Provides the next request.
+ @param done Receives each completed request.
+ @param userdata Passed as it is to next and done.
+ @return CP_OK if the batch ran, CP_FAIL if it could not start; the outcome of each request is given to done.
+*/
+cp_res cloudplugs_batch_run(cp_session cps, cp_batch_next_func next, cp_batch_done_func done, void* userdata);
+
+/**
+ * Start a request on the session event loop; cb is called from cloudplugs_socket_action() with the response body, owned by cb.
+ * A buffer body is copied if copy is CP_TRUE, otherwise body and its data must stay valid until cb is called.
+ */
+cp_res cloudplugs_async_exec(cp_session cps, CP_HTTP_METHOD http_method, const char* path, const char* query, const cp_body* body, cp_bool copy, cp_async_callback cb, void* userdata);
+
+/**
+ * Release the event loop of a session, failing the pending requests
+ */
+void cloudplugs_async_cleanup(cp_session cps);
+
+/**
+ * Release the session, once no asynchronous callback is running
+ */
+void cloudplugs_session_free(cp_session cps);
+
+/**
+ * Return a dynamically allocated JSON string literal (quotes included) with the value of s
+ */
+char* cloudplugs_json_quote(cp_session cps, const char* s);
+
+/**
+ * Check a location and write its json object in body; negative altitude, accuracy and timestamp are omitted
+ */
+cp_res cloudplugs_location_format(cp_session cps, char* body, size_t size, double longitude, double latitude, double altitude, double accuracy, double timestamp);
+
+/**
+ * Write the json object of a location, without checking it; negative altitude, accuracy and timestamp are omitted
+ */
+cp_res cloudplugs_location_write(cp_json_writer* w, double longitude, double latitude, double altitude, double accuracy, double timestamp);
+
+/**
+ * Tokenize a whole json buffer in local, or in an allocated array of the right size if local is too small;
+ * *tokens is set to the array used, to be freed by the caller when it is not local
+ */
+int cloudplugs_tokenize_all(const char* js, size_t length, cp_token* local, unsigned int num_local, cp_token** tokens);
+
+/**
+ * Copy the unescaped value of a string token, or the text of a primitive, in at most size bytes without NUL-terminating it;
+ * return its length, -1 if it does not fit or is not valid
+ */
+int cloudplugs_token_copy(const char* js, const cp_token* t, char* res, size_t size);
+
+/**
+ * Append text to a json writer as it is, leaving its state to the caller
+ */
+cp_bool cloudplugs_json_writer_put(cp_json_writer* w, const char* s, size_t n);
+
+/**
+ * Write a key or a string value of length bytes, which can contain NULs
+ */
+cp_res cloudplugs_json_write_key_length(cp_json_writer* w, const char* key, size_t length);
+cp_res cloudplugs_json_write_string_length(cp_json_writer* w, const char* s, size_t length);
+
+/**
+ * Parse the n bytes of s as a decimal integer of at most 64 bits in magnitude, e.g. a json number without fraction nor exponent
+ */
+cp_bool cloudplugs_integer_parse(const char* s, size_t n, cp_bool* negative, unsigned long long* magnitude);
+
+/**
+ * Write the integer of the given sign and magnitude exactly, also beyond the integers of a double or of a long long
+ */
+cp_res cloudplugs_json_write_magnitude(cp_json_writer* w, cp_bool negative, unsigned long long magnitude);
+
+/**
+ * Append the head of a CBOR data item: the major type and its argument in the shortest form
+ */
+cp_bool cloudplugs_cbor_head(cp_json_writer* w, int major, unsigned long long value);
+
+/**
+ * Append a CBOR integer, or a number in its smallest exact encoding (integer, single or double precision float)
+ */
+cp_bool cloudplugs_cbor_integer(cp_json_writer* w, long long value);
+cp_bool cloudplugs_cbor_number(cp_json_writer* w, double value);
+
+/**
+ * Write the json text of length bytes as a CBOR value of the writer, failing it if the text is not a single json value
+ */
+cp_res cloudplugs_cbor_from_json(cp_json_writer* w, const char* json, size_t length);
+
+/**
+ * Publish a json body encoded as CBOR, resending it as json if the server refuses CBOR (and disabling CBOR on the session)
+ */
+cp_res cloudplugs_cbor_publish_json(cp_session cps, const char* path, const char* json, size_t length, char** result, size_t* result_length);
+
+/**
+ * GET a resource accepting CBOR, *result receives it converted to json; as above the request is retried as json if the server refuses
+ */
+cp_res cloudplugs_cbor_get(cp_session cps, const char* path, const char* query, char** result, size_t* result_length);
+
+/**
+ * Empty the session buffer (its json writer), keeping its memory for the next use
+ */
+void cloudplugs_buffer_reset(cp_session cps);
+
+/**
+ * Append data to the session buffer, it has the signature of a json_dump_callback_t whose data is the session
+ */
+int cloudplugs_buffer_append(const char* data, size_t length, void* userdata);
+
 /**
  * Get the authentication ID associated to the current session
  */
@@ -87,8 +484,21 @@ char* cloudplugs_url_encode_channel(cp_session cps, const char* channel_mask);
 
 char* cloudplugs_url_encode_data(cp_session cps, const char* channel_mask);
 
+/**
+ * The path of a property of the device id, or of all its properties ("device/id/") if prop is NULL
+ */
 char* cloudplugs_url_encode_prop(cp_session cps, const char* id, const char* prop);
 
+/**
+ * The path of the device id
+ */
+char* cloudplugs_url_device(cp_session cps, const char* id);
+
+/**
+ * Release a path built by the functions above; in the tiny build they use a buffer of the session, valid until the next one, and nothing is freed
+ */
+void cloudplugs_url_free(cp_session cps, char* url);
+
 #ifdef  __cplusplus
 }
 #endif
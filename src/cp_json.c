@@ -0,0 +1,663 @@
+/*
+Copyright 2014 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest.h"
+#include "cp_internals.h"
+#include "cp_constants.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+
+void cloudplugs_tokenizer_init(cp_tokenizer* p) {
+    p->pos = 0;
+    p->next = 0;
+    p->super = -1;
+    p->comma = CP_FALSE;
+}
+
+static cp_token* cloudplugs_token_alloc(cp_tokenizer* p, cp_token* tokens, unsigned int num_tokens, CP_TOKEN_TYPE type, int start, int end) {
+    if(p->next >= num_tokens) return NULL;
+    p->comma = CP_FALSE;
+    cp_token* t = &tokens[p->next++];
+    t->type = type;
+    t->start = start;
+    t->end = end;
+    t->size = 0;
+    t->parent = p->super;
+    return t;
+}
+
+/* a value is allowed where the current parent is not an object, whose children are keys, nor a key with its value; items after the first need a ',' */
+static cp_bool cloudplugs_token_value_allowed(const cp_tokenizer* p, const cp_token* tokens) {
+    if(p->super < 0) return p->next == 0;
+    const cp_token* s = &tokens[p->super];
+    if(s->type == CP_TOKEN_OBJECT) return CP_FALSE;
+    if(s->type == CP_TOKEN_STRING) return s->size == 0;
+    return s->size == 0 || p->comma;
+}
+
+/* whether the last token is a key of object still without its value */
+static cp_bool cloudplugs_token_pending_key(const cp_tokenizer* p, const cp_token* tokens, int object) {
+    if(!p->next) return CP_FALSE;
+    const cp_token* t = &tokens[p->next - 1];
+    return t->type == CP_TOKEN_STRING && t->parent == object && !t->size;
+}
+
+static int cloudplugs_hex(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int cloudplugs_tokenize_string(cp_tokenizer* p, const char* js, size_t length, cp_token* tokens, unsigned int num_tokens) {
+    unsigned int start = p->pos;
+    for(p->pos++; p->pos < length && js[p->pos]; p->pos++) {
+        char c = js[p->pos];
+        if(c == '\"') {
+            if(!tokens) return 0;
+            /* a string is a key if its parent is an object, and the previous key must have its value */
+            cp_bool key = p->super >= 0 && tokens[p->super].type == CP_TOKEN_OBJECT;
+            if(key ? cloudplugs_token_pending_key(p, tokens, p->super) || (tokens[p->super].size && !p->comma) : !cloudplugs_token_value_allowed(p, tokens)) {
+                p->pos = start;
+                return CP_TOKEN_ERR_INVALID;
+            }
+            if(!cloudplugs_token_alloc(p, tokens, num_tokens, CP_TOKEN_STRING, (int) start + 1, (int) p->pos)) {
+                p->pos = start;
+                return CP_TOKEN_ERR_NOMEM;
+            }
+            if(p->super >= 0) tokens[p->super].size++;
+            return 0;
+        }
+        if((unsigned char) c < 0x20) break;
+        if(c == '\\') {
+            if(++p->pos >= length) break;
+            switch(js[p->pos]) {
+                case '\"': case '/': case '\\': case 'b': case 'f': case 'n': case 'r': case 't':
+                    break;
+                case 'u': {
+                    int i;
+                    for(i = 0; i < 4; i++) {
+                        if(++p->pos >= length) {
+                            p->pos = start;
+                            return CP_TOKEN_ERR_PARTIAL;
+                        }
+                        if(cloudplugs_hex(js[p->pos]) < 0) {
+                            p->pos = start;
+                            return CP_TOKEN_ERR_INVALID;
+                        }
+                    }
+                    break;
+                }
+                default:
+                    p->pos = start;
+                    return CP_TOKEN_ERR_INVALID;
+            }
+        }
+    }
+    cp_bool partial = p->pos >= length || !js[p->pos];
+    p->pos = start;
+    return partial ? CP_TOKEN_ERR_PARTIAL : CP_TOKEN_ERR_INVALID;
+}
+
+static int cloudplugs_tokenize_primitive(cp_tokenizer* p, const char* js, size_t length, cp_token* tokens, unsigned int num_tokens) {
+    unsigned int start = p->pos;
+    for(; p->pos < length && js[p->pos]; p->pos++) {
+        char c = js[p->pos];
+        if(c == '\t' || c == '\r' || c == '\n' || c == ' ' || c == ',' || c == ']' || c == '}') break;
+        if((unsigned char) c < 0x20 || (unsigned char) c >= 0x7f || c == ':') {
+            p->pos = start;
+            return CP_TOKEN_ERR_INVALID;
+        }
+    }
+    /* a primitive at the end of the buffer may continue in the next part, unless it is the outer value */
+    if((p->pos >= length || !js[p->pos]) && p->super >= 0) {
+        p->pos = start;
+        return CP_TOKEN_ERR_PARTIAL;
+    }
+    if(tokens) {
+        if(!cloudplugs_token_value_allowed(p, tokens)) {
+            p->pos = start;
+            return CP_TOKEN_ERR_INVALID;
+        }
+        if(!cloudplugs_token_alloc(p, tokens, num_tokens, CP_TOKEN_PRIMITIVE, (int) start, (int) p->pos)) {
+            p->pos = start;
+            return CP_TOKEN_ERR_NOMEM;
+        }
+        if(p->super >= 0) tokens[p->super].size++;
+    }
+    p->pos--;
+    return 0;
+}
+
+int cloudplugs_tokenize(cp_tokenizer* p, const char* js, size_t length, cp_token* tokens, unsigned int num_tokens) {
+    int count = (int) p->next;
+    int r;
+    for(; p->pos < length && js[p->pos]; p->pos++) {
+        char c = js[p->pos];
+        switch(c) {
+            case '{': case '[': {
+                count++;
+                if(!tokens) break;
+                if(!cloudplugs_token_value_allowed(p, tokens)) return CP_TOKEN_ERR_INVALID;
+                cp_token* t = cloudplugs_token_alloc(p, tokens, num_tokens, c == '{' ? CP_TOKEN_OBJECT : CP_TOKEN_ARRAY, (int) p->pos, -1);
+                if(!t) return CP_TOKEN_ERR_NOMEM;
+                if(p->super >= 0) tokens[p->super].size++;
+                p->super = (int) p->next - 1;
+                break;
+            }
+            case '}': case ']': {
+                if(!tokens) break;
+                CP_TOKEN_TYPE type = c == '}' ? CP_TOKEN_OBJECT : CP_TOKEN_ARRAY;
+                if(!p->next || p->comma) return CP_TOKEN_ERR_INVALID;
+                /* close the innermost open container, which must be of the same type */
+                int i = (int) p->next - 1;
+                while(i >= 0 && !(tokens[i].end == -1 && (tokens[i].type == CP_TOKEN_OBJECT || tokens[i].type == CP_TOKEN_ARRAY))) i = tokens[i].parent;
+                if(i < 0 || tokens[i].type != type) return CP_TOKEN_ERR_INVALID;
+                /* an object cannot end with a key without value */
+                if((type == CP_TOKEN_OBJECT && cloudplugs_token_pending_key(p, tokens, i)) || (p->super >= 0 && tokens[p->super].type == CP_TOKEN_STRING && !tokens[p->super].size))
+                    return CP_TOKEN_ERR_INVALID;
+                tokens[i].end = (int) p->pos + 1;
+                p->super = tokens[i].parent;
+                break;
+            }
+            case '\"':
+                r = cloudplugs_tokenize_string(p, js, length, tokens, num_tokens);
+                if(r < 0) return r;
+                count++;
+                break;
+            case '\t': case '\r': case '\n': case ' ':
+                break;
+            case ':':
+                if(!tokens) break;
+                /* the last token must be a key of the current object */
+                if(!p->next || tokens[p->next - 1].type != CP_TOKEN_STRING || tokens[p->next - 1].size
+                    || (int) p->next - 1 == p->super || p->super < 0 || tokens[p->super].type != CP_TOKEN_OBJECT)
+                    return CP_TOKEN_ERR_INVALID;
+                p->super = (int) p->next - 1;
+                break;
+            case ',':
+                if(!tokens) break;
+                if(p->super >= 0 && tokens[p->super].type == CP_TOKEN_STRING) {
+                    if(!tokens[p->super].size) return CP_TOKEN_ERR_INVALID;
+                    p->super = tokens[p->super].parent;
+                }
+                /* a ',' follows an item of the current container */
+                if(p->super < 0 || p->comma || !tokens[p->super].size || p->next - 1 == (unsigned int) p->super) return CP_TOKEN_ERR_INVALID;
+                p->comma = CP_TRUE;
+                break;
+            case '-': case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
+            case 't': case 'f': case 'n':
+                r = cloudplugs_tokenize_primitive(p, js, length, tokens, num_tokens);
+                if(r < 0) return r;
+                count++;
+                break;
+            default:
+                return CP_TOKEN_ERR_INVALID;
+        }
+    }
+
+    if(tokens) {
+        unsigned int i;
+        for(i = 0; i < p->next; i++) {
+            if(tokens[i].end == -1) return CP_TOKEN_ERR_PARTIAL;
+        }
+        /* after a key value the parent is the key until the next ',' or closing bracket */
+        if(p->super >= 0) return CP_TOKEN_ERR_PARTIAL;
+    }
+    return count;
+}
+
+int cloudplugs_token_skip(const cp_token* tokens, int count, int index) {
+    int end = tokens[index].end;
+    int i = index + 1;
+    while(i < count && tokens[i].start < end) i++;
+    return i;
+}
+
+/* decode the escape at s[*i], just after the backslash, as utf-8 in out; return the bytes written, -1 if invalid */
+static int cloudplugs_unescape(const char* s, int end, int* i, char* out) {
+    char c = s[*i];
+    switch(c) {
+        case 'b': out[0] = '\b'; return 1;
+        case 'f': out[0] = '\f'; return 1;
+        case 'n': out[0] = '\n'; return 1;
+        case 'r': out[0] = '\r'; return 1;
+        case 't': out[0] = '\t'; return 1;
+        case 'u': break;
+        default: out[0] = c; return 1;
+    }
+    if(*i + 4 >= end) return -1;
+    unsigned long cp = 0;
+    int k;
+    for(k = 1; k <= 4; k++) cp = (cp << 4) | (unsigned long) cloudplugs_hex(s[*i + k]);
+    *i += 4;
+    /* a high surrogate is combined with the low one following it, a lone surrogate has no utf-8 encoding */
+    if(cp >= 0xd800 && cp < 0xe000) {
+        if(cp >= 0xdc00 || *i + 6 >= end || s[*i + 1] != '\\' || s[*i + 2] != 'u') return -1;
+        unsigned long lo = 0;
+        for(k = 3; k <= 6; k++) lo = (lo << 4) | (unsigned long) cloudplugs_hex(s[*i + k]);
+        if(lo < 0xdc00 || lo >= 0xe000) return -1;
+        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+        *i += 6;
+    }
+    if(cp < 0x80) {
+        out[0] = (char) cp;
+        return 1;
+    }
+    if(cp < 0x800) {
+        out[0] = (char) (0xc0 | (cp >> 6));
+        out[1] = (char) (0x80 | (cp & 0x3f));
+        return 2;
+    }
+    if(cp < 0x10000) {
+        out[0] = (char) (0xe0 | (cp >> 12));
+        out[1] = (char) (0x80 | ((cp >> 6) & 0x3f));
+        out[2] = (char) (0x80 | (cp & 0x3f));
+        return 3;
+    }
+    out[0] = (char) (0xf0 | (cp >> 18));
+    out[1] = (char) (0x80 | ((cp >> 12) & 0x3f));
+    out[2] = (char) (0x80 | ((cp >> 6) & 0x3f));
+    out[3] = (char) (0x80 | (cp & 0x3f));
+    return 4;
+}
+
+int cloudplugs_token_copy(const char* js, const cp_token* t, char* res, size_t size) {
+    if(!res || (t->type != CP_TOKEN_STRING && t->type != CP_TOKEN_PRIMITIVE)) return -1;
+    size_t len = 0;
+    int i;
+    for(i = t->start; i < t->end; i++) {
+        char buf[4];
+        int n = 1;
+        buf[0] = js[i];
+        if(js[i] == '\\' && t->type == CP_TOKEN_STRING) {
+            i++;
+            n = cloudplugs_unescape(js, t->end, &i, buf);
+            if(n < 0) return -1;
+        }
+        if(len + n > size) return -1;
+        memcpy(res + len, buf, n);
+        len += n;
+    }
+    return (int) len;
+}
+
+int cloudplugs_token_string(const char* js, const cp_token* t, char* res, size_t size) {
+    if(!res || !size) return -1;
+    int len = cloudplugs_token_copy(js, t, res, size - 1);
+    if(len < 0) return -1;
+    res[len] = '\0';
+    return len;
+}
+
+int cloudplugs_tokenize_all(const char* js, size_t length, cp_token* local, unsigned int num_local, cp_token** tokens) {
+    cp_tokenizer p;
+    cloudplugs_tokenizer_init(&p);
+    *tokens = local;
+    int count = cloudplugs_tokenize(&p, js, length, local, num_local);
+    if(count != CP_TOKEN_ERR_NOMEM) return count;
+    /* count the tokens first, then tokenize again in an array of the right size */
+    cloudplugs_tokenizer_init(&p);
+    count = cloudplugs_tokenize(&p, js, length, NULL, 0);
+    if(count <= 0) return count ? count : CP_TOKEN_ERR_INVALID;
+    *tokens = (cp_token*) cloudplugs_malloc((size_t) count * sizeof(cp_token));
+    if(!*tokens) {
+        *tokens = local;
+        return CP_TOKEN_ERR_NOMEM;
+    }
+    cloudplugs_tokenizer_init(&p);
+    return cloudplugs_tokenize(&p, js, length, *tokens, (unsigned int) count);
+}
+
+static cp_bool cloudplugs_token_equals(const char* js, const cp_token* t, const char* s) {
+    size_t n = strlen(s);
+    if(!memchr(js + t->start, '\\', t->end - t->start))
+        return (size_t) (t->end - t->start) == n && !memcmp(js + t->start, s, n);
+    char key[CP_JSON_KEY_SIZE];
+    return cloudplugs_token_string(js, t, key, sizeof(key)) >= 0 && !strcmp(key, s);
+}
+
+int cloudplugs_token_find(const char* js, const cp_token* tokens, int count, int object, const char* key) {
+    if(object < 0 || object >= count || tokens[object].type != CP_TOKEN_OBJECT) return -1;
+    int i = object + 1;
+    int k;
+    for(k = 0; k < tokens[object].size && i + 1 < count; k++) {
+        if(cloudplugs_token_equals(js, &tokens[i], key)) return i + 1;
+        i = cloudplugs_token_skip(tokens, count, i + 1);
+    }
+    return -1;
+}
+
+cp_bool cloudplugs_token_number(const char* js, const cp_token* t, double* value) {
+    char buf[64];
+    if(t->type != CP_TOKEN_PRIMITIVE || (js[t->start] != '-' && (js[t->start] < '0' || js[t->start] > '9'))) return CP_FALSE;
+    if(cloudplugs_token_string(js, t, buf, sizeof(buf)) < 0) return CP_FALSE;
+    char* end;
+    *value = strtod(buf, &end);
+    return *end == '\0' ? CP_TRUE : CP_FALSE;
+}
+
+void cloudplugs_json_writer_init(cp_json_writer* w) {
+    w->buffer = NULL;
+    w->size = 0;
+    w->fixed = CP_FALSE;
+    w->cbor = CP_FALSE;
+    cloudplugs_json_writer_reset(w);
+}
+
+void cloudplugs_json_writer_fixed(cp_json_writer* w, char* buf, size_t size) {
+    w->buffer = buf;
+    w->size = size;
+    w->fixed = CP_TRUE;
+    w->cbor = CP_FALSE;
+    cloudplugs_json_writer_reset(w);
+}
+
+void cloudplugs_json_writer_cbor(cp_json_writer* w, cp_bool enabled) {
+    w->cbor = enabled;
+}
+
+void cloudplugs_json_writer_reset(cp_json_writer* w) {
+    w->length = 0;
+    w->failed = CP_FALSE;
+    w->key = CP_FALSE;
+    w->depth = 0;
+    w->items = 0;
+    w->objects = 0;
+    if(w->size) w->buffer[0] = '\0';
+}
+
+void cloudplugs_json_writer_free(cp_json_writer* w) {
+    if(!w->fixed) cloudplugs_free(w->buffer);
+    cloudplugs_json_writer_init(w);
+}
+
+cp_bool cloudplugs_json_writer_put(cp_json_writer* w, const char* s, size_t n) {
+    if(w->failed) return CP_FALSE;
+    if(w->length + n + 1 > w->size) {
+        if(w->fixed) {
+            w->failed = CP_TRUE;
+            return CP_FALSE;
+        }
+        size_t size = w->size ? w->size : CP_BUFFER_SIZE;
+        while(size < w->length + n + 1) size *= 2;
+        char* tmp = (char*) cloudplugs_realloc(w->buffer, size);
+        if(!tmp) {
+            w->failed = CP_TRUE;
+            return CP_FALSE;
+        }
+        w->buffer = tmp;
+        w->size = size;
+    }
+    memcpy(w->buffer + w->length, s, n);
+    w->length += n;
+    w->buffer[w->length] = '\0';
+    return CP_TRUE;
+}
+
+static cp_res cloudplugs_json_fail(cp_json_writer* w) {
+    w->failed = CP_TRUE;
+    return CP_FAIL;
+}
+
+/* the separator before a value: nothing after a key, a comma between the items of a json array */
+static cp_bool cloudplugs_json_value(cp_json_writer* w) {
+    if(w->failed) return CP_FALSE;
+    if(w->key) {
+        w->key = CP_FALSE;
+        return CP_TRUE;
+    }
+    if(!w->depth) return w->length ? !cloudplugs_json_fail(w) : CP_TRUE;
+    unsigned int bit = 1u << (w->depth - 1);
+    if(w->objects & bit) return !cloudplugs_json_fail(w);
+    if((w->items & bit) && !w->cbor && !cloudplugs_json_writer_put(w, ",", 1)) return CP_FALSE;
+    w->items |= bit;
+    return CP_TRUE;
+}
+
+static cp_res cloudplugs_json_begin(cp_json_writer* w, char open, cp_bool object) {
+    if(!cloudplugs_json_value(w)) return CP_FAIL;
+    if(w->depth == (int) (sizeof(w->items) * 8)) return cloudplugs_json_fail(w);
+    /* cbor containers have an indefinite length, closed by a break */
+    if(w->cbor) open = (char) (object ? CP_CBOR_MAP_INDEFINITE : CP_CBOR_ARRAY_INDEFINITE);
+    if(!cloudplugs_json_writer_put(w, &open, 1)) return CP_FAIL;
+    unsigned int bit = 1u << w->depth++;
+    w->items &= ~bit;
+    if(object) w->objects |= bit;
+    else w->objects &= ~bit;
+    return CP_OK;
+}
+
+static cp_res cloudplugs_json_end(cp_json_writer* w, char close, cp_bool object) {
+    if(w->failed) return CP_FAIL;
+    if(!w->depth || w->key || !(w->objects & (1u << (w->depth - 1))) != !object) return cloudplugs_json_fail(w);
+    if(w->cbor) close = (char) CP_CBOR_BREAK;
+    if(!cloudplugs_json_writer_put(w, &close, 1)) return CP_FAIL;
+    w->depth--;
+    return CP_OK;
+}
+
+cp_res cloudplugs_json_begin_object(cp_json_writer* w) {
+    return cloudplugs_json_begin(w, '{', CP_TRUE);
+}
+
+cp_res cloudplugs_json_end_object(cp_json_writer* w) {
+    return cloudplugs_json_end(w, '}', CP_TRUE);
+}
+
+cp_res cloudplugs_json_begin_array(cp_json_writer* w) {
+    return cloudplugs_json_begin(w, '[', CP_FALSE);
+}
+
+cp_res cloudplugs_json_end_array(cp_json_writer* w) {
+    return cloudplugs_json_end(w, ']', CP_FALSE);
+}
+
+const char* cloudplugs_json_writer_finish(cp_json_writer* w, size_t* length) {
+    while(!w->failed && w->depth) {
+        cp_bool object = (w->objects & (1u << (w->depth - 1))) ? CP_TRUE : CP_FALSE;
+        cloudplugs_json_end(w, object ? '}' : ']', object);
+    }
+    if(length) *length = w->failed ? 0 : w->length;
+    return (w->failed || !w->length) ? NULL : w->buffer;
+}
+
+/* write the n bytes of s quoted, copying the runs of bytes that need no escape at once */
+static cp_bool cloudplugs_json_quoted(cp_json_writer* w, const char* s, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    if(w->cbor) return cloudplugs_cbor_head(w, CP_CBOR_TEXT, n) && cloudplugs_json_writer_put(w, s, n);
+    if(!cloudplugs_json_writer_put(w, "\"", 1)) return CP_FALSE;
+    const char* run = s;
+    const unsigned char* p;
+    const unsigned char* end = (const unsigned char*) s + n;
+    for(p = (const unsigned char*) s; p < end; p++) {
+        if(*p != '"' && *p != '\\' && *p >= 0x20) continue;
+        if(!cloudplugs_json_writer_put(w, run, (const char*) p - run)) return CP_FALSE;
+        char esc[6] = { '\\', (char) *p, 0, 0, 0, 0 };
+        size_t len = 2;
+        switch(*p) {
+            case '"': case '\\': break;
+            case '\n': esc[1] = 'n'; break;
+            case '\r': esc[1] = 'r'; break;
+            case '\t': esc[1] = 't'; break;
+            default:
+                esc[1] = 'u';
+                esc[2] = '0';
+                esc[3] = '0';
+                esc[4] = hex[*p >> 4];
+                esc[5] = hex[*p & 0xf];
+                len = 6;
+        }
+        if(!cloudplugs_json_writer_put(w, esc, len)) return CP_FALSE;
+        run = (const char*) p + 1;
+    }
+    return cloudplugs_json_writer_put(w, run, (const char*) p - run) && cloudplugs_json_writer_put(w, "\"", 1);
+}
+
+cp_res cloudplugs_json_write_key(cp_json_writer* w, const char* key) {
+    if(!key) return cloudplugs_json_fail(w);
+    return cloudplugs_json_write_key_length(w, key, strlen(key));
+}
+
+cp_res cloudplugs_json_write_key_length(cp_json_writer* w, const char* key, size_t length) {
+    if(w->failed) return CP_FAIL;
+    if(!w->depth || w->key || !(w->objects & (1u << (w->depth - 1)))) return cloudplugs_json_fail(w);
+    unsigned int bit = 1u << (w->depth - 1);
+    if((w->items & bit) && !w->cbor && !cloudplugs_json_writer_put(w, ",", 1)) return CP_FAIL;
+    w->items |= bit;
+    if(!cloudplugs_json_quoted(w, key, length) || (!w->cbor && !cloudplugs_json_writer_put(w, ":", 1))) return CP_FAIL;
+    w->key = CP_TRUE;
+    return CP_OK;
+}
+
+cp_res cloudplugs_json_write_string(cp_json_writer* w, const char* s) {
+    if(!s) return cloudplugs_json_fail(w);
+    return cloudplugs_json_write_string_length(w, s, strlen(s));
+}
+
+cp_res cloudplugs_json_write_string_length(cp_json_writer* w, const char* s, size_t length) {
+    return cloudplugs_json_value(w) && cloudplugs_json_quoted(w, s, length) ? CP_OK : CP_FAIL;
+}
+
+static int cloudplugs_json_format_magnitude(char* buf, cp_bool negative, unsigned long long u) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = (char) ('0' + u % 10);
+        u /= 10;
+    } while(u);
+    int len = 0;
+    if(negative) buf[len++] = '-';
+    while(n) buf[len++] = digits[--n];
+    return len;
+}
+
+static int cloudplugs_json_format_integer(char* buf, long long value) {
+    return cloudplugs_json_format_magnitude(buf, value < 0, value < 0 ? 0ULL - (unsigned long long) value : (unsigned long long) value);
+}
+
+cp_bool cloudplugs_integer_parse(const char* s, size_t n, cp_bool* negative, unsigned long long* magnitude) {
+    size_t i = 0;
+    *negative = n && s[0] == '-';
+    if(*negative) i++;
+    if(i == n) return CP_FALSE;
+    *magnitude = 0;
+    for(; i < n; i++) {
+        if(s[i] < '0' || s[i] > '9') return CP_FALSE;
+        unsigned int d = (unsigned int) (s[i] - '0');
+        if(*magnitude > (ULLONG_MAX - d) / 10) return CP_FALSE;
+        *magnitude = *magnitude * 10 + d;
+    }
+    return CP_TRUE;
+}
+
+/* the shortest of %.15g, %.16g and %.17g reading back as value: %.17g alone round-trips, but prints 0.1 as 0.10000000000000001 */
+static int cloudplugs_json_format_number(char* buf, size_t size, double value) {
+    if(fabs(value) < 9007199254740992.0 && (double) (long long) value == value)
+        return cloudplugs_json_format_integer(buf, (long long) value);
+    int precision;
+    int n = 0;
+    for(precision = 15; precision <= 17; precision++) {
+        n = snprintf(buf, size, "%.*g", precision, value);
+        if(precision == 17 || strtod(buf, NULL) == value) break;
+    }
+    return n;
+}
+
+cp_res cloudplugs_json_write_number(cp_json_writer* w, double value) {
+    char buf[32];
+    if(!isfinite(value)) return cloudplugs_json_fail(w);
+    if(w->cbor) return cloudplugs_json_value(w) && cloudplugs_cbor_number(w, value) ? CP_OK : CP_FAIL;
+    int n = cloudplugs_json_format_number(buf, sizeof(buf), value);
+    return cloudplugs_json_value(w) && cloudplugs_json_writer_put(w, buf, (size_t) n) ? CP_OK : CP_FAIL;
+}
+
+cp_res cloudplugs_json_write_integer(cp_json_writer* w, long long value) {
+    char buf[24];
+    if(w->cbor) return cloudplugs_json_value(w) && cloudplugs_cbor_integer(w, value) ? CP_OK : CP_FAIL;
+    int n = cloudplugs_json_format_integer(buf, value);
+    return cloudplugs_json_value(w) && cloudplugs_json_writer_put(w, buf, (size_t) n) ? CP_OK : CP_FAIL;
+}
+
+cp_res cloudplugs_json_write_magnitude(cp_json_writer* w, cp_bool negative, unsigned long long magnitude) {
+    char buf[24];
+    if(negative && !magnitude) negative = CP_FALSE;
+    /* a cbor negative integer n is encoded as -1 - n */
+    if(w->cbor) return cloudplugs_json_value(w) && cloudplugs_cbor_head(w, negative ? CP_CBOR_NEGATIVE : CP_CBOR_UNSIGNED, negative ? magnitude - 1 : magnitude) ? CP_OK : CP_FAIL;
+    int n = cloudplugs_json_format_magnitude(buf, negative, magnitude);
+    return cloudplugs_json_value(w) && cloudplugs_json_writer_put(w, buf, (size_t) n) ? CP_OK : CP_FAIL;
+}
+
+cp_res cloudplugs_json_write_bool(cp_json_writer* w, cp_bool value) {
+    const char* s = value ? CP_JSON_STRING_TRUE : CP_JSON_STRING_FALSE;
+    if(w->cbor) {
+        char c = (char) (value ? CP_CBOR_TRUE : CP_CBOR_FALSE);
+        return cloudplugs_json_value(w) && cloudplugs_json_writer_put(w, &c, 1) ? CP_OK : CP_FAIL;
+    }
+    return cloudplugs_json_value(w) && cloudplugs_json_writer_put(w, s, strlen(s)) ? CP_OK : CP_FAIL;
+}
+
+cp_res cloudplugs_json_write_null(cp_json_writer* w) {
+    if(w->cbor) {
+        char c = (char) CP_CBOR_NULL;
+        return cloudplugs_json_value(w) && cloudplugs_json_writer_put(w, &c, 1) ? CP_OK : CP_FAIL;
+    }
+    return cloudplugs_json_value(w) && cloudplugs_json_writer_put(w, "null", 4) ? CP_OK : CP_FAIL;
+}
+
+cp_res cloudplugs_json_write_raw(cp_json_writer* w, const char* json, size_t length) {
+    if(!json && length) return cloudplugs_json_fail(w);
+    /* the json text is converted, through the calls of the writer taking care of the separators */
+    if(w->cbor && length) return cloudplugs_cbor_from_json(w, json, length);
+    return cloudplugs_json_value(w) && cloudplugs_json_writer_put(w, json, length) ? CP_OK : CP_FAIL;
+}
+
+/* open the record, and the array of the batch on the first one */
+static cp_bool cloudplugs_json_record_begin(cp_json_writer* w, const char* channel) {
+    if(!w->depth && !w->length && cloudplugs_json_begin_array(w) != CP_OK) return CP_FALSE;
+    if(cloudplugs_json_begin_object(w) != CP_OK) return CP_FALSE;
+    return !channel || (cloudplugs_json_write_key(w, CHANNEL) == CP_OK && cloudplugs_json_write_string(w, channel) == CP_OK);
+}
+
+static cp_res cloudplugs_json_record_end(cp_json_writer* w, cp_time at, const char* id) {
+    if(at > 0 && (cloudplugs_json_write_key(w, AT) != CP_OK || cloudplugs_json_write_number(w, at) != CP_OK)) return CP_FAIL;
+    if(id && (cloudplugs_json_write_key(w, ID) != CP_OK || cloudplugs_json_write_string(w, id) != CP_OK)) return CP_FAIL;
+    return cloudplugs_json_end_object(w);
+}
+
+cp_res cloudplugs_json_append_record(cp_json_writer* w, const char* channel, const char* data, cp_time at, const char* id) {
+    if(!data) return cloudplugs_json_fail(w);
+    if(!cloudplugs_json_record_begin(w, channel)
+        || cloudplugs_json_write_key(w, DATA) != CP_OK
+        || cloudplugs_json_write_raw(w, data, strlen(data)) != CP_OK)
+        return CP_FAIL;
+    return cloudplugs_json_record_end(w, at, id);
+}
+
+cp_res cloudplugs_json_append_number_record(cp_json_writer* w, const char* channel, double value, cp_time at, const char* id) {
+    if(!cloudplugs_json_record_begin(w, channel)
+        || cloudplugs_json_write_key(w, DATA) != CP_OK
+        || cloudplugs_json_write_number(w, value) != CP_OK)
+        return CP_FAIL;
+    return cloudplugs_json_record_end(w, at, id);
+}
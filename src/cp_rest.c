@@ -25,9 +25,16 @@ under the License.
 #include <stdlib.h>
 #include <string.h>
 #include <curl/curl.h>
+#include <sys/mman.h>
+#ifdef CP_ENABLE_JSON
+#include <jansson.h>
+#endif
 
 cp_res cloudplugs_global_init() {
-    return curl_global_init(CURL_GLOBAL_ALL) == CURLE_OK ? CP_OK : CP_FAIL;
+#ifdef CP_ENABLE_JSON
+    json_set_alloc_funcs(cloudplugs_malloc, cloudplugs_free);
+#endif
+    return curl_global_init_mem(CURL_GLOBAL_ALL, cloudplugs_malloc, cloudplugs_free, cloudplugs_realloc, cloudplugs_strdup, cloudplugs_calloc) == CURLE_OK ? CP_OK : CP_FAIL;
 }
 
 cp_res cloudplugs_global_shutdown() {
@@ -40,9 +47,7 @@ cp_res cloudplugs_set_base_url(cp_session cps, const char* url) {
     int http = !strncmp(url, CP_HTTP_STR, LIT_STR_LEN(CP_HTTP_STR));
     int https = !strncmp(url, CP_HTTPS_STR, LIT_STR_LEN(CP_HTTPS_STR));
     if(http || https) {
-        free(cps->base_url);
-        cps->base_url = url[strlen(url)-1] == '/' ? cloudplugs_concat(cps, 1, url) : cloudplugs_concat(cps, 2, url, "/");
-        return cps->base_url ? CP_OK : CP_FAIL;
+        return cloudplugs_string_set(cps, &cps->base_url, CP_ARENA(cps->base_url_arena), url, url[strlen(url)-1] == '/' ? NULL : "/");
     } else SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
 }
 
@@ -63,14 +68,29 @@ int cloudplugs_get_timeout(cp_session cps) {
     return cps ? cps->timeout : -1;
 }
 
+cp_res cloudplugs_set_max_connections(cp_session cps, int max_connections) {
+    if(cps && max_connections >= 0) {
+        cps->max_connections = max_connections ? max_connections : CP_MAX_CONNECTIONS;
+        if(cps->multi) curl_multi_setopt(cps->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long) cps->max_connections);
+        return CP_OK;
+    }
+    return CP_FAIL;
+}
+
+int cloudplugs_get_max_connections(cp_session cps) {
+    return cps ? cps->max_connections : -1;
+}
+
 cp_res cloudplugs_set_cacert(cp_session cps, const char* filename) {
     if(!cps) return CP_FAIL;
-    if(cps->ca) free(cps->ca);
-    cps->ca = cloudplugs_concat(cps, 1, filename);
-    return CP_OK;
+    return cloudplugs_string_set(cps, &cps->ca, CP_ARENA(cps->ca_arena), filename, NULL);
 }
 
 const char* cloudplugs_get_last_err_string(cp_session cps) {
+#ifdef CP_TINY
+    (void) cps;
+    return NULL;
+#else
     switch(cps->err) {
         case CP_ERR_INTERNAL_ERROR:	return "Internal Library Error";
         case CP_ERR_OUT_OF_MEMORY: return "Out of memory";
@@ -83,8 +103,10 @@ const char* cloudplugs_get_last_err_string(cp_session cps) {
         case CP_ERR_JSON_PARSE: return "JSON parse error";
         case CP_ERR_JSON_ENCODE: return "JSON encode error";
         case CP_ERR_HTTP: return "HTTP error";
+        case CP_ERR_BUFFER_TOO_SMALL: return "Buffer too small";
         default: return NULL;
    }
+#endif
 }
 
 CP_ERR_CODE cloudplugs_get_last_err_code(cp_session cps){
@@ -92,6 +114,10 @@ CP_ERR_CODE cloudplugs_get_last_err_code(cp_session cps){
 }
 
 const char* cloudplugs_get_last_http_result_string(cp_session cps){
+#ifdef CP_TINY
+    (void) cps;
+    return NULL;
+#else
     switch(cps->http_res) {
       case CP_HTTP_OK:			return "Ok";
       case CP_HTTP_CREATED:		return "Created";
@@ -103,12 +129,14 @@ const char* cloudplugs_get_last_http_result_string(cp_session cps){
       case CP_HTTP_NOT_FOUND:		return "Not found";
       case CP_HTTP_NOT_ALLOWED:		return "Method Not Allowed";
       case CP_HTTP_NOT_ACCEPTABLE:	return "Not Acceptable";
+      case CP_HTTP_UNSUPPORTED_MEDIA_TYPE:	return "Unsupported Media Type";
       case CP_HTTP_SERVER_ERROR:		return "Internal Server Error";
       case CP_HTTP_NOT_IMPLEMENTED:	return "Not Implemented";
       case CP_HTTP_BAD_GATEWAY:		return "Bad Gateway";
       case CP_HTTP_SERVICE_UNAVAILABLE:	return "Service Unavailable";
       default: return NULL;
     }
+#endif
 }
 
 CP_HTTP_RESULT cloudplugs_get_last_http_result(cp_session cps){
@@ -116,26 +144,53 @@ CP_HTTP_RESULT cloudplugs_get_last_http_result(cp_session cps){
 }
 
 cp_session cloudplugs_create_session() {
-  cp_session cps = malloc(sizeof(struct _cloudplugs_session));
+  cp_session cps = cloudplugs_malloc(sizeof(struct _cloudplugs_session));
   if(!cps) return NULL;
   cps->curl = curl_easy_init();
   if(!cps->curl) {
-      free(cps);
+      cloudplugs_free(cps);
       return NULL;
   }
   cps->timeout = CP_TIMEOUT;
-  cps->id = NULL;
-  cps->auth = NULL;
-  cps->is_master = CP_FALSE;
-  cps->base_url = (char*) malloc(LIT_STR_LEN(CP_URL)+1);
-  strcpy(cps->base_url, CP_URL);
+  cps->own.id = NULL;
+  cps->own.auth = NULL;
+  cps->own.is_master = CP_FALSE;
+  cps->identity = &cps->own;
+  cps->base_url = NULL;
+  if(cloudplugs_string_set(cps, &cps->base_url, CP_ARENA(cps->base_url_arena), CP_URL, NULL) != CP_OK) {
+      curl_easy_cleanup(cps->curl);
+      cloudplugs_free(cps);
+      return NULL;
+  }
   cps->http_res = 0;
   cps->err = 0;
   cps->verify_ssl = CP_TRUE;
   cps->ca = NULL;
+  cloudplugs_json_writer_init(&cps->writer);
+  cps->cbor = CP_FALSE;
+  cps->max_connections = CP_MAX_CONNECTIONS;
+  cps->multi = NULL;
+  cps->socket_cb = NULL;
+  cps->timer_cb = NULL;
+  cps->event_userdata = NULL;
+  cps->async = NULL;
+  cps->dispatching = 0;
+  cps->destroyed = CP_FALSE;
   return cps;
 }
 
+size_t cloudplugs_session_footprint(cp_session cps) {
+    if(!cps) return 0;
+    size_t size = sizeof(struct _cloudplugs_session) + cps->writer.size;
+#ifndef CP_TINY
+    const char* strings[] = { cps->base_url, cps->ca, cps->own.id, cps->own.auth };
+    size_t i;
+    for(i = 0; i < sizeof(strings)/sizeof(strings[0]); i++)
+        if(strings[i]) size += strlen(strings[i]) + 1;
+#endif
+    return size;
+}
+
 cp_res cloudplugs_ssl_verify(cp_session cps, cp_bool is_verified){
     if(!cps) return CP_FAIL;
     cps->verify_ssl = is_verified;
@@ -152,13 +207,7 @@ cp_res cloudplugs_enable_ssl(cp_session cps, cp_bool is_enabled){
     if((https && is_enabled) || (!https && !is_enabled)) return CP_OK;
     char* protocol = is_enabled ? CP_HTTPS_STR : CP_HTTP_STR;
     int start = (is_enabled ? LIT_STR_LEN(CP_HTTP_STR) : LIT_STR_LEN(CP_HTTPS_STR));
-    char* tmp = cloudplugs_concat(cps, 2, protocol, cps->base_url+start);
-    if(tmp){
-        free(cps->base_url);
-        cps->base_url = tmp;
-        return CP_OK;
-    }
-    return CP_FAIL;
+    return cloudplugs_string_set(cps, &cps->base_url, CP_ARENA(cps->base_url_arena), protocol, cps->base_url+start);
 }
 
 cp_bool cloudplugs_has_ssl(cp_session cps){
@@ -166,51 +215,101 @@ cp_bool cloudplugs_has_ssl(cp_session cps){
     return strncmp(cps->base_url, CP_HTTP_STR, LIT_STR_LEN(CP_HTTP_STR));
 }
 
+static cp_bool cloudplugs_identity_assign(cp_session cps, cp_identity identity, const char* id, const char* pass, cp_bool is_master) {
+    identity->is_master = is_master;
+    if(cloudplugs_string_set(cps, &identity->id, CP_ARENA(identity->id_arena), strchr(id,'@') ? PLUG_EMAIL_HEADER : PLUG_ID_HEADER, id) == CP_OK
+        && cloudplugs_string_set(cps, &identity->auth, CP_ARENA(identity->auth_arena), is_master ? PLUG_MASTER_HEADER : PLUG_AUTH_HEADER, pass) == CP_OK)
+        return CP_TRUE;
+    cloudplugs_string_set(cps, &identity->id, CP_ARENA(identity->id_arena), NULL, NULL);
+    cloudplugs_string_set(cps, &identity->auth, CP_ARENA(identity->auth_arena), NULL, NULL);
+    return CP_FALSE;
+}
+
 cp_res cloudplugs_set_auth(cp_session cps, const char* id, const char* pass, cp_bool is_master) {
     if(!cps || !id || !pass) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
-    if(cps->id) free(cps->id);
-    if(cps->auth) free(cps->auth);
-    cps->id = strchr(id,'@') ? cloudplugs_concat(cps, 2, PLUG_EMAIL_HEADER, id) : cloudplugs_concat(cps, 2, PLUG_ID_HEADER, id);
-    cps->auth = is_master ? cloudplugs_concat(cps, 2, PLUG_MASTER_HEADER, pass) : cloudplugs_concat(cps, 2, PLUG_AUTH_HEADER, pass);
-    cps->is_master = is_master;
-    return (cps->id && cps->auth) ? CP_TRUE : CP_FALSE;
+    return cloudplugs_identity_assign(cps, &cps->own, id, pass, is_master) ? CP_OK : CP_FAIL;
+}
+
+cp_identity cloudplugs_create_identity(cp_session cps, const char* id, const char* pass, cp_bool is_master) {
+    if(!cps || !id || !pass) {
+        if(cps) cps->err = CP_ERR_INVALID_PARAMETER;
+        return NULL;
+    }
+    cp_identity identity = (cp_identity) cloudplugs_calloc(1, sizeof(struct _cp_identity));
+    if(!identity) {
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    if(!cloudplugs_identity_assign(cps, identity, id, pass, is_master)) {
+        cloudplugs_destroy_identity(identity);
+        return NULL;
+    }
+    return identity;
+}
+
+cp_res cloudplugs_destroy_identity(cp_identity identity) {
+    if(!identity) return CP_FAIL;
+    cloudplugs_string_set(NULL, &identity->id, CP_ARENA(identity->id_arena), NULL, NULL);
+    cloudplugs_string_set(NULL, &identity->auth, CP_ARENA(identity->auth_arena), NULL, NULL);
+    cloudplugs_free(identity);
+    return CP_OK;
+}
+
+cp_res cloudplugs_set_identity(cp_session cps, cp_identity identity) {
+    if(!cps) return CP_FAIL;
+    cps->identity = identity ? identity : &cps->own;
+    return CP_OK;
+}
+
+cp_identity cloudplugs_get_identity(cp_session cps) {
+    return (cps && cps->identity != &cps->own) ? cps->identity : NULL;
 }
 
 cp_res cloudplugs_get_auth_id(cp_session cps, char* id, size_t size) {
-   if(!cps || !cps->id) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
-   char* index = strchr(cps->id,' ');
+   if(!cps || !cps->identity->id) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+   char* index = strchr(cps->identity->id,' ');
    strncpy(id, index+1, size);
    return id[size] == '\0' ? CP_TRUE : CP_FALSE;
 }
 
 cp_res cloudplugs_get_auth_pass(cp_session cps, char* pass, size_t size) {
-   if(!cps || !cps->auth) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
-   char* index = strchr(cps->auth,' ');
+   if(!cps || !cps->identity->auth) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+   char* index = strchr(cps->identity->auth,' ');
    strncpy(pass, index+1, size);
    return pass[size] == '\0' ? CP_TRUE : CP_FALSE;
 }
 
 cp_bool cloudplugs_is_auth_master(cp_session cps) {
-    return (cps && cps->is_master) ? CP_TRUE : CP_FALSE;
+    return (cps && cps->identity->is_master) ? CP_TRUE : CP_FALSE;
 }
 
 
 cp_res cloudplugs_destroy_session(cp_session cps) {
     if(!cps) return CP_FAIL;
-    curl_easy_cleanup(cps->curl);
-    if(cps->id) free(cps->id);
-    if(cps->auth) free(cps->auth);
-    free(cps->base_url);
-    if(cps->ca) free(cps->ca);
-    free(cps);
+    if(cps->dispatching) {
+        cps->destroyed = CP_TRUE;
+        return CP_OK;
+    }
+    cloudplugs_session_free(cps);
     return CP_OK;
 }
 
+void cloudplugs_session_free(cp_session cps) {
+    cloudplugs_async_cleanup(cps);
+    curl_easy_cleanup(cps->curl);
+    cloudplugs_string_set(cps, &cps->own.id, CP_ARENA(cps->own.id_arena), NULL, NULL);
+    cloudplugs_string_set(cps, &cps->own.auth, CP_ARENA(cps->own.auth_arena), NULL, NULL);
+    cloudplugs_string_set(cps, &cps->base_url, CP_ARENA(cps->base_url_arena), NULL, NULL);
+    cloudplugs_string_set(cps, &cps->ca, CP_ARENA(cps->ca_arena), NULL, NULL);
+    cloudplugs_json_writer_free(&cps->writer);
+    cloudplugs_free(cps);
+}
+
 cp_res cloudplugs_uncontrol_device(cp_session cps, const char* plugid, const char* plugid_controlled, char** result, size_t* result_length) {
     const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
-    char* url = cloudplugs_concat(cps, 2, PATH_DEVICE "/", id);
+    char* url = cloudplugs_url_device(cps, id);
     cp_res cp_res = cloudplugs_request_exec(cps, CP_TRUE, CP_HTTP_DELETE, url, NULL, NULL, plugid_controlled, result, result_length);
-    if(url) free(url);
+    if(url) cloudplugs_url_free(cps, url);
     return cp_res;
 }
 
@@ -227,112 +326,367 @@ cp_res cloudplugs_get_channel(cp_session cps, const char* channel_mask, const ch
     if(!result) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
     char* url = channel_mask ? cloudplugs_url_encode_channel(cps, channel_mask) : PATH_CHANNEL;
     cp_res cp_res = cloudplugs_request_exec(cps, CP_TRUE, CP_HTTP_GET, url, NULL, query, NULL, result, result_length);
-    if(url && channel_mask) free(url);
+    if(url && channel_mask) cloudplugs_url_free(cps, url);
     return cp_res;
 }
 
+static const cp_body* cloudplugs_string_body(cp_body* b, const char* s) {
+    if(!s) return NULL;
+    cloudplugs_body_buffer(b, s, strlen(s));
+    return b;
+}
+
 cp_res cloudplugs_publish_data(cp_session cps, const char *channel, const char *body, char** result, size_t* result_length) {
+    cp_body b;
+    return cloudplugs_publish_data_body(cps, channel, cloudplugs_string_body(&b, body), result, result_length);
+}
+
+cp_res cloudplugs_publish_data_body(cp_session cps, const char *channel, const cp_body* body, char** result, size_t* result_length) {
     char* url = channel ? cloudplugs_url_encode_data(cps, channel) : PATH_DATA;
-    cp_res cp_res = cloudplugs_request_exec(cps, CP_TRUE, CP_HTTP_PUT, url, NULL, NULL, body, result, result_length);
-    if(url && channel) free(url);
+    cp_res cp_res;
+    if(cps && cps->cbor && body && body->type == CP_BODY_BUFFER)
+        cp_res = cloudplugs_cbor_publish_json(cps, url, body->data, body->length, result, result_length);
+    else
+        cp_res = cloudplugs_request_exec_body(cps, CP_TRUE, CP_HTTP_PUT, url, NULL, NULL, body, result, result_length);
+    if(url && channel) cloudplugs_url_free(cps, url);
+    return cp_res;
+}
+
+cp_res cloudplugs_publish_data_stream(cp_session cps, const char* channel, const cp_body* body, char** result, size_t* result_length) {
+    if(!cps) return CP_FAIL;
+    if(!body) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    cp_body_reader r;
+    if(cloudplugs_body_open(cps, &r, body) != CP_OK) return CP_FAIL;
+    cp_body stream;
+    cloudplugs_body_callback(&stream, cloudplugs_body_read, &r, CP_BODY_UNKNOWN_LENGTH);
+    cp_res cp_res = cloudplugs_publish_data_body(cps, channel, &stream, result, result_length);
+    cloudplugs_body_close(&r);
     return cp_res;
 }
 
 cp_bool cloudplugs_extract_string_from_json(char** json, const char* key, char* res, const int n) {
-    char*  start = strstr(*json, key);
-    if(!start) return CP_FALSE;
-    start = strchr(start,':');
-    if(!start) return CP_FALSE;
-    start = strchr(start,'\"');
-    if(!start) return CP_FALSE;
-    start++;
-    char* end = strchr(start,'\"');
-    if(!end) return CP_FALSE;
-
-    int len = (int) (end-start);
-    if(len>n) return CP_FALSE;
-    strncpy(res, start, (size_t) len);
-    return CP_TRUE;
+    if(!json || !*json || !key || !res || n <= 0) return CP_FALSE;
+    cp_token local[CP_JSON_TOKENS];
+    cp_token* tokens;
+    int count = cloudplugs_tokenize_all(*json, strlen(*json), local, CP_JSON_TOKENS, &tokens);
+    int i = count > 0 ? cloudplugs_token_find(*json, tokens, count, 0, key) : -1;
+    /* a value of n bytes fills res, a shorter one is NUL-terminated */
+    int len = (i >= 0 && tokens[i].type == CP_TOKEN_STRING) ? cloudplugs_token_copy(*json, &tokens[i], res, (size_t) n) : -1;
+    if(len >= 0 && len < n) res[len] = '\0';
+    if(tokens != local) cloudplugs_free(tokens);
+    return len >= 0 ? CP_TRUE : CP_FALSE;
 }
 
 cp_res cloudplugs_enroll_prototype(cp_session cps, const char* body, char** result, size_t* result_length) {
+    cp_body b;
+    return cloudplugs_enroll_prototype_body(cps, cloudplugs_string_body(&b, body), result, result_length);
+}
+
+cp_res cloudplugs_enroll_prototype_body(cp_session cps, const cp_body* body, char** result, size_t* result_length) {
     if(!cps || !body) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
-    if(!cps->is_master) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
-    cp_res cp_res = cloudplugs_request_exec(cps, CP_TRUE, CP_HTTP_POST, PATH_DEVICE, NULL, NULL, body, result, result_length);
+    if(!cps->identity->is_master) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
+    cp_res cp_res = cloudplugs_request_exec_body(cps, CP_TRUE, CP_HTTP_POST, PATH_DEVICE, NULL, NULL, body, result, result_length);
     return cp_res;
 }
 
 cp_res cloudplugs_enroll_product(cp_session cps, const char* body, char** result, size_t* result_length) {
+    cp_body b;
+    return cloudplugs_enroll_product_body(cps, cloudplugs_string_body(&b, body), result, result_length);
+}
+
+cp_res cloudplugs_enroll_product_body(cp_session cps, const cp_body* body, char** result, size_t* result_length) {
     if(!body) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
-    cp_res cp_res = cloudplugs_request_exec(cps, CP_FALSE, CP_HTTP_POST, PATH_DEVICE, NULL, NULL, body, result, result_length);
+    cp_res cp_res = cloudplugs_request_exec_body(cps, CP_FALSE, CP_HTTP_POST, PATH_DEVICE, NULL, NULL, body, result, result_length);
     cloudplugs_internal_set_auth(cps, cp_res, result);
     return cp_res;
 }
 
+struct _cp_enroll_bulk {
+    cp_enroll_item* items;
+    size_t n;
+    size_t next;
+    size_t* retry;
+    size_t retry_count;
+    int* attempts;
+    int retries;
+    cp_enroll_callback cb;
+    void* userdata;
+    size_t failed;
+};
+
+static char* cloudplugs_enroll_item_body(cp_session cps, const cp_enroll_item* item) {
+    char* model = cloudplugs_json_quote(cps, item->model);
+    char* hwid = cloudplugs_json_quote(cps, item->hwid);
+    char* pass = cloudplugs_json_quote(cps, item->pass);
+    char* body = NULL;
+    if(model && hwid && pass) {
+        body = item->props
+            ? cloudplugs_concat(cps, 9, "{\"" MODEL "\":", model, ",\"" HWID "\":", hwid, ",\"" PASS "\":", pass, ",\"" PROPS "\":", item->props, "}")
+            : cloudplugs_concat(cps, 7, "{\"" MODEL "\":", model, ",\"" HWID "\":", hwid, ",\"" PASS "\":", pass, "}");
+    }
+    cloudplugs_free(model);
+    cloudplugs_free(hwid);
+    cloudplugs_free(pass);
+    return body;
+}
+
+static cp_bool cloudplugs_enroll_bulk_next(cp_session cps, cp_transfer* t, void* userdata) {
+    struct _cp_enroll_bulk* bulk = (struct _cp_enroll_bulk*) userdata;
+    for(;;) {
+        size_t i;
+        if(bulk->retry_count) i = bulk->retry[--bulk->retry_count];
+        else if(bulk->next < bulk->n) i = bulk->next++;
+        else return CP_FALSE;
+
+        cp_enroll_item* item = &bulk->items[i];
+        t->index = i;
+        t->method = CP_HTTP_POST;
+        t->url = cloudplugs_concat(cps, 2, cps->base_url, PATH_DEVICE);
+        t->data = cloudplugs_enroll_item_body(cps, item);
+        if(t->url && t->data) {
+            t->data_length = strlen(t->data);
+            return CP_TRUE;
+        }
+        cloudplugs_free(t->url);
+        cloudplugs_free(t->data);
+        t->url = NULL;
+        t->data = NULL;
+        item->res = CP_FAIL;
+        item->http_res = 0;
+        bulk->failed++;
+        if(bulk->cb) bulk->cb(cps, i, CP_FAIL, NULL, NULL, bulk->userdata);
+    }
+}
+
+static void cloudplugs_enroll_bulk_done(cp_session cps, cp_transfer* t, void* userdata) {
+    struct _cp_enroll_bulk* bulk = (struct _cp_enroll_bulk*) userdata;
+    cp_enroll_item* item = &bulk->items[t->index];
+    item->http_res = t->http_res;
+
+    if(t->response.curl_res == CURLE_OK && (t->http_res == CP_HTTP_OK || t->http_res == CP_HTTP_CREATED) && t->response.body) {
+        char id[32 + 1] = {0};
+        char auth[128 + 1] = {0};
+        char* json = t->response.body;
+        if(cloudplugs_extract_string_from_json(&json, ID, id, 32) && cloudplugs_extract_string_from_json(&json, AUTH, auth, 128)) {
+            item->res = CP_OK;
+            if(bulk->cb) bulk->cb(cps, t->index, CP_OK, id, auth, bulk->userdata);
+            return;
+        }
+    } else if((t->response.curl_res != CURLE_OK || t->http_res >= 500) && bulk->attempts[t->index] < bulk->retries) {
+        bulk->attempts[t->index]++;
+        bulk->retry[bulk->retry_count++] = t->index;
+        return;
+    }
+    item->res = CP_FAIL;
+    bulk->failed++;
+    if(bulk->cb) bulk->cb(cps, t->index, CP_FAIL, NULL, NULL, bulk->userdata);
+}
+
+cp_res cloudplugs_enroll_product_bulk(cp_session cps, cp_enroll_item* items, size_t n, int retries, cp_enroll_callback cb, void* userdata) {
+    if(!cps || (!items && n) || retries < 0) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    size_t i;
+    for(i = 0; i < n; i++) {
+        if(!items[i].model || !items[i].hwid || !items[i].pass) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+        items[i].res = CP_FAIL;
+        items[i].http_res = 0;
+    }
+    if(!n) return CP_OK;
+
+    struct _cp_enroll_bulk bulk;
+    bulk.items = items;
+    bulk.n = n;
+    bulk.next = 0;
+    bulk.retry_count = 0;
+    bulk.retries = retries;
+    bulk.cb = cb;
+    bulk.userdata = userdata;
+    bulk.failed = 0;
+    bulk.retry = (size_t*) cloudplugs_malloc(n * sizeof(size_t));
+    bulk.attempts = (int*) cloudplugs_calloc(n, sizeof(int));
+    if(!bulk.retry || !bulk.attempts) {
+        cloudplugs_free(bulk.retry);
+        cloudplugs_free(bulk.attempts);
+        SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    }
+
+    cps->err = 0;
+    cp_res cp_res = cloudplugs_batch_run(cps, cloudplugs_enroll_bulk_next, cloudplugs_enroll_bulk_done, &bulk);
+    cloudplugs_free(bulk.retry);
+    cloudplugs_free(bulk.attempts);
+    if(cp_res != CP_OK) return cp_res;
+    if(bulk.failed) SET_ERROR_AND_RETURN(cps, CP_ERR_HTTP);
+    return CP_OK;
+}
+
 cp_res cloudplugs_control_device(cp_session cps, const char* body, char** result, size_t* result_length) {
+    cp_body b;
+    return cloudplugs_control_device_body(cps, cloudplugs_string_body(&b, body), result, result_length);
+}
+
+cp_res cloudplugs_control_device_body(cp_session cps, const cp_body* body, char** result, size_t* result_length) {
     if(!body) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
-    cp_res cp_res = cloudplugs_request_exec(cps, CP_TRUE, CP_HTTP_PUT, PATH_DEVICE, NULL, NULL, body, result, result_length);
-    if(!cps->id) cloudplugs_internal_set_auth(cps, cp_res, result);
+    cp_res cp_res = cloudplugs_request_exec_body(cps, CP_TRUE, CP_HTTP_PUT, PATH_DEVICE, NULL, NULL, body, result, result_length);
+    if(!cps->identity->id) cloudplugs_internal_set_auth(cps, cp_res, result);
     return cp_res;
 }
 
 cp_res cloudplugs_enroll_ctrl(cp_session cps, const char* body, char** result, size_t* result_length) {
-    if(cps->id && !strchr(cps->id,'@')) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
+    cp_body b;
+    return cloudplugs_enroll_ctrl_body(cps, cloudplugs_string_body(&b, body), result, result_length);
+}
+
+cp_res cloudplugs_enroll_ctrl_body(cp_session cps, const cp_body* body, char** result, size_t* result_length) {
+    if(cps->identity->id && !strchr(cps->identity->id,'@')) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
     if(!body) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
-    cp_res cp_res = cloudplugs_request_exec(cps, CP_FALSE, CP_HTTP_PUT, PATH_DEVICE, NULL, NULL, body, result, result_length);
-    if(!cps->id) cloudplugs_internal_set_auth(cps, cp_res, result);
+    cp_res cp_res = cloudplugs_request_exec_body(cps, CP_FALSE, CP_HTTP_PUT, PATH_DEVICE, NULL, NULL, body, result, result_length);
+    if(!cps->identity->id) cloudplugs_internal_set_auth(cps, cp_res, result);
     return cp_res;
 }
 
 cp_res cloudplugs_retrieve_data(cp_session cps, const char* channel_mask, const char* query, char** result, size_t* result_length) {
     if(!channel_mask || !result) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
     char* url = cloudplugs_url_encode_data(cps, channel_mask);
-    cp_res cp_res = cloudplugs_request_exec(cps, CP_TRUE, CP_HTTP_GET, url, NULL, query, NULL, result, result_length);
-    if(url) free(url);
+    cp_res cp_res;
+    if(cps->cbor)
+        cp_res = cloudplugs_cbor_get(cps, url, query, result, result_length);
+    else
+        cp_res = cloudplugs_request_exec(cps, CP_TRUE, CP_HTTP_GET, url, NULL, query, NULL, result, result_length);
+    if(url) cloudplugs_url_free(cps, url);
+    return cp_res;
+}
+
+cp_res cloudplugs_retrieve_data_spill(cp_session cps, const char* channel_mask, const char* query, size_t threshold, cp_response* response) {
+    if(!channel_mask || !response) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    response->body = NULL;
+    response->length = 0;
+    response->mapped = CP_FALSE;
+    char* url = cloudplugs_url_encode_data(cps, channel_mask);
+    if(!url) return CP_FAIL;
+    cp_req_buffer b;
+    cloudplugs_req_buffer_init(&b, cps, cps->curl, threshold);
+    cp_res cp_res = cloudplugs_request_exec_buffer(cps, CP_TRUE, CP_HTTP_GET, url, NULL, query, NULL, &b);
+    cloudplugs_url_free(cps, url);
+    if(b.curl_res != CURLE_OK) {
+        cloudplugs_req_buffer_discard(&b);
+        return CP_FAIL;
+    }
+    response->body = b.body;
+    response->length = b.offset;
+    response->mapped = b.mapped;
     return cp_res;
 }
 
+cp_res cloudplugs_retrieve_data_buf(cp_session cps, const char* channel_mask, const char* query, char* buf, size_t cap, size_t* len) {
+    if(!channel_mask) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    char path[CP_MAX_URL_LENGTH];
+    if(cloudplugs_path_format(cps, path, sizeof(path), PATH_DATA "/", NULL, channel_mask) != CP_OK) return CP_FAIL;
+    return cloudplugs_request_exec_fixed(cps, CP_TRUE, CP_HTTP_GET, path, query, NULL, buf, cap, len);
+}
+
+cp_res cloudplugs_publish_data_buf(cp_session cps, const char* channel, const char* body, char* buf, size_t cap, size_t* len) {
+    char path[CP_MAX_URL_LENGTH];
+    if(cloudplugs_path_format(cps, path, sizeof(path), channel ? PATH_DATA "/" : PATH_DATA, NULL, channel) != CP_OK) return CP_FAIL;
+    cp_body b;
+    return cloudplugs_request_exec_fixed(cps, CP_TRUE, CP_HTTP_PUT, path, NULL, cloudplugs_string_body(&b, body), buf, cap, len);
+}
+
+cp_res cloudplugs_get_channel_buf(cp_session cps, const char* channel_mask, const char* query, char* buf, size_t cap, size_t* len) {
+    char path[CP_MAX_URL_LENGTH];
+    if(cloudplugs_path_format(cps, path, sizeof(path), channel_mask ? PATH_CHANNEL "/" : PATH_CHANNEL, NULL, channel_mask) != CP_OK) return CP_FAIL;
+    return cloudplugs_request_exec_fixed(cps, CP_TRUE, CP_HTTP_GET, path, query, NULL, buf, cap, len);
+}
+
+cp_res cloudplugs_get_device_buf(cp_session cps, const char* plugid, char* buf, size_t cap, size_t* len) {
+    const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
+    if(!id) return CP_FAIL;
+    char path[CP_MAX_URL_LENGTH];
+    if(cloudplugs_path_format(cps, path, sizeof(path), PATH_DEVICE "/", id, NULL) != CP_OK) return CP_FAIL;
+    return cloudplugs_request_exec_fixed(cps, CP_TRUE, CP_HTTP_GET, path, NULL, NULL, buf, cap, len);
+}
+
+cp_res cloudplugs_set_device_buf(cp_session cps, const char* plugid, const char* value, char* buf, size_t cap, size_t* len) {
+    if(!value) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
+    if(!id) return CP_FAIL;
+    char path[CP_MAX_URL_LENGTH];
+    if(cloudplugs_path_format(cps, path, sizeof(path), PATH_DEVICE "/", id, NULL) != CP_OK) return CP_FAIL;
+    cp_body b;
+    return cloudplugs_request_exec_fixed(cps, CP_TRUE, CP_HTTP_PATCH, path, NULL, cloudplugs_string_body(&b, value), buf, cap, len);
+}
+
+cp_res cloudplugs_get_device_prop_buf(cp_session cps, const char* plugid, const char* prop, char* buf, size_t cap, size_t* len) {
+    const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
+    if(!id) return CP_FAIL;
+    char path[CP_MAX_URL_LENGTH];
+    if(cloudplugs_path_format(cps, path, sizeof(path), PATH_DEVICE "/", id, prop ? prop : "") != CP_OK) return CP_FAIL;
+    return cloudplugs_request_exec_fixed(cps, CP_TRUE, CP_HTTP_GET, path, NULL, NULL, buf, cap, len);
+}
+
+void cloudplugs_response_release(cp_response* response) {
+    if(!response) return;
+    if(response->mapped) munmap(response->body, response->length + 1);
+    else if(response->body) cloudplugs_free(response->body);
+    response->body = NULL;
+    response->length = 0;
+    response->mapped = CP_FALSE;
+}
+
 cp_res cloudplugs_remove_data(cp_session cps, const char* channel_mask, const char* body, char** result, size_t* result_length) {
+    cp_body b;
+    return cloudplugs_remove_data_body(cps, channel_mask, cloudplugs_string_body(&b, body), result, result_length);
+}
+
+cp_res cloudplugs_remove_data_body(cp_session cps, const char* channel_mask, const cp_body* body, char** result, size_t* result_length) {
     if(!body || !channel_mask) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
     char* url = cloudplugs_url_encode_data(cps, channel_mask);
-    cp_res cp_res = cloudplugs_request_exec(cps, CP_TRUE, CP_HTTP_DELETE, url, NULL, NULL, body, result, result_length);
-    if(url) free(url);
+    cp_res cp_res = cloudplugs_request_exec_body(cps, CP_TRUE, CP_HTTP_DELETE, url, NULL, NULL, body, result, result_length);
+    if(url) cloudplugs_url_free(cps, url);
     return cp_res;
 }
 
 cp_res cloudplugs_get_device(cp_session cps, const char* plugid, char** result, size_t* result_length) {
     if(!result) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
     const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
-    char* url = cloudplugs_concat(cps, 2, PATH_DEVICE "/", id);
+    char* url = cloudplugs_url_device(cps, id);
     cp_res cp_res = cloudplugs_request_exec(cps, CP_TRUE, CP_HTTP_GET, url, NULL, NULL, NULL, result, result_length);
-    if(url) free(url);
+    if(url) cloudplugs_url_free(cps, url);
     return cp_res;
 }
 
 cp_res cloudplugs_set_device(cp_session cps, const char* plugid, const char* value, char** result, size_t* result_length) {
+    cp_body b;
+    return cloudplugs_set_device_body(cps, plugid, cloudplugs_string_body(&b, value), result, result_length);
+}
+
+cp_res cloudplugs_set_device_body(cp_session cps, const char* plugid, const cp_body* value, char** result, size_t* result_length) {
     if(!value) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
     const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
-    char* url = cloudplugs_concat(cps, 2, PATH_DEVICE "/", id);
-    cp_res cp_res = cloudplugs_request_exec(cps, CP_TRUE, CP_HTTP_PATCH, url, NULL, NULL, value, result, result_length);
-    if(url) free(url);
+    char* url = cloudplugs_url_device(cps, id);
+    cp_res cp_res = cloudplugs_request_exec_body(cps, CP_TRUE, CP_HTTP_PATCH, url, NULL, NULL, value, result, result_length);
+    if(url) cloudplugs_url_free(cps, url);
     return cp_res;
 }
 
 cp_res cloudplugs_get_device_prop(cp_session cps, const char* plugid, const char* prop, char** result, size_t* result_length) {
     if(!result) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
     const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
-    char* url = prop ? cloudplugs_url_encode_prop(cps, id, prop) : cloudplugs_concat(cps, 3, PATH_DEVICE "/", id, "/");
+    char* url = cloudplugs_url_encode_prop(cps, id, prop);
     cp_res cp_res = cloudplugs_request_exec(cps, CP_TRUE, CP_HTTP_GET, url, NULL, NULL, NULL, result, result_length);
-    if(url) free(url);
+    if(url) cloudplugs_url_free(cps, url);
     return cp_res;
 }
 
 cp_res cloudplugs_set_device_prop(cp_session cps, const char* plugid, const char* prop, const char* value) {
+    cp_body b;
+    return cloudplugs_set_device_prop_body(cps, plugid, prop, cloudplugs_string_body(&b, value));
+}
+
+cp_res cloudplugs_set_device_prop_body(cp_session cps, const char* plugid, const char* prop, const cp_body* value) {
     if(!value) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
     const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
-    char* url = prop ? cloudplugs_url_encode_prop(cps, id, prop) : cloudplugs_concat(cps, 3, PATH_DEVICE "/", id, "/");
-    cp_res cp_res = cloudplugs_request_exec(cps, CP_TRUE, CP_HTTP_PATCH, url, NULL, NULL, value, NULL, 0);
-    if(url) free(url);
+    char* url = cloudplugs_url_encode_prop(cps, id, prop);
+    cp_res cp_res = cloudplugs_request_exec_body(cps, CP_TRUE, CP_HTTP_PATCH, url, NULL, NULL, value, NULL, 0);
+    if(url) cloudplugs_url_free(cps, url);
     return cp_res;
 }
 
@@ -341,27 +695,13 @@ cp_res cloudplugs_remove_device_prop(cp_session cps, const char* plugid, const c
     const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
     char* url = cloudplugs_url_encode_prop(cps, id, prop);
     cp_res cp_res = cloudplugs_request_exec(cps, CP_TRUE, CP_HTTP_DELETE, url, NULL, NULL, NULL, NULL, 0);
-    if(url) free(url);
+    if(url) cloudplugs_url_free(cps, url);
     return cp_res;
 }
 
 cp_res cloudplugs_set_device_location(cp_session cps, const char* plugid, double longitude, double latitude, double altitude, double accuracy, double timestamp) {
-    if(!longitude || !latitude) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
-  //longitude,  latitude,  altitude,  accuracy,  timestamp
-    if(longitude > MAX_LONGITUDE || longitude < MIN_LONGITUDE) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
-    if(latitude > MAX_LATITUDE || latitude < MIN_LATITUDE) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
-
-    const int size = 200;
-    const int s_size = 50;
-    char body[size];
-    char s_acc[s_size];
-    char s_all[s_size];
-    char s_tim[s_size];
-    if(accuracy >= 0) snprintf(s_acc, s_size, ",\""ACCURACY"\":%g", accuracy); else s_acc[0]='\0';
-    if(altitude >= 0) snprintf(s_all, s_size, ",\""ALTITUDE"\":%g", altitude); else s_all[0]='\0';
-    if(timestamp >= 0) snprintf(s_tim, s_size, ",\""TIMESTAMP"\":%g", timestamp); else s_tim[0]='\0';
-
-    snprintf(body, size, "{\""LONGITUDE"\":%g,\""LATITUDE"\":%g%s%s%s}", longitude, latitude, s_acc, s_all, s_tim);
+    char body[CP_LOCATION_SIZE];
+    if(cloudplugs_location_format(cps, body, sizeof(body), longitude, latitude, altitude, accuracy, timestamp) != CP_OK) return CP_FAIL;
 
     cp_res cp_res = cloudplugs_set_device_prop(cps, plugid, LOCATION, body);
     return cp_res;
@@ -370,3 +710,63 @@ cp_res cloudplugs_set_device_location(cp_session cps, const char* plugid, double
 cp_res cloudplugs_get_device_location(cp_session cps, const char* plugid, char** result, size_t* result_length) {
     return cloudplugs_get_device_prop(cps, plugid, LOCATION, result, result_length);
 }
+
+static cp_prepared cloudplugs_prepare(cp_session cps, CP_HTTP_METHOD http_method, char* url) {
+    if(!url) return NULL;
+    cp_prepared prep = cloudplugs_malloc(sizeof(struct _cloudplugs_prepared));
+    if(!prep) {
+        cloudplugs_url_free(cps, url);
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    prep->method = http_method;
+    prep->url = cloudplugs_concat(cps, 2, cps->base_url, url);
+    prep->headers = cloudplugs_build_headers(cps, NULL);
+    cloudplugs_url_free(cps, url);
+    if(!prep->url || !prep->headers) {
+        cloudplugs_prepared_destroy(prep);
+        return NULL;
+    }
+    return prep;
+}
+
+cp_prepared cloudplugs_prepare_publish(cp_session cps, const char* channel) {
+    if(!cps) return NULL;
+    if(!cps->identity->auth) {
+        cps->err = CP_ERR_INVALID_LOGIN;
+        return NULL;
+    }
+    char* url = channel ? cloudplugs_url_encode_data(cps, channel) : cloudplugs_concat(cps, 1, PATH_DATA);
+    return cloudplugs_prepare(cps, CP_HTTP_PUT, url);
+}
+
+cp_prepared cloudplugs_prepare_prop(cp_session cps, const char* plugid, const char* prop) {
+    if(!cps) return NULL;
+    if(!cps->identity->auth) {
+        cps->err = CP_ERR_INVALID_LOGIN;
+        return NULL;
+    }
+    const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
+    if(!id) return NULL;
+    char* url = cloudplugs_url_encode_prop(cps, id, prop);
+    return cloudplugs_prepare(cps, CP_HTTP_PATCH, url);
+}
+
+cp_res cloudplugs_prepared_exec(cp_session cps, cp_prepared prep, const char* body, char** result, size_t* result_length) {
+    cp_body b;
+    return cloudplugs_prepared_exec_body(cps, prep, cloudplugs_string_body(&b, body), result, result_length);
+}
+
+cp_res cloudplugs_prepared_exec_body(cp_session cps, cp_prepared prep, const cp_body* body, char** result, size_t* result_length) {
+    if(!cps) return CP_FAIL;
+    if(!prep || !body) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    return cloudplugs_request_perform(cps, prep->method, prep->url, prep->headers, body, result, result_length);
+}
+
+cp_res cloudplugs_prepared_destroy(cp_prepared prep) {
+    if(!prep) return CP_FAIL;
+    if(prep->url) cloudplugs_free(prep->url);
+    if(prep->headers) curl_slist_free_all(prep->headers);
+    cloudplugs_free(prep);
+    return CP_OK;
+}
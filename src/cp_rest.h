@@ -30,6 +30,20 @@ extern "C" {
 
 typedef struct _cloudplugs_session* cp_session; /**<Reference to a session */
 
+typedef struct _cloudplugs_prepared* cp_prepared; /**<Reference to a prepared request */
+
+typedef struct _cp_identity* cp_identity; /**<Reference to a set of credentials, usable by any session */
+
+typedef struct _cloudplugs_checkpoint* cp_checkpoint; /**<Reference to a durable store of retrieval positions */
+
+typedef struct _cloudplugs_aggregator* cp_aggregator; /**<Reference to a windowed aggregation stage in front of publishing */
+
+typedef struct _cloudplugs_deadband* cp_deadband; /**<Reference to a filter of unchanged values in front of publishing */
+
+typedef struct _cloudplugs_combiner* cp_combiner; /**<Reference to a buffer merging the property writes of each device */
+
+typedef struct _cloudplugs_tracker* cp_tracker; /**<Reference to a buffer simplifying a location track before publishing */
+
 #define CP_OK 0
 #define CP_FAIL 1
 typedef int cp_res; /**<An integer representing the result of a request */
@@ -38,6 +52,37 @@ typedef int cp_bool; /**<Library internal booleans */
 #define CP_TRUE 1
 #define CP_FALSE 0
 
+/**
+ Number of milliseconds in GMT since the time of Epoch
+*/
+typedef double cp_time;
+
+/**
+ Numeric data of a channel stored by columns: the i-th record is at[i], value[i] and cloudplugs_series_id(s, i).
+*/
+struct _cp_series {
+   cp_time* at;	/**< the timestamps */
+   double* value;	/**< the numeric data */
+   size_t* id;		/**< offset of each id in ids */
+   char* ids;		/**< the NUL-terminated ids, one after the other */
+   size_t count;	/**< number of records */
+   size_t size;	/**< capacity of at, value and id */
+   size_t ids_length;	/**< bytes used in ids */
+   size_t ids_size;	/**< capacity of ids */
+};
+typedef struct _cp_series cp_series;
+
+/**
+ Aggregates of a range of values.
+*/
+struct _cp_stats {
+   double min;		/**< the smallest value, +infinity if count is 0 */
+   double max;		/**< the largest value, -infinity if count is 0 */
+   double sum;		/**< the sum of the values */
+   size_t count;	/**< the number of values */
+};
+typedef struct _cp_stats cp_stats;
+
 
 
 enum _CP_HTTP_RESULT {   
@@ -51,6 +96,7 @@ enum _CP_HTTP_RESULT {
                 CP_HTTP_NOT_FOUND = 404,
                 CP_HTTP_NOT_ALLOWED = 405,
                 CP_HTTP_NOT_ACCEPTABLE = 406,
+                CP_HTTP_UNSUPPORTED_MEDIA_TYPE = 415,
                 CP_HTTP_SERVER_ERROR = 500,
                 CP_HTTP_NOT_IMPLEMENTED = 501,
                 CP_HTTP_BAD_GATEWAY = 502,
@@ -70,12 +116,152 @@ enum _CP_ERR_CODE { CP_ERR_INTERNAL_ERROR = -1,
                     CP_ERR_JSON_PARSE = -9,
                     CP_ERR_JSON_ENCODE = -10,
                     CP_ERR_INVALID_CONTENT_LENGTH = -11,
-                    CP_ERR_HTTP = -12
+                    CP_ERR_HTTP = -12,
+                    CP_ERR_BUFFER_TOO_SMALL = -13
                   };
 
 
 typedef enum _CP_ERR_CODE CP_ERR_CODE; /**<Library internal error codes */
 
+typedef void* (*cp_malloc_func)(size_t size); /**<Allocation function, same semantics of malloc() */
+typedef void (*cp_free_func)(void* ptr); /**<Release function, same semantics of free() */
+typedef void* (*cp_realloc_func)(void* ptr, size_t size); /**<Reallocation function, same semantics of realloc() */
+typedef char* (*cp_strdup_func)(const char* str); /**<String duplication function, same semantics of strdup() */
+typedef void* (*cp_calloc_func)(size_t nmemb, size_t size); /**<Zeroed allocation function, same semantics of calloc() */
+
+/**
+ Replace the memory functions used by the library, by libcurl and by the Jansson library.
+ Must be called before cloudplugs_global_init(), that hands the functions over to libcurl and Jansson.
+ Every buffer returned by the library (i.e. *result) is allocated with malloc_fn and must be released with cloudplugs_free().
+
+ @param malloc_fn The allocation function.
+ @param free_fn The release function.
+ @param realloc_fn The reallocation function.
+ @param strdup_fn If NULL, then it is implemented with malloc_fn.
+ @param calloc_fn If NULL, then it is implemented with malloc_fn.
+ @return CP_OK if the functions are set correctly, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_set_allocator(cp_malloc_func malloc_fn, cp_free_func free_fn, cp_realloc_func realloc_fn, cp_strdup_func strdup_fn, cp_calloc_func calloc_fn);
+
+/**
+ Release a buffer returned by the library.
+
+ @param ptr The buffer, can be NULL.
+*/
+void cloudplugs_free(void* ptr);
+
+/**
+ Get the number of allocations (malloc, realloc, strdup and calloc calls) performed by the library, libcurl and Jansson since the start or the last cloudplugs_reset_alloc_count().
+ The counter is atomic, so the allocations made by the threads of libcurl (e.g. its resolver) are counted as well.
+
+ @return The number of allocations.
+*/
+size_t cloudplugs_get_alloc_count();
+
+/**
+ Reset the allocation counter.
+*/
+void cloudplugs_reset_alloc_count();
+
+/**
+ Body producer, it must write at most size bytes in buffer and return how many bytes were written, or CP_READ_ABORT to abort the request.
+*/
+typedef size_t (*cp_read_func)(char* buffer, size_t size, void* userdata);
+#define CP_READ_ABORT ((size_t) -1)
+
+#define CP_BODY_UNKNOWN_LENGTH ((size_t) -1) /**<Length of a body known only at its end, sent with chunked transfer encoding */
+
+/**
+ One contiguous chunk of a scattered body
+*/
+struct _cp_iovec {
+   const void* base;
+   size_t len;
+};
+typedef struct _cp_iovec cp_iovec;
+
+enum _CP_BODY_TYPE { CP_BODY_BUFFER, CP_BODY_IOVEC, CP_BODY_CALLBACK, CP_BODY_FD, CP_BODY_MMAP };
+typedef enum _CP_BODY_TYPE CP_BODY_TYPE; /**<Source of a request body */
+
+/**
+ Request body, sent without any copy of the caller-owned memory: initialize it with cloudplugs_body_buffer(), cloudplugs_body_iovec(), cloudplugs_body_callback(), cloudplugs_body_fd() or cloudplugs_body_mmap().
+ The memory and the file descriptor referenced by the body must stay valid until the request ends.
+*/
+struct _cp_body {
+   CP_BODY_TYPE type;
+   const char* data;
+   size_t length;
+   const cp_iovec* iov;
+   int iovcnt;
+   cp_read_func read;
+   void* userdata;
+   int fd;
+};
+typedef struct _cp_body cp_body;
+
+/**
+ Initialize a body from a contiguous buffer.
+
+ @param body The body to initialize.
+ @param data The buffer, it does not need to be NUL-terminated.
+ @param length The number of bytes in data.
+*/
+void cloudplugs_body_buffer(cp_body* body, const char* data, size_t length);
+
+/**
+ Initialize a body from an array of chunks, sent in sequence.
+
+ @param body The body to initialize.
+ @param iov The array of chunks, it must stay valid until the request ends.
+ @param iovcnt The number of chunks in iov.
+*/
+void cloudplugs_body_iovec(cp_body* body, const cp_iovec* iov, int iovcnt);
+
+/**
+ Initialize a body produced by a callback.
+
+ @param body The body to initialize.
+ @param read The producer, called until length bytes are written.
+ @param userdata Passed as it is to read.
+ @param length The total number of bytes that read will produce, or CP_BODY_UNKNOWN_LENGTH if read signals the end returning 0.
+*/
+void cloudplugs_body_callback(cp_body* body, cp_read_func read, void* userdata, size_t length);
+
+/**
+ Initialize a body read from a file descriptor (a file, a pipe or a socket) from its current position.
+
+ @param body The body to initialize.
+ @param fd The file descriptor, it is not closed by the library.
+ @param length The number of bytes to send, or CP_BODY_UNKNOWN_LENGTH to send until the end of file.
+*/
+void cloudplugs_body_fd(cp_body* body, int fd, size_t length);
+
+/**
+ Initialize a body with the whole content of a regular file, that will be memory mapped while sending it.
+
+ @param body The body to initialize.
+ @param fd The file descriptor of a regular file, it is not closed by the library.
+ @return CP_OK if fd is a regular file, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_body_mmap(cp_body* body, int fd);
+
+/**
+ Response body that may be memory mapped from a temporary file: release it with cloudplugs_response_release()
+*/
+struct _cp_response {
+   char* body;
+   size_t length;
+   cp_bool mapped;
+};
+typedef struct _cp_response cp_response;
+
+/**
+ Release a response body.
+
+ @param response The response, its fields are reset.
+*/
+void cloudplugs_response_release(cp_response* response);
+
 /**
  Must be called at least once within a program (a program is all the code that shares a memory space) before the program calls any other function of CloudPlugs library. The environment it sets up is constant for the life of the program and is the same for every program, so multiple calls have the same effect as one call.
  This function is not thread safe. You must not call it when any other thread in the program (i.e. a thread sharing the same memory) is running. This doesn't just mean no other thread that is using CloudPlugs library.
@@ -135,6 +321,23 @@ cp_res cloudplugs_set_timeout(cp_session cps, int timeout);
 */
 int cloudplugs_get_timeout(cp_session cps);
 
+/**
+ Change the maximum number of connections opened by the concurrent requests (e.g. cloudplugs_enroll_product_bulk()).
+
+ @param cps The session reference.
+ @param max_connections Number of connections, 0 restores the default.
+ @return CP_OK if the new value is set correctly, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_set_max_connections(cp_session cps, int max_connections);
+
+/**
+ Get the maximum number of connections opened by the concurrent requests.
+
+ @param cps The session reference.
+ @return The current maximum number of connections.
+*/
+int cloudplugs_get_max_connections(cp_session cps);
+
 /**
  Return a human-readable string that describes the last error.
 
@@ -175,6 +378,15 @@ CP_HTTP_RESULT cloudplugs_get_last_http_result(cp_session cps);
 */
 cp_session cloudplugs_create_session();
 
+/**
+ Compute the memory held by a session: its structure, its strings and its encoding buffer, excluding the libcurl handles and the pending asynchronous requests.
+ In the tiny build (configure --enable-tiny) the strings live in fixed arrays of the structure, so the footprint only grows with the encoding buffer.
+
+ @param cps The session reference.
+ @return The size in bytes, 0 if cps is NULL.
+*/
+size_t cloudplugs_session_footprint(cp_session cps);
+
 /**
  Set the session authentication credentials.
 
@@ -248,8 +460,48 @@ cp_res cloudplugs_get_auth_pass(cp_session cps, char* password, size_t size);
 */
 cp_bool cloudplugs_is_auth_master(cp_session cps);
 
+/**
+ Create a set of credentials, with the headers already formatted, to be activated with cloudplugs_set_identity().
+
+ @param cps The session reference, used only to report errors.
+ @param id A string containing the @ref details_PLUG_ID or the master email.
+ @param pass A string containing the authentication code.
+ @param is_master CP_TRUE for master authentication; CP_FALSE for regular authentication.
+ @return The new identity, NULL on error. It must be released with cloudplugs_destroy_identity().
+*/
+cp_identity cloudplugs_create_identity(cp_session cps, const char* id, const char* pass, cp_bool is_master);
+
+/**
+ Release an identity; it must not be active in any session.
+
+ @param identity The identity reference.
+ @return CP_OK if the identity is released, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_destroy_identity(cp_identity identity);
+
+/**
+ Make the next requests of the session authenticate with the given identity, in place of the credentials set with cloudplugs_set_auth().
+ The session keeps its connection, so switching identity costs no new connection or handshake.
+ While an identity is active, cloudplugs_get_auth_id(), cloudplugs_get_auth_pass() and cloudplugs_is_auth_master() refer to it,
+ and the credentials set by cloudplugs_set_auth() and by the enrollments are stored as the session's own.
+
+ @param cps The session reference.
+ @param identity The identity to use, or NULL to restore the session's own credentials.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_set_identity(cp_session cps, cp_identity identity);
+
+/**
+ Get the identity activated with cloudplugs_set_identity().
+
+ @param cps The session reference.
+ @return The active identity, NULL if the session is using its own credentials.
+*/
+cp_identity cloudplugs_get_identity(cp_session cps);
+
 /**
  Closes and cleans a session.
+ Called by an asynchronous callback, the session is released when all the completed requests have been given to their callbacks.
 
  @param cps The session reference.
  @return CP_OK if the session is correctly closed, CP_FAIL otherwise.
@@ -259,15 +511,308 @@ cp_res cloudplugs_destroy_session(cp_session cps);
 /**
  Extract a string value from a json object
 
- @param json The JSON string.
+ @param json The JSON string, a pointer to an object whose members are searched; only the members of the outer object match.
  @param key The key.
- @param res The destination buffer where the string value will be written.
- @param n Size of the destination buffer.
+ @param res The destination buffer where the unescaped string value will be written, NUL-terminated if shorter than n bytes.
+ @param n Maximum length of the value, the size of res without the terminator.
  @return CP_TRUE if succeeds, CP_FALSE otherwise.
 */
 
 cp_bool cloudplugs_extract_string_from_json(char **json, const char* key, char *res, const int n);
 
+/**
+ Types of the json tokens
+*/
+enum _CP_TOKEN_TYPE { CP_TOKEN_UNDEFINED, CP_TOKEN_OBJECT, CP_TOKEN_ARRAY, CP_TOKEN_STRING, CP_TOKEN_PRIMITIVE };
+typedef enum _CP_TOKEN_TYPE CP_TOKEN_TYPE; /**<Type of a json token */
+
+/**
+ Errors of cloudplugs_tokenize()
+*/
+enum _CP_TOKEN_ERR { CP_TOKEN_ERR_NOMEM = -1, CP_TOKEN_ERR_INVALID = -2, CP_TOKEN_ERR_PARTIAL = -3 };
+
+/**
+ A json value inside a buffer: the bytes from start to end, quotes excluded for strings.
+ The members of an object are its key strings, each having its value as single child.
+*/
+struct _cp_token {
+   CP_TOKEN_TYPE type;
+   int start;
+   int end;
+   int size;      /**<Number of children: members of an object, items of an array, 1 for a key with its value */
+   int parent;    /**<Index of the parent token, -1 for the outer value */
+};
+typedef struct _cp_token cp_token;
+
+/**
+ State of a tokenizer, it can be resumed when more of the buffer is available
+*/
+struct _cp_tokenizer {
+   unsigned int pos;
+   unsigned int next;
+   int super;
+   cp_bool comma;  /**<A ',' waits for the next item */
+};
+typedef struct _cp_tokenizer cp_tokenizer;
+
+/**
+ Prepare a tokenizer for a new buffer.
+
+ @param p The tokenizer.
+*/
+void cloudplugs_tokenizer_init(cp_tokenizer* p);
+
+/**
+ Split a json buffer into tokens, in document order, without allocating memory.
+
+ @param p The tokenizer.
+ @param js The buffer, it does not need to be NUL-terminated.
+ @param length The number of bytes in js.
+ @param tokens The array receiving the tokens, or NULL to count them only.
+ @param num_tokens The size of tokens.
+ @return The number of tokens, or CP_TOKEN_ERR_NOMEM if tokens is too small, CP_TOKEN_ERR_INVALID if js is not json, CP_TOKEN_ERR_PARTIAL if js ends too early.
+*/
+int cloudplugs_tokenize(cp_tokenizer* p, const char* js, size_t length, cp_token* tokens, unsigned int num_tokens);
+
+/**
+ Get the index of the token following a value and all its children.
+
+ @param tokens The tokens.
+ @param count The number of tokens.
+ @param index The index of the value.
+ @return The index of the next token, count if there is none.
+*/
+int cloudplugs_token_skip(const cp_token* tokens, int count, int index);
+
+/**
+ Find the value of a member of an object.
+
+ @param js The buffer of the tokens.
+ @param tokens The tokens.
+ @param count The number of tokens.
+ @param object The index of the object, e.g. 0 for the outer value.
+ @param key The key of the member.
+ @return The index of the value, -1 if the object has no such member.
+*/
+int cloudplugs_token_find(const char* js, const cp_token* tokens, int count, int object, const char* key);
+
+/**
+ Copy the value of a string token, unescaped, or the text of a primitive token.
+
+ @param js The buffer of the token.
+ @param t The token.
+ @param res The destination buffer, NUL-terminated.
+ @param size Size of the destination buffer.
+ @return The length of the value, -1 if it does not fit or t is an object or an array.
+*/
+int cloudplugs_token_string(const char* js, const cp_token* t, char* res, size_t size);
+
+/**
+ Read the value of a number token.
+
+ @param js The buffer of the token.
+ @param t The token.
+ @param value *value will contain the number.
+ @return CP_TRUE if t is a number, CP_FALSE otherwise.
+*/
+cp_bool cloudplugs_token_number(const char* js, const cp_token* t, double* value);
+
+/**
+ A streaming json serializer writing into a reusable buffer, either growing or provided by the caller.
+ After a failure (out of memory or space, or a call out of place) the next calls are ignored and cloudplugs_json_writer_finish() returns NULL.
+*/
+struct _cp_json_writer {
+   char* buffer;
+   size_t length;
+   size_t size;
+   cp_bool fixed;        /**<The buffer belongs to the caller and does not grow */
+   cp_bool cbor;         /**<The values are encoded in CBOR instead of json */
+   cp_bool failed;
+   cp_bool key;          /**<A key waits for its value */
+   int depth;
+   unsigned int items;   /**<Bit d - 1 is set when the container at depth d has items */
+   unsigned int objects; /**<Bit d - 1 is set when the container at depth d is an object */
+};
+typedef struct _cp_json_writer cp_json_writer;
+
+/**
+ Prepare a writer with a buffer growing as needed, released by cloudplugs_json_writer_free().
+
+ @param w The writer.
+*/
+void cloudplugs_json_writer_init(cp_json_writer* w);
+
+/**
+ Prepare a writer on a caller buffer: the text is always NUL-terminated, and the writer fails when it does not fit.
+
+ @param w The writer.
+ @param buf The buffer.
+ @param size The size of buf in bytes.
+*/
+void cloudplugs_json_writer_fixed(cp_json_writer* w, char* buf, size_t size);
+
+/**
+ Switch a writer to CBOR (RFC 8949): the same calls encode the values in binary, with containers of indefinite length,
+ and the raw values are converted from json. The setting is kept by cloudplugs_json_writer_reset().
+
+ @param w The writer.
+ @param enabled CP_TRUE for CBOR, CP_FALSE for json.
+*/
+void cloudplugs_json_writer_cbor(cp_json_writer* w, cp_bool enabled);
+
+/**
+ Empty a writer for a new text, keeping its buffer.
+
+ @param w The writer.
+*/
+void cloudplugs_json_writer_reset(cp_json_writer* w);
+
+/**
+ Release the buffer of a writer, unless it belongs to the caller, leaving the writer empty.
+
+ @param w The writer.
+*/
+void cloudplugs_json_writer_free(cp_json_writer* w);
+
+/**
+ Close the containers still open and get the text.
+
+ @param w The writer.
+ @param length If not NULL, *length will contain the length of the text.
+ @return The NUL-terminated text, valid until the writer is changed, NULL if the writer failed or is empty. In CBOR mode the bytes can contain NULs, use *length.
+*/
+const char* cloudplugs_json_writer_finish(cp_json_writer* w, size_t* length);
+
+/**
+ Open an object, as a value.
+
+ @param w The writer.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_json_begin_object(cp_json_writer* w);
+
+/**
+ Close the innermost container, which must be an object.
+
+ @param w The writer.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_json_end_object(cp_json_writer* w);
+
+/**
+ Open an array, as a value.
+
+ @param w The writer.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_json_begin_array(cp_json_writer* w);
+
+/**
+ Close the innermost container, which must be an array.
+
+ @param w The writer.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_json_end_array(cp_json_writer* w);
+
+/**
+ Write the key of the next member of the innermost object.
+
+ @param w The writer.
+ @param key The key, UTF-8.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_json_write_key(cp_json_writer* w, const char* key);
+
+/**
+ Write a string value, escaped.
+
+ @param w The writer.
+ @param s The string, UTF-8.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_json_write_string(cp_json_writer* w, const char* s);
+
+/**
+ Write a number value, with the shortest text reading back as the same double; integral values are formatted without the C library.
+
+ @param w The writer.
+ @param value The number, it must be finite.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_json_write_number(cp_json_writer* w, double value);
+
+/**
+ Write an integer value.
+
+ @param w The writer.
+ @param value The integer.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_json_write_integer(cp_json_writer* w, long long value);
+
+/**
+ Write a boolean value.
+
+ @param w The writer.
+ @param value The boolean.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_json_write_bool(cp_json_writer* w, cp_bool value);
+
+/**
+ Write a null value.
+
+ @param w The writer.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_json_write_null(cp_json_writer* w);
+
+/**
+ Write a value already encoded as json, copied as it is.
+
+ @param w The writer.
+ @param json The json text.
+ @param length The length of json.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_json_write_raw(cp_json_writer* w, const char* json, size_t length);
+
+/**
+ Append a data record to the array of a batch for cloudplugs_publish_data(), opening the array on the first record of an empty writer.
+
+ @param w The writer.
+ @param channel The channel of the record, or NULL when the batch is published to a channel.
+ @param data The json text of the data.
+ @param at The timestamp of the record, omitted if not greater than zero.
+ @param id The id of the record, or NULL.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_json_append_record(cp_json_writer* w, const char* channel, const char* data, cp_time at, const char* id);
+
+/**
+ Append a data record with a number as data, as cloudplugs_json_append_record().
+
+ @param w The writer.
+ @param channel The channel of the record, or NULL when the batch is published to a channel.
+ @param value The data, it must be finite.
+ @param at The timestamp of the record, omitted if not greater than zero.
+ @param id The id of the record, or NULL.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_json_append_number_record(cp_json_writer* w, const char* channel, double value, cp_time at, const char* id);
+
+/**
+ Convert a CBOR (RFC 8949) data item to json, written in a writer. Byte strings become base64url strings, tags are dropped,
+ integer map keys become strings and the non-finite floats and undefined become null.
+
+ @param cbor The encoded item.
+ @param length The number of bytes in cbor, it must hold exactly one item.
+ @param w The writer.
+ @return CP_OK on success, CP_FAIL if cbor is malformed or the writer failed.
+*/
+cp_res cloudplugs_cbor_to_json(const char* cbor, size_t length, cp_json_writer* w);
+
 /**
  This function performs an HTTP request to the server  for enrolling a new production device and place the response in *result and *result_length.
 
@@ -285,6 +830,51 @@ cp_bool cloudplugs_extract_string_from_json(char **json, const char* key, char *
 */
 cp_res cloudplugs_enroll_product(cp_session cps, const char* body, char** result, size_t* result_length);
 
+/**
+ Same as cloudplugs_enroll_product(), with a body of known length that is not copied.
+*/
+cp_res cloudplugs_enroll_product_body(cp_session cps, const cp_body* body, char** result, size_t* result_length);
+
+/**
+ A device to enroll with cloudplugs_enroll_product_bulk().
+*/
+struct _cp_enroll_item {
+   const char* model;	/**< the model of the device, see @ref details_PLUG_ID */
+   const char* hwid;	/**< the serial number, see @ref details_HWID */
+   const char* pass;	/**< the password of the device */
+   const char* props;	/**< optional JSON value to initialize the custom properties, or NULL */
+   cp_res res;		/**< set to CP_OK if the device is enrolled, CP_FAIL otherwise */
+   CP_HTTP_RESULT http_res;	/**< the last http result of the device */
+};
+typedef struct _cp_enroll_item cp_enroll_item;
+
+/**
+ Receives the outcome of each device of cloudplugs_enroll_product_bulk(), in order of completion.
+
+ @param cps The session reference.
+ @param index The index of the device in the items array.
+ @param res CP_OK if the device is enrolled, CP_FAIL otherwise.
+ @param id The plug id of the enrolled device, NULL on failure; valid only during the call.
+ @param auth The authentication of the enrolled device, NULL on failure; valid only during the call.
+ @param userdata The pointer given to cloudplugs_enroll_product_bulk().
+*/
+typedef void (*cp_enroll_callback)(cp_session cps, size_t index, cp_res res, const char* id, const char* auth, void* userdata);
+
+/**
+ Enroll many products concurrently, on at most cloudplugs_get_max_connections() connections.
+ Unlike cloudplugs_enroll_product(), the session credentials are not changed.
+ Connection failures and server errors (5xx) are retried up to retries times; to retry the other failures later, call it again with the items whose res is CP_FAIL.
+
+ @param cps The session reference.
+ @param items The devices to enroll; their res and http_res fields are set on return.
+ @param n The number of items.
+ @param retries How many times a device is retried after a transient failure.
+ @param cb If not NULL, called when each device is enrolled or has failed.
+ @param userdata Passed as it is to cb.
+ @return CP_OK if all the devices are enrolled, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_enroll_product_bulk(cp_session cps, cp_enroll_item* items, size_t n, int retries, cp_enroll_callback cb, void* userdata);
+
 /**
  This function performs an HTTP request to the server for enrolling a prototype and place the response in *result and *result_length.
 
@@ -303,6 +893,11 @@ cp_res cloudplugs_enroll_product(cp_session cps, const char* body, char** result
 */
 cp_res cloudplugs_enroll_prototype(cp_session cps, const char* body, char** result, size_t* result_length);
 
+/**
+ Same as cloudplugs_enroll_prototype(), with a body of known length that is not copied.
+*/
+cp_res cloudplugs_enroll_prototype_body(cp_session cps, const cp_body* body, char** result, size_t* result_length);
+
 /**
  This function performs an HTTP request to the server for enrolling a new or already existent controller device and place the response in *result and *result_length.
 
@@ -322,7 +917,12 @@ cp_res cloudplugs_enroll_prototype(cp_session cps, const char* body, char** resu
 cp_res cloudplugs_enroll_ctrl(cp_session cps, const char* body, char** result, size_t* result_length);
 
 /**
- This function performs an HTTP request to the server for controlling a device and place the response in *result and *result_length.
+ Same as cloudplugs_enroll_ctrl(), with a body of known length that is not copied.
+*/
+cp_res cloudplugs_enroll_ctrl_body(cp_session cps, const cp_body* body, char** result, size_t* result_length);
+
+/**
+ This function performs an HTTP request to the server for controlling a device and place the response in *result and *result_length.
 
  @param cps The session reference.
  @param body A buffer containing a json object like this:\n
@@ -337,6 +937,11 @@ cp_res cloudplugs_enroll_ctrl(cp_session cps, const char* body, char** result, s
 */
 cp_res cloudplugs_control_device(cp_session cps, const char* body, char** result, size_t* result_length);
 
+/**
+ Same as cloudplugs_control_device(), with a body of known length that is not copied.
+*/
+cp_res cloudplugs_control_device_body(cp_session cps, const cp_body* body, char** result, size_t* result_length);
+
 /**
  This function performs an HTTP request to the server for uncontrol a device and [optionally] place the response in *result and *result_length.
 
@@ -383,6 +988,11 @@ cp_res cloudplugs_get_device_prop(cp_session cps, const char* plugid, const char
 */
 cp_res cloudplugs_set_device_prop(cp_session cps, const char* plugid, const char* prop, const char* value);
 
+/**
+ Same as cloudplugs_set_device_prop(), with a body of known length that is not copied.
+*/
+cp_res cloudplugs_set_device_prop_body(cp_session cps, const char* plugid, const char* prop, const cp_body* value);
+
 /**
  This function performs an HTTP request to the server for deleting device property and [optionally] place the response in *result and *result_length.
 
@@ -411,6 +1021,11 @@ cp_res cloudplugs_remove_device_prop(cp_session cps, const char* plugid, const c
 */
 cp_res cloudplugs_set_device(cp_session cps, const char* plugid, const char* value, char** result, size_t* result_length);
 
+/**
+ Same as cloudplugs_set_device(), with a body of known length that is not copied.
+*/
+cp_res cloudplugs_set_device_body(cp_session cps, const char* plugid, const cp_body* value, char** result, size_t* result_length);
+
 /**
  This function performs an HTTP request to the server for removing any device (development, product or controller) and [optionally] place the response in *result and *result_length.
 
@@ -458,6 +1073,194 @@ cp_res cloudplugs_get_channel(cp_session cps, const char* channel_mask, const ch
 */
 cp_res cloudplugs_retrieve_data(cp_session cps, const char* channel_mask, const char* query, char** result, size_t* result_length);
 
+/**
+ Same as cloudplugs_retrieve_data(), appending the records with numeric data to a series, ordered by timestamp; the other records are skipped.
+ The response is decoded directly into the series, without building a JSON document.
+
+ @param cps The session reference.
+ @param channel_mask @ref details_CHMASK The channel mask.
+ @param query If not NULL, the same url-encoded string of cloudplugs_retrieve_data().
+ @param s The series, initialized with cloudplugs_series_init().
+ @return CP_OK if the request succeeds, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_retrieve_series(cp_session cps, const char* channel_mask, const char* query, cp_series* s);
+
+/**
+ Initialize an empty series.
+
+ @param s The series.
+*/
+void cloudplugs_series_init(cp_series* s);
+
+/**
+ Remove all the records of a series, keeping its memory.
+
+ @param s The series.
+*/
+void cloudplugs_series_clear(cp_series* s);
+
+/**
+ Release the memory of a series, leaving it empty.
+
+ @param s The series.
+*/
+void cloudplugs_series_free(cp_series* s);
+
+/**
+ Append a record to a series.
+
+ @param s The series.
+ @param at The timestamp.
+ @param value The value.
+ @param id The id of the record, or NULL.
+ @return CP_OK on success, CP_FAIL if out of memory.
+*/
+cp_res cloudplugs_series_append(cp_series* s, cp_time at, double value, const char* id);
+
+/**
+ Append the records with numeric data of a JSON array, as returned by cloudplugs_retrieve_data().
+
+ @param s The series.
+ @param json The JSON text.
+ @param length The length of json.
+ @return CP_OK on success, CP_FAIL if the text is not an array of objects or out of memory.
+*/
+cp_res cloudplugs_series_decode(cp_series* s, const char* json, size_t length);
+
+/**
+ Order the records of a series by timestamp.
+
+ @param s The series.
+ @return CP_OK on success, CP_FAIL if out of memory.
+*/
+cp_res cloudplugs_series_sort(cp_series* s);
+
+/**
+ Get the id of a record.
+
+ @param s The series.
+ @param i The index of the record.
+ @return The id, an empty string if the record has none, NULL if i is out of range; valid until the series is changed.
+*/
+const char* cloudplugs_series_id(const cp_series* s, size_t i);
+
+/**
+ Compute min, max, sum and count of the values of the records from index from to index to (excluded), with SSE2 or AVX instructions when the library is built for them.
+
+ @param s The series.
+ @param from The first record.
+ @param to The record after the last one.
+ @param stats *stats will contain the aggregates.
+*/
+void cloudplugs_series_stats(const cp_series* s, size_t from, size_t to, cp_stats* stats);
+
+/**
+ Compute the aggregates of consecutive time buckets: out[b] is computed on the records with origin + b * bucket <= at < origin + (b + 1) * bucket.
+ The series must be ordered by timestamp.
+
+ @param s The series.
+ @param origin The start of the first bucket.
+ @param bucket The duration of each bucket, in milliseconds.
+ @param out An array of buckets elements.
+ @param buckets The number of buckets.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_series_downsample(const cp_series* s, cp_time origin, cp_time bucket, cp_stats* out, size_t buckets);
+
+/**
+ This function performs an HTTP request to the server for retrieving already published data as cloudplugs_retrieve_data(), for responses of any size.
+ A response body larger than threshold bytes is written to an unlinked temporary file (in $TMPDIR, or the system default) and returned as a read-only mapping of it,
+ so that its pages are backed by the file instead of the swap.
+
+ @param cps The session reference.
+ @param channel_mask @ref details_CHMASK The channel mask.
+ @param query If not NULL, must be a url-encode string as in cloudplugs_retrieve_data().
+ @param threshold The size in bytes above which the response body is spilled to disk, 0 to keep it always in memory.
+ @param response Receives the NUL-terminated response body, the caller is responsible to release it with cloudplugs_response_release().
+ @return CP_OK if the request succeeds, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_retrieve_data_spill(cp_session cps, const char* channel_mask, const char* query, size_t threshold, cp_response* response);
+
+/**
+ Same as cloudplugs_retrieve_data(), writing the response body in a caller buffer instead of allocating it.
+ The request path, url and headers are built on the stack, so that no memory is allocated by the library after the session creation (libcurl may still allocate internally).
+ The body is always NUL-terminated; if it needs more than cap - 1 bytes it is truncated, *len receives its whole length and the function fails with CP_ERR_BUFFER_TOO_SMALL,
+ so that the request can be repeated with a buffer of at least *len + 1 bytes.
+
+ @param cps The session reference.
+ @param channel_mask @ref details_CHMASK The channel mask.
+ @param query If not NULL, must be a url-encode string as in cloudplugs_retrieve_data().
+ @param buf The destination of the response body.
+ @param cap The size of buf in bytes.
+ @param len If not NULL, *len will contain the length of the response body.
+ @return CP_OK if the request succeeds and the body fits buf, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_retrieve_data_buf(cp_session cps, const char* channel_mask, const char* query, char* buf, size_t cap, size_t* len);
+
+/**
+ Same as cloudplugs_publish_data(), writing the response body in a caller buffer as cloudplugs_retrieve_data_buf().
+
+ @param cps The session reference.
+ @param channel If not NULL, the channel, as in cloudplugs_publish_data().
+ @param body The json string of the data to publish.
+ @param buf The destination of the response body.
+ @param cap The size of buf in bytes.
+ @param len If not NULL, *len will contain the length of the response body.
+ @return CP_OK if the request succeeds and the body fits buf, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_publish_data_buf(cp_session cps, const char* channel, const char* body, char* buf, size_t cap, size_t* len);
+
+/**
+ Same as cloudplugs_get_channel(), writing the response body in a caller buffer as cloudplugs_retrieve_data_buf().
+
+ @param cps The session reference.
+ @param channel_mask If not NULL, @ref details_CHMASK The channel mask.
+ @param query If not NULL, must be a url-encode string as in cloudplugs_get_channel().
+ @param buf The destination of the response body.
+ @param cap The size of buf in bytes.
+ @param len If not NULL, *len will contain the length of the response body.
+ @return CP_OK if the request succeeds and the body fits buf, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_get_channel_buf(cp_session cps, const char* channel_mask, const char* query, char* buf, size_t cap, size_t* len);
+
+/**
+ Same as cloudplugs_get_device(), writing the response body in a caller buffer as cloudplugs_retrieve_data_buf().
+
+ @param cps The session reference.
+ @param plugid The plug-id of the device, or NULL for the device of the session.
+ @param buf The destination of the response body.
+ @param cap The size of buf in bytes.
+ @param len If not NULL, *len will contain the length of the response body.
+ @return CP_OK if the request succeeds and the body fits buf, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_get_device_buf(cp_session cps, const char* plugid, char* buf, size_t cap, size_t* len);
+
+/**
+ Same as cloudplugs_set_device(), writing the response body in a caller buffer as cloudplugs_retrieve_data_buf().
+
+ @param cps The session reference.
+ @param plugid The plug-id of the device, or NULL for the device of the session.
+ @param value The json string of the device fields to set.
+ @param buf The destination of the response body.
+ @param cap The size of buf in bytes.
+ @param len If not NULL, *len will contain the length of the response body.
+ @return CP_OK if the request succeeds and the body fits buf, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_set_device_buf(cp_session cps, const char* plugid, const char* value, char* buf, size_t cap, size_t* len);
+
+/**
+ Same as cloudplugs_get_device_prop(), writing the response body in a caller buffer as cloudplugs_retrieve_data_buf().
+
+ @param cps The session reference.
+ @param plugid The plug-id of the device, or NULL for the device of the session.
+ @param prop The property name, or NULL for all the properties.
+ @param buf The destination of the response body.
+ @param cap The size of buf in bytes.
+ @param len If not NULL, *len will contain the length of the response body.
+ @return CP_OK if the request succeeds and the body fits buf, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_get_device_prop_buf(cp_session cps, const char* plugid, const char* prop, char* buf, size_t cap, size_t* len);
+
 /**
  This function performs an HTTP request to the server for publishing data and [optionally] place the response in *result and *result_length.
 
@@ -480,6 +1283,60 @@ cp_res cloudplugs_retrieve_data(cp_session cps, const char* channel_mask, const
 */
 cp_res cloudplugs_publish_data(cp_session cps, const char* channel, const char* body, char** result, size_t* result_length);
 
+/**
+ Same as cloudplugs_publish_data(), with a body of known length that is not copied.
+*/
+cp_res cloudplugs_publish_data_body(cp_session cps, const char* channel, const cp_body* body, char** result, size_t* result_length);
+
+/**
+ This function performs an HTTP request to the server for publishing a large amount of data and [optionally] place the response in *result and *result_length.
+ The body is streamed with chunked transfer encoding while it is read, so the memory used is constant whatever is the size of the payload;
+ pages of a mapped file are dropped as soon as they are sent.
+
+ @param cps The session reference.
+ @param channel An optional @ref details_CHANNEL , if NULL data need to contain a couple "channel":"channel"
+ @param body The source of a json array of objects as in cloudplugs_publish_data(), usually from cloudplugs_body_fd(), cloudplugs_body_mmap() or cloudplugs_body_callback().
+ @param result If not NULL, then *result will contain the dynamically allocated json string of the retrieved response body. The caller is responsible to free memory in *result.
+ @param result_length The length of the string stored in *result.
+ @return CP_OK if the request succeeds, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_publish_data_stream(cp_session cps, const char* channel, const cp_body* body, char** result, size_t* result_length);
+
+/**
+ Exchange the data records as CBOR instead of json: cloudplugs_publish_data() (with a body in memory) sends CBOR,
+ and cloudplugs_retrieve_data() accepts it; their results are always json. The integers of the json body are encoded exactly,
+ up to 64 bits, the other numbers as the shortest float keeping their value.
+ When the server answers 415 Unsupported Media Type or 406 Not Acceptable the request is repeated as json and CBOR is disabled
+ for the next requests of the session too: cloudplugs_has_cbor() tells when it happened, and calling cloudplugs_set_cbor(cps, CP_TRUE)
+ again enables it, e.g. periodically or after the server is upgraded.
+ basic_example/mock_server.py is a local server accepting both formats, or refusing CBOR with --json-only.
+
+ @param cps The session reference.
+ @param enabled CP_TRUE to prefer CBOR, CP_FALSE (the default) for json only.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_set_cbor(cp_session cps, cp_bool enabled);
+
+/**
+ @param cps The session reference.
+ @return CP_TRUE if the session prefers CBOR, i.e. it was enabled and the server did not refuse it since, see cloudplugs_set_cbor().
+*/
+cp_bool cloudplugs_has_cbor(cp_session cps);
+
+/**
+ Same as cloudplugs_publish_data(), with a body already encoded as CBOR, e.g. by a writer switched with cloudplugs_json_writer_cbor().
+ If the server refuses CBOR the body is converted and sent as json.
+
+ @param cps The session reference.
+ @param channel The channel, or NULL if the channels are in the body.
+ @param cbor The body.
+ @param length The number of bytes in cbor.
+ @param result If not NULL, then *result will contain the dynamically allocated json string of the retrieved response body. The caller is responsible to free memory in *result.
+ @param result_length The length of the string stored in *result.
+ @return CP_OK if the request succeeds, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_publish_data_cbor(cp_session cps, const char* channel, const char* cbor, size_t length, char** result, size_t* result_length);
+
 /**
  This function performs an HTTP request to the server for deleting already published data and [optionally] place the response in *result and *result_length.
 
@@ -499,6 +1356,11 @@ cp_res cloudplugs_publish_data(cp_session cps, const char* channel, const char*
 */
 cp_res cloudplugs_remove_data(cp_session cps, const char* channel_mask, const char* body, char** result, size_t* result_length);
 
+/**
+ Same as cloudplugs_remove_data(), with a body of known length that is not copied.
+*/
+cp_res cloudplugs_remove_data_body(cp_session cps, const char* channel_mask, const cp_body* body, char** result, size_t* result_length);
+
 /**
  This function performs an HTTP request to the server for writing or deleting device location and [optionally] place the response in *result and *result_length.
 
@@ -523,6 +1385,532 @@ cp_res cloudplugs_set_device_location(cp_session cps, const char* plugid, double
 */
 cp_res cloudplugs_get_device_location(cp_session cps, const char* plugid, char** result, size_t* result_length);
 
+/**
+ Prepare a request for publishing data on a channel, to be executed many times with cloudplugs_prepared_exec().
+ The encoded url, the method and the headers (including the current session credentials) are computed once.
+
+ @param cps The session reference.
+ @param channel An optional @ref details_CHANNEL , if NULL data need to contain a couple "channel":"channel"
+ @return The prepared request, NULL if occurred an error.
+*/
+cp_prepared cloudplugs_prepare_publish(cp_session cps, const char* channel);
+
+/**
+ Prepare a request for writing a device property, to be executed many times with cloudplugs_prepared_exec().
+ The encoded url, the method and the headers (including the current session credentials) are computed once.
+
+ @param cps The session reference.
+ @param plugid If NULL, then is the @ref details_PLUG_ID in the session.
+ @param prop If NULL, then the body must be an object; otherwise the single property value is written.
+ @return The prepared request, NULL if occurred an error.
+*/
+cp_prepared cloudplugs_prepare_prop(cp_session cps, const char* plugid, const char* prop);
+
+/**
+ Execute a prepared request with the given body.
+
+ @param cps The session reference used to prepare the request.
+ @param prep The prepared request.
+ @param body A json value sent as request body.
+ @param result If not NULL, then *result will contain the dynamically allocated json string of the retrieved response body. The caller is responsible to free memory in *result.
+ @param result_length The length of the string stored in *result.
+ @return CP_OK if the request succeeds, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_prepared_exec(cp_session cps, cp_prepared prep, const char* body, char** result, size_t* result_length);
+
+/**
+ Same as cloudplugs_prepared_exec(), with a body of known length that is not copied.
+*/
+cp_res cloudplugs_prepared_exec_body(cp_session cps, cp_prepared prep, const cp_body* body, char** result, size_t* result_length);
+
+/**
+ Release a prepared request.
+
+ @param prep The prepared request.
+ @return CP_OK if the request is correctly released, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_prepared_destroy(cp_prepared prep);
+
+/**
+ A reducer computes the data of a window: add() folds a sample into a state, merge() folds a state into another,
+ final() writes the resulting JSON value as snprintf() does, returning its length.
+*/
+struct _cp_reducer {
+   size_t state_size;	/**< size of the state */
+   void (*init)(void* state);	/**< make an empty state */
+   void (*add)(void* state, cp_time at, double value);	/**< add a sample */
+   void (*merge)(void* state, const void* other);	/**< add all the samples of other */
+   int (*final)(const void* state, char* buf, size_t size);	/**< write the JSON data of the window */
+};
+typedef struct _cp_reducer cp_reducer;
+
+/**
+ Reducer publishing {"min":Number,"max":Number,"avg":Number,"count":Number}; NaN samples are not counted, and a value that is not finite is published as null.
+*/
+extern const cp_reducer cloudplugs_reducer_stats;
+
+/**
+ Create an aggregation stage: samples pushed by any number of threads are reduced by time windows,
+ and cloudplugs_aggregator_poll() publishes one record per closed window.
+
+ @param cps The session reference, used to publish.
+ @param capacity How many samples can wait between two polls; rounded up to a power of two.
+ @param lateness How many milliseconds a window waits after its end for late samples.
+ @return The aggregator, NULL on error. It must be released with cloudplugs_aggregator_destroy().
+*/
+cp_aggregator cloudplugs_aggregator_create(cp_session cps, size_t capacity, cp_time lateness);
+
+/**
+ Release an aggregator, discarding the windows not yet published.
+
+ @param agg The aggregator reference.
+ @return CP_OK if the aggregator is released, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_aggregator_destroy(cp_aggregator agg);
+
+/**
+ Add a channel to aggregate; it must be called before pushing samples.
+ Windows are aligned to multiples of slide since the Epoch: with slide equal to window they are tumbling, otherwise sliding.
+ Each published record has as "at" the start of its window.
+
+ @param agg The aggregator reference.
+ @param channel The @ref details_CHANNEL to publish to.
+ @param window The duration of a window in milliseconds.
+ @param slide The distance between the start of two windows, a divisor of window; 0 for tumbling windows.
+ @param reducer How the samples of a window are reduced, e.g. &cloudplugs_reducer_stats.
+ @return The index of the channel, to be given to cloudplugs_aggregator_push(), or -1 on error.
+*/
+int cloudplugs_aggregator_add_channel(cp_aggregator agg, const char* channel, cp_time window, cp_time slide, const cp_reducer* reducer);
+
+/**
+ Add a sample; it never blocks and can be called by many threads at once.
+
+ @param agg The aggregator reference.
+ @param channel The index of the channel.
+ @param at The timestamp of the sample.
+ @param value The value of the sample.
+ @return CP_OK on success, CP_FAIL if the sample is dropped because the aggregator is full.
+*/
+cp_res cloudplugs_aggregator_push(cp_aggregator agg, int channel, cp_time at, double value);
+
+/**
+ Reduce the pushed samples and publish, in a single request, the windows ended before now minus the lateness.
+ If the request fails, its records are kept and published again with the ones of the next poll.
+ It must be called by a single thread.
+
+ @param agg The aggregator reference.
+ @param now The current time.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_aggregator_poll(cp_aggregator agg, cp_time now);
+
+/**
+ Publish all the windows with samples, also the ones not yet ended.
+
+ @param agg The aggregator reference.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_aggregator_flush(cp_aggregator agg);
+
+/**
+ Get the number of samples dropped, because the aggregator was full or they arrived after their windows were published.
+
+ @param agg The aggregator reference.
+ @return The number of samples dropped.
+*/
+size_t cloudplugs_aggregator_dropped(cp_aggregator agg);
+
+/**
+ Create a filter publishing a value only if it differs enough from the last one published in the same channel.
+ A number is published if it moves more than abs or more than rel times the last value (any change if both are 0);
+ a string if it is different; any value if heartbeat milliseconds are passed since the last publish, measured on the local monotonic clock.
+
+ @param cps The session reference, used to publish.
+ @param abs The absolute deadband, 0 to disable it.
+ @param rel The relative deadband, e.g. 0.01 for 1%, 0 to disable it.
+ @param heartbeat The longest interval between two publishes in a channel, 0 to disable it.
+ @return The filter, NULL on error. It must be released with cloudplugs_deadband_destroy().
+*/
+cp_deadband cloudplugs_deadband_create(cp_session cps, double abs, double rel, cp_time heartbeat);
+
+/**
+ Release a filter.
+
+ @param db The filter reference.
+ @return CP_OK if the filter is released, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_deadband_destroy(cp_deadband db);
+
+/**
+ Use different deadbands for a channel.
+
+ @param db The filter reference.
+ @param channel The @ref details_CHANNEL.
+ @param abs The absolute deadband, 0 to disable it.
+ @param rel The relative deadband, 0 to disable it.
+ @param heartbeat The longest interval between two publishes, 0 to disable it.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_deadband_set_channel(cp_deadband db, const char* channel, double abs, double rel, cp_time heartbeat);
+
+/**
+ Publish {"data":value,"at":at} in a channel, unless value is inside the deadband of the last value published.
+
+ @param db The filter reference.
+ @param channel The @ref details_CHANNEL.
+ @param value The value, a finite number.
+ @param at The @ref details_TIMESTAMP of the value; if 0, then it is not published and the server sets it.
+ @param result If not NULL and the value is published, then *result will contain the dynamically allocated json string of the retrieved response body. The caller is responsible to free memory in *result.
+ @param result_length The length of the string stored in *result.
+ @param published If not NULL, then *published will be CP_TRUE if the value was published, CP_FALSE if it was suppressed.
+ @return CP_OK if the value is published or suppressed, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_publish_number_deadband(cp_deadband db, const char* channel, double value, cp_time at, char** result, size_t* result_length, cp_bool* published);
+
+/**
+ Same as cloudplugs_publish_number_deadband() for a string value, published only if it differs from the last one.
+*/
+cp_res cloudplugs_publish_string_deadband(cp_deadband db, const char* channel, const char* value, cp_time at, char** result, size_t* result_length, cp_bool* published);
+
+/**
+ Open a checkpoint store, keeping for each channel mask the timestamp and the ids of the last records processed.
+ The store is saved in a new file renamed over the old one, so after a crash it holds either the old or the new positions.
+
+ @param cps The session reference, used only to report errors.
+ @param filename The file of the store; it is created at the first save if it does not exist.
+ @return The store, NULL on error. It must be released with cloudplugs_checkpoint_close().
+*/
+cp_checkpoint cloudplugs_checkpoint_open(cp_session cps, const char* filename);
+
+/**
+ Change how often the store is saved: after max_updates calls to cloudplugs_checkpoint_set(), or at the first call after max_delay milliseconds since the last save.
+
+ @param cp The store reference.
+ @param max_updates Number of updates saved together, 0 or 1 to save at each update.
+ @param max_delay Maximum milliseconds between saves.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_checkpoint_set_sync(cp_checkpoint cp, int max_updates, int max_delay);
+
+/**
+ Get the timestamp of the last record processed for a channel mask, to be used as the after parameter of the next retrieval.
+
+ @param cp The store reference.
+ @param channel_mask The @ref details_CHMASK.
+ @param at *at will contain the timestamp.
+ @return CP_OK if the channel mask has a checkpoint, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_checkpoint_get(cp_checkpoint cp, const char* channel_mask, cp_time* at);
+
+/**
+ Set the window before each checkpoint where records can still arrive late or on a later page, as the overlap of a watch.
+ Inside the window a record counts as processed only if its id was recorded, so the ids are kept for the whole window.
+
+ @param cp The store reference.
+ @param window The width of the window in milliseconds, 0 by default to check by id only the records with the timestamp of the checkpoint.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_checkpoint_set_window(cp_checkpoint cp, cp_time window);
+
+/**
+ Tell whether a record was already processed: since it is older than the window before the checkpoint, or it is inside the window and its id was recorded.
+ A record without id inside the window is never reported as processed.
+
+ @param cp The store reference.
+ @param channel_mask The @ref details_CHMASK.
+ @param at The timestamp of the record.
+ @param id The id of the record, or NULL.
+ @return CP_TRUE if the record was already processed, CP_FALSE otherwise.
+*/
+cp_bool cloudplugs_checkpoint_has(cp_checkpoint cp, const char* channel_mask, cp_time at, const char* id);
+
+/**
+ Record a processed record, moving the checkpoint of the channel mask forward; records older than the window are ignored.
+
+ @param cp The store reference.
+ @param channel_mask The @ref details_CHMASK.
+ @param at The timestamp of the record.
+ @param id The id of the record, or NULL.
+ @return CP_OK on success, CP_FAIL if the store could not be saved.
+*/
+cp_res cloudplugs_checkpoint_set(cp_checkpoint cp, const char* channel_mask, cp_time at, const char* id);
+
+/**
+ Save the pending updates and sync them to disk.
+
+ @param cp The store reference.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_checkpoint_flush(cp_checkpoint cp);
+
+/**
+ Save the pending updates and release the store.
+
+ @param cp The store reference.
+ @return CP_OK on success, CP_FAIL if the last save failed.
+*/
+cp_res cloudplugs_checkpoint_close(cp_checkpoint cp);
+
+/**
+ Called once for each write given to a combiner, when the request carrying it ends.
+
+ @param cps The session reference.
+ @param plugid The @ref details_PLUG_ID of the device written.
+ @param prop The property written.
+ @param res CP_OK if the merged write succeeded, CP_FAIL otherwise.
+ @param http_res The http result of the merged write, 0 if it could not be sent.
+ @param userdata The pointer given with the write.
+*/
+typedef void (*cp_combiner_callback)(cp_session cps, const char* plugid, const char* prop, cp_res res, CP_HTTP_RESULT http_res, void* userdata);
+
+/**
+ Create a buffer merging the property writes of each device arriving within a window into a single request.
+ The writes of a device are sent together as {"props":{...}} to its @ref details_PLUG_ID, the last write of a property winning.
+
+ @param cps The session reference, used to send the writes.
+ @param window The milliseconds a device waits, since its first buffered write, before being sent.
+ @return The combiner, NULL on error. It must be released with cloudplugs_combiner_destroy().
+*/
+cp_combiner cloudplugs_combiner_create(cp_session cps, cp_time window);
+
+/**
+ Send the buffered writes and release a combiner.
+
+ @param comb The combiner reference.
+ @return CP_OK if all the writes succeeded, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_combiner_destroy(cp_combiner comb);
+
+/**
+ Buffer a property write, as cloudplugs_set_device_prop() does without a combiner.
+
+ @param comb The combiner reference.
+ @param plugid If not NULL, then the @ref details_PLUG_ID of the device, otherwise the device referenced in the session.
+ @param prop The property to write.
+ @param value A json value, null to delete the property.
+ @param now The current time, starting the window of the device at its first write.
+ @param cb If not NULL, then called when the write is sent.
+ @param userdata Pointer given to cb.
+ @return CP_OK if the write is buffered, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_combiner_set_prop(cp_combiner comb, const char* plugid, const char* prop, const char* value, cp_time now, cp_combiner_callback cb, void* userdata);
+
+/**
+ Buffer a location write, as cloudplugs_set_device_location() does without a combiner.
+
+ @param comb The combiner reference.
+ @param plugid If not NULL, then the @ref details_PLUG_ID of the device, otherwise the device referenced in the session.
+ @param longitude
+ @param latitude
+ @param altitude //optional
+ @param accuracy //optional
+ @param timestamp //optional
+ @param now The current time, starting the window of the device at its first write.
+ @param cb If not NULL, then called when the write is sent.
+ @param userdata Pointer given to cb.
+ @return CP_OK if the write is buffered, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_combiner_set_location(cp_combiner comb, const char* plugid, double longitude, double latitude, double altitude, double accuracy, double timestamp, cp_time now, cp_combiner_callback cb, void* userdata);
+
+/**
+ Send, one request for each device, the writes of the devices whose window ended at now.
+
+ @param comb The combiner reference.
+ @param now The current time.
+ @return CP_OK if all the writes sent succeeded, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_combiner_poll(cp_combiner comb, cp_time now);
+
+/**
+ Send all the buffered writes.
+
+ @param comb The combiner reference.
+ @return CP_OK if all the writes succeeded, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_combiner_flush(cp_combiner comb);
+
+/**
+ Create a location tracker: the fixes added are buffered, and when the buffer is full (or interval milliseconds of fixes are buffered)
+ the track is simplified with the Douglas-Peucker algorithm, keeping the fixes which deviate more than tolerance meters from it.
+ The retained fixes are published in one request as records {"channel":channel,"data":{"x":...,"y":...},"at":...},
+ and the latest one is written in the location property of the device.
+
+ @param cps The session reference, used to publish.
+ @param plugid If not NULL, then the @ref details_PLUG_ID of the device whose location is written, otherwise the device referenced in the session.
+ @param channel The channel of the track records.
+ @param tolerance The largest distance in meters of a dropped fix from the simplified track, 0 to drop only the aligned fixes.
+ @param capacity How many fixes are buffered, at least 3.
+ @param interval The longest time span of the buffered fixes, 0 to disable it.
+ @return The tracker, NULL on error. It must be released with cloudplugs_tracker_destroy().
+*/
+cp_tracker cloudplugs_tracker_create(cp_session cps, const char* plugid, const char* channel, double tolerance, size_t capacity, cp_time interval);
+
+/**
+ Release a tracker, discarding the fixes not yet published.
+
+ @param trk The tracker reference.
+ @return CP_OK if the tracker is released, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_tracker_destroy(cp_tracker trk);
+
+/**
+ Add a fix to the track, publishing the buffered fixes if it fills the buffer.
+ If publishing fails the simplified fixes stay buffered, and are published with the next ones without being simplified again.
+
+ @param trk The tracker reference.
+ @param longitude
+ @param latitude
+ @param altitude Negative to omit it.
+ @param accuracy Negative to omit it.
+ @param at The time of the fix, not lower than the one of the previous fix.
+ @return CP_OK on success, CP_FAIL if the fix is invalid or cannot be buffered, or if the publish it started failed, as in cloudplugs_tracker_flush().
+*/
+cp_res cloudplugs_tracker_add(cp_tracker trk, double longitude, double latitude, double altitude, double accuracy, cp_time at);
+
+/**
+ Publish the buffered fixes, e.g. at the end of a trip.
+
+ @param trk The tracker reference.
+ @return CP_OK if the fixes are published or there is nothing to publish, CP_FAIL otherwise.
+ When only the location property cannot be written the call succeeds, cloudplugs_get_last_err_code() reports the error and the property is written again by the next publish.
+*/
+cp_res cloudplugs_tracker_flush(cp_tracker trk);
+
+/**
+ Get the counters of a tracker, to measure the simplification.
+
+ @param trk The tracker reference.
+ @param fixes If not NULL, *fixes will contain the number of fixes added.
+ @param records If not NULL, *records will contain the number of fixes published.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_tracker_counters(cp_tracker trk, size_t* fixes, size_t* records);
+
+/**
+ Socket events the event loop is asked to watch, given to the cp_socket_callback
+*/
+enum _CP_POLL { CP_POLL_NONE = 0, CP_POLL_IN = 1, CP_POLL_OUT = 2, CP_POLL_INOUT = 3, CP_POLL_REMOVE = 4 };
+
+/**
+ Socket events that occurred, given to cloudplugs_socket_action()
+*/
+enum _CP_EVENT { CP_EVENT_IN = 1, CP_EVENT_OUT = 2, CP_EVENT_ERR = 4 };
+
+#define CP_SOCKET_TIMEOUT -1 /**<The fd given to cloudplugs_socket_action() when the timer expires */
+
+/**
+ Called when the session needs a socket watched by the event loop, or no longer watched.
+ It must not call cloudplugs_socket_action().
+
+ @param cps The session reference.
+ @param fd The socket.
+ @param what CP_POLL_IN, CP_POLL_OUT or CP_POLL_INOUT to watch the socket for those events, CP_POLL_NONE to keep it without watching any event, CP_POLL_REMOVE to stop watching it.
+ @param userdata The pointer given to cloudplugs_set_event_callbacks().
+ @return 0 on success, -1 on error.
+*/
+typedef int (*cp_socket_callback)(cp_session cps, int fd, int what, void* userdata);
+
+/**
+ Called when the session needs the timer of the event loop changed; when the timer expires cloudplugs_socket_action() must be called with CP_SOCKET_TIMEOUT.
+ It must not call cloudplugs_socket_action().
+
+ @param cps The session reference.
+ @param timeout_ms The milliseconds after which the timer expires, 0 to expire as soon as possible, -1 to stop it.
+ @param userdata The pointer given to cloudplugs_set_event_callbacks().
+ @return 0 on success, -1 on error.
+*/
+typedef int (*cp_timer_callback)(cp_session cps, long timeout_ms, void* userdata);
+
+/**
+ Called when an asynchronous request ends.
+
+ @param cps The session reference.
+ @param res CP_OK if the request succeeded, CP_FAIL otherwise.
+ @param http_res The http result, 0 if no response was received.
+ @param result The dynamically allocated response body, or the error message when no response was received; NULL if the request was cancelled. The callback is responsible to free memory in result.
+ @param result_length The length of the string in result.
+ @param userdata The pointer given with the request.
+*/
+typedef void (*cp_async_callback)(cp_session cps, cp_res res, CP_HTTP_RESULT http_res, char* result, size_t result_length, void* userdata);
+
+/**
+ Run the asynchronous requests of a session inside an external event loop, e.g. epoll, libuv or libevent, without blocking and without threads.
+ The session asks the loop to watch its sockets and to set its timer; the loop calls cloudplugs_socket_action() when they are ready.
+ The synchronous requests of the session are not affected.
+
+ @param cps The session reference.
+ @param socket_cb Called to watch a socket or to stop watching it.
+ @param timer_cb Called to change the timer.
+ @param userdata Passed as it is to socket_cb and timer_cb.
+ @return CP_OK on success, CP_FAIL if some asynchronous request is pending or on error.
+*/
+cp_res cloudplugs_set_event_callbacks(cp_session cps, cp_socket_callback socket_cb, cp_timer_callback timer_cb, void* userdata);
+
+/**
+ Make progress on the asynchronous requests after an event of the loop, calling the callbacks of the completed ones.
+
+ @param cps The session reference.
+ @param fd The socket ready, or CP_SOCKET_TIMEOUT when the timer expired.
+ @param events The CP_EVENT_IN, CP_EVENT_OUT and CP_EVENT_ERR flags of the events occurred on fd, 0 if unknown.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_socket_action(cp_session cps, int fd, int events);
+
+/**
+ Get the number of asynchronous requests not yet completed.
+
+ @param cps The session reference.
+ @return The number of pending requests, -1 on error.
+*/
+int cloudplugs_async_pending(cp_session cps);
+
+/**
+ Same as cloudplugs_publish_data(), without waiting: the response is given to cb.
+
+ @param cps The session reference, with event callbacks.
+ @param channel If not NULL, then the @ref details_CHANNEL to publish to, otherwise it must be in the body.
+ @param body The data to publish, it is copied.
+ @param cb Called when the request ends.
+ @param userdata Passed as it is to cb.
+ @return CP_OK if the request is started, CP_FAIL otherwise; cb is called only if the request is started.
+*/
+cp_res cloudplugs_publish_data_async(cp_session cps, const char* channel, const char* body, cp_async_callback cb, void* userdata);
+
+/**
+ Same as cloudplugs_publish_data_async(), with a body that is not copied: it must stay valid until cb is called.
+*/
+cp_res cloudplugs_publish_data_async_body(cp_session cps, const char* channel, const cp_body* body, cp_async_callback cb, void* userdata);
+
+/**
+ Same as cloudplugs_retrieve_data(), without waiting: the response is given to cb.
+
+ @param cps The session reference, with event callbacks.
+ @param channel_mask The @ref details_CHMASK.
+ @param query If not NULL, then the query string as in cloudplugs_retrieve_data().
+ @param cb Called when the request ends.
+ @param userdata Passed as it is to cb.
+ @return CP_OK if the request is started, CP_FAIL otherwise; cb is called only if the request is started.
+*/
+cp_res cloudplugs_retrieve_data_async(cp_session cps, const char* channel_mask, const char* query, cp_async_callback cb, void* userdata);
+
+/**
+ Same as cloudplugs_set_device_prop(), without waiting: the response is given to cb.
+
+ @param cps The session reference, with event callbacks.
+ @param plugid If not NULL, then the @ref details_PLUG_ID of the device, otherwise the device referenced in the session.
+ @param prop If NULL, then value must be an object; otherwise the single property value is written.
+ @param value A json value, it is copied.
+ @param cb Called when the request ends.
+ @param userdata Passed as it is to cb.
+ @return CP_OK if the request is started, CP_FAIL otherwise; cb is called only if the request is started.
+*/
+cp_res cloudplugs_set_device_prop_async(cp_session cps, const char* plugid, const char* prop, const char* value, cp_async_callback cb, void* userdata);
+
+/**
+ Same as cloudplugs_set_device_prop_async(), with a value that is not copied: it must stay valid until cb is called.
+*/
+cp_res cloudplugs_set_device_prop_async_body(cp_session cps, const char* plugid, const char* prop, const cp_body* value, cp_async_callback cb, void* userdata);
+
 #ifdef  __cplusplus
 }
 #endif
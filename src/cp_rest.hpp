@@ -0,0 +1,242 @@
+/*
+Copyright 2014 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+
+/*
+ C++ bindings of cp_rest.h: move-only owners of the library handles and buffers, viewed without copies.
+
+ cp::Session s;
+ if(!s.set_auth(id, pass)) return;
+ cp::Result r = s.retrieve("temperature", "limit=10");
+ if(r) consume(r.view());
+*/
+
+#ifndef CP_REST_HPP
+#define CP_REST_HPP
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
+#if __has_include(<span>)
+#include <span>
+#endif
+#include "cp_rest.h"
+#if __has_include("cp_rest_json.h") && __has_include(<jansson.h>)
+#include "cp_rest_json.h"
+#define CP_REST_HPP_JSON 1
+#endif
+
+namespace cp {
+
+namespace detail {
+
+struct Free {
+    void operator()(char* p) const noexcept { cloudplugs_free(p); }
+};
+
+/* a NUL-terminated copy of a view, NULL when empty for the optional parameters */
+class CString {
+public:
+    explicit CString(std::string_view s) : s_(s), empty_(s.empty()) {}
+    const char* get() const noexcept { return s_.c_str(); }
+    const char* or_null() const noexcept { return empty_ ? nullptr : s_.c_str(); }
+
+private:
+    std::string s_;
+    bool empty_;
+};
+
+} // namespace detail
+
+#ifdef CP_REST_HPP_JSON
+/**
+ Owner of a reference to a json value, released on destruction.
+*/
+class Json {
+public:
+    Json() noexcept = default;
+    explicit Json(json_t* json) noexcept : json_(json) {}
+    Json(Json&& other) noexcept : json_(std::exchange(other.json_, nullptr)) {}
+    Json& operator=(Json&& other) noexcept {
+        if(this != &other) {
+            if(json_) json_decref(json_);
+            json_ = std::exchange(other.json_, nullptr);
+        }
+        return *this;
+    }
+    Json(const Json&) = delete;
+    Json& operator=(const Json&) = delete;
+    ~Json() {
+        if(json_) json_decref(json_);
+    }
+
+    json_t* get() const noexcept { return json_; }
+    json_t* release() noexcept { return std::exchange(json_, nullptr); }
+    explicit operator bool() const noexcept { return json_ != nullptr; }
+
+private:
+    json_t* json_ = nullptr;
+};
+#endif
+
+/**
+ Outcome of a request, owning the response body allocated by the library.
+ On failure the body, if any, is the response of the server or the transfer error message.
+*/
+class [[nodiscard]] Result {
+public:
+    Result() noexcept = default;
+    Result(cp_res res, CP_HTTP_RESULT http, CP_ERR_CODE err, char* body, size_t length) noexcept
+        : res_(res), http_(http), err_(err), body_(body), length_(body ? length : 0) {}
+    Result(Result&& other) noexcept
+        : res_(std::exchange(other.res_, CP_FAIL)), http_(std::exchange(other.http_, CP_HTTP_RESULT())), err_(std::exchange(other.err_, CP_ERR_CODE())),
+          body_(std::move(other.body_)), length_(std::exchange(other.length_, 0)) {}
+    Result& operator=(Result&& other) noexcept {
+        if(this != &other) {
+            res_ = std::exchange(other.res_, CP_FAIL);
+            http_ = std::exchange(other.http_, CP_HTTP_RESULT());
+            err_ = std::exchange(other.err_, CP_ERR_CODE());
+            body_ = std::move(other.body_);
+            length_ = std::exchange(other.length_, 0);
+        }
+        return *this;
+    }
+    Result(const Result&) = delete;
+    Result& operator=(const Result&) = delete;
+
+    bool ok() const noexcept { return res_ == CP_OK; }
+    explicit operator bool() const noexcept { return ok(); }
+    cp_res res() const noexcept { return res_; }
+    CP_HTTP_RESULT http() const noexcept { return http_; }
+    CP_ERR_CODE err() const noexcept { return err_; }
+
+    const char* data() const noexcept { return body_.get(); }
+    size_t size() const noexcept { return length_; }
+    std::string_view view() const noexcept { return body_ ? std::string_view(body_.get(), length_) : std::string_view(); }
+#ifdef __cpp_lib_span
+    std::span<const std::byte> bytes() const noexcept { return std::span<const std::byte>(reinterpret_cast<const std::byte*>(body_.get()), length_); }
+#endif
+#ifdef CP_REST_HPP_JSON
+    /** Parse the body */
+    Json json() const noexcept {
+        json_error_t error;
+        return Json(body_ ? json_loadb(body_.get(), length_, 0, &error) : nullptr);
+    }
+#endif
+
+    /** Give up the body, to be released with cloudplugs_free() */
+    char* release() noexcept {
+        length_ = 0;
+        return body_.release();
+    }
+
+private:
+    cp_res res_ = CP_FAIL;
+    CP_HTTP_RESULT http_ = CP_HTTP_RESULT();
+    CP_ERR_CODE err_ = CP_ERR_CODE();
+    std::unique_ptr<char, detail::Free> body_;
+    size_t length_ = 0;
+};
+
+/**
+ Owner of a session, released on destruction. An empty plugid stands for the device of the session.
+*/
+class Session {
+public:
+    Session() : cps_(cloudplugs_create_session()) {
+        if(!cps_) throw std::bad_alloc();
+    }
+    explicit Session(cp_session cps) noexcept : cps_(cps) {}
+    Session(Session&& other) noexcept : cps_(std::exchange(other.cps_, nullptr)) {}
+    Session& operator=(Session&& other) noexcept {
+        if(this != &other) {
+            if(cps_) cloudplugs_destroy_session(cps_);
+            cps_ = std::exchange(other.cps_, nullptr);
+        }
+        return *this;
+    }
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+    ~Session() {
+        if(cps_) cloudplugs_destroy_session(cps_);
+    }
+
+    cp_session get() const noexcept { return cps_; }
+    cp_session release() noexcept { return std::exchange(cps_, nullptr); }
+    explicit operator bool() const noexcept { return cps_ != nullptr; }
+
+    [[nodiscard]] Result set_base_url(std::string_view url) {
+        return local(cloudplugs_set_base_url(cps_, detail::CString(url).get()));
+    }
+    [[nodiscard]] Result set_auth(std::string_view id, std::string_view pass, bool is_master = false) {
+        return local(cloudplugs_set_auth(cps_, detail::CString(id).get(), detail::CString(pass).get(), is_master ? CP_TRUE : CP_FALSE));
+    }
+
+    /** Publish payload, sent without being copied; an empty channel must be in the payload */
+    [[nodiscard]] Result publish(std::string_view channel, std::string_view payload) {
+        cp_body body;
+        cloudplugs_body_buffer(&body, payload.data(), payload.size());
+        char* result = nullptr;
+        size_t length = 0;
+        cp_res res = cloudplugs_publish_data_body(cps_, detail::CString(channel).or_null(), &body, &result, &length);
+        return done(res, result, length);
+    }
+    [[nodiscard]] Result retrieve(std::string_view channel_mask, std::string_view query = {}) {
+        char* result = nullptr;
+        size_t length = 0;
+        cp_res res = cloudplugs_retrieve_data(cps_, detail::CString(channel_mask).get(), detail::CString(query).or_null(), &result, &length);
+        return done(res, result, length);
+    }
+    [[nodiscard]] Result get_device(std::string_view plugid = {}) {
+        char* result = nullptr;
+        size_t length = 0;
+        cp_res res = cloudplugs_get_device(cps_, detail::CString(plugid).or_null(), &result, &length);
+        return done(res, result, length);
+    }
+    [[nodiscard]] Result get_device_prop(std::string_view plugid, std::string_view prop) {
+        char* result = nullptr;
+        size_t length = 0;
+        cp_res res = cloudplugs_get_device_prop(cps_, detail::CString(plugid).or_null(), detail::CString(prop).or_null(), &result, &length);
+        return done(res, result, length);
+    }
+    /** Write a device property, value is sent without being copied */
+    [[nodiscard]] Result set_device_prop(std::string_view plugid, std::string_view prop, std::string_view value) {
+        cp_body body;
+        cloudplugs_body_buffer(&body, value.data(), value.size());
+        return done(cloudplugs_set_device_prop_body(cps_, detail::CString(plugid).or_null(), detail::CString(prop).or_null(), &body));
+    }
+
+private:
+    Result local(cp_res res) const noexcept {
+        return Result(res, CP_HTTP_RESULT(), res == CP_OK ? CP_ERR_CODE() : cloudplugs_get_last_err_code(cps_), nullptr, 0);
+    }
+    Result done(cp_res res, char* result = nullptr, size_t length = 0) const noexcept {
+        return Result(res, cloudplugs_get_last_http_result(cps_), res == CP_OK ? CP_ERR_CODE() : cloudplugs_get_last_err_code(cps_), result, length);
+    }
+
+    cp_session cps_;
+};
+
+} // namespace cp
+
+#endif // CP_REST_HPP
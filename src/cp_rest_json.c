@@ -26,42 +26,66 @@ under the License.
 #include <string.h>
 #include <curl/curl.h>
 
+/* append s to the query of length *length, failing if it does not fit CP_MAX_URL_LENGTH */
+static cp_bool query_append(char* query, size_t* length, const char* s) {
+    size_t n = strlen(s);
+    if(*length + n >= CP_MAX_URL_LENGTH) return CP_FALSE;
+    memcpy(query + *length, s, n + 1);
+    *length += n;
+    return CP_TRUE;
+}
+
 static char* get_http_query(cp_session cps, json_t* data) {
     CURL* curl = cps->curl;
-    char* result = (char*) malloc(CP_MAX_URL_LENGTH* sizeof(char));
-    if(!result) {
-        cps->err = CP_ERR_OUT_OF_MEMORY;
-        return NULL;
-    }
-    strcpy(result, "");
     if(!json_is_object(data)) {
         cps->err = CP_ERR_QUERY_IS_NOT_AN_OBJECT;
         return NULL;
     }
+    char* result = (char*) cloudplugs_malloc(CP_MAX_URL_LENGTH* sizeof(char));
+    if(!result) {
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    size_t length = 0;
+    result[0] = '\0';
     const char* key;
     json_t* value;
 
     json_object_foreach(data, key, value) {
+        cp_bool ok = length == 0 || query_append(result, &length, "&");
         char* ekey = curl_easy_escape(curl, key, strlen(key));
-        strcat(result, ekey);
-        free(ekey);
-        strcat(result, "=");
+        ok = ok && ekey && query_append(result, &length, ekey) && query_append(result, &length, "=");
+        curl_free(ekey);
         if(json_is_string(value)) {
             const char* s = json_string_value(value);
             char* es = curl_easy_escape(curl, s, strlen(s));
-            strcat(result, es);
-            free(es);
-        } else if(json_is_number(value)) sprintf(result+strlen(result), "%g", json_number_value(value));
-        else if(json_is_true(value)) strcat(result, CP_JSON_STRING_TRUE);
-        else if(json_is_false(value)) strcat(result, CP_JSON_STRING_FALSE);
+            ok = ok && es && query_append(result, &length, es);
+            curl_free(es);
+        } else if(json_is_number(value)) {
+            /* the shortest text giving back the same double: a millisecond timestamp keeps all its digits */
+            char num[32];
+            cp_json_writer w;
+            cloudplugs_json_writer_fixed(&w, num, sizeof(num));
+            if(cloudplugs_json_write_number(&w, json_number_value(value)) != CP_OK) {
+                cloudplugs_free(result);
+                cps->err = CP_ERR_QUERY_INVALID_TYPE;
+                return NULL;
+            }
+            ok = ok && query_append(result, &length, num);
+        } else if(json_is_true(value)) ok = ok && query_append(result, &length, CP_JSON_STRING_TRUE);
+        else if(json_is_false(value)) ok = ok && query_append(result, &length, CP_JSON_STRING_FALSE);
         //TODO else if(json_is_array(value)) {}
         else {
+            cloudplugs_free(result);
             cps->err = CP_ERR_QUERY_INVALID_TYPE;
             return NULL;
         }
-        strcat(result, "&");
+        if(!ok) {
+            cloudplugs_free(result);
+            cps->err = CP_ERR_INVALID_PARAMETER;
+            return NULL;
+        }
     }
-    result[strlen(result)-1] = '\0';
     return result;
 }
 
@@ -69,10 +93,10 @@ static void free_http_headers(char** h_array){
     if(h_array) {
         int i = 0;
         while(h_array[i]) {
-            free(h_array[i]);
+            cloudplugs_free(h_array[i]);
             i++;
         }
-        free(h_array);
+        cloudplugs_free(h_array);
     }
 }
 
@@ -81,7 +105,7 @@ static char** get_http_headers(cp_session cps, json_t* headers){
     const char* key;
     json_t* value;
     int i = 0;
-    h_array = malloc(sizeof (char* )*  (json_object_size(headers) + 1));
+    h_array = cloudplugs_malloc(sizeof (char* )*  (json_object_size(headers) + 1));
     if(!h_array){
         cps->err = CP_ERR_OUT_OF_MEMORY;
         return NULL;
@@ -117,7 +141,21 @@ static char** get_http_headers(cp_session cps, json_t* headers){
 */
 //CP_RES cloudplugs_request_json(cp_session cps, CP_HTTP_METHOD http_method, const char* path, json_t* headers, json_t* query, json_t* body, json_t** result);
 
-static cp_res cloudplugs_request_json(cp_session cps, cp_bool auth, CP_HTTP_METHOD http_method, const char* path, json_t* headers, json_t* query, json_t* body, json_t** result)
+static json_t* cloudplugs_parse_json(cp_session cps, const char* sres, size_t len) {
+    if(!len) return NULL;
+    json_error_t error;
+    json_t* result = json_loadb(sres, len, JSON_DECODE_ANY, &error);
+    if(!result) {
+        result = json_object();
+        json_object_set_new(result, CP_JSON_ERR, json_string(error.text));
+        json_object_set_new(result, CP_JSON_BODY, json_string(sres));
+        cps->err = CP_ERR_JSON_PARSE;
+    }
+    return result;
+}
+
+/* as cloudplugs_request_json(), sending the body as the member wrap of an object if wrap is not NULL */
+static cp_res cloudplugs_request_json_wrapped(cp_session cps, cp_bool auth, CP_HTTP_METHOD http_method, const char* path, json_t* headers, json_t* query, json_t* body, const char* wrap, json_t** result)
 {
     cp_res cp_res = CP_FAIL;
     if(!cps) return cp_res;
@@ -131,61 +169,49 @@ static cp_res cloudplugs_request_json(cp_session cps, cp_bool auth, CP_HTTP_METH
         return cp_res;
     }
 
-    char* sbody = body ? json_dumps(body, JSON_ENCODE_ANY) : NULL;
-    if(body && !sbody) {
-        free_http_headers(h_array);
-        if(squery) free(squery);
-        cps->err = CP_ERR_JSON_ENCODE;
-        return cp_res;
+    cp_body sbody;
+    if(body) {
+        cp_json_writer* w = &cps->writer;
+        cloudplugs_buffer_reset(cps);
+        /* the member is written around the dump of the body, an empty raw value taking its place in the writer */
+        if((wrap && (cloudplugs_json_begin_object(w) != CP_OK || cloudplugs_json_write_key(w, wrap) != CP_OK || cloudplugs_json_write_raw(w, "", 0) != CP_OK))
+            || json_dump_callback(body, cloudplugs_buffer_append, cps, JSON_ENCODE_ANY)
+            || (wrap && cloudplugs_json_end_object(w) != CP_OK)) {
+            free_http_headers(h_array);
+            if(squery) cloudplugs_free(squery);
+            cps->err = CP_ERR_JSON_ENCODE;
+            return cp_res;
+        }
+        cloudplugs_body_buffer(&sbody, cps->writer.buffer, cps->writer.length);
     }
 
     size_t len = 0;
     char* sres = NULL;
-    cp_res = cloudplugs_request_exec(cps, auth, http_method, path, h_array, squery, sbody, result ? &sres : NULL, result ? &len : NULL);
+    cp_res = cloudplugs_request_exec_body(cps, auth, http_method, path, h_array, squery, body ? &sbody : NULL, result ? &sres : NULL, result ? &len : NULL);
 
-    if(len && result) {
-        json_error_t error;
-        *result = json_loads(sres, JSON_DECODE_ANY, &error);
-        if(!*result) {
-            *result = json_object();
-            json_object_set_new(*result, CP_JSON_ERR, json_string(error.text));
-            json_object_set_new(*result, CP_JSON_BODY, json_string(sres));
-            cps->err = CP_ERR_JSON_PARSE;
-        }
-        free(sres);
-    } else if(result) {
-        *result = NULL;
-    }
+    if(result) *result = cloudplugs_parse_json(cps, sres, len);
+    if(sres) cloudplugs_free(sres);
 
     free_http_headers(h_array);
-    if(squery) free(squery);
-    if(sbody) free(sbody);
+    if(squery) cloudplugs_free(squery);
     return cp_res;
 }
 
+static cp_res cloudplugs_request_json(cp_session cps, cp_bool auth, CP_HTTP_METHOD http_method, const char* path, json_t* headers, json_t* query, json_t* body, json_t** result) {
+    return cloudplugs_request_json_wrapped(cps, auth, http_method, path, headers, query, body, NULL, result);
+}
+
 cp_res cloudplugs_publish_data_json(cp_session cps, const char* channel, json_t* body, json_t** result) {
+    if(!json_is_array(body) && !json_is_object(body)) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    /* an object without data is the data of the record */
+    const char* wrap = json_is_object(body) && !json_object_get(body, DATA) ? DATA : NULL;
+
     char* url = channel ? cloudplugs_url_encode_data(cps, channel) : PATH_DATA;
     if(!url) return CP_FAIL;
 
-    cp_res res;
-    json_t* obj;
-    if(json_is_array(body)) {
-        obj = body;
-    } else if(json_is_object(body)) {
-        if(!json_object_get(body, DATA)) {
-            obj = json_object();
-            if(!obj) SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
-            json_object_set(obj, DATA, body);
-        } else {
-            obj = body;
-        }
-    } else {
-        SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
-    }
+    cp_res res = cloudplugs_request_json_wrapped(cps, CP_TRUE, CP_HTTP_PUT, url, NULL, NULL, body, wrap, result);
 
-    res = cloudplugs_request_json(cps, CP_TRUE, CP_HTTP_PUT, url, NULL, NULL, obj, result);
-
-    if(channel) free(url);
+    if(channel) cloudplugs_free(url);
     return res;
 }
 
@@ -220,7 +246,7 @@ cp_res cloudplugs_enroll_product_json(cp_session cps, const char* model, const c
 cp_res cloudplugs_enroll_prototype_json(cp_session cps, const char* name, const char* hwid, const char* pass, json_t* perm, json_t* props, json_t** result) {
     if(!cps) return CP_FAIL;
     if(!name) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
-    if(!cps->is_master) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
+    if(!cps->identity->is_master) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
 
     json_t* body = json_object();
     if(!body) SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
@@ -237,7 +263,7 @@ cp_res cloudplugs_enroll_prototype_json(cp_session cps, const char* name, const
 
 cp_res cloudplugs_enroll_ctrl_json(cp_session cps, const char* model, const char* ctrl, const char* pass, const char* hwid, const char* name, json_t** result) {
     if(!cps) return CP_FAIL;
-    if(cps->id && !strchr(cps->id,'@')) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
+    if(cps->identity->id && !strchr(cps->identity->id,'@')) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
     if(!model || !ctrl || !pass) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
 
     json_t* body = json_object();
@@ -249,7 +275,7 @@ cp_res cloudplugs_enroll_ctrl_json(cp_session cps, const char* model, const char
     if(name) json_object_set_new(body, NAME, json_string(name));
     cp_res res = cloudplugs_request_json(cps, CP_FALSE, CP_HTTP_PUT, PATH_DEVICE, NULL, NULL, body, result);
 
-    if(!cps->id && res == CP_OK)
+    if(!cps->identity->id && res == CP_OK)
         cloudplugs_set_auth(cps, json_string_value(json_object_get(*result, ID)), json_string_value(json_object_get(*result, AUTH)), CP_FALSE);
 
     json_decref(body);
@@ -266,7 +292,7 @@ cp_res cloudplugs_control_device_json(cp_session cps, const char* model, const c
     json_object_set_new(body, PASS, json_string(pass));
     cp_res res = cloudplugs_request_json(cps, CP_TRUE, CP_HTTP_PUT, PATH_DEVICE, NULL, NULL, body, result);
 
-    if(!cps->id && res == CP_OK)
+    if(!cps->identity->id && res == CP_OK)
         cloudplugs_set_auth(cps, json_string_value(json_object_get(*result, ID)), json_string_value(json_object_get(*result, AUTH)), CP_FALSE);
 
     json_decref(body);
@@ -291,7 +317,202 @@ cp_res cloudplugs_retrieve_data_json(cp_session cps, const char* channel_mask, c
 
     cp_res res = cloudplugs_request_json(cps, CP_TRUE, CP_HTTP_GET, url, NULL, query, NULL, result);
     json_decref(query);
-    free(url);
+    cloudplugs_free(url);
+    return res;
+}
+
+struct _cp_range {
+    cp_time after;
+    cp_time before;
+    int offset;
+    int probe;   /* length of the previous page, when this one checks whether it was cut by the server */
+};
+
+struct _cp_range_read {
+    char* path;
+    char* of;
+    struct _cp_range* ranges;
+    size_t count;
+    size_t size;
+    json_t* records;
+    size_t limit;      /* pages this long are cut: CP_RANGE_LIMIT, or less once the server shows a lower cap */
+    size_t complete;   /* pages up to this long were shown complete, so the cap of the server is above */
+    cp_bool failed;
+};
+
+static cp_bool cloudplugs_range_push(struct _cp_range_read* read, cp_time after, cp_time before, int offset, int probe) {
+    if(read->count == read->size) {
+        size_t size = read->size ? read->size * 2 : CP_MAX_CONNECTIONS;
+        struct _cp_range* tmp = (struct _cp_range*) cloudplugs_realloc(read->ranges, size * sizeof(struct _cp_range));
+        if(!tmp) return CP_FALSE;
+        read->ranges = tmp;
+        read->size = size;
+    }
+    read->ranges[read->count].after = after;
+    read->ranges[read->count].before = before;
+    read->ranges[read->count].offset = offset;
+    read->ranges[read->count].probe = probe;
+    read->count++;
+    return CP_TRUE;
+}
+
+static cp_bool cloudplugs_range_next(cp_session cps, cp_transfer* t, void* userdata) {
+    struct _cp_range_read* read = (struct _cp_range_read*) userdata;
+    if(read->failed || !read->count) return CP_FALSE;
+    struct _cp_range* r = &read->ranges[--read->count];
+
+    char query[128];
+    snprintf(query, sizeof(query), "?" AFTER "=%.17g&" BEFORE "=%.17g&" LIMIT "=%d&" OFFSET "=%d", r->after, r->before, CP_RANGE_LIMIT, r->offset);
+    t->method = CP_HTTP_GET;
+    t->url = read->of ? cloudplugs_concat(cps, 5, cps->base_url, read->path, query, "&" OF "=", read->of) : cloudplugs_concat(cps, 3, cps->base_url, read->path, query);
+    /* the range travels with the transfer, to be split or continued when its page is full */
+    t->userdata = cloudplugs_malloc(sizeof(struct _cp_range));
+    if(t->userdata) {
+        *(struct _cp_range*) t->userdata = *r;
+    } else {
+        cloudplugs_free(t->url);
+        t->url = NULL;
+    }
+    return CP_TRUE;
+}
+
+static void cloudplugs_range_done(cp_session cps, cp_transfer* t, void* userdata) {
+    struct _cp_range_read* read = (struct _cp_range_read*) userdata;
+    if(!t->userdata) {
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        read->failed = CP_TRUE;
+        return;
+    }
+    struct _cp_range r = *(struct _cp_range*) t->userdata;
+    cloudplugs_free(t->userdata);
+    if(t->response.curl_res != CURLE_OK || (t->http_res != CP_HTTP_OK && t->http_res != CP_HTTP_CREATED)) {
+        cps->http_res = t->http_res;
+        read->failed = CP_TRUE;
+        return;
+    }
+    json_t* page = cloudplugs_parse_json(cps, t->response.body, t->response.offset);
+    if(page && !json_is_array(page)) {
+        json_decref(page);
+        cps->err = CP_ERR_JSON_PARSE;
+        read->failed = CP_TRUE;
+        return;
+    }
+    size_t n = json_array_size(page);
+    if(r.probe) {
+        /* the previous page was shorter than asked: it was complete if this one is empty, otherwise its length is the cap of the server */
+        if(n && (size_t) r.probe < read->limit) read->limit = (size_t) r.probe;
+        else if(!n && (size_t) r.probe > read->complete) read->complete = (size_t) r.probe;
+    }
+    cp_bool ok = CP_TRUE;
+    if(n >= read->limit) {
+        /* dense range: keep the page and split the rest while it is wide enough, otherwise page through it */
+        cp_time first = json_number_value(json_object_get(json_array_get(page, 0), AT));
+        cp_time last = json_number_value(json_object_get(json_array_get(page, n - 1), AT));
+        cp_time rest_after = r.after, rest_before = r.before;
+        if(first < last) rest_after = last;
+        else rest_before = last;
+        cp_time middle = rest_after + (rest_before - rest_after) / 2;
+        /* a page within one timestamp does not tell which end of the range it covers */
+        if(r.offset || first == last) {
+            ok = cloudplugs_range_push(read, r.after, r.before, r.offset + (int) n, 0);
+        } else if(middle - rest_after >= CP_RANGE_MIN_SPAN) {
+            ok = cloudplugs_range_push(read, rest_after, middle, 0, 0) && cloudplugs_range_push(read, middle, rest_before, 0, 0);
+        } else {
+            ok = cloudplugs_range_push(read, rest_after, rest_before, 0, 0);
+        }
+    } else if(n > read->complete) {
+        /* a shorter page can still be cut by a server capping below CP_RANGE_LIMIT */
+        ok = cloudplugs_range_push(read, r.after, r.before, r.offset + (int) n, (int) n);
+    }
+    if(!ok) {
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        read->failed = CP_TRUE;
+    }
+    if(n && json_array_extend(read->records, page)) {
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        read->failed = CP_TRUE;
+    }
+    if(page) json_decref(page);
+}
+
+static int cloudplugs_record_cmp(const void* a, const void* b) {
+    json_t* x = *(json_t* const*) a;
+    json_t* y = *(json_t* const*) b;
+    cp_time ax = json_number_value(json_object_get(x, AT));
+    cp_time ay = json_number_value(json_object_get(y, AT));
+    if(ax != ay) return ax < ay ? -1 : 1;
+    const char* ix = json_string_value(json_object_get(x, ID));
+    const char* iy = json_string_value(json_object_get(y, ID));
+    return ix && iy ? strcmp(ix, iy) : (ix != NULL) - (iy != NULL);
+}
+
+/* sort the records by timestamp, dropping the ones returned by two adjacent ranges */
+static json_t* cloudplugs_records_merge(json_t* records) {
+    size_t i, n = json_array_size(records);
+    json_t** v = (json_t**) cloudplugs_malloc((n ? n : 1) * sizeof(json_t*));
+    json_t* merged = json_array();
+    if(!v || !merged) {
+        cloudplugs_free(v);
+        if(merged) json_decref(merged);
+        return NULL;
+    }
+    for(i = 0; i < n; i++) v[i] = json_array_get(records, i);
+    qsort(v, n, sizeof(json_t*), cloudplugs_record_cmp);
+    for(i = 0; i < n; i++) {
+        if(i && json_object_get(v[i], ID) && !cloudplugs_record_cmp(&v[i-1], &v[i])) continue;
+        if(json_array_append(merged, v[i])) {
+            json_decref(merged);
+            merged = NULL;
+            break;
+        }
+    }
+    cloudplugs_free(v);
+    return merged;
+}
+
+cp_res cloudplugs_retrieve_data_range_json(cp_session cps, const char* channel_mask, cp_time after, cp_time before, const char* of, int shards, json_t** result) {
+    if(!cps) return CP_FAIL;
+    if(!channel_mask || !result || after < 0 || before <= after || shards < 0) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    if(!cps->identity->auth) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
+    *result = NULL;
+    if(!shards) shards = cps->max_connections;
+
+    struct _cp_range_read read;
+    memset(&read, 0, sizeof(read));
+    read.path = cloudplugs_url_encode_data(cps, channel_mask);
+    read.of = of ? curl_easy_escape(cps->curl, of, strlen(of)) : NULL;
+    read.records = json_array();
+    read.limit = CP_RANGE_LIMIT;
+    cp_res res = (read.path && (!of || read.of) && read.records) ? CP_OK : CP_FAIL;
+
+    /* pushed backwards, so the oldest range is requested first */
+    cp_time span = (before - after) / shards;
+    int i;
+    for(i = shards - 1; res == CP_OK && i >= 0; i--) {
+        if(!cloudplugs_range_push(&read, after + span * i, i == shards - 1 ? before : after + span * (i + 1), 0, 0)) res = CP_FAIL;
+    }
+    if(res != CP_OK) cps->err = CP_ERR_OUT_OF_MEMORY;
+    else {
+        cps->err = 0;
+        cps->http_res = CP_HTTP_OK;
+        res = cloudplugs_batch_run(cps, cloudplugs_range_next, cloudplugs_range_done, &read);
+    }
+    if(res == CP_OK && read.failed) {
+        if(!cps->err) cps->err = CP_ERR_HTTP;
+        res = CP_FAIL;
+    }
+    if(res == CP_OK) {
+        *result = cloudplugs_records_merge(read.records);
+        if(!*result) {
+            cps->err = CP_ERR_OUT_OF_MEMORY;
+            res = CP_FAIL;
+        }
+    }
+
+    if(read.records) json_decref(read.records);
+    if(read.of) curl_free(read.of);
+    cloudplugs_free(read.path);
+    cloudplugs_free(read.ranges);
     return res;
 }
 
@@ -311,7 +532,7 @@ cp_res cloudplugs_remove_data_json(cp_session cps, const char* channel_mask, jso
 
     cp_res res = cloudplugs_request_json(cps, CP_TRUE, CP_HTTP_DELETE, url, NULL, NULL, body, result);
     json_decref(body);
-    if(url) free(url);
+    if(url) cloudplugs_free(url);
     return res;
 }
 
@@ -321,7 +542,7 @@ cp_res cloudplugs_uncontrol_device_json(cp_session cps, const char* plugid, json
 
     if(!json_is_string(plugid_controlled) || !json_is_array(plugid_controlled)) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
     cp_res res = cloudplugs_request_json(cps, CP_TRUE, CP_HTTP_DELETE, url, NULL, NULL, plugid_controlled, result);
-    if(url) free(url);
+    if(url) cloudplugs_free(url);
     return res;
 }
 
@@ -348,7 +569,7 @@ cp_res cloudplugs_get_channel_json(cp_session cps, const char* channel_mask, jso
 
     cp_res res = cloudplugs_request_json(cps, CP_TRUE, CP_HTTP_GET, url, NULL, query, NULL, result);
     json_decref(query);
-    if(url && channel_mask) free(url);
+    if(url && channel_mask) cloudplugs_free(url);
     return res;
 }
 
@@ -356,17 +577,77 @@ cp_res cloudplugs_get_device_json(cp_session cps, const char* plugid, json_t** r
     const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
     char* url = cloudplugs_concat(cps, 2, PATH_DEVICE "/", id);
     cp_res res = cloudplugs_request_json(cps, CP_TRUE, CP_HTTP_GET, url, NULL, NULL, NULL, result);
-    if(url) free(url);
+    if(url) cloudplugs_free(url);
     return res;
 }
 
+struct _cp_devices_read {
+    const char** ids;
+    size_t n;
+    size_t next;
+    const char* prop;
+    json_t** results;
+    size_t failed;
+};
+
+static cp_bool cloudplugs_devices_next(cp_session cps, cp_transfer* t, void* userdata) {
+    struct _cp_devices_read* read = (struct _cp_devices_read*) userdata;
+    if(read->next >= read->n) return CP_FALSE;
+    t->index = read->next++;
+    t->method = CP_HTTP_GET;
+    const char* id = read->ids[t->index];
+    char* path = read->prop ? cloudplugs_url_encode_prop(cps, id, read->prop) : cloudplugs_concat(cps, 2, PATH_DEVICE "/", id);
+    t->url = path ? cloudplugs_concat(cps, 2, cps->base_url, path) : NULL;
+    if(path) cloudplugs_free(path);
+    return CP_TRUE;
+}
+
+static void cloudplugs_devices_done(cp_session cps, cp_transfer* t, void* userdata) {
+    struct _cp_devices_read* read = (struct _cp_devices_read*) userdata;
+    if(t->response.curl_res == CURLE_OK)
+        read->results[t->index] = cloudplugs_parse_json(cps, t->response.body, t->response.offset);
+    if(t->response.curl_res != CURLE_OK || (t->http_res != CP_HTTP_OK && t->http_res != CP_HTTP_CREATED)) {
+        cps->http_res = t->http_res;
+        read->failed++;
+    }
+}
+
+cp_res cloudplugs_get_devices_json(cp_session cps, const char* plugids[], size_t n, const char* prop, json_t* results[]) {
+    if(!cps) return CP_FAIL;
+    if((n && (!plugids || !results))) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    if(!cps->identity->auth) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_LOGIN);
+    size_t i;
+    for(i = 0; i < n; i++) {
+        if(!plugids[i]) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+        results[i] = NULL;
+    }
+
+    struct _cp_devices_read read;
+    read.ids = plugids;
+    read.n = n;
+    read.next = 0;
+    read.prop = prop;
+    read.results = results;
+    read.failed = 0;
+
+    cps->err = 0;
+    cps->http_res = CP_HTTP_OK;
+    cp_res res = cloudplugs_batch_run(cps, cloudplugs_devices_next, cloudplugs_devices_done, &read);
+    if(res != CP_OK) return res;
+    if(read.failed) {
+        if(!cps->err) cps->err = CP_ERR_HTTP;
+        return CP_FAIL;
+    }
+    return CP_OK;
+}
+
 cp_res cloudplugs_set_device_json(cp_session cps, const char* plugid, json_t* value, json_t** result) {
     if(!value) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
 
     const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
     char* url = cloudplugs_concat(cps, 2, PATH_DEVICE "/", id);
     cp_res res = cloudplugs_request_json(cps, CP_TRUE, CP_HTTP_PATCH, url, NULL, NULL, value, result);
-    if(url) free(url);
+    if(url) cloudplugs_free(url);
     return res;
 }
 
@@ -374,7 +655,7 @@ cp_res cloudplugs_get_device_prop_json(cp_session cps, const char* plugid, const
     const char *id = plugid ? plugid : cloudplugs_get_plug_id(cps);
     char* url = prop ? cloudplugs_concat(cps, 4, PATH_DEVICE "/", id, "/", prop) : cloudplugs_concat(cps, 3, PATH_DEVICE "/", id, "/");
     cp_res res = cloudplugs_request_json(cps, CP_TRUE, CP_HTTP_GET, url, NULL, NULL, NULL, result);
-    if(url) free(url);
+    if(url) cloudplugs_free(url);
     return res;
 }
 
@@ -384,7 +665,7 @@ cp_res cloudplugs_set_device_prop_json(cp_session cps, const char* plugid, const
     const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
     char* url = prop ? cloudplugs_concat(cps, 4, PATH_DEVICE "/", id, "/", prop) : cloudplugs_concat(cps, 3, PATH_DEVICE "/", id, "/");
     cp_res res = cloudplugs_request_json(cps, CP_TRUE, CP_HTTP_PATCH, url, NULL, NULL, value, NULL);
-    if(url) free(url);
+    if(url) cloudplugs_free(url);
     return res;
 }
 
@@ -394,7 +675,7 @@ cp_res cloudplugs_remove_device_prop_json(cp_session cps, const char* plugid, co
     const char* id = plugid ? plugid : cloudplugs_get_plug_id(cps);
     char* url = cloudplugs_concat(cps, 4, PATH_DEVICE "/", id, "/", prop);
     cp_res res = cloudplugs_request_json(cps, CP_TRUE, CP_HTTP_DELETE, url, NULL, NULL, NULL, NULL);
-    if(url) free(url);
+    if(url) cloudplugs_free(url);
     return res;
 }
 
@@ -403,18 +684,12 @@ cp_res cloudplugs_set_device_location_json(cp_session cps, const char* plugid, d
     if(longitude > MAX_LONGITUDE || longitude < MIN_LONGITUDE) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
     if(latitude > MAX_LATITUDE || latitude < MIN_LATITUDE) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
 
-    json_t* body = json_object();
-    if(!body) SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
-
-    json_object_set_new(body, LONGITUDE, json_real(longitude));
-    json_object_set_new(body, LATITUDE, json_real(latitude));
-    if(accuracy >= 0) json_object_set_new(body, ACCURACY, json_real(accuracy));
-    if(altitude >= 0) json_object_set_new(body, ALTITUDE, json_real(altitude));
-    if(timestamp >= 0) json_object_set_new(body, TIMESTAMP, json_real(timestamp));
+    char body[CP_LOCATION_SIZE];
+    cp_json_writer w;
+    cloudplugs_json_writer_fixed(&w, body, sizeof(body));
+    if(cloudplugs_location_write(&w, longitude, latitude, altitude, accuracy, timestamp) != CP_OK) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
 
-    cp_res res = cloudplugs_set_device_prop_json(cps, plugid, LOCATION, body);
-    json_decref(body);
-    return res;
+    return cloudplugs_set_device_prop(cps, plugid, LOCATION, body);
 
 }
 
@@ -422,6 +697,6 @@ cp_res cloudplugs_get_device_location_json(cp_session cps, const char* plugid, j
     const char *id = plugid ? plugid : cloudplugs_get_plug_id(cps);
     char* url = cloudplugs_concat(cps, 4, PATH_DEVICE "/", id, "/", LOCATION);
     cp_res res = cloudplugs_request_json(cps, CP_TRUE, CP_HTTP_GET, url, NULL, NULL, NULL, result);
-    if(url) free(url);
+    if(url) cloudplugs_free(url);
     return res;
 }
@@ -29,10 +29,18 @@ under the License.
 extern "C" {
 #endif
 
+typedef struct _cloudplugs_watch* cp_watch; /**<Reference to a subscription to the new data of a channel mask */
+
+typedef struct _cloudplugs_device_cache* cp_device_cache; /**<Reference to the last acknowledged state of some devices */
+
 /**
- Number of milliseconds in GMT since the time of Epoch
+ Receives each new record of a watch, in order of timestamp.
+
+ @param w The watch reference.
+ @param record The record, with "id", "at" and "data"; it is valid only during the call, use json_incref() to keep it.
+ @param userdata The pointer given to cloudplugs_watch_create().
 */
-typedef double cp_time;
+typedef void (*cp_watch_callback)(cp_watch w, json_t* record, void* userdata);
 
 /**
  This function performs an HTTP request to the server  for enrolling a new production device or create new (development) device or enroll new or already existent controller device, that depends on the content of the json. Optionally places the response in *result.
@@ -145,6 +153,18 @@ cp_res cloudplugs_get_device_json(cp_session cps, const char* plugid, json_t** r
 */
 cp_res cloudplugs_get_device_prop_json(cp_session cps, const char* plugid, const char* prop, json_t** result);
 
+/**
+ Read many devices, or one of their properties, concurrently on at most cloudplugs_get_max_connections() connections.
+
+  @param cps The session reference.
+  @param plugids The @ref details_PLUG_ID of the devices.
+  @param n The number of devices.
+  @param prop If NULL, then the whole devices as cloudplugs_get_device_json(); otherwise the single property value as cloudplugs_get_device_prop_json().
+  @param results An array of n pointers such that results[i] will contain the dynamically allocated json object of the response for plugids[i], or NULL if the request failed without a response. The caller is responsible to free memory in each results[i].
+  @return CP_SUCCESS if all the requests succeed, CP_FAILED otherwise.
+*/
+cp_res cloudplugs_get_devices_json(cp_session cps, const char* plugids[], size_t n, const char* prop, json_t* results[]);
+
 /**
  This function performs an HTTP request to the server for writing or deleting device properties and [optionally] it places the response in *result.
 
@@ -209,6 +229,22 @@ cp_res cloudplugs_unenroll_json(cp_session cps, json_t* plugid, json_t** result)
 */
 cp_res cloudplugs_retrieve_data_json(cp_session cps, const char* channel_mask, cp_time before, cp_time after, cp_time at, const char* of, int offset, int limit, json_t** result);
 
+/**
+ Retrieve all the data published in a time window, splitting it in ranges fetched concurrently on at most cloudplugs_get_max_connections() connections.
+ A range returning a full page keeps it and the part of the range not covered by the page is split again in halves, so dense periods get more parallel requests.
+ A page is full when it reaches the requested limit or the lower cap of the server, learned from the pages that were cut.
+
+  @param cps The session reference.
+  @param channel_mask @ref details_CHMASK The channel mask.
+  @param after @ref details_TIMESTAMP Start of the window.
+  @param before @ref details_TIMESTAMP End of the window, greater than after.
+  @param of If not NULL, then @ref details_PLUG_ID_CSV.
+  @param shards Number of ranges the window is split at first; if 0, then the maximum number of connections.
+  @param result A pointer such that *result will contain the dynamically allocated json array of the records ordered by timestamp. The caller is responsible to free memory in *result.
+  @return CP_SUCCESS if all the requests succeed, CP_FAILED otherwise.
+*/
+cp_res cloudplugs_retrieve_data_range_json(cp_session cps, const char* channel_mask, cp_time after, cp_time before, const char* of, int shards, json_t** result);
+
 /**
  This function performs an HTTP request to the server to publish data. Authentication is requested
 
@@ -269,6 +305,168 @@ cp_res cloudplugs_set_device_location_json(cp_session cps, const char* plugid, d
 */
 cp_res cloudplugs_get_device_location_json(cp_session cps, const char* plugid, json_t** result);
 
+/**
+ Publish {"data":data,"at":at} in a channel through a deadband filter: numbers are compared as by cloudplugs_publish_number_deadband(),
+ strings by content and the other values with json_equal(), without serializing them.
+
+ @param db The filter reference.
+ @param channel The @ref details_CHANNEL.
+ @param data The value.
+ @param at The @ref details_TIMESTAMP of the value; if 0, then it is not published and the server sets it.
+ @param result If not NULL, then *result will contain the dynamically allocated json object of the response, NULL if the value was suppressed. The caller is responsible to free memory in *result.
+ @param published If not NULL, then *published will be CP_TRUE if the value was published, CP_FALSE if it was suppressed.
+ @return CP_SUCCESS if the value is published or suppressed, CP_FAILED otherwise.
+*/
+cp_res cloudplugs_publish_data_json_deadband(cp_deadband db, const char* channel, json_t* data, cp_time at, json_t** result, cp_bool* published);
+
+/**
+ Create a subscription to the data published in the channels matching a mask.
+ The watch keeps the highest timestamp received and asks only for the records after it;
+ the records received again at the boundary are recognized by their id and skipped.
+
+ @param cps The session reference, used by the watch for its requests.
+ @param channel_mask The @ref details_CHMASK to watch.
+ @param after Only the records published after this timestamp are reported; 0 for all the records.
+ @param cb Called for each new record.
+ @param userdata Passed as it is to cb.
+ @return The new watch, NULL on error. It must be released with cloudplugs_watch_destroy().
+*/
+cp_watch cloudplugs_watch_create(cp_session cps, const char* channel_mask, cp_time after, cp_watch_callback cb, void* userdata);
+
+/**
+ Release a watch.
+
+ @param w The watch reference.
+ @return CP_OK if the watch is released, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_watch_destroy(cp_watch w);
+
+/**
+ Change the polling interval: it is min_interval after new records, and doubles at each empty poll up to max_interval.
+
+ @param w The watch reference.
+ @param min_interval The shortest interval in milliseconds.
+ @param max_interval The longest interval in milliseconds.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_watch_set_interval(cp_watch w, int min_interval, int max_interval);
+
+/**
+ Change the page size of the polls and the boundary window.
+
+ @param w The watch reference.
+ @param limit The maximum number of records requested by each poll.
+ @param overlap How many milliseconds before the highest timestamp are requested again, to catch the records stored late with the same timestamp.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_watch_set_limit(cp_watch w, int limit, cp_time overlap);
+
+/**
+ Resume the watch from the checkpoint of its channel mask and record there each record given to the callback.
+ The window of the store follows the overlap of the watch, so the records requested again are recognized by id.
+
+ @param w The watch reference.
+ @param cp The checkpoint store, or NULL to stop recording; it must stay open while the watch uses it.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_watch_set_checkpoint(cp_watch w, cp_checkpoint cp);
+
+/**
+ Get the highest timestamp received, usable as after to resume the watch.
+
+ @param w The watch reference.
+ @return The highest timestamp received.
+*/
+cp_time cloudplugs_watch_get_mark(cp_watch w);
+
+/**
+ Perform a single poll, calling the callback for the new records.
+ If the id of a record cannot be tracked the record is delivered anyway and CP_FAILED is returned
+ with CP_ERR_OUT_OF_MEMORY: the same record can then be delivered again by a later poll.
+
+ @param w The watch reference.
+ @param next_interval If not NULL, *next_interval will contain the milliseconds to wait before the next poll.
+ @return CP_SUCCESS if the request succeeds, CP_FAILED otherwise.
+*/
+cp_res cloudplugs_watch_poll(cp_watch w, int* next_interval);
+
+/**
+ Poll until cloudplugs_watch_stop() is called or a poll fails.
+
+ @param w The watch reference.
+ @return CP_SUCCESS if stopped, CP_FAILED if a poll failed.
+*/
+cp_res cloudplugs_watch_run(cp_watch w);
+
+/**
+ Make cloudplugs_watch_run() return after the current poll; it can be called from the callback.
+
+ @param w The watch reference.
+ @return CP_OK on success, CP_FAIL otherwise.
+*/
+cp_res cloudplugs_watch_stop(cp_watch w);
+
+/**
+ Create a cache of the device documents written through it, so that each write sends only what changed.
+ The writes are sent as RFC 7386 merge patches: a member equal to the cached one is left out and a request whose patch is empty is not sent.
+ A device is cached from the first successful write, or all at once by cloudplugs_device_cache_load(); a failed write forgets it.
+
+ @param cps The session reference, used for the requests.
+ @return The cache, NULL on error. It must be released with cloudplugs_device_cache_destroy().
+*/
+cp_device_cache cloudplugs_device_cache_create(cp_session cps);
+
+/**
+ Release a cache.
+
+ @param cache The cache reference.
+ @return CP_SUCCESS if the cache is released, CP_FAILED otherwise.
+*/
+cp_res cloudplugs_device_cache_destroy(cp_device_cache cache);
+
+/**
+ Read a device from the server and cache its whole document, so that also the deletions of missing members can be skipped.
+
+ @param cache The cache reference.
+ @param plugid If NULL, then is the @ref details_PLUG_ID in the session.
+ @return CP_SUCCESS if the request succeeds, CP_FAILED otherwise.
+*/
+cp_res cloudplugs_device_cache_load(cp_device_cache cache, const char* plugid);
+
+/**
+ Forget a device, e.g. because it was modified by someone else; its next write is sent in full.
+
+ @param cache The cache reference.
+ @param plugid If NULL, then is the @ref details_PLUG_ID in the session.
+ @return CP_SUCCESS on success, CP_FAILED otherwise.
+*/
+cp_res cloudplugs_device_cache_forget(cp_device_cache cache, const char* plugid);
+
+/**
+ Same as cloudplugs_set_device_json(), sending only the members of value that differ from the cached device.
+
+ @param cache The cache reference.
+ @param plugid If NULL, then is the @ref details_PLUG_ID in the session.
+ @param value A json object as in cloudplugs_set_device_json().
+ @param result If not NULL, then *result will contain the dynamically allocated json object of the response, NULL if nothing was sent. The caller is responsible to free memory in *result.
+ @param sent If not NULL, then *sent will be CP_TRUE if a request was sent, CP_FALSE if value did not change anything.
+ @return CP_SUCCESS if the request succeeds or is not needed, CP_FAILED otherwise.
+*/
+cp_res cloudplugs_set_device_json_diff(cp_device_cache cache, const char* plugid, json_t* value, json_t** result, cp_bool* sent);
+
+/**
+ Same as cloudplugs_set_device_prop_json(), skipping the request when value does not differ from the cached properties.
+ A property is written whole, so the full value of each changed property is sent, not only its changed members.
+
+ @param cache The cache reference.
+ @param plugid If NULL, then is the @ref details_PLUG_ID in the session.
+ @param prop If NULL, then value must be an object of properties; otherwise the single property value is written.
+ @param value A json value, use null to delete one or all device properties.
+ @param sent If not NULL, then *sent will be CP_TRUE if a request was sent, CP_FALSE if value did not change anything.
+ @return CP_SUCCESS if the request succeeds or is not needed, CP_FAILED otherwise.
+*/
+cp_res cloudplugs_set_device_prop_json_diff(cp_device_cache cache, const char* plugid, const char* prop, json_t* value, cp_bool* sent);
+
 #ifdef  __cplusplus
 }
 #endif
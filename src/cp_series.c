@@ -0,0 +1,339 @@
+/*
+Copyright 2014 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest.h"
+#include "cp_internals.h"
+#include "cp_constants.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+void cloudplugs_series_init(cp_series* s) {
+    memset(s, 0, sizeof(cp_series));
+}
+
+void cloudplugs_series_clear(cp_series* s) {
+    s->count = 0;
+    s->ids_length = 0;
+}
+
+void cloudplugs_series_free(cp_series* s) {
+    if(!s) return;
+    cloudplugs_free(s->at);
+    cloudplugs_free(s->value);
+    cloudplugs_free(s->id);
+    cloudplugs_free(s->ids);
+    cloudplugs_series_init(s);
+}
+
+static cp_bool cloudplugs_series_reserve(cp_series* s, size_t count) {
+    if(count <= s->size) return CP_TRUE;
+    size_t size = s->size ? s->size * 2 : CP_BUFFER_SIZE;
+    if(size < count) size = count;
+    cp_time* at = (cp_time*) cloudplugs_realloc(s->at, size * sizeof(cp_time));
+    if(!at) return CP_FALSE;
+    s->at = at;
+    double* value = (double*) cloudplugs_realloc(s->value, size * sizeof(double));
+    if(!value) return CP_FALSE;
+    s->value = value;
+    size_t* id = (size_t*) cloudplugs_realloc(s->id, size * sizeof(size_t));
+    if(!id) return CP_FALSE;
+    s->id = id;
+    s->size = size;
+    return CP_TRUE;
+}
+
+static cp_res cloudplugs_series_push(cp_series* s, cp_time at, double value, const char* id, size_t id_length) {
+    if(!cloudplugs_series_reserve(s, s->count + 1)) return CP_FAIL;
+    if(s->ids_length + id_length + 1 > s->ids_size) {
+        size_t size = s->ids_size ? s->ids_size * 2 : CP_BUFFER_SIZE;
+        while(size < s->ids_length + id_length + 1) size *= 2;
+        char* ids = (char*) cloudplugs_realloc(s->ids, size);
+        if(!ids) return CP_FAIL;
+        s->ids = ids;
+        s->ids_size = size;
+    }
+    memcpy(s->ids + s->ids_length, id, id_length);
+    s->ids[s->ids_length + id_length] = '\0';
+    s->id[s->count] = s->ids_length;
+    s->ids_length += id_length + 1;
+    s->at[s->count] = at;
+    s->value[s->count] = value;
+    s->count++;
+    return CP_OK;
+}
+
+cp_res cloudplugs_series_append(cp_series* s, cp_time at, double value, const char* id) {
+    if(!s) return CP_FAIL;
+    return cloudplugs_series_push(s, at, value, id ? id : "", id ? strlen(id) : 0);
+}
+
+const char* cloudplugs_series_id(const cp_series* s, size_t i) {
+    return (s && i < s->count) ? s->ids + s->id[i] : NULL;
+}
+
+/*
+ * A scanner for the array of records returned by the data retrieval: only "id", "at" and a numeric "data"
+ * are kept, any other value is skipped without being built.
+ */
+
+static const char* cloudplugs_scan_space(const char* p, const char* end) {
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+    return p;
+}
+
+static const char* cloudplugs_scan_string(const char* p, const char* end) {
+    for(p++; p < end; p++) {
+        if(*p == '\\') p++;
+        else if(*p == '"') return p + 1;
+    }
+    return NULL;
+}
+
+static const char* cloudplugs_scan_value(const char* p, const char* end) {
+    if(p >= end) return NULL;
+    if(*p == '"') return cloudplugs_scan_string(p, end);
+    if(*p == '{' || *p == '[') {
+        int depth = 0;
+        while(p < end) {
+            if(*p == '"') {
+                p = cloudplugs_scan_string(p, end);
+                if(!p) return NULL;
+                continue;
+            }
+            if(*p == '{' || *p == '[') depth++;
+            else if(*p == '}' || *p == ']') {
+                if(!--depth) return p + 1;
+            }
+            p++;
+        }
+        return NULL;
+    }
+    while(p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\n' && *p != '\r' && *p != '\t') p++;
+    return p;
+}
+
+static cp_bool cloudplugs_scan_number(const char* p, const char* end, double* n) {
+    char buf[64];
+    size_t len = (size_t) (end - p);
+    if(!len || len >= sizeof(buf) || !(*p == '-' || (*p >= '0' && *p <= '9'))) return CP_FALSE;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    char* stop;
+    *n = strtod(buf, &stop);
+    return *stop == '\0';
+}
+
+cp_res cloudplugs_series_decode(cp_series* s, const char* json, size_t length) {
+    if(!s || !json) return CP_FAIL;
+    const char* end = json + length;
+    const char* p = cloudplugs_scan_space(json, end);
+    if(p >= end || *p != '[') return CP_FAIL;
+    p = cloudplugs_scan_space(p + 1, end);
+    if(p < end && *p == ']') return CP_OK;
+
+    while(p < end) {
+        if(*p != '{') {
+            p = cloudplugs_scan_value(p, end);
+            if(!p) return CP_FAIL;
+        } else {
+            const char* id = NULL;
+            size_t id_length = 0;
+            double at = 0, value = 0;
+            cp_bool has_at = CP_FALSE, has_value = CP_FALSE;
+            p = cloudplugs_scan_space(p + 1, end);
+            while(p < end && *p == '"') {
+                const char* key = p + 1;
+                const char* key_end = cloudplugs_scan_string(p, end);
+                if(!key_end) return CP_FAIL;
+                size_t key_length = (size_t) (key_end - key - 1);
+                p = cloudplugs_scan_space(key_end, end);
+                if(p >= end || *p != ':') return CP_FAIL;
+                const char* v = cloudplugs_scan_space(p + 1, end);
+                p = cloudplugs_scan_value(v, end);
+                if(!p) return CP_FAIL;
+                if(key_length == LIT_STR_LEN(ID) && !memcmp(key, ID, key_length) && *v == '"') {
+                    id = v + 1;
+                    id_length = (size_t) (p - v - 2);
+                } else if(key_length == LIT_STR_LEN(AT) && !memcmp(key, AT, key_length)) {
+                    has_at = cloudplugs_scan_number(v, p, &at);
+                } else if(key_length == LIT_STR_LEN(DATA) && !memcmp(key, DATA, key_length)) {
+                    has_value = cloudplugs_scan_number(v, p, &value);
+                }
+                p = cloudplugs_scan_space(p, end);
+                if(p < end && *p == ',') p = cloudplugs_scan_space(p + 1, end);
+            }
+            if(p >= end || *p != '}') return CP_FAIL;
+            p++;
+            if(has_at && has_value && cloudplugs_series_push(s, at, value, id ? id : "", id_length) != CP_OK) return CP_FAIL;
+        }
+        p = cloudplugs_scan_space(p, end);
+        if(p < end && *p == ',') p = cloudplugs_scan_space(p + 1, end);
+        else if(p < end && *p == ']') return CP_OK;
+        else return CP_FAIL;
+    }
+    return CP_FAIL;
+}
+
+struct _cp_series_row {
+    cp_time at;
+    double value;
+    size_t id;
+};
+
+static int cloudplugs_series_row_cmp(const void* a, const void* b) {
+    cp_time x = ((const struct _cp_series_row*) a)->at;
+    cp_time y = ((const struct _cp_series_row*) b)->at;
+    return x < y ? -1 : x > y;
+}
+
+cp_res cloudplugs_series_sort(cp_series* s) {
+    if(!s) return CP_FAIL;
+    size_t i, n = s->count;
+    for(i = 1; i < n && s->at[i-1] <= s->at[i]; i++);
+    if(i >= n) return CP_OK;
+
+    /* the retrieval returns the newest records first: a reversed run is just flipped */
+    for(i = 1; i < n && s->at[i-1] >= s->at[i]; i++);
+    if(i == n) {
+        for(i = 0; i < n / 2; i++) {
+            size_t j = n - 1 - i;
+            cp_time at = s->at[i];
+            double value = s->value[i];
+            size_t id = s->id[i];
+            s->at[i] = s->at[j];
+            s->value[i] = s->value[j];
+            s->id[i] = s->id[j];
+            s->at[j] = at;
+            s->value[j] = value;
+            s->id[j] = id;
+        }
+        return CP_OK;
+    }
+
+    struct _cp_series_row* rows = (struct _cp_series_row*) cloudplugs_malloc(n * sizeof(struct _cp_series_row));
+    if(!rows) return CP_FAIL;
+    for(i = 0; i < n; i++) {
+        rows[i].at = s->at[i];
+        rows[i].value = s->value[i];
+        rows[i].id = s->id[i];
+    }
+    qsort(rows, n, sizeof(struct _cp_series_row), cloudplugs_series_row_cmp);
+    for(i = 0; i < n; i++) {
+        s->at[i] = rows[i].at;
+        s->value[i] = rows[i].value;
+        s->id[i] = rows[i].id;
+    }
+    cloudplugs_free(rows);
+    return CP_OK;
+}
+
+cp_res cloudplugs_retrieve_series(cp_session cps, const char* channel_mask, const char* query, cp_series* s) {
+    if(!s) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    char* result = NULL;
+    size_t length = 0;
+    cp_res res = cloudplugs_retrieve_data(cps, channel_mask, query, &result, &length);
+    if(res == CP_OK && cloudplugs_series_decode(s, result, length) != CP_OK) {
+        cps->err = CP_ERR_JSON_PARSE;
+        res = CP_FAIL;
+    }
+    if(result) cloudplugs_free(result);
+    if(res == CP_OK && cloudplugs_series_sort(s) != CP_OK) SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    return res;
+}
+
+void cloudplugs_series_stats(const cp_series* s, size_t from, size_t to, cp_stats* stats) {
+    const double* v = s->value;
+    if(to > s->count) to = s->count;
+    stats->count = from < to ? to - from : 0;
+    stats->min = INFINITY;
+    stats->max = -INFINITY;
+    stats->sum = 0;
+    if(!stats->count) return;
+
+    size_t i = from;
+#if defined(__AVX__)
+    if(to - i >= 4) {
+        __m256d vmin = _mm256_loadu_pd(v + i), vmax = vmin, vsum = vmin;
+        for(i += 4; i + 4 <= to; i += 4) {
+            __m256d x = _mm256_loadu_pd(v + i);
+            vmin = _mm256_min_pd(vmin, x);
+            vmax = _mm256_max_pd(vmax, x);
+            vsum = _mm256_add_pd(vsum, x);
+        }
+        double lanes[4];
+        int k;
+        _mm256_storeu_pd(lanes, vmin);
+        for(k = 0; k < 4; k++) if(lanes[k] < stats->min) stats->min = lanes[k];
+        _mm256_storeu_pd(lanes, vmax);
+        for(k = 0; k < 4; k++) if(lanes[k] > stats->max) stats->max = lanes[k];
+        _mm256_storeu_pd(lanes, vsum);
+        stats->sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+#elif defined(__SSE2__)
+    if(to - i >= 2) {
+        __m128d vmin = _mm_loadu_pd(v + i), vmax = vmin, vsum = vmin;
+        for(i += 2; i + 2 <= to; i += 2) {
+            __m128d x = _mm_loadu_pd(v + i);
+            vmin = _mm_min_pd(vmin, x);
+            vmax = _mm_max_pd(vmax, x);
+            vsum = _mm_add_pd(vsum, x);
+        }
+        double lanes[2];
+        _mm_storeu_pd(lanes, vmin);
+        stats->min = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+        _mm_storeu_pd(lanes, vmax);
+        stats->max = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+        _mm_storeu_pd(lanes, vsum);
+        stats->sum = lanes[0] + lanes[1];
+    }
+#endif
+    for(; i < to; i++) {
+        if(v[i] < stats->min) stats->min = v[i];
+        if(v[i] > stats->max) stats->max = v[i];
+        stats->sum += v[i];
+    }
+}
+
+static size_t cloudplugs_series_lower_bound(const cp_series* s, size_t from, cp_time at) {
+    size_t lo = from, hi = s->count;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(s->at[mid] < at) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+cp_res cloudplugs_series_downsample(const cp_series* s, cp_time origin, cp_time bucket, cp_stats* out, size_t buckets) {
+    if(!s || !out || bucket <= 0) return CP_FAIL;
+    size_t b, from = cloudplugs_series_lower_bound(s, 0, origin);
+    for(b = 0; b < buckets; b++) {
+        size_t to = cloudplugs_series_lower_bound(s, from, origin + bucket * (double) (b + 1));
+        cloudplugs_series_stats(s, from, to, &out[b]);
+        from = to;
+    }
+    return CP_OK;
+}
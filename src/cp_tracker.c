@@ -0,0 +1,229 @@
+/*
+Copyright 2014 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest.h"
+#include "cp_internals.h"
+#include "cp_constants.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+struct _cp_track_fix {
+    double longitude;
+    double latitude;
+    double altitude;
+    double accuracy;
+    cp_time at;
+};
+
+struct _cloudplugs_tracker {
+    cp_session cps;
+    char* plugid;
+    char* channel;
+    double tolerance;
+    size_t capacity;
+    cp_time interval;
+    struct _cp_track_fix* fixes;
+    size_t count;
+    cp_bool anchored;		/* fixes[0] is the last fix published, where the track goes on */
+    size_t simplified;		/* the first fixes, kept by a simplification whose publish failed, are not simplified again */
+    unsigned char* keep;	/* the fixes retained by the simplification */
+    size_t* stack;		/* the spans still to simplify, as pairs of indexes */
+    size_t added;
+    size_t records;
+};
+
+cp_tracker cloudplugs_tracker_create(cp_session cps, const char* plugid, const char* channel, double tolerance, size_t capacity, cp_time interval) {
+    if(!cps) return NULL;
+    if(!channel || !(tolerance >= 0) || capacity < CP_TRACKER_MIN_CAPACITY || interval < 0) {
+        cps->err = CP_ERR_INVALID_PARAMETER;
+        return NULL;
+    }
+    cp_tracker trk = (cp_tracker) cloudplugs_calloc(1, sizeof(struct _cloudplugs_tracker));
+    if(trk) {
+        trk->channel = cloudplugs_strdup(channel);
+        trk->plugid = plugid ? cloudplugs_strdup(plugid) : NULL;
+        trk->fixes = (struct _cp_track_fix*) cloudplugs_malloc(capacity * sizeof(struct _cp_track_fix));
+        trk->keep = (unsigned char*) cloudplugs_malloc(capacity);
+        trk->stack = (size_t*) cloudplugs_malloc(2 * capacity * sizeof(size_t));
+    }
+    if(!trk || !trk->channel || (plugid && !trk->plugid) || !trk->fixes || !trk->keep || !trk->stack) {
+        cloudplugs_tracker_destroy(trk);
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    trk->cps = cps;
+    trk->tolerance = tolerance;
+    trk->capacity = capacity;
+    trk->interval = interval;
+    return trk;
+}
+
+cp_res cloudplugs_tracker_destroy(cp_tracker trk) {
+    if(!trk) return CP_FAIL;
+    cloudplugs_free(trk->plugid);
+    cloudplugs_free(trk->channel);
+    cloudplugs_free(trk->fixes);
+    cloudplugs_free(trk->keep);
+    cloudplugs_free(trk->stack);
+    cloudplugs_free(trk);
+    return CP_OK;
+}
+
+static double cloudplugs_track_longitude(double delta) {
+    /* the short way around, across the antimeridian */
+    if(delta > 180.0) return delta - 360.0;
+    if(delta < -180.0) return delta + 360.0;
+    return delta;
+}
+
+/* squared distance, in degrees of latitude, of p from the segment a-b; scale shrinks the degrees of longitude at the latitude of the track */
+static double cloudplugs_track_distance(const struct _cp_track_fix* a, const struct _cp_track_fix* b, const struct _cp_track_fix* p, double scale) {
+    double bx = cloudplugs_track_longitude(b->longitude - a->longitude) * scale;
+    double by = b->latitude - a->latitude;
+    double px = cloudplugs_track_longitude(p->longitude - a->longitude) * scale;
+    double py = p->latitude - a->latitude;
+    double length = bx * bx + by * by;
+    double t = length > 0 ? (px * bx + py * by) / length : 0;
+    if(t < 0) t = 0;
+    else if(t > 1) t = 1;
+    double dx = px - t * bx;
+    double dy = py - t * by;
+    return dx * dx + dy * dy;
+}
+
+/* Douglas-Peucker, iterative on the preallocated stack: drop the fixes within the tolerance from the track simplified so far.
+   Only the fixes after the simplified ones are considered, from the last of them: simplifying a simplified track again would add up the errors */
+static void cloudplugs_track_simplify(cp_tracker trk) {
+    size_t n = trk->count;
+    size_t from = trk->simplified ? trk->simplified - 1 : 0;
+    trk->simplified = n;
+    if(n - from < 3) return;
+    /* an equirectangular projection, accurate on the extent of a buffer */
+    double scale = cos(trk->fixes[0].latitude * CP_RADIANS_PER_DEGREE);
+    double limit = trk->tolerance / (CP_EARTH_RADIUS * CP_RADIANS_PER_DEGREE);
+    limit *= limit;
+
+    memset(trk->keep, 1, from);
+    memset(trk->keep + from, 0, n - from);
+    trk->keep[from] = trk->keep[n - 1] = 1;
+    size_t top = 0;
+    trk->stack[top++] = from;
+    trk->stack[top++] = n - 1;
+    while(top) {
+        size_t last = trk->stack[--top];
+        size_t first = trk->stack[--top];
+        size_t i, far = first;
+        double max = 0;
+        for(i = first + 1; i < last; i++) {
+            double d = cloudplugs_track_distance(&trk->fixes[first], &trk->fixes[last], &trk->fixes[i], scale);
+            if(d > max) {
+                max = d;
+                far = i;
+            }
+        }
+        if(far == first || max <= limit) continue;
+        trk->keep[far] = 1;
+        if(far - first > 1) {
+            trk->stack[top++] = first;
+            trk->stack[top++] = far;
+        }
+        if(last - far > 1) {
+            trk->stack[top++] = far;
+            trk->stack[top++] = last;
+        }
+    }
+
+    size_t i, j = 0;
+    for(i = 0; i < n; i++)
+        if(trk->keep[i]) trk->fixes[j++] = trk->fixes[i];
+    trk->count = j;
+    trk->simplified = j;
+}
+
+cp_res cloudplugs_tracker_flush(cp_tracker trk) {
+    if(!trk) return CP_FAIL;
+    cp_session cps = trk->cps;
+    size_t start = trk->anchored ? 1 : 0;
+    if(trk->count <= start) return CP_OK;
+    cloudplugs_track_simplify(trk);
+
+    cloudplugs_buffer_reset(cps);
+    char data[CP_LOCATION_SIZE];
+    size_t i;
+    for(i = start; i < trk->count; i++) {
+        const struct _cp_track_fix* f = &trk->fixes[i];
+        cp_json_writer w;
+        cloudplugs_json_writer_fixed(&w, data, sizeof(data));
+        /* the time of the fix is the one of the record */
+        if(cloudplugs_location_write(&w, f->longitude, f->latitude, f->altitude, f->accuracy, -1) != CP_OK
+            || cloudplugs_json_append_record(&cps->writer, trk->channel, data, f->at, NULL) != CP_OK)
+            SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    }
+    size_t length;
+    const char* records = cloudplugs_json_writer_finish(&cps->writer, &length);
+    if(!records) SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+
+    cp_body body;
+    cloudplugs_body_buffer(&body, records, length);
+    if(cloudplugs_publish_data_body(cps, NULL, &body, NULL, NULL) != CP_OK) return CP_FAIL;
+    trk->records += trk->count - start;
+
+    /* the last fix starts the next part of the track */
+    trk->fixes[0] = trk->fixes[trk->count - 1];
+    trk->count = 1;
+    trk->simplified = 1;
+    trk->anchored = CP_TRUE;
+    /* the fixes are published: a failure of the location, written again by the next publish, is only left in cps->err */
+    const struct _cp_track_fix* f = &trk->fixes[0];
+    cloudplugs_set_device_location(cps, trk->plugid, f->longitude, f->latitude, f->altitude, f->accuracy, f->at);
+    return CP_OK;
+}
+
+cp_res cloudplugs_tracker_add(cp_tracker trk, double longitude, double latitude, double altitude, double accuracy, cp_time at) {
+    if(!trk) return CP_FAIL;
+    cp_session cps = trk->cps;
+    if(!(longitude >= MIN_LONGITUDE && longitude <= MAX_LONGITUDE) || !(latitude >= MIN_LATITUDE && latitude <= MAX_LATITUDE) || !(at >= 0))
+        SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    if(trk->count && at < trk->fixes[trk->count - 1].at) SET_ERROR_AND_RETURN(cps, CP_ERR_INVALID_PARAMETER);
+    if(trk->count == trk->capacity) {
+        /* the last publish failed: retry, the simplification can make room even if it fails again */
+        cloudplugs_tracker_flush(trk);
+        if(trk->count == trk->capacity) return CP_FAIL;
+    }
+
+    struct _cp_track_fix* f = &trk->fixes[trk->count++];
+    f->longitude = longitude;
+    f->latitude = latitude;
+    f->altitude = altitude;
+    f->accuracy = accuracy;
+    f->at = at;
+    trk->added++;
+    if(trk->count == trk->capacity || (trk->interval > 0 && at - trk->fixes[0].at >= trk->interval)) return cloudplugs_tracker_flush(trk);
+    return CP_OK;
+}
+
+cp_res cloudplugs_tracker_counters(cp_tracker trk, size_t* fixes, size_t* records) {
+    if(!trk) return CP_FAIL;
+    if(fixes) *fixes = trk->added;
+    if(records) *records = trk->records;
+    return CP_OK;
+}
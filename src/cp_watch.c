@@ -0,0 +1,213 @@
+/*
+Copyright 2014 CloudPlugs Inc.
+
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+*/
+#include "cp_rest_json.h"
+#include "cp_internals.h"
+#include "cp_constants.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct _cloudplugs_watch {
+    cp_session cps;
+    char* channel_mask;
+    cp_watch_callback cb;
+    void* userdata;
+    cp_time mark;
+    cp_time overlap;
+    cp_time page_after;
+    int offset;
+    int limit;
+    int min_interval;
+    int max_interval;
+    int interval;
+    cp_bool stopped;
+    cp_checkpoint checkpoint;
+    cp_id_set seen;
+};
+
+struct _cp_watch_record {
+    json_t* record;
+    const char* id;
+    cp_time at;
+};
+
+static int cloudplugs_watch_record_cmp(const void* a, const void* b) {
+    cp_time x = ((const struct _cp_watch_record*) a)->at;
+    cp_time y = ((const struct _cp_watch_record*) b)->at;
+    return x < y ? -1 : x > y;
+}
+
+/* only the ids inside the window of the next query can be returned again */
+static void cloudplugs_watch_prune(cp_watch w) {
+    cloudplugs_id_set_prune(&w->seen, w->offset ? w->page_after : w->mark - w->overlap);
+}
+
+cp_watch cloudplugs_watch_create(cp_session cps, const char* channel_mask, cp_time after, cp_watch_callback cb, void* userdata) {
+    if(!cps) return NULL;
+    if(!channel_mask || !cb) {
+        cps->err = CP_ERR_INVALID_PARAMETER;
+        return NULL;
+    }
+    cp_watch w = (cp_watch) cloudplugs_calloc(1, sizeof(struct _cloudplugs_watch));
+    if(!w || !(w->channel_mask = cloudplugs_strdup(channel_mask))) {
+        cloudplugs_free(w);
+        cps->err = CP_ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    w->cps = cps;
+    w->cb = cb;
+    w->userdata = userdata;
+    w->mark = after;
+    w->overlap = CP_WATCH_OVERLAP;
+    w->limit = CP_WATCH_LIMIT;
+    w->min_interval = CP_WATCH_MIN_INTERVAL;
+    w->max_interval = CP_WATCH_MAX_INTERVAL;
+    w->interval = w->min_interval;
+    return w;
+}
+
+cp_res cloudplugs_watch_destroy(cp_watch w) {
+    if(!w) return CP_FAIL;
+    cloudplugs_id_set_clear(&w->seen);
+    cloudplugs_free(w->channel_mask);
+    cloudplugs_free(w);
+    return CP_OK;
+}
+
+cp_res cloudplugs_watch_set_interval(cp_watch w, int min_interval, int max_interval) {
+    if(!w || min_interval < 0 || max_interval < min_interval) return CP_FAIL;
+    w->min_interval = min_interval;
+    w->max_interval = max_interval;
+    w->interval = min_interval;
+    return CP_OK;
+}
+
+cp_res cloudplugs_watch_set_limit(cp_watch w, int limit, cp_time overlap) {
+    if(!w || limit <= 0 || overlap < 0) return CP_FAIL;
+    w->limit = limit;
+    w->overlap = overlap;
+    if(w->checkpoint) cloudplugs_checkpoint_set_window(w->checkpoint, overlap);
+    return CP_OK;
+}
+
+cp_res cloudplugs_watch_set_checkpoint(cp_watch w, cp_checkpoint cp) {
+    if(!w) return CP_FAIL;
+    w->checkpoint = cp;
+    if(cp) cloudplugs_checkpoint_set_window(cp, w->overlap);
+    cp_time at;
+    if(cp && cloudplugs_checkpoint_get(cp, w->channel_mask, &at) == CP_OK && at > w->mark) {
+        w->mark = at;
+        w->offset = 0;
+    }
+    return CP_OK;
+}
+
+cp_time cloudplugs_watch_get_mark(cp_watch w) {
+    return w ? w->mark : 0;
+}
+
+cp_res cloudplugs_watch_poll(cp_watch w, int* next_interval) {
+    if(!w) return CP_FAIL;
+    cp_session cps = w->cps;
+
+    if(!w->offset) w->page_after = w->mark > w->overlap ? w->mark - w->overlap : 0;
+
+    json_t* result = NULL;
+    cp_res res = cloudplugs_retrieve_data_json(cps, w->channel_mask, 0, w->page_after, 0, NULL, w->offset, w->limit, &result);
+    if(res == CP_OK && !json_is_array(result)) {
+        cps->err = CP_ERR_JSON_PARSE;
+        res = CP_FAIL;
+    }
+    if(res != CP_OK) {
+        if(result) json_decref(result);
+        w->interval = w->max_interval;
+        if(next_interval) *next_interval = w->interval;
+        return res;
+    }
+
+    size_t n = json_array_size(result);
+    struct _cp_watch_record* fresh = n ? (struct _cp_watch_record*) cloudplugs_malloc(n * sizeof(struct _cp_watch_record)) : NULL;
+    if(n && !fresh) {
+        json_decref(result);
+        SET_ERROR_AND_RETURN(cps, CP_ERR_OUT_OF_MEMORY);
+    }
+
+    size_t i, count = 0;
+    for(i = 0; i < n; i++) {
+        json_t* record = json_array_get(result, i);
+        const char* id = json_string_value(json_object_get(record, ID));
+        cp_time at = json_number_value(json_object_get(record, AT));
+        if(id ? cloudplugs_id_set_has(&w->seen, id) : at <= w->mark) continue;
+        if(w->checkpoint && cloudplugs_checkpoint_has(w->checkpoint, w->channel_mask, at, id)) continue;
+        fresh[count].record = record;
+        fresh[count].id = id;
+        fresh[count].at = at;
+        count++;
+    }
+    qsort(fresh, count, sizeof(struct _cp_watch_record), cloudplugs_watch_record_cmp);
+
+    for(i = 0; i < count; i++) {
+        /* an id that cannot be tracked may come again with a later poll, but the record is never lost */
+        if(fresh[i].id && fresh[i].at >= w->page_after && !cloudplugs_id_set_add(&w->seen, fresh[i].id, fresh[i].at)) {
+            cps->err = CP_ERR_OUT_OF_MEMORY;
+            res = CP_FAIL;
+        }
+        if(fresh[i].at > w->mark) w->mark = fresh[i].at;
+        w->cb(w, fresh[i].record, w->userdata);
+        if(w->checkpoint && cloudplugs_checkpoint_set(w->checkpoint, w->channel_mask, fresh[i].at, fresh[i].id) != CP_OK) res = CP_FAIL;
+    }
+    cloudplugs_free(fresh);
+    json_decref(result);
+
+    /* a full page means more records are waiting behind it */
+    w->offset = (int) n >= w->limit ? w->offset + (int) n : 0;
+    cloudplugs_watch_prune(w);
+    if(count) w->interval = w->min_interval;
+    else {
+        w->interval = w->interval ? w->interval * 2 : 1;
+        if(w->interval > w->max_interval) w->interval = w->max_interval;
+    }
+    if(next_interval) *next_interval = w->offset ? 0 : w->interval;
+    return res;
+}
+
+cp_res cloudplugs_watch_run(cp_watch w) {
+    if(!w) return CP_FAIL;
+    w->stopped = CP_FALSE;
+    while(!w->stopped) {
+        int next;
+        cp_res res = cloudplugs_watch_poll(w, &next);
+        if(res != CP_OK) return res;
+        if(!w->stopped && next > 0) {
+            struct timespec ts;
+            ts.tv_sec = next / 1000;
+            ts.tv_nsec = (long) (next % 1000) * 1000000L;
+            nanosleep(&ts, NULL);
+        }
+    }
+    return CP_OK;
+}
+
+cp_res cloudplugs_watch_stop(cp_watch w) {
+    if(!w) return CP_FAIL;
+    w->stopped = CP_TRUE;
+    return CP_OK;
+}